@@ -0,0 +1,134 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_BLOCK_CACHE_HPP
+#define LIBSAVVY_BLOCK_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <functional>
+
+namespace savvy
+{
+  /**
+   * Thread-safe LRU cache of decompressed SAV blocks with a byte budget. Blocks are keyed by file path and the file
+   * offset of the compressed block, so a single cache can be shared by any number of readers (see reader::reader()).
+   */
+  class block_cache
+  {
+  public:
+    struct cached_block
+    {
+      std::int64_t end_offset; ///< File offset immediately following the compressed block
+      std::shared_ptr<const std::vector<char>> data; ///< Decompressed block, shared with the readers that loaded it
+    };
+  private:
+    struct key_type
+    {
+      std::string file;
+      std::int64_t offset;
+      bool operator==(const key_type& other) const { return offset == other.offset && file == other.file; }
+    };
+
+    struct key_hash
+    {
+      std::size_t operator()(const key_type& k) const
+      {
+        // Combined as in boost::hash_combine, since a plain XOR of the two hashes collides easily.
+        std::size_t h = std::hash<std::string>()(k.file);
+        h ^= std::hash<std::int64_t>()(k.offset) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        return h;
+      }
+    };
+
+    typedef std::list<std::pair<key_type, std::shared_ptr<const cached_block>>> list_type;
+
+    std::size_t max_bytes_;
+    std::size_t cur_bytes_ = 0;
+    std::uint64_t hits_ = 0;
+    std::uint64_t misses_ = 0;
+    list_type lru_;
+    std::unordered_map<key_type, list_type::iterator, key_hash> map_;
+    std::mutex mtx_;
+  public:
+    /**
+     * @param max_bytes Maximum total size of decompressed blocks held by cache
+     */
+    block_cache(std::size_t max_bytes) :
+      max_bytes_(max_bytes)
+    {
+    }
+
+    block_cache(const block_cache&) = delete;
+    block_cache& operator=(const block_cache&) = delete;
+
+    /**
+     * Looks up block and marks it as most recently used.
+     * @param file Path of file
+     * @param offset File offset of compressed block
+     * @return Cached block or nullptr if not present
+     */
+    std::shared_ptr<const cached_block> find(const std::string& file, std::int64_t offset)
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      auto it = map_.find(key_type{file, offset});
+      if (it == map_.end())
+      {
+        ++misses_;
+        return nullptr;
+      }
+
+      ++hits_;
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->second;
+    }
+
+    /**
+     * Adds block to cache, evicting least recently used blocks as needed to stay within budget. Blocks larger than
+     * the budget are not cached.
+     * @param file Path of file
+     * @param offset File offset of compressed block
+     * @param blk Decompressed block
+     */
+    void insert(const std::string& file, std::int64_t offset, std::shared_ptr<const cached_block> blk)
+    {
+      if (!blk || !blk->data || blk->data->size() > max_bytes_)
+        return;
+
+      std::lock_guard<std::mutex> lk(mtx_);
+      key_type k{file, offset};
+      auto it = map_.find(k);
+      if (it != map_.end())
+      {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return;
+      }
+
+      while (!lru_.empty() && cur_bytes_ + blk->data->size() > max_bytes_)
+      {
+        cur_bytes_ -= lru_.back().second->data->size();
+        map_.erase(lru_.back().first);
+        lru_.pop_back();
+      }
+
+      cur_bytes_ += blk->data->size();
+      lru_.emplace_front(k, std::move(blk));
+      map_[std::move(k)] = lru_.begin();
+    }
+
+    std::size_t max_bytes() const { return max_bytes_; } ///< Gets byte budget.
+    std::size_t size_in_bytes() { std::lock_guard<std::mutex> lk(mtx_); return cur_bytes_; } ///< Gets total size of cached blocks.
+    std::uint64_t hits() { std::lock_guard<std::mutex> lk(mtx_); return hits_; } ///< Gets number of successful lookups.
+    std::uint64_t misses() { std::lock_guard<std::mutex> lk(mtx_); return misses_; } ///< Gets number of failed lookups.
+  };
+}
+
+#endif // LIBSAVVY_BLOCK_CACHE_HPP
@@ -0,0 +1,494 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_BLOCK_IBUF_HPP
+#define LIBSAVVY_BLOCK_IBUF_HPP
+
+#include "thread_pool.hpp"
+#include "block_cache.hpp"
+
+#include <zstd.h>
+#include <zlib.h>
+
+#include <streambuf>
+#include <cstdio>
+#include <cstdint>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <future>
+
+namespace savvy
+{
+  namespace detail
+  {
+    /**
+     * Splits a zstd stream into frames by walking frame and block headers. Skippable frames (e.g., an appended s1r index) are passed over.
+     */
+    struct zstd_block_codec
+    {
+      /**
+       * Reads the next compressed frame from fp.
+       * @param fp Input file positioned at a frame boundary
+       * @param block_offset File offset of the frame that was read
+       * @param dest Destination for compressed frame
+       * @return 1 on success, 0 on EOF, and -1 on error
+       */
+      static int read_block(std::FILE* fp, std::int64_t& block_offset, std::vector<char>& dest)
+      {
+        while (true)
+        {
+          block_offset = std::ftell(fp);
+
+          std::uint8_t magic_bytes[4];
+          std::size_t n = std::fread(magic_bytes, 1, 4, fp);
+          if (n == 0)
+            return 0;
+          if (n != 4)
+            return -1;
+
+          std::uint32_t magic = le_u32(magic_bytes);
+          if ((magic & 0xFFFFFFF0u) == 0x184D2A50u)
+          {
+            std::uint8_t sz_bytes[4];
+            if (std::fread(sz_bytes, 1, 4, fp) != 4 || std::fseek(fp, le_u32(sz_bytes), SEEK_CUR) != 0)
+              return -1;
+            continue;
+          }
+
+          if (magic != 0xFD2FB528u)
+            return -1;
+
+          dest.assign((char*)magic_bytes, (char*)magic_bytes + 4);
+
+          int fhd = std::fgetc(fp);
+          if (fhd == EOF)
+            return -1;
+          dest.push_back(char(fhd));
+
+          const std::size_t did_sizes[] = {0, 1, 2, 4};
+          int fcs_flag = fhd >> 6;
+          bool single_segment = (fhd >> 5) & 1;
+          bool has_checksum = (fhd >> 2) & 1;
+          std::size_t header_remaining = (single_segment ? 0 : 1) + did_sizes[fhd & 3] + (fcs_flag == 0 ? (single_segment ? 1 : 0) : (1u << fcs_flag));
+          if (!append(fp, dest, header_remaining))
+            return -1;
+
+          bool last_block = false;
+          while (!last_block)
+          {
+            if (!append(fp, dest, 3))
+              return -1;
+            const std::uint8_t* bh = (const std::uint8_t*)(dest.data() + dest.size() - 3);
+            std::uint32_t block_header = std::uint32_t(bh[0]) | (std::uint32_t(bh[1]) << 8) | (std::uint32_t(bh[2]) << 16);
+            last_block = block_header & 1u;
+            std::uint32_t block_type = (block_header >> 1) & 3u;
+            if (block_type == 3)
+              return -1;
+            if (!append(fp, dest, block_type == 1 ? 1 : (block_header >> 3)))
+              return -1;
+          }
+
+          if (has_checksum && !append(fp, dest, 4))
+            return -1;
+
+          return 1;
+        }
+      }
+
+      static bool decompress(const std::vector<char>& src, std::vector<char>& dest)
+      {
+        struct dstream_deleter { void operator()(ZSTD_DStream* p) const { ZSTD_freeDStream(p); } };
+        static thread_local std::unique_ptr<ZSTD_DStream, dstream_deleter> dstrm(ZSTD_createDStream());
+
+        if (!dstrm || ZSTD_isError(ZSTD_initDStream(dstrm.get())))
+          return false;
+
+        dest.resize(std::max(ZSTD_DStreamOutSize(), src.size() * 4));
+        ZSTD_inBuffer in = {src.data(), src.size(), 0};
+        ZSTD_outBuffer out = {dest.data(), dest.size(), 0};
+        while (true)
+        {
+          std::size_t ret = ZSTD_decompressStream(dstrm.get(), &out, &in);
+          if (ZSTD_isError(ret))
+            return false;
+          if (ret == 0)
+            break;
+
+          if (out.pos == out.size)
+          {
+            dest.resize(dest.size() * 2);
+            out.dst = dest.data();
+            out.size = dest.size();
+          }
+          else if (in.pos == in.size)
+          {
+            return false; // truncated frame
+          }
+        }
+
+        dest.resize(out.pos);
+        return true;
+      }
+
+      static std::int64_t tell(std::int64_t block_offset, std::int64_t /*end_offset*/, std::size_t /*pos_in_block*/)
+      {
+        return block_offset;
+      }
+
+      static std::int64_t tell_end(std::int64_t end_offset)
+      {
+        return end_offset;
+      }
+
+      static void split_position(std::int64_t pos, std::int64_t& block_offset, std::size_t& pos_in_block)
+      {
+        block_offset = pos;
+        pos_in_block = 0;
+      }
+    private:
+      static std::uint32_t le_u32(const std::uint8_t* p)
+      {
+        return std::uint32_t(p[0]) | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24);
+      }
+
+      static bool append(std::FILE* fp, std::vector<char>& dest, std::size_t sz)
+      {
+        std::size_t prev_sz = dest.size();
+        dest.resize(prev_sz + sz);
+        return std::fread(dest.data() + prev_sz, 1, sz, fp) == sz;
+      }
+    };
+
+    /**
+     * Splits a BGZF stream (VCF.gz or BCF) into blocks using the BSIZE field of each block's BC extra subfield.
+     * Positions are BGZF virtual offsets (compressed block offset << 16 | offset within decompressed block).
+     */
+    struct bgzf_block_codec
+    {
+      /**
+       * Reads the next compressed block from fp.
+       * @param fp Input file positioned at a block boundary
+       * @param block_offset File offset of the block that was read
+       * @param dest Destination for compressed block (including header and footer)
+       * @return 1 on success, 0 on EOF, and -1 on error
+       */
+      static int read_block(std::FILE* fp, std::int64_t& block_offset, std::vector<char>& dest)
+      {
+        block_offset = std::ftell(fp);
+
+        dest.resize(12);
+        std::size_t n = std::fread(dest.data(), 1, 12, fp);
+        if (n == 0)
+          return 0;
+        if (n != 12)
+          return -1;
+
+        const std::uint8_t* hdr = (const std::uint8_t*)dest.data();
+        if (hdr[0] != 31 || hdr[1] != 139 || hdr[2] != 8 || !(hdr[3] & 4))
+          return -1;
+
+        std::size_t xlen = std::size_t(hdr[10]) | (std::size_t(hdr[11]) << 8);
+        dest.resize(12 + xlen);
+        if (std::fread(dest.data() + 12, 1, xlen, fp) != xlen)
+          return -1;
+
+        std::size_t block_size = 0;
+        const std::uint8_t* extra = (const std::uint8_t*)dest.data() + 12;
+        for (std::size_t i = 0; i + 4 <= xlen; )
+        {
+          std::size_t slen = std::size_t(extra[i + 2]) | (std::size_t(extra[i + 3]) << 8);
+          if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen)
+            block_size = (std::size_t(extra[i + 4]) | (std::size_t(extra[i + 5]) << 8)) + 1;
+          i += 4 + slen;
+        }
+
+        if (block_size < 12 + xlen + 8)
+          return -1;
+
+        std::size_t remaining = block_size - 12 - xlen;
+        dest.resize(block_size);
+        return std::fread(dest.data() + 12 + xlen, 1, remaining, fp) == remaining ? 1 : -1;
+      }
+
+      static bool decompress(const std::vector<char>& src, std::vector<char>& dest)
+      {
+        std::size_t xlen = std::size_t(std::uint8_t(src[10])) | (std::size_t(std::uint8_t(src[11])) << 8);
+        std::size_t cdata_sz = src.size() - 12 - xlen - 8;
+        const std::uint8_t* footer = (const std::uint8_t*)src.data() + src.size() - 8;
+        std::uint32_t crc = std::uint32_t(footer[0]) | (std::uint32_t(footer[1]) << 8) | (std::uint32_t(footer[2]) << 16) | (std::uint32_t(footer[3]) << 24);
+        std::uint32_t isize = std::uint32_t(footer[4]) | (std::uint32_t(footer[5]) << 8) | (std::uint32_t(footer[6]) << 16) | (std::uint32_t(footer[7]) << 24);
+        if (isize > 0x10000)
+          return false;
+
+        dest.resize(isize);
+        if (isize == 0)
+          return true;
+
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -15) != Z_OK)
+          return false;
+        zs.next_in = (Bytef*)(src.data() + 12 + xlen);
+        zs.avail_in = uInt(cdata_sz);
+        zs.next_out = (Bytef*)dest.data();
+        zs.avail_out = uInt(dest.size());
+        int res = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+
+        return res == Z_STREAM_END && zs.total_out == isize && crc32(crc32(0, nullptr, 0), (const Bytef*)dest.data(), uInt(isize)) == crc;
+      }
+
+      static std::int64_t tell(std::int64_t block_offset, std::int64_t /*end_offset*/, std::size_t pos_in_block)
+      {
+        return (block_offset << 16) | std::int64_t(pos_in_block);
+      }
+
+      static std::int64_t tell_end(std::int64_t end_offset)
+      {
+        return end_offset << 16;
+      }
+
+      static void split_position(std::int64_t pos, std::int64_t& block_offset, std::size_t& pos_in_block)
+      {
+        block_offset = std::int64_t(std::uint64_t(pos) >> 16);
+        pos_in_block = std::size_t(pos & 0xFFFF);
+      }
+    };
+
+    /**
+     * Input streambuf for formats made up of independently compressed blocks. Compressed blocks are read on the
+     * consuming thread and decompressed ahead of it by a pool of worker threads. Blocks are delivered in file order,
+     * so positions reported by seekoff() match those of the single-threaded shrinkwrap buffers.
+     */
+    template <typename Codec>
+    class block_ibuf : public std::streambuf
+    {
+    private:
+      struct block
+      {
+        std::int64_t offset = 0;
+        std::int64_t end_offset = 0;
+        std::vector<char> compressed;
+        std::shared_ptr<const std::vector<char>> data; // Read-only so that it can be shared with block_cache.
+        std::atomic<bool> cancelled;
+        block() : cancelled(false) {}
+      };
+
+      struct pending_block
+      {
+        std::shared_ptr<block> blk;
+        std::future<bool> result;
+      };
+
+      std::FILE* fp_;
+      std::int64_t file_pos_ = 0;
+      bool eof_ = false;
+      std::size_t read_ahead_;
+      std::deque<pending_block> queue_;
+      std::shared_ptr<block> current_;
+      std::shared_ptr<block> previous_;
+      std::shared_ptr<block_cache> cache_;
+      std::string cache_key_;
+      thread_pool pool_;
+    public:
+      /**
+       * @param fp Input file (ownership is transferred)
+       * @param n_threads Number of decompression threads
+       * @param read_ahead Maximum number of blocks decompressed ahead of the consumer (0 selects twice the thread count)
+       */
+      block_ibuf(std::FILE* fp, std::size_t n_threads, std::size_t read_ahead = 0) :
+        fp_(fp),
+        read_ahead_(std::max<std::size_t>(1, read_ahead ? read_ahead : 2 * n_threads)),
+        pool_(n_threads)
+      {
+        if (fp_)
+          file_pos_ = std::ftell(fp_);
+        setg(nullptr, nullptr, nullptr);
+      }
+
+      ~block_ibuf()
+      {
+        cancel_pending();
+        if (fp_)
+          std::fclose(fp_);
+      }
+
+      /**
+       * Enables caching of decompressed blocks. Blocks found in the cache are used in place instead of being read and
+       * decompressed, and newly decompressed blocks are shared with it without copying.
+       * @param cache Shared block cache (nullptr disables caching)
+       * @param key Identifies the file within the cache (e.g., its path)
+       */
+      void set_cache(std::shared_ptr<block_cache> cache, std::string key)
+      {
+        cache_ = std::move(cache);
+        cache_key_ = std::move(key);
+      }
+
+      /**
+       * Consumes the next n bytes of the current block without copying them. The returned pointer remains valid until
+       * the block after next is loaded, so data borrowed from a record that straddles a block boundary stays intact.
+       * @param n Number of bytes to consume
+       * @return Pointer to consumed bytes or nullptr if fewer than n bytes remain in the current block (nothing is consumed in this case)
+       */
+      const char* borrow(std::size_t n)
+      {
+        if (std::size_t(egptr() - gptr()) < n)
+          return nullptr;
+        const char* ret = gptr();
+        setg(eback(), gptr() + n, egptr());
+        return ret;
+      }
+    protected:
+      int_type underflow() override
+      {
+        if (gptr() < egptr())
+          return traits_type::to_int_type(*gptr());
+
+        while (true)
+        {
+          fill_queue();
+          if (queue_.empty())
+            return traits_type::eof();
+
+          pending_block p = std::move(queue_.front());
+          queue_.pop_front();
+          if (current_ && current_->data && !current_->data->empty())
+            previous_ = std::move(current_);
+          current_ = p.blk;
+          bool decompressed = p.result.get();
+          current_->compressed.clear();
+          current_->compressed.shrink_to_fit();
+          if (!decompressed)
+          {
+            std::fprintf(stderr, "Error: failed to decompress block at offset %lld\n", (long long)current_->offset);
+            cancel_pending();
+            eof_ = true;
+            setg(nullptr, nullptr, nullptr);
+            return traits_type::eof();
+          }
+
+          if (pool_.size())
+            fill_queue(); // Otherwise the next block is decompressed on demand.
+
+          if (current_->data && !current_->data->empty())
+          {
+            // The get area is never written to, so the shared buffer can back it directly.
+            char* beg = const_cast<char*>(current_->data->data());
+            setg(beg, beg, beg + current_->data->size());
+            return traits_type::to_int_type(*gptr());
+          }
+        }
+      }
+
+      pos_type seekoff(off_type off, std::ios_base::seekdir way, std::ios_base::openmode /*which*/) override
+      {
+        if (off != 0 || way != std::ios::cur)
+          return pos_type(off_type(-1));
+
+        if (!current_)
+          return pos_type(off_type(Codec::tell_end(file_pos_)));
+        if (gptr() == egptr())
+          return pos_type(off_type(Codec::tell_end(current_->end_offset)));
+        return pos_type(off_type(Codec::tell(current_->offset, current_->end_offset, gptr() - eback())));
+      }
+
+      pos_type seekpos(pos_type pos, std::ios_base::openmode /*which*/) override
+      {
+        std::int64_t block_offset;
+        std::size_t pos_in_block;
+        Codec::split_position(off_type(pos), block_offset, pos_in_block);
+
+        cancel_pending();
+        current_.reset();
+        previous_.reset();
+        setg(nullptr, nullptr, nullptr);
+
+        if (!fp_ || std::fseek(fp_, block_offset, SEEK_SET) != 0)
+          return pos_type(off_type(-1));
+
+        file_pos_ = block_offset;
+        eof_ = false;
+
+        if (pos_in_block)
+        {
+          if (traits_type::eq_int_type(underflow(), traits_type::eof()) || std::size_t(egptr() - gptr()) < pos_in_block)
+            return pos_type(off_type(-1));
+          gbump(int(pos_in_block));
+        }
+
+        return pos;
+      }
+    private:
+      void fill_queue()
+      {
+        while (!eof_ && queue_.size() < read_ahead_)
+        {
+          auto blk = std::make_shared<block>();
+
+          std::shared_ptr<const block_cache::cached_block> cached;
+          if (cache_ && fp_ && (cached = cache_->find(cache_key_, file_pos_)) && std::fseek(fp_, cached->end_offset, SEEK_SET) == 0)
+          {
+            blk->offset = file_pos_;
+            blk->end_offset = file_pos_ = cached->end_offset;
+            blk->data = cached->data;
+            std::promise<bool> ready;
+            ready.set_value(true);
+            queue_.emplace_back();
+            queue_.back().blk = blk;
+            queue_.back().result = ready.get_future();
+            continue;
+          }
+
+          int res = fp_ ? Codec::read_block(fp_, blk->offset, blk->compressed) : 0;
+          if (res <= 0)
+          {
+            if (res < 0)
+              std::fprintf(stderr, "Error: corrupt or truncated block at offset %lld\n", (long long)blk->offset);
+            eof_ = true;
+            break;
+          }
+
+          blk->end_offset = file_pos_ = std::ftell(fp_);
+          queue_.emplace_back();
+          queue_.back().blk = blk;
+          std::shared_ptr<block_cache> cache = cache_;
+          std::string cache_key = cache_ ? cache_key_ : std::string();
+          queue_.back().result = pool_.submit([blk, cache, cache_key]()
+          {
+            auto data = std::make_shared<std::vector<char>>();
+            if (blk->cancelled || !Codec::decompress(blk->compressed, *data))
+              return false;
+
+            blk->data = std::move(data);
+            if (cache)
+            {
+              auto cached = std::make_shared<block_cache::cached_block>();
+              cached->end_offset = blk->end_offset;
+              cached->data = blk->data;
+              cache->insert(cache_key, blk->offset, std::move(cached));
+            }
+            return true;
+          });
+        }
+      }
+
+      void cancel_pending()
+      {
+        for (auto it = queue_.begin(); it != queue_.end(); ++it)
+          it->blk->cancelled = true;
+        queue_.clear();
+      }
+    };
+  }
+}
+
+#endif // LIBSAVVY_BLOCK_IBUF_HPP
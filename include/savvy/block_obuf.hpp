@@ -0,0 +1,402 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_BLOCK_OBUF_HPP
+#define LIBSAVVY_BLOCK_OBUF_HPP
+
+#include "thread_pool.hpp"
+
+#include <zstd.h>
+#include <zlib.h>
+
+#include <streambuf>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <future>
+
+namespace savvy
+{
+  namespace detail
+  {
+    struct zstd_block_compressor
+    {
+      static bool compress(const std::vector<char>& src, std::vector<char>& dest, int level)
+      {
+        struct cctx_deleter { void operator()(ZSTD_CCtx* p) const { ZSTD_freeCCtx(p); } };
+        static thread_local std::unique_ptr<ZSTD_CCtx, cctx_deleter> cctx(ZSTD_createCCtx());
+
+        if (!cctx)
+          return false;
+
+        dest.resize(ZSTD_compressBound(src.size()));
+        std::size_t ret = ZSTD_compressCCtx(cctx.get(), dest.data(), dest.size(), src.data(), src.size(), level);
+        if (ZSTD_isError(ret))
+          return false;
+        dest.resize(ret);
+        return true;
+      }
+
+      static std::string trailer() { return std::string(); }
+
+      /**
+       * Position reported by tellp(), which is the file offset of the frame that buffered data will be written to.
+       */
+      static std::int64_t tell(std::int64_t block_start, std::size_t /*buffered*/) { return block_start; }
+      static const std::size_t max_tell_buffered = std::size_t(-1);
+
+      /**
+       * Position of a byte within a compressed frame that has been written at block_start.
+       */
+      static std::int64_t tell_written(const std::vector<char>& /*compressed*/, std::int64_t block_start, std::size_t /*offset*/) { return block_start; }
+    };
+
+    /**
+     * Compresses a chunk of data as a sequence of BGZF blocks (gzip members of at most 64 KiB with a BC extra field).
+     */
+    struct bgzf_block_compressor
+    {
+      static const std::size_t max_block_size = 0xff00;
+
+      static bool compress(const std::vector<char>& src, std::vector<char>& dest, int level)
+      {
+        dest.clear();
+        for (std::size_t off = 0; off < src.size(); off += max_block_size)
+        {
+          std::size_t sz = src.size() - off < max_block_size ? src.size() - off : max_block_size;
+          if (!compress_block(src.data() + off, sz, dest, std::min(level, 9)))
+            return false;
+        }
+        return true;
+      }
+
+      static std::string trailer()
+      {
+        static const char eof_block[28] = {31, -117, 8, 4, 0, 0, 0, 0, 0, -1, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+        return std::string(eof_block, sizeof(eof_block));
+      }
+
+      /**
+       * Position reported by tellp(), which is the BGZF virtual offset of the next byte written.
+       */
+      static std::int64_t tell(std::int64_t block_start, std::size_t buffered) { return (block_start << 16) | std::int64_t(buffered); }
+      static const std::size_t max_tell_buffered = max_block_size - 1;
+
+      /**
+       * Virtual offset of a byte within a compressed chunk that has been written at block_start. The chunk is made up
+       * of BGZF blocks of max_block_size bytes each, which are skipped using their BSIZE fields.
+       */
+      static std::int64_t tell_written(const std::vector<char>& compressed, std::int64_t block_start, std::size_t offset)
+      {
+        std::size_t pos = 0;
+        for (std::size_t i = offset / max_block_size; i > 0 && pos + 18 <= compressed.size(); --i)
+          pos += (std::size_t(std::uint8_t(compressed[pos + 16])) | (std::size_t(std::uint8_t(compressed[pos + 17])) << 8)) + 1;
+        return tell(block_start + std::int64_t(pos), offset % max_block_size);
+      }
+    private:
+      static bool compress_block(const char* data, std::size_t sz, std::vector<char>& dest, int level)
+      {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+          return false;
+
+        std::size_t hdr_pos = dest.size();
+        dest.resize(hdr_pos + 18 + deflateBound(&zs, sz) + 8);
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = uInt(sz);
+        zs.next_out = (Bytef*)dest.data() + hdr_pos + 18;
+        zs.avail_out = uInt(dest.size() - hdr_pos - 18 - 8);
+        int res = deflate(&zs, Z_FINISH);
+        std::size_t csz = zs.total_out;
+        deflateEnd(&zs);
+        if (res != Z_STREAM_END || csz + 26 > 0x10000)
+          return false;
+
+        std::uint16_t bsize = std::uint16_t(csz + 25);
+        std::uint32_t crc = crc32(crc32(0, nullptr, 0), (const Bytef*)data, uInt(sz));
+        std::uint32_t isize = std::uint32_t(sz);
+        unsigned char hdr[18] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, std::uint8_t(bsize & 0xFF), std::uint8_t(bsize >> 8)};
+        std::memcpy(dest.data() + hdr_pos, hdr, 18);
+
+        char* p = dest.data() + hdr_pos + 18 + csz;
+        for (int i = 0; i < 4; ++i) *p++ = char((crc >> (8 * i)) & 0xFF);
+        for (int i = 0; i < 4; ++i) *p++ = char((isize >> (8 * i)) & 0xFF);
+        dest.resize(hdr_pos + 18 + csz + 8);
+        return true;
+      }
+    };
+
+    /**
+     * Output streambuf that compresses each block (the data written between calls to sync() or end_block()) as an
+     * independent frame on a pool of worker threads. Frames are written to the file in the order they were ended,
+     * followed by the compressor's trailer (e.g., the BGZF EOF marker) when the buffer is destroyed. The put area is
+     * the storage of the current block, so single characters are only passed to overflow() when it needs to grow.
+     */
+    template <typename Compressor>
+    class block_obuf : public std::streambuf
+    {
+    public:
+      typedef std::function<void(std::int64_t)> written_callback;
+    private:
+      struct block
+      {
+        std::vector<char> data;
+        std::vector<char> compressed;
+        std::size_t size = 0;
+        written_callback on_written;
+        std::vector<std::pair<std::size_t, written_callback>> marks;
+      };
+
+      struct pending_block
+      {
+        std::shared_ptr<block> blk;
+        std::future<bool> result;
+      };
+
+      static const std::size_t initial_block_capacity = 0x10000;
+
+      std::FILE* fp_;
+      int level_;
+      std::int64_t file_pos_;
+      std::size_t max_pending_;
+      bool failed_ = false;
+      std::shared_ptr<block> current_;
+      std::deque<pending_block> queue_;
+      thread_pool pool_;
+    public:
+      /**
+       * @param fp Output file (ownership is transferred)
+       * @param level Compression level
+       * @param n_threads Number of compression threads
+       * @param file_pos Current byte offset of fp (used to report offsets of written blocks)
+       */
+      block_obuf(std::FILE* fp, int level, std::size_t n_threads, std::int64_t file_pos) :
+        fp_(fp),
+        level_(level),
+        file_pos_(file_pos),
+        max_pending_(std::max<std::size_t>(1, 2 * n_threads)),
+        pool_(n_threads)
+      {
+        start_block();
+      }
+
+      ~block_obuf()
+      {
+        if (fp_)
+        {
+          end_block();
+          if (drain())
+          {
+            std::string trailer = Compressor::trailer();
+            std::fwrite(trailer.data(), 1, trailer.size(), fp_);
+          }
+          std::fclose(fp_);
+        }
+      }
+
+      /**
+       * Submits buffered data as a block to be compressed.
+       * @param on_written Called from a writing thread with the file offset of the compressed block once it has been written
+       * @return False if a write error has occurred
+       */
+      bool end_block(written_callback on_written = nullptr)
+      {
+        if (!fp_ || failed_)
+          return false;
+
+        if (buffered_size() || on_written || !current_->marks.empty())
+        {
+          std::shared_ptr<block> blk = current_;
+          blk->data.resize(buffered_size());
+          blk->size = blk->data.size();
+          blk->on_written = std::move(on_written);
+          start_block();
+
+          queue_.emplace_back();
+          queue_.back().blk = blk;
+          int level = level_;
+          queue_.back().result = pool_.submit([blk, level]()
+          {
+            if (blk->data.empty())
+              return true;
+            bool ret = Compressor::compress(blk->data, blk->compressed, level);
+            blk->data.clear();
+            blk->data.shrink_to_fit();
+            return ret;
+          });
+        }
+
+        return write_completed(false);
+      }
+
+      /**
+       * Gets size of data written since the last block was ended.
+       * @return Number of buffered bytes
+       */
+      std::size_t buffered_size() const { return std::size_t(pptr() - pbase()); }
+
+      /**
+       * Gets the position that tellp() would report, without waiting for pending blocks to be compressed and written.
+       * @param on_position Called from the thread that writes blocks (i.e., during a later call to end_block(), drain()
+       * or the destructor) with the position once the block containing it has been written
+       */
+      void mark_position(written_callback on_position)
+      {
+        current_->marks.emplace_back(buffered_size(), std::move(on_position));
+      }
+
+      /**
+       * Waits for all submitted blocks to be compressed and written.
+       * @return False if a write error has occurred
+       */
+      bool drain()
+      {
+        if (!fp_ || !write_completed(true))
+          return false;
+        return std::fflush(fp_) == 0;
+      }
+
+      /**
+       * Writes buffered data and gives up ownership of the file without writing the trailer, so that the stream can be
+       * continued by another buffer (e.g., one with a different number of threads).
+       * @param file_pos Set to the current byte offset of the file
+       * @return File or nullptr if a write error has occurred (in which case the file is closed)
+       */
+      std::FILE* release(std::int64_t& file_pos)
+      {
+        std::FILE* ret = fp_;
+        if (ret && !(end_block() && drain()))
+        {
+          std::fclose(ret);
+          ret = nullptr;
+        }
+        fp_ = nullptr;
+        file_pos = file_pos_;
+        return ret;
+      }
+    protected:
+      int_type overflow(int_type c) override
+      {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+          reserve(1);
+          *pptr() = traits_type::to_char_type(c);
+          pbump(1);
+        }
+        return traits_type::not_eof(c);
+      }
+
+      std::streamsize xsputn(const char* s, std::streamsize n) override
+      {
+        if (n <= 0)
+          return 0;
+        reserve(std::size_t(n));
+        std::memcpy(pptr(), s, std::size_t(n));
+        advance(std::size_t(n));
+        return n;
+      }
+
+      int sync() override
+      {
+        return end_block() ? 0 : -1;
+      }
+
+      pos_type seekoff(off_type off, std::ios_base::seekdir way, std::ios_base::openmode which) override
+      {
+        if (off != 0 || way != std::ios::cur || (which & std::ios::in) || !fp_)
+          return pos_type(off_type(-1));
+
+        // Buffered data only fits in the block that the offset refers to if it is smaller than a single block.
+        if (buffered_size() > Compressor::max_tell_buffered && !end_block())
+          return pos_type(off_type(-1));
+
+        // The start of the next block is only known once pending blocks have been written, but the file does not need
+        // to be flushed. Callers that cannot wait use mark_position() instead.
+        if (!write_completed(!queue_.empty()))
+          return pos_type(off_type(-1));
+        return pos_type(off_type(Compressor::tell(file_pos_, buffered_size())));
+      }
+    private:
+      void start_block()
+      {
+        current_ = std::make_shared<block>();
+        current_->data.resize(initial_block_capacity);
+        setp(current_->data.data(), current_->data.data() + current_->data.size());
+      }
+
+      // Grows the current block so that n more bytes fit in the put area.
+      void reserve(std::size_t n)
+      {
+        std::size_t used = buffered_size();
+        if (current_->data.size() - used >= n)
+          return;
+
+        current_->data.resize(std::max(used + n, 2 * current_->data.size()));
+        setp(current_->data.data(), current_->data.data() + current_->data.size());
+        advance(used);
+      }
+
+      // Moves the put pointer forward (pbump() only takes an int).
+      void advance(std::size_t n)
+      {
+        for (; n > std::size_t(std::numeric_limits<int>::max()); n -= std::size_t(std::numeric_limits<int>::max()))
+          pbump(std::numeric_limits<int>::max());
+        pbump(int(n));
+      }
+
+      bool write_completed(bool wait_for_all)
+      {
+        while (!queue_.empty() && !failed_)
+        {
+          pending_block& p = queue_.front();
+          bool must_wait = wait_for_all || queue_.size() > max_pending_;
+          if (!must_wait && p.result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            break;
+
+          if (!p.result.get())
+          {
+            std::fprintf(stderr, "Error: block compression failed\n");
+            failed_ = true;
+            break;
+          }
+
+          std::int64_t block_pos = file_pos_;
+          if (std::fwrite(p.blk->compressed.data(), 1, p.blk->compressed.size(), fp_) != p.blk->compressed.size())
+          {
+            failed_ = true;
+            break;
+          }
+          file_pos_ += p.blk->compressed.size();
+
+          if (p.blk->on_written)
+            p.blk->on_written(block_pos);
+          for (auto it = p.blk->marks.begin(); it != p.blk->marks.end(); ++it)
+          {
+            // A position at the end of a block refers to the start of the next one.
+            if (it->first == p.blk->size)
+              it->second(Compressor::tell(file_pos_, 0));
+            else
+              it->second(Compressor::tell_written(p.blk->compressed, block_pos, it->first));
+          }
+          queue_.pop_front();
+        }
+
+        return !failed_;
+      }
+    };
+  }
+}
+
+#endif // LIBSAVVY_BLOCK_OBUF_HPP
@@ -143,9 +143,11 @@ namespace  savvy
                   std::uint32_t n_intv{};
                   if (fs_.read((char*)&n_intv, sizeof(n_intv)))
                   {
-                    std::uint64_t ioff{};
+                    linear_indices_.resize(n_indices);
+                    linear_indices_[i].resize(n_intv);
                     for (std::size_t v = 0; v < n_intv; ++v)
-                      fs_.read((char *) &ioff, sizeof(ioff));
+                      fs_.read((char *) &linear_indices_[i][v], sizeof(std::uint64_t));
+                    update_loff(i);
                   }
                 }
               }
@@ -167,7 +169,7 @@ namespace  savvy
     }
 
     /* calculate maximum bin number -- valid bin numbers range within [0,bin_limit) */
-    int bin_limit()
+    int bin_limit() const
     {
       return ((1 << (depth_+1)*3) - 1) / 7;
     }
@@ -209,6 +211,14 @@ namespace  savvy
     static int bin_first(int l) { return (((1<<(((l)<<1) + (l))) - 1) / 7); }
     static int bin_parent(int l) { return (((l) - 1) >> 3); }
 
+    /* calculate the first linear index interval covered by bin */
+    int bin_bot(int bin) const
+    {
+      int l = 0;
+      for (int b = bin; b; ++l, b = bin_parent(b));
+      return (bin - bin_first(l)) << (depth_ - l) * 3;
+    }
+
     std::vector<std::pair<std::uint64_t, std::uint64_t>> query_intervals(const std::string& contig, const std::unordered_map<std::string, std::uint32_t>& contig_to_id, std::int64_t beg, std::int64_t end)
     {
       std::vector<std::pair<std::uint64_t, std::uint64_t>> ret;
@@ -256,10 +266,10 @@ namespace  savvy
         if (bin == 0)
           bin_it = indices_[contig_id].find(bin);
         std::uint64_t min_off = bin_it != indices_[contig_id].end() ? bin_it->second.loff : 0;
-//        if (idx->lidx[tid].offset
-//          && beg>>idx->min_shift < idx->lidx[tid].n
-//          && min_off < idx->lidx[tid].offset[beg>>idx->min_shift])
-//          min_off = idx->lidx[tid].offset[beg>>idx->min_shift];
+        if (contig_id < linear_indices_.size()
+          && std::size_t(beg >> min_shift_) < linear_indices_[contig_id].size()
+          && min_off < linear_indices_[contig_id][beg >> min_shift_])
+          min_off = linear_indices_[contig_id][beg >> min_shift_];
 
         // compute max_off: a virtual offset from a bin to the right of end
         std::uint64_t max_off = 0;
@@ -435,12 +445,37 @@ namespace  savvy
     }
 
 
+  private:
+    // TBI bins do not store loff, so it is derived from the linear index as in htslib's update_loff().
+    void update_loff(std::size_t contig_id)
+    {
+      auto& lidx = linear_indices_[contig_id];
+      for (std::size_t l = 1; l < lidx.size(); ++l) // fill empty intervals
+      {
+        if (lidx[l] == 0)
+          lidx[l] = lidx[l - 1];
+      }
+
+      for (auto it = indices_[contig_id].begin(); it != indices_[contig_id].end(); ++it)
+      {
+        if (int(it->first) < bin_limit())
+        {
+          int bot_bin = bin_bot(int(it->first));
+          it->second.loff = std::size_t(bot_bin) < lidx.size() ? lidx[bot_bin] : 0;
+        }
+        else
+        {
+          it->second.loff = 0;
+        }
+      }
+    }
   private:
     shrinkwrap::bgzf::istream fs_;
     std::int32_t min_shift_ = 0;
     std::int32_t depth_ = 0;
     std::vector<std::string> aux_contigs_;
     std::vector<std::unordered_map<std::uint32_t, bin_t>> indices_;
+    std::vector<std::vector<std::uint64_t>> linear_indices_; // TBI only
   };
 }
 
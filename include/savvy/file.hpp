@@ -13,6 +13,7 @@
 #include "site_info.hpp"
 
 #include <list>
+#include <memory>
 
 namespace savvy
 {
@@ -28,7 +29,7 @@ namespace savvy
       vcf
     };
   protected:
-    ::savvy::dictionary dict_;
+    std::shared_ptr<const ::savvy::dictionary> dict_ = std::make_shared<::savvy::dictionary>(); // Shared with reader clones. Only modified while the header is parsed.
     std::array<std::uint8_t, 16> uuid_;
     std::list<header_value_details> info_headers_;
     std::unordered_map<std::string, std::reference_wrapper<header_value_details>> info_headers_map_;
@@ -38,7 +39,7 @@ namespace savvy
     phasing phasing_ = phasing::unknown;
     format file_format_;
   public:
-    const ::savvy::dictionary& dictionary() const { return dict_; }
+    const ::savvy::dictionary& dictionary() const { return *dict_; }
 
     /**
      * Gets Universally Unique Identifier (UUID) for file.
@@ -53,11 +54,12 @@ namespace savvy
     file::format file_format() const { return file_format_; }
     virtual ~file() {}
   protected:
-    void process_header_pair(const std::string& key, const std::string& val);
+    void process_header_pair(::savvy::dictionary& dict, const std::string& key, const std::string& val);
+    void copy_header_state(const file& src);
   };
 
   inline
-  void file::process_header_pair(const std::string& key, const std::string& val)
+  void file::process_header_pair(::savvy::dictionary& dict, const std::string& key, const std::string& val)
   {
     auto hval = parse_header_value(val);
     if (!hval.id.empty())
@@ -67,7 +69,7 @@ namespace savvy
       else if (key == "INFO" || key == "FILTER" || key == "FORMAT") which_dict = dictionary::id;
       else if (key == "SAMPLE") which_dict = dictionary::sample;
 
-      if (which_dict >= 0 && dict_.str_to_int[which_dict].find(hval.id) == dict_.str_to_int[which_dict].end())
+      if (which_dict >= 0 && dict.str_to_int[which_dict].find(hval.id) == dict.str_to_int[which_dict].end())
       {
         dictionary::entry e;
         e.id = hval.id;
@@ -84,14 +86,14 @@ namespace savvy
         if (!hval.idx.empty())
         {
           std::size_t idx = std::atoi(hval.idx.c_str());
-          dict_.entries[which_dict].resize(std::max(dict_.entries[which_dict].size(), idx + 1), {"DELETED", "", 0});
-          dict_.entries[which_dict][idx] = std::move(e);
-          dict_.str_to_int[which_dict][hval.id] = idx;
+          dict.entries[which_dict].resize(std::max(dict.entries[which_dict].size(), idx + 1), {"DELETED", "", 0});
+          dict.entries[which_dict][idx] = std::move(e);
+          dict.str_to_int[which_dict][hval.id] = idx;
         }
         else
         {
-          dict_.str_to_int[which_dict][hval.id] = dict_.entries[which_dict].size();
-          dict_.entries[which_dict].emplace_back(std::move(e));
+          dict.str_to_int[which_dict][hval.id] = dict.entries[which_dict].size();
+          dict.entries[which_dict].emplace_back(std::move(e));
         }
       }
     }
@@ -122,6 +124,26 @@ namespace savvy
         phasing_ = phasing::phased;
     }
   }
+
+  // Copies state parsed from the header of another file object. Decoding state (i.e., PBWT sort context) is not copied.
+  inline
+  void file::copy_header_state(const file& src)
+  {
+    dict_ = src.dict_;
+    uuid_ = src.uuid_;
+    phasing_ = src.phasing_;
+    file_format_ = src.file_format_;
+
+    info_headers_ = src.info_headers_;
+    info_headers_map_.clear();
+    for (auto it = info_headers_.begin(); it != info_headers_.end(); ++it)
+      info_headers_map_.insert(std::make_pair(it->id, std::ref(*it)));
+
+    format_headers_ = src.format_headers_;
+    format_headers_map_.clear();
+    for (auto it = format_headers_.begin(); it != format_headers_.end(); ++it)
+      format_headers_map_.insert(std::make_pair(it->id, std::ref(*it)));
+  }
 }
 
 #endif // LIBSAVVY_FILE_HPP
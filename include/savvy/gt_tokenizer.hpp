@@ -0,0 +1,191 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_GT_TOKENIZER_HPP
+#define LIBSAVVY_GT_TOKENIZER_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SAVVY_GT_TOKENIZER_X86 1
+#include <immintrin.h>
+#endif
+
+namespace savvy
+{
+  namespace detail
+  {
+    /**
+     * Fast path for VCF sample columns that contain only diploid GT values with single-character alleles (e.g.,
+     * "\t0|1\t./.\t1/1"). Each sample then occupies exactly four bytes, so the line can be validated and converted in
+     * fixed-width chunks. Lines that do not match this layout are rejected so that the caller can fall back to the
+     * general parser.
+     */
+    class diploid_gt_tokenizer
+    {
+    public:
+      /**
+       * Converts sample columns to alleles.
+       * @param line Sample columns, including the tab preceding the first sample
+       * @param line_sz Size of line
+       * @param n_samples Expected number of samples
+       * @param alleles Destination for 2 * n_samples alleles (missing alleles are encoded as 0x80)
+       * @param ph Destination for n_samples phase flags (1 if separator is '|'), or nullptr
+       * @return False if line does not match the fast path layout (alleles and ph may be partially written)
+       */
+      static bool tokenize(const char* line, std::size_t line_sz, std::size_t n_samples, std::int8_t* alleles, std::int8_t* ph)
+      {
+        if (line_sz != 4 * n_samples)
+          return false;
+
+        std::size_t i = 0;
+#ifdef SAVVY_GT_TOKENIZER_X86
+        static const int level = simd_level();
+        if (level >= 2)
+          i = tokenize_avx2(line, n_samples, alleles, ph);
+        else if (level == 1)
+          i = tokenize_sse4(line, n_samples, alleles, ph);
+
+        if (i == std::size_t(-1))
+          return false;
+#endif
+        return tokenize_scalar(line, i, n_samples, alleles, ph);
+      }
+
+      /**
+       * Scalar implementation of tokenize(). Only the samples in [sample_beg, n_samples) are converted.
+       */
+      static bool tokenize_scalar(const char* line, std::size_t sample_beg, std::size_t n_samples, std::int8_t* alleles, std::int8_t* ph)
+      {
+        for (std::size_t i = sample_beg; i < n_samples; ++i)
+        {
+          const char* s = line + 4 * i;
+          if (s[0] != '\t' || (s[2] != '|' && s[2] != '/'))
+            return false;
+
+          for (int j = 0; j < 2; ++j)
+          {
+            char c = s[1 + 2 * j];
+            if (c == '.')
+              alleles[2 * i + j] = std::int8_t(0x80);
+            else if (c >= '0' && c <= '9')
+              alleles[2 * i + j] = std::int8_t(c - '0');
+            else
+              return false;
+          }
+
+          if (ph)
+            ph[i] = s[2] == '|';
+        }
+        return true;
+      }
+    private:
+#ifdef SAVVY_GT_TOKENIZER_X86
+      // 0: scalar, 1: SSE4.2, 2: AVX2
+      static int simd_level()
+      {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+          return 2;
+        if (__builtin_cpu_supports("sse4.2"))
+          return 1;
+        return 0;
+      }
+
+      // Returns number of samples converted or -1 if an irregular sample is found. Within each 32-byte chunk (8 samples),
+      // alleles are at odd offsets, tabs at offsets 4k and separators at offsets 4k + 2.
+      __attribute__((target("avx2")))
+      static std::size_t tokenize_avx2(const char* line, std::size_t n_samples, std::int8_t* alleles, std::int8_t* ph)
+      {
+        const __m256i zero_char = _mm256_set1_epi8('0');
+        const __m256i nine = _mm256_set1_epi8(9);
+        const __m256i dot = _mm256_set1_epi8('.');
+        const __m256i tab = _mm256_set1_epi8('\t');
+        const __m256i pipe = _mm256_set1_epi8('|');
+        const __m256i slash = _mm256_set1_epi8('/');
+        const __m256i missing = _mm256_set1_epi8(char(0x80));
+        const __m256i odd_bytes = _mm256_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                   1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+
+        std::size_t i = 0;
+        for ( ; i + 8 <= n_samples; i += 8)
+        {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(line + 4 * i));
+          __m256i digit = _mm256_sub_epi8(v, zero_char);
+          __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, nine), digit);
+          __m256i is_dot = _mm256_cmpeq_epi8(v, dot);
+          __m256i is_pipe = _mm256_cmpeq_epi8(v, pipe);
+          __m256i is_sep = _mm256_or_si256(is_pipe, _mm256_cmpeq_epi8(v, slash));
+
+          std::uint32_t allele_mask = std::uint32_t(_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_dot)));
+          std::uint32_t tab_mask = std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab)));
+          std::uint32_t sep_mask = std::uint32_t(_mm256_movemask_epi8(is_sep));
+          if ((allele_mask & 0xAAAAAAAAu) != 0xAAAAAAAAu || (tab_mask & 0x11111111u) != 0x11111111u || (sep_mask & 0x44444444u) != 0x44444444u)
+            return std::size_t(-1);
+
+          __m256i vals = _mm256_blendv_epi8(digit, missing, is_dot);
+          vals = _mm256_shuffle_epi8(vals, odd_bytes);
+          vals = _mm256_permute4x64_epi64(vals, 0x08); // lane 0 low half, lane 1 low half
+          _mm_storeu_si128((__m128i*)(alleles + 2 * i), _mm256_castsi256_si128(vals));
+
+          if (ph)
+          {
+            std::uint32_t pipe_mask = std::uint32_t(_mm256_movemask_epi8(is_pipe));
+            for (int k = 0; k < 8; ++k)
+              ph[i + k] = std::int8_t((pipe_mask >> (4 * k + 2)) & 1u);
+          }
+        }
+        return i;
+      }
+
+      // Same as tokenize_avx2() with 16-byte chunks (4 samples).
+      __attribute__((target("sse4.2")))
+      static std::size_t tokenize_sse4(const char* line, std::size_t n_samples, std::int8_t* alleles, std::int8_t* ph)
+      {
+        const __m128i zero_char = _mm_set1_epi8('0');
+        const __m128i nine = _mm_set1_epi8(9);
+        const __m128i dot = _mm_set1_epi8('.');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i pipe = _mm_set1_epi8('|');
+        const __m128i slash = _mm_set1_epi8('/');
+        const __m128i missing = _mm_set1_epi8(char(0x80));
+        const __m128i odd_bytes = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+
+        std::size_t i = 0;
+        for ( ; i + 4 <= n_samples; i += 4)
+        {
+          __m128i v = _mm_loadu_si128((const __m128i*)(line + 4 * i));
+          __m128i digit = _mm_sub_epi8(v, zero_char);
+          __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, nine), digit);
+          __m128i is_dot = _mm_cmpeq_epi8(v, dot);
+          __m128i is_pipe = _mm_cmpeq_epi8(v, pipe);
+          __m128i is_sep = _mm_or_si128(is_pipe, _mm_cmpeq_epi8(v, slash));
+
+          std::uint32_t allele_mask = std::uint32_t(_mm_movemask_epi8(_mm_or_si128(is_digit, is_dot)));
+          std::uint32_t tab_mask = std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)));
+          std::uint32_t sep_mask = std::uint32_t(_mm_movemask_epi8(is_sep));
+          if ((allele_mask & 0xAAAAu) != 0xAAAAu || (tab_mask & 0x1111u) != 0x1111u || (sep_mask & 0x4444u) != 0x4444u)
+            return std::size_t(-1);
+
+          __m128i vals = _mm_shuffle_epi8(_mm_blendv_epi8(digit, missing, is_dot), odd_bytes);
+          _mm_storel_epi64((__m128i*)(alleles + 2 * i), vals);
+
+          if (ph)
+          {
+            std::uint32_t pipe_mask = std::uint32_t(_mm_movemask_epi8(is_pipe));
+            for (int k = 0; k < 4; ++k)
+              ph[i + k] = std::int8_t((pipe_mask >> (4 * k + 2)) & 1u);
+          }
+        }
+        return i;
+      }
+#endif
+    };
+  }
+}
+
+#endif // LIBSAVVY_GT_TOKENIZER_HPP
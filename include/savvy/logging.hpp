@@ -9,12 +9,14 @@
 
 #include <unordered_set>
 #include <cstdio>
+#include <mutex>
 
 template <typename T = void>
 class logging
 {
 private:
  static std::unordered_set<std::string> distinct_messages_;
+ static std::mutex mtx_;
 public:
   template<typename... A>
   static void cerr_once(const std::string& s, A ...args)
@@ -27,6 +29,7 @@ public:
       std::cerr << "Warning: log message too long\n";
 
     buf.resize(sz);
+    std::lock_guard<std::mutex> lk(mtx_); // records may be parsed concurrently (see reader::parse_vcf_line())
     if (distinct_messages_.insert(buf).second)
       std::cerr.write(buf.data(), buf.size());
   }
@@ -35,4 +38,7 @@ public:
 template <typename T>
 std::unordered_set<std::string> logging<T>::distinct_messages_;
 
+template <typename T>
+std::mutex logging<T>::mtx_;
+
 #endif // LIBSAVVY_LOGGING_HPP
\ No newline at end of file
@@ -8,12 +8,27 @@
 #define LIBSAVVY_PBWT_HPP
 
 #include <cstdint>
+#include <cstddef>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <utility>
+#include <algorithm>
+#include <memory>
+#include <future>
+#include <tuple>
+
+#include "thread_pool.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SAVVY_PBWT_X86 1
+#include <immintrin.h>
+#endif
 
 namespace savvy
 {
+  class typed_value;
+
   namespace internal
   {
     // PBWT
@@ -25,8 +40,80 @@ namespace savvy
     {
       std::vector<std::size_t> prev_sort_mapping;
       std::vector<std::size_t> counts;
+      std::vector<std::size_t> sort_scratch; // Used when sorting sparse vectors
+      std::vector<std::size_t> unsort_scratch; // Used when unsorting sparse vectors
       std::unordered_map<std::string, std::unordered_map<std::size_t, pbwt_sort_map>> format_contexts;
 
+      // When records are left in PBWT-sorted order (see reader::pbwt_unsort()), these hold the mappings that the fields
+      // of the most recently read record are sorted by.
+      std::unordered_map<std::string, std::unordered_map<std::size_t, pbwt_sort_map>> record_contexts;
+      std::vector<std::pair<std::string, const pbwt_sort_map*>> record_sort_maps;
+
+      // Scratch for a task that sorts or unsorts one field. The scratch vectors above are only used when fields are
+      // processed on the calling thread.
+      struct task_scratch
+      {
+        std::vector<std::size_t> prev_sort_mapping;
+        std::vector<std::size_t> counts;
+        std::vector<std::size_t> sort_scratch;
+        std::vector<std::size_t> unsort_scratch;
+        std::vector<char> serialized;
+        std::unique_ptr<typed_value> unsorted; // Created on first use since typed_value is incomplete here
+      };
+
+      // When set, fields of a record that are sorted by different mappings are processed concurrently.
+      std::unique_ptr<::savvy::detail::thread_pool> pool;
+      std::vector<task_scratch> task_scratches;
+      std::vector<std::future<void>> task_futures;
+
+      // Fields of the current record that are processed by tasks. These are kept so that they are not reallocated for
+      // every record.
+      std::vector<std::pair<typed_value*, pbwt_sort_map*>> unsort_fields;
+      std::vector<std::tuple<const typed_value*, pbwt_sort_map*, pbwt_sort_map*>> update_fields;
+      std::vector<std::size_t> serialize_fields;
+      std::vector<std::size_t> serialize_task_indices; // Task index of each FORMAT field (-1 if not serialized by a task)
+
+      // Handing a field to the pool costs a few microseconds, which is about as long as unsorting a 2,000 element
+      // biallelic vector, so fields are only processed concurrently when there is enough work besides the largest one.
+      static const std::size_t min_concurrent_size = 8192;
+
+      /**
+       * Decides whether the fields of a record should be processed by tasks.
+       * @param n_fields Number of PBWT-sorted fields in the record
+       * @param total_size Sum of the sizes of these fields
+       * @param max_size Size of the largest of these fields
+       * @return True if pool is set and the fields other than the largest have at least min_concurrent_size values
+       */
+      bool use_tasks(std::size_t n_fields, std::size_t total_size, std::size_t max_size) const
+      {
+        return pool && n_fields > 1 && total_size - max_size >= min_concurrent_size;
+      }
+
+      /**
+       * Calls fn(i, task_scratches[i]) for each i in [0, n_tasks). Tasks other than the first are run on pool, and this
+       * returns once all of them have finished.
+       */
+      template <typename Fn>
+      void run_tasks(std::size_t n_tasks, Fn fn)
+      {
+        if (task_scratches.size() < n_tasks)
+          task_scratches.resize(n_tasks);
+
+        task_futures.clear();
+        for (std::size_t i = 1; i < n_tasks; ++i)
+        {
+          task_scratch* scratch = &task_scratches[i];
+          task_futures.emplace_back(pool->submit([&fn, i, scratch]() { fn(i, *scratch); }));
+        }
+
+        if (n_tasks)
+          fn(0, task_scratches[0]);
+
+        for (auto it = task_futures.begin(); it != task_futures.end(); ++it)
+          it->get();
+        task_futures.clear();
+      }
+
       void reset()
       {
         for (auto it = format_contexts.begin(); it != format_contexts.end(); ++it)
@@ -40,6 +127,134 @@ namespace savvy
       }
     };
   }
+
+  namespace detail
+  {
+    /**
+     * Fast path for unsorting PBWT-sorted vectors whose values are all 0 or 1 (e.g., biallelic GT without missing
+     * values). The next sort mapping is then a stable partition of the previous one, so indices of zeros are written
+     * to the front of the sort mapping and indices of ones to a scratch buffer, without building a histogram. Vectors
+     * with other values are rejected so that the caller can fall back to the general counting sort.
+     */
+    class biallelic_pbwt_unsorter
+    {
+    public:
+      /**
+       * Unsorts values and computes the next sort mapping.
+       * @param src PBWT-sorted values
+       * @param sz Size of src
+       * @param dest Destination for values in unsorted order, or nullptr to only compute the next sort mapping
+       * @param sort_mapping Destination for next sort mapping
+       * @param prev_sort_mapping Mapping that src is sorted by
+       * @param scratch Scratch buffer
+       * @return False if src contains values other than 0 and 1 (dest and sort_mapping may be partially written)
+       */
+      static bool unsort(const std::int8_t* src, std::size_t sz, std::int8_t* dest, std::vector<std::size_t>& sort_mapping, const std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& scratch)
+      {
+        // Vector stores may write up to 3 indices past the end of either partition.
+        sort_mapping.resize(sz + 4);
+        scratch.resize(sz + 4);
+        std::size_t* zeros = sort_mapping.data();
+        std::size_t* ones = scratch.data();
+
+        std::size_t i = 0;
+#ifdef SAVVY_PBWT_X86
+        static const bool use_avx2 = has_avx2();
+        if (use_avx2)
+          i = unsort_avx2(src, sz, dest, prev_sort_mapping.data(), zeros, ones);
+#endif
+        bool ret = i != std::size_t(-1) && unsort_scalar(src, i, sz, dest, prev_sort_mapping.data(), zeros, ones);
+        if (ret)
+          std::copy(scratch.data(), ones, zeros);
+        sort_mapping.resize(sz);
+        return ret;
+      }
+
+      /**
+       * Scalar implementation of unsort() for indices [beg, sz).
+       */
+      static bool unsort_scalar(const std::int8_t* src, std::size_t beg, std::size_t sz, std::int8_t* dest, const std::size_t* prev_sort_mapping, std::size_t*& zeros, std::size_t*& ones)
+      {
+        for (std::size_t i = beg; i < sz; ++i)
+        {
+          const std::uint8_t b = std::uint8_t(src[i]);
+          if (b > 1u)
+            return false;
+          const std::size_t unsorted_index = prev_sort_mapping[i];
+          if (dest)
+            dest[unsorted_index] = std::int8_t(b);
+          // Branchless partition: both buffers are written, but only one pointer advances.
+          *zeros = unsorted_index;
+          *ones = unsorted_index;
+          zeros += 1u - b;
+          ones += b;
+        }
+        return true;
+      }
+    private:
+#ifdef SAVVY_PBWT_X86
+      static bool has_avx2()
+      {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+      }
+
+      // Returns number of values processed or -1 if a value other than 0 or 1 is found. Each 32-byte chunk of values
+      // is reduced to a bit mask, and each group of four 64-bit indices is compressed into the zeros or ones partition
+      // with a permutation selected by four bits of the mask.
+      __attribute__((target("avx2")))
+      static std::size_t unsort_avx2(const std::int8_t* src, std::size_t sz, std::int8_t* dest, const std::size_t* prev_sort_mapping, std::size_t*& zeros, std::size_t*& ones)
+      {
+        static_assert(sizeof(std::size_t) == 8, "64-bit indices required");
+        alignas(32) static const std::int32_t compress_lut[16][8] = {
+          {0, 1, 0, 1, 0, 1, 0, 1},
+          {0, 1, 0, 1, 0, 1, 0, 1},
+          {2, 3, 0, 1, 0, 1, 0, 1},
+          {0, 1, 2, 3, 0, 1, 0, 1},
+          {4, 5, 0, 1, 0, 1, 0, 1},
+          {0, 1, 4, 5, 0, 1, 0, 1},
+          {2, 3, 4, 5, 0, 1, 0, 1},
+          {0, 1, 2, 3, 4, 5, 0, 1},
+          {6, 7, 0, 1, 0, 1, 0, 1},
+          {0, 1, 6, 7, 0, 1, 0, 1},
+          {2, 3, 6, 7, 0, 1, 0, 1},
+          {0, 1, 2, 3, 6, 7, 0, 1},
+          {4, 5, 6, 7, 0, 1, 0, 1},
+          {0, 1, 4, 5, 6, 7, 0, 1},
+          {2, 3, 4, 5, 6, 7, 0, 1},
+          {0, 1, 2, 3, 4, 5, 6, 7}};
+        const __m256i not_binary = _mm256_set1_epi8(char(0xFE));
+
+        std::size_t i = 0;
+        for ( ; i + 32 <= sz; i += 32)
+        {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+          if (!_mm256_testz_si256(v, not_binary))
+            return std::size_t(-1);
+
+          std::uint32_t one_mask = std::uint32_t(_mm256_movemask_epi8(_mm256_slli_epi16(v, 7)));
+          for (int k = 0; k < 32; k += 4)
+          {
+            __m256i idx = _mm256_loadu_si256((const __m256i*)(prev_sort_mapping + i + k));
+            unsigned m1 = (one_mask >> k) & 0xFu;
+            unsigned m0 = ~m1 & 0xFu;
+            _mm256_storeu_si256((__m256i*)zeros, _mm256_permutevar8x32_epi32(idx, _mm256_load_si256((const __m256i*)compress_lut[m0])));
+            _mm256_storeu_si256((__m256i*)ones, _mm256_permutevar8x32_epi32(idx, _mm256_load_si256((const __m256i*)compress_lut[m1])));
+            zeros += __builtin_popcount(m0);
+            ones += __builtin_popcount(m1);
+          }
+
+          if (dest)
+          {
+            for (int k = 0; k < 32; ++k)
+              dest[prev_sort_mapping[i + k]] = src[i + k];
+          }
+        }
+        return i;
+      }
+#endif
+    };
+  }
 }
 
 #endif // LIBSAVVY_PBWT_HPP
\ No newline at end of file
@@ -0,0 +1,365 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_PBWT_MATCHER_HPP
+#define LIBSAVVY_PBWT_MATCHER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <utility>
+
+namespace savvy
+{
+  /**
+   * Finds haplotype matches with the positional Burrows-Wheeler transform (Durbin 2014). Haplotypes are added one
+   * site at a time while prefix and divergence arrays are maintained (Algorithm 2), and matches are reported as soon as
+   * they end. Alleles are compared by value, so multiallelic sites are supported and missing values only match other
+   * missing values.
+   */
+  class pbwt_matcher
+  {
+  public:
+    enum class mode
+    {
+      long_matches, ///< All maximal pairwise matches of at least min_length sites (Algorithm 3)
+      set_maximal   ///< For each haplotype, matches that are not contained in a longer match to another haplotype (Algorithm 4)
+    };
+
+    struct match
+    {
+      std::size_t haplotype; ///< Haplotype index (for long matches, the smaller of the two indices)
+      std::size_t matching_haplotype; ///< Index of haplotype that matches haplotype
+      std::size_t begin; ///< Index of first matching site
+      std::size_t end; ///< One past index of last matching site
+
+      std::size_t length() const { return end - begin; }
+    };
+
+    /**
+     * Constructs matcher.
+     * @param n_haplotypes Number of haplotypes at each site
+     * @param min_length Minimum number of sites in a reported match
+     * @param m Type of matches to report
+     */
+    pbwt_matcher(std::size_t n_haplotypes, std::size_t min_length, mode m = mode::long_matches) :
+      n_haplotypes_(n_haplotypes),
+      min_length_(std::max(std::size_t(1), min_length)),
+      mode_(m)
+    {
+      sorted_alleles_.resize(n_haplotypes_);
+      next_prefix_.resize(n_haplotypes_);
+      next_divergence_.resize(n_haplotypes_ + 1);
+      reset();
+    }
+
+    std::size_t haplotype_count() const { return n_haplotypes_; }
+    std::size_t site_count() const { return site_count_; }
+
+    /**
+     * Restricts reported matches to those involving query haplotypes. For long matches, a pair is reported if either
+     * haplotype is a query; for set-maximal matches, only matches of query haplotypes are reported. The prefix and
+     * divergence arrays still span all haplotypes, but matches are only searched for from query haplotypes.
+     * @param is_query Element i is true if haplotype i is a query (an empty vector makes every haplotype a query)
+     */
+    void set_query_haplotypes(std::vector<bool> is_query)
+    {
+      if (!is_query.empty())
+        is_query.resize(n_haplotypes_, false);
+      is_query_ = std::move(is_query);
+    }
+
+    /**
+     * Prefix array, which orders haplotypes by their reversed prefixes up to the current site.
+     * @return Haplotype indices in sorted order
+     */
+    const std::vector<std::size_t>& prefix_array() const { return prefix_; }
+
+    /**
+     * Divergence array. Element i is the index of the first site at which haplotypes prefix_array()[i - 1] and
+     * prefix_array()[i] match up to the current site.
+     * @return Divergence array (element 0 and element haplotype_count() are used as sentinels)
+     */
+    const std::vector<std::size_t>& divergence_array() const { return divergence_; }
+
+    /**
+     * Reports matches that end before the given site and then adds the site.
+     * @param alleles Allele of each haplotype
+     * @param report Function called with each match (const match&)
+     * @return False if the size of alleles does not match haplotype_count()
+     */
+    template <typename Fn>
+    bool add_site(const std::vector<std::int8_t>& alleles, Fn report)
+    {
+      if (alleles.size() != n_haplotypes_)
+        return false;
+
+      for (std::size_t i = 0; i < n_haplotypes_; ++i)
+        sorted_alleles_[i] = alleles[prefix_[i]];
+
+      report_matches(sorted_alleles_.data(), report);
+      update(sorted_alleles_.data());
+      ++site_count_;
+      return true;
+    }
+
+    /**
+     * Reports matches that extend to the last site added and resets the matcher so that a new set of sites (e.g.,
+     * the next chromosome) can be added.
+     * @param report Function called with each match (const match&)
+     */
+    template <typename Fn>
+    void finish(Fn report)
+    {
+      report_matches(nullptr, report);
+      reset();
+    }
+
+    /**
+     * Clears matcher state without reporting matches.
+     */
+    void reset()
+    {
+      site_count_ = 0;
+      prefix_.resize(n_haplotypes_);
+      for (std::size_t i = 0; i < n_haplotypes_; ++i)
+        prefix_[i] = i;
+      divergence_.assign(n_haplotypes_ + 1, 0);
+    }
+  private:
+    // Alleles are in prefix array order. A null alleles pointer ends every match at the current site.
+    template <typename Fn>
+    void report_matches(const std::int8_t* alleles, Fn& report)
+    {
+      if (n_haplotypes_ < 2 || site_count_ < min_length_)
+        return;
+
+      divergence_[0] = site_count_ + 1;
+      divergence_[n_haplotypes_] = site_count_ + 1;
+
+      if (mode_ == mode::set_maximal)
+        report_set_maximal(alleles, report);
+      else
+        report_long(alleles, report);
+    }
+
+    // Haplotypes in a block of the prefix array match each other over at least min_length sites. Pairs with different
+    // alleles at the current site are reported, starting at the maximum divergence between them.
+    template <typename Fn>
+    void report_long(const std::int8_t* alleles, Fn& report)
+    {
+      const std::size_t k = site_count_;
+      std::size_t block_beg = 0;
+      for (std::size_t i = 1; i <= n_haplotypes_; ++i)
+      {
+        if (i == n_haplotypes_ || divergence_[i] + min_length_ > k)
+        {
+          if (i - block_beg > 1)
+          {
+            if (is_query_.empty())
+              report_long_block(alleles, block_beg, i, report);
+            else
+              report_long_query_block(alleles, block_beg, i, report);
+          }
+          block_beg = i;
+        }
+      }
+    }
+
+    template <typename Fn>
+    void report_long_block(const std::int8_t* alleles, std::size_t beg, std::size_t end, Fn& report)
+    {
+      const std::size_t k = site_count_;
+      std::int8_t majority = 0;
+      if (alleles)
+      {
+        std::size_t i = beg + 1;
+        while (i < end && alleles[i] == alleles[beg])
+          ++i;
+        if (i == end)
+          return; // Every match in block extends past this site.
+
+        std::array<std::size_t, 256> counts{};
+        for (i = beg; i < end; ++i)
+          ++counts[std::uint8_t(alleles[i])];
+        majority = std::int8_t(std::max_element(counts.begin(), counts.end()) - counts.begin());
+      }
+
+      // Only haplotypes with a minority allele are walked from, so that the cost is proportional to the number of
+      // matches reported. Pairs of minority haplotypes are only reported while walking left.
+      for (std::size_t i = beg; i < end; ++i)
+      {
+        if (alleles && alleles[i] == majority)
+          continue;
+
+        std::size_t start = 0;
+        for (std::size_t j = i; j-- > beg; )
+        {
+          start = std::max(start, divergence_[j + 1]);
+          if (!alleles || alleles[j] != alleles[i])
+            report(make_pair_match(prefix_[i], prefix_[j], start, k));
+        }
+
+        if (alleles)
+        {
+          start = 0;
+          for (std::size_t j = i + 1; j < end; ++j)
+          {
+            start = std::max(start, divergence_[j]);
+            if (alleles[j] == majority)
+              report(make_pair_match(prefix_[i], prefix_[j], start, k));
+          }
+        }
+      }
+    }
+
+    // Walks the whole block from each query haplotype. Pairs of query haplotypes are only reported while walking left.
+    template <typename Fn>
+    void report_long_query_block(const std::int8_t* alleles, std::size_t beg, std::size_t end, Fn& report)
+    {
+      const std::size_t k = site_count_;
+      for (std::size_t i = beg; i < end; ++i)
+      {
+        if (!is_query_[prefix_[i]])
+          continue;
+
+        std::size_t start = 0;
+        for (std::size_t j = i; j-- > beg; )
+        {
+          start = std::max(start, divergence_[j + 1]);
+          if (!alleles || alleles[j] != alleles[i])
+            report(make_pair_match(prefix_[i], prefix_[j], start, k));
+        }
+
+        start = 0;
+        for (std::size_t j = i + 1; j < end; ++j)
+        {
+          start = std::max(start, divergence_[j]);
+          if ((!alleles || alleles[j] != alleles[i]) && !is_query_[prefix_[j]])
+            report(make_pair_match(prefix_[i], prefix_[j], start, k));
+        }
+      }
+    }
+
+    // Algorithm 4. A match of haplotype i to its neighbors ends at this site only if none of the neighbors that match
+    // at least as far back can be extended.
+    template <typename Fn>
+    void report_set_maximal(const std::int8_t* alleles, Fn& report)
+    {
+      const std::size_t k = site_count_;
+      const std::vector<std::size_t>& d = divergence_;
+      for (std::size_t i = 0; i < n_haplotypes_; ++i)
+      {
+        if (!is_query_.empty() && !is_query_[prefix_[i]])
+          continue;
+
+        std::size_t lo = i, hi = i + 1;
+        bool extends = false;
+        if (d[i] <= d[i + 1])
+        {
+          while (d[lo] <= d[i])
+          {
+            if (alleles && alleles[lo - 1] == alleles[i])
+            {
+              extends = true;
+              break;
+            }
+            --lo;
+          }
+        }
+
+        if (!extends && d[i] >= d[i + 1])
+        {
+          while (d[hi] <= d[i + 1])
+          {
+            if (alleles && alleles[hi] == alleles[i])
+            {
+              extends = true;
+              break;
+            }
+            ++hi;
+          }
+        }
+
+        if (extends)
+          continue;
+
+        if (k - std::min(d[i], k) >= min_length_)
+        {
+          for (std::size_t j = lo; j < i; ++j)
+            report(match{prefix_[i], prefix_[j], d[i], k});
+        }
+
+        if (k - std::min(d[i + 1], k) >= min_length_)
+        {
+          for (std::size_t j = i + 1; j < hi; ++j)
+            report(match{prefix_[i], prefix_[j], d[i + 1], k});
+        }
+      }
+    }
+
+    // Algorithm 2, generalized to more than two alleles. Haplotypes are stably bucketed by allele, and the divergence
+    // of each haplotype is the maximum divergence since the previous haplotype in the same bucket.
+    void update(const std::int8_t* alleles)
+    {
+      const std::size_t k = site_count_;
+      std::array<std::size_t, 256> counts{};
+      for (std::size_t i = 0; i < n_haplotypes_; ++i)
+        ++counts[std::uint8_t(alleles[i])];
+
+      bucket_offsets_.clear();
+      std::size_t offset = 0;
+      for (std::size_t v = 0; v < counts.size(); ++v)
+      {
+        if (counts[v])
+        {
+          bucket_index_[v] = std::uint8_t(bucket_offsets_.size());
+          bucket_offsets_.push_back(offset);
+          offset += counts[v];
+        }
+      }
+
+      bucket_divergence_.assign(bucket_offsets_.size(), k + 1);
+      for (std::size_t i = 0; i < n_haplotypes_; ++i)
+      {
+        for (auto it = bucket_divergence_.begin(); it != bucket_divergence_.end(); ++it)
+          *it = std::max(*it, divergence_[i]);
+
+        const std::size_t b = bucket_index_[std::uint8_t(alleles[i])];
+        const std::size_t dest = bucket_offsets_[b]++;
+        next_prefix_[dest] = prefix_[i];
+        next_divergence_[dest] = bucket_divergence_[b];
+        bucket_divergence_[b] = 0;
+      }
+
+      prefix_.swap(next_prefix_);
+      divergence_.swap(next_divergence_);
+    }
+
+    static match make_pair_match(std::size_t a, std::size_t b, std::size_t beg, std::size_t end)
+    {
+      return a < b ? match{a, b, beg, end} : match{b, a, beg, end};
+    }
+  private:
+    std::size_t n_haplotypes_;
+    std::size_t min_length_;
+    mode mode_;
+    std::size_t site_count_ = 0;
+    std::vector<std::size_t> prefix_;
+    std::vector<std::size_t> divergence_;
+    std::vector<std::size_t> next_prefix_;
+    std::vector<std::size_t> next_divergence_;
+    std::vector<std::int8_t> sorted_alleles_;
+    std::vector<bool> is_query_;
+    std::vector<std::size_t> bucket_offsets_;
+    std::vector<std::size_t> bucket_divergence_;
+    std::array<std::uint8_t, 256> bucket_index_{};
+  };
+}
+
+#endif // LIBSAVVY_PBWT_MATCHER_HPP
@@ -12,6 +12,8 @@
 #include "file.hpp"
 #include "csi.hpp"
 #include "s1r.hpp"
+#include "block_ibuf.hpp"
+#include "variant_batch.hpp"
 
 #include <shrinkwrap/zstd.hpp>
 #include <shrinkwrap/gz.hpp>
@@ -19,9 +21,13 @@
 
 #include <cstdlib>
 #include <string>
+#include <sstream>
 #include <memory>
 #include <stdexcept>
 #include <limits>
+#include <algorithm>
+#include <functional>
+#include <map>
 
 namespace savvy
 {
@@ -31,30 +37,41 @@ namespace savvy
     {
     private:
       std::unique_ptr<std::streambuf> sbuf_;
+      ::savvy::detail::block_ibuf<::savvy::detail::zstd_block_codec>* block_buf_ = nullptr;
       std::unique_ptr<std::istream> input_stream_;
-      std::vector<std::pair<std::string, std::string>> headers_;
-      std::vector<std::string> ids_;
+      std::string file_path_;
+      std::shared_ptr<std::vector<std::pair<std::string, std::string>>> headers_ = std::make_shared<std::vector<std::pair<std::string, std::string>>>(); // Shared with clones
+      std::shared_ptr<std::vector<std::string>> ids_ = std::make_shared<std::vector<std::string>>(); // Shared with clones
       typed_value extra_typed_value_;
 
       std::vector<std::size_t> subset_map_;
       std::size_t subset_size_;
 
+      std::vector<bool> skipped_format_ids_;
+      std::vector<bool> all_format_ids_;
+      bool sites_only_ = false;
+      bool zero_copy_ = false;
+      bool pbwt_unsort_ = true;
+      std::function<bool(const site_info&)> site_filter_;
+
       // Random access
       struct s1r_query_context
       {
-        genomic_region reg;
-        s1r::reader::query query;
-        s1r::reader::query::iterator iter;
+        std::vector<genomic_region> regs; // Merged (see query_bounds::merge())
+        std::vector<std::uint64_t> blocks;
+        const std::vector<std::uint64_t>* block_list; // Points to blocks or, for slice queries, to a cached leaf table
+        std::size_t next_block_idx;
         bounding_point bounding_type;
         std::uint32_t current_offset_in_block;
         std::uint32_t total_in_block;
         std::uint64_t total_records_read;
         std::uint64_t max_records_to_read;
 
-        s1r_query_context(s1r::reader& file, genomic_region bounds, bounding_point bound_type = bounding_point::beg) :
-          reg(bounds),
-          query(file.create_query(bounds)),
-          iter(query.begin()),
+        s1r_query_context(std::vector<genomic_region> bounds, bounding_point bound_type, std::vector<std::uint64_t> block_values) :
+          regs(std::move(bounds)),
+          blocks(std::move(block_values)),
+          block_list(&blocks),
+          next_block_idx(0),
           bounding_type(bound_type),
           current_offset_in_block(0),
           total_in_block(0),
@@ -62,28 +79,71 @@ namespace savvy
           max_records_to_read(std::numeric_limits<std::uint64_t>::max())
         {
         }
+
+        bool next_block(std::uint64_t& value)
+        {
+          if (next_block_idx >= block_list->size())
+            return false;
+          value = (*block_list)[next_block_idx++];
+          return true;
+        }
       };
 
       struct csi_query_context
       {
-        genomic_region reg;
+        std::vector<genomic_region> regs; // Merged (see query_bounds::merge())
         std::list<std::pair<std::uint64_t, std::uint64_t>> intervals;
         std::size_t interval_off;
         bounding_point bounding_type;
 
-        csi_query_context(csi_index& file, const std::unordered_map<std::string, std::uint32_t>& contig_map, genomic_region bounds, bounding_point bound_type = bounding_point::beg) :
-          reg(bounds),
+        csi_query_context(csi_index& file, const std::unordered_map<std::string, std::uint32_t>& contig_map, std::vector<genomic_region> bounds, bounding_point bound_type = bounding_point::beg) :
+          regs(std::move(bounds)),
           interval_off(0),
           bounding_type(bound_type)
         {
-          auto tmp = file.query_intervals(reg.chromosome(), contig_map, reg.from(), std::min<std::uint64_t>(reg.to(), std::numeric_limits<std::int64_t>::max())); // TODO: have this return list instead of vector
-          intervals.assign(tmp.begin(), tmp.end());
+          // Intervals are coalesced per chromosome so that chunks shared by nearby regions are only read once. Intervals
+          // that start in the compressed block where the previous one ends are also merged, since that block is
+          // decompressed anyway. Intervals of different chromosomes are never merged, even when they abut, because
+          // read_csi_indexed_record() skips the rest of an interval once a record is past the regions of its chromosome.
+          std::map<std::string, std::vector<std::pair<std::uint64_t, std::uint64_t>>> chrom_intervals;
+          for (auto it = regs.begin(); it != regs.end(); ++it)
+          {
+            // Index bins use zero-based, half-open coordinates.
+            auto reg_intervals = file.query_intervals(it->chromosome(), contig_map, it->from() ? it->from() - 1 : 0, std::min<std::uint64_t>(it->to(), std::numeric_limits<std::int64_t>::max()));
+            auto& tmp = chrom_intervals[it->chromosome()];
+            tmp.insert(tmp.end(), reg_intervals.begin(), reg_intervals.end());
+          }
+
+          std::vector<std::pair<std::uint64_t, std::uint64_t>> merged;
+          for (auto ct = chrom_intervals.begin(); ct != chrom_intervals.end(); ++ct)
+          {
+            auto& tmp = ct->second;
+            std::sort(tmp.begin(), tmp.end());
+            std::size_t chrom_beg = merged.size();
+            for (auto it = tmp.begin(); it != tmp.end(); ++it)
+            {
+              if (merged.size() == chrom_beg || (it->first > merged.back().second && (it->first >> 16) != (merged.back().second >> 16)))
+                merged.emplace_back(*it);
+              else
+                merged.back().second = std::max(merged.back().second, it->second);
+            }
+          }
+
+          std::sort(merged.begin(), merged.end());
+          intervals.assign(merged.begin(), merged.end());
+        }
+
+        // Checks whether there are no regions beyond the given position on the given chromosome.
+        bool past_regions(const std::string& chrom, std::uint64_t pos) const
+        {
+          auto it = std::upper_bound(regs.begin(), regs.end(), chrom, [](const std::string& c, const genomic_region& reg) { return c < reg.chromosome(); });
+          return it == regs.begin() || (it - 1)->chromosome() != chrom || pos > (it - 1)->to();
         }
       };
 
-      std::unique_ptr<s1r::reader> s1r_index_;
+      std::shared_ptr<s1r::reader> s1r_index_; // Shared with clones
       std::unique_ptr<s1r_query_context> s1r_query_;
-      std::unique_ptr<csi_index> csi_index_;
+      std::shared_ptr<csi_index> csi_index_; // Shared with clones
       std::unique_ptr<csi_query_context> csi_query_;
     public:
       /**
@@ -95,22 +155,36 @@ namespace savvy
        * Constructs reader object and opens SAV, BCF, or VCF file.
        *
        * @param file_path Path to file that will be opened
+       * @param decompression_threads Number of worker threads used to decompress SAV or BGZF (VCF.gz and BCF) blocks ahead of read() (0 decompresses on the calling thread)
+       * @param cache Cache of decompressed SAV blocks, which can be shared with other readers to avoid decompressing the same blocks repeatedly across reset_bounds() calls (nullptr disables caching)
+       */
+      reader(const std::string& file_path, std::size_t decompression_threads = 0, std::shared_ptr<block_cache> cache = nullptr);
+
+      /**
+       * Opens another reader of the same file without re-parsing the header. The parsed header, sample IDs and
+       * index are shared with this reader, so only a file stream and decoding buffers are created for the clone. The
+       * clone is positioned at the first record and does not inherit sample subsets, FORMAT field selections, site
+       * filters or query bounds. Clones and the original reader may be used concurrently from different threads.
+       *
+       * @param decompression_threads Number of worker threads used by clone to decompress SAV or BGZF blocks ahead of read()
+       * @param cache Cache of decompressed SAV blocks (nullptr disables caching)
+       * @return New reader object
        */
-      reader(const std::string& file_path);
+      std::unique_ptr<reader> clone(std::size_t decompression_threads = 0, std::shared_ptr<block_cache> cache = nullptr) const;
 
       /**
        * Getter for meta-information lines found in file header.
        *
        * @return Vector of header line key-value pairs
        */
-      const std::vector<std::pair<std::string, std::string>>& headers() const { return headers_; }
+      const std::vector<std::pair<std::string, std::string>>& headers() const { return *headers_; }
 
       /**
        * Getter for sample IDs found in file header
        *
        * @return Vector of sample IDs
        */
-      const std::vector<std::string>& samples() const { return ids_; } // TODO: return subset when applicable.
+      const std::vector<std::string>& samples() const { return *ids_; } // TODO: return subset when applicable.
 
       /**
        * Getter for FORMAT headers found in file.
@@ -134,6 +208,96 @@ namespace savvy
        */
       std::vector<std::string> subset_samples(const std::unordered_set<std::string>& subset);
 
+      /**
+       * Restricts the FORMAT fields decoded by future calls to read(). For SAV and BCF files, data for other fields is
+       * skipped over without being decoded.
+       *
+       * @param fields FORMAT keys to include (e.g., {"GT"})
+       * @param exclude If true, fields are excluded instead of included
+       */
+      void set_format_fields(const std::unordered_set<std::string>& fields, bool exclude = false);
+
+      /**
+       * Getter for sites-only mode.
+       *
+       * @return True if individual data is skipped by read()
+       */
+      bool sites_only() const { return sites_only_; }
+
+      /**
+       * Enables or disables sites-only mode. When enabled, read() only populates site info and skips over the
+       * individual data of each record without decoding it. Since PBWT state is not maintained while individual data
+       * is skipped, disabling sites-only mode part way through a file should be followed by a call to reset_bounds().
+       *
+       * @param val Sites-only status
+       */
+      void sites_only(bool val) { sites_only_ = val; }
+
+      /**
+       * Getter for zero-copy mode.
+       *
+       * @return True if FORMAT values may reference the reader's decompression buffers
+       */
+      bool zero_copy() const { return zero_copy_; }
+
+      /**
+       * Enables or disables zero-copy mode. When enabled, FORMAT values populated by read() reference decompressed
+       * blocks owned by the reader instead of copying them (see typed_value::is_borrowed()). Borrowed values are only
+       * valid until the next call to read() or reset_bounds(). Copying the variant or modifying a value makes it take
+       * ownership of its data. This only has an effect on SAV files opened with decompression threads or a block cache.
+       *
+       * @param val Zero-copy status
+       */
+      void zero_copy(bool val) { zero_copy_ = val; }
+
+      /**
+       * Getter for PBWT unsort mode.
+       *
+       * @return True if PBWT-sorted FORMAT fields are put back into sample order by read()
+       */
+      bool pbwt_unsort() const { return pbwt_unsort_; }
+
+      /**
+       * Enables or disables unsorting of PBWT-sorted FORMAT fields. When disabled, read() leaves these fields in
+       * PBWT-sorted order (see typed_value::pbwt_flag()), which saves scattering every value into sample order. This
+       * is useful when only permutation-invariant summaries (e.g., allele counts) are needed. The mapping that a
+       * field is sorted by is available from pbwt_sort_map() until the next call to read(), and
+       * typed_value::copy_pbwt_unsorted() can be used to put individual fields into sample order. Fields are always
+       * unsorted when a sample subset is set.
+       *
+       * @param val PBWT unsort status
+       */
+      void pbwt_unsort(bool val) { pbwt_unsort_ = val; }
+
+      /**
+       * Unsorts PBWT-sorted FORMAT fields (e.g., GT and PH) of each record concurrently. Each field is sorted by its own
+       * mapping, so this only reduces the time spent in read() for records with more than one PBWT-sorted field.
+       *
+       * @param n_threads Number of threads used per record, including the calling thread (values less than 2 disable)
+       */
+      void set_pbwt_threads(std::size_t n_threads)
+      {
+        sort_context_.pool.reset(n_threads > 1 ? new ::savvy::detail::thread_pool(n_threads - 1) : nullptr);
+      }
+
+      /**
+       * Gets the mapping that a PBWT-sorted FORMAT field of the most recently read record is sorted by. The value at
+       * index i of the sorted field belongs to sample-order index (*pbwt_sort_map(key))[i].
+       *
+       * @param key FORMAT key (e.g., "GT")
+       * @return Pointer to sort mapping or nullptr if field was not left in PBWT-sorted order
+       */
+      const std::vector<std::size_t>* pbwt_sort_map(const std::string& key) const;
+
+      /**
+       * Sets a predicate that is evaluated on the site info of each record before its individual data is decoded.
+       * Records for which the predicate returns false are skipped by read(). For SAV and BCF files, the individual data
+       * of skipped records is passed over without being decoded (PBWT sort mappings are still updated).
+       *
+       * @param fn Site predicate (an empty function disables filtering)
+       */
+      void set_site_filter(std::function<bool(const site_info&)> fn);
+
       /**
        * Uses S1R or CSI index to query genomic region.
        *
@@ -143,6 +307,17 @@ namespace savvy
        */
       reader& reset_bounds(genomic_region reg, bounding_point bp = bounding_point::beg);
 
+      /**
+       * Uses S1R or CSI index to query a list of genomic regions in a single pass. Overlapping regions are merged and
+       * each block of the file is read at most once. Records are returned in file order, and records within more than
+       * one region are only returned once.
+       *
+       * @param regs Genomic regions to query
+       * @param bp Specifies how indels are treated when they cross region bounds
+       * @return *this
+       */
+      reader& reset_bounds(const std::vector<genomic_region>& regs, bounding_point bp = bounding_point::beg);
+
       /**
        * Uses S1R index to query records by offset within file.
        *
@@ -151,6 +326,15 @@ namespace savvy
        */
       reader& reset_bounds(slice_bounds reg);
 
+      /**
+       * Uses S1R index to split file into shards with roughly equal record counts (see s1r::reader::plan_shards()).
+       * Each shard can be queried by passing it to reset_bounds().
+       *
+       * @param n_shards Number of shards
+       * @return Slice bounds of each shard (empty vector if file is not indexed or the index could not be read)
+       */
+      std::vector<slice_bounds> plan_shards(std::size_t n_shards);
+
       /**
        * Getter for file's phasing status.
        *
@@ -187,6 +371,40 @@ namespace savvy
        */
       reader& read(variant& r);
 
+      /**
+       * Reads the next record of a VCF file as an unparsed line of text. Parsing can then be done by parse_vcf_line(),
+       * which allows records to be parsed on worker threads while this thread splits the input into lines. Only
+       * supported for VCF files without a region query.
+       *
+       * @param line Destination of record text (without trailing newline)
+       * @return False on EOF or error
+       */
+      bool read_vcf_line(std::string& line);
+
+      /**
+       * Parses a line produced by read_vcf_line() the same way read() parses VCF records, including the site filter,
+       * FORMAT field selection and sample subset. Reader state is not modified, so this may be called concurrently from
+       * multiple threads.
+       *
+       * @param line Record text
+       * @param r Destination record object
+       * @param filtered_out Set to true if record is excluded by site filter, in which case only site info is populated
+       * @return False if line is malformed
+       */
+      bool parse_vcf_line(const std::string& line, variant& r, bool& filtered_out) const;
+
+      /**
+       * Reads up to max_records consecutive records into a columnar batch. Existing contents of the batch are
+       * replaced. A record whose FORMAT field size differs from the stride of the current batch is held in the batch
+       * object and becomes the first record of the next call, so the same batch object should be passed to consecutive calls.
+       *
+       * @param batch Destination batch object
+       * @param max_records Maximum number of records to read
+       * @return Number of records read into batch (0 at end of file or on error)
+       */
+      template <typename T>
+      std::size_t read_batch(variant_batch<T>& batch, std::size_t max_records);
+
       /**
        * Shorthand for read() function.
        *
@@ -210,26 +428,73 @@ namespace savvy
       std::streampos tellg() { return this->input_stream_->tellg(); }
     private:
 //      void process_header_pair(const std::string& key, const std::string& val);
+      bool open_stream(std::size_t decompression_threads, std::shared_ptr<block_cache> cache);
+      bool skip_header();
       bool read_header();
-      bool read_header_sav1();
+      bool read_header_sav1(::savvy::dictionary& dict);
 
-      reader& read_record(variant& r);
-      reader& read_vcf_record(variant& r);
+      reader& read_record(variant& r, bool& filtered_out);
+      reader& read_vcf_record(variant& r, bool& filtered_out);
+      bool deserialize_vcf_record(std::istream& is, variant& r, bool& filtered_out) const;
+      void project_format_fields(variant& r, typed_value& scratch) const;
       reader& read_sav1_record(variant& r);
       reader& read_indexed_record(variant& r);
       reader& read_csi_indexed_record(variant& r);
+      bool site_filtered_out(const site_info& s) const;
+      bool discard_record(variant& tmp_var);
     };
 
     //================================================================//
     // Reader definitions
     inline
-    reader::reader(const std::string& file_path)
+    reader::reader(const std::string& file_path, std::size_t decompression_threads, std::shared_ptr<block_cache> cache) :
+      file_path_(file_path)
     {
-      FILE* fp = fopen(file_path.c_str(), "rb");
+      if (!open_stream(decompression_threads, std::move(cache)))
+        return;
+
+      if (!read_header())
+        input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+
+      bool csi_exists;
+      if (file_format_ == format::sav1 || file_format_ == format::sav2)
+        s1r_index_ = ::savvy::detail::make_unique<s1r::reader>(::savvy::detail::file_exists(file_path + ".s1r") ? file_path + ".s1r" : file_path);
+      else if ((csi_exists = ::savvy::detail::file_exists(file_path + ".csi")) || ::savvy::detail::file_exists(file_path + ".tbi"))
+        csi_index_ = ::savvy::detail::make_unique<csi_index>(file_path + (csi_exists ? ".csi" : ".tbi"));
+    }
+
+    inline
+    std::unique_ptr<reader> reader::clone(std::size_t decompression_threads, std::shared_ptr<block_cache> cache) const
+    {
+      if (!sbuf_ || file_format_ == format::sav1)
+        return ::savvy::detail::make_unique<reader>(file_path_, decompression_threads, std::move(cache));
+
+      auto ret = ::savvy::detail::make_unique<reader>();
+      ret->file_path_ = file_path_;
+      if (!ret->open_stream(decompression_threads, std::move(cache)))
+        return ret;
+
+      ret->copy_header_state(*this);
+      ret->headers_ = headers_;
+      ret->ids_ = ids_;
+      ret->subset_size_ = ids_->size();
+      ret->s1r_index_ = s1r_index_;
+      ret->csi_index_ = csi_index_;
+
+      if (bad() || !ret->skip_header())
+        ret->input_stream_->setstate(ret->input_stream_->rdstate() | std::ios::badbit);
+
+      return ret;
+    }
+
+    inline
+    bool reader::open_stream(std::size_t decompression_threads, std::shared_ptr<block_cache> cache)
+    {
+      FILE* fp = fopen(file_path_.c_str(), "rb");
       if (!fp)
       {
         input_stream_ = savvy::detail::make_unique<std::istream>(nullptr);
-        return;
+        return false;
       }
 
       int first_byte = fgetc(fp);
@@ -238,10 +503,21 @@ namespace savvy
       switch (char(first_byte))
       {
       case '\x1F':
-        sbuf_ = ::savvy::detail::make_unique<::shrinkwrap::bgzf::ibuf>(fp);
+        if (decompression_threads)
+          sbuf_ = ::savvy::detail::make_unique<::savvy::detail::block_ibuf<::savvy::detail::bgzf_block_codec>>(fp, decompression_threads);
+        else
+          sbuf_ = ::savvy::detail::make_unique<::shrinkwrap::bgzf::ibuf>(fp);
         break;
       case '\x28':
-        sbuf_ = ::savvy::detail::make_unique<::shrinkwrap::zstd::ibuf>(fp);
+        if (decompression_threads || cache)
+        {
+          auto buf = ::savvy::detail::make_unique<::savvy::detail::block_ibuf<::savvy::detail::zstd_block_codec>>(fp, decompression_threads);
+          buf->set_cache(std::move(cache), file_path_);
+          block_buf_ = buf.get();
+          sbuf_ = std::move(buf);
+        }
+        else
+          sbuf_ = ::savvy::detail::make_unique<::shrinkwrap::zstd::ibuf>(fp);
         break;
       default:
         sbuf_ = ::savvy::detail::make_unique<::shrinkwrap::stdio::filebuf>(fp);
@@ -249,15 +525,7 @@ namespace savvy
       }
 
       input_stream_ = savvy::detail::make_unique<std::istream>(sbuf_.get());
-
-      if (!read_header())
-        input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
-
-      bool csi_exists;
-      if (file_format_ == format::sav1 || file_format_ == format::sav2)
-        s1r_index_ = ::savvy::detail::make_unique<s1r::reader>(::savvy::detail::file_exists(file_path + ".s1r") ? file_path + ".s1r" : file_path);
-      else if ((csi_exists = ::savvy::detail::file_exists(file_path + ".csi")) || ::savvy::detail::file_exists(file_path + ".tbi"))
-        csi_index_ = ::savvy::detail::make_unique<csi_index>(file_path + (csi_exists ? ".csi" : ".tbi"));
+      return true;
     }
 
 //    inline
@@ -286,16 +554,16 @@ namespace savvy
     std::vector<std::string> reader::subset_samples(const std::unordered_set<std::string>& subset)
     {
       std::vector<std::string> ret;
-      ret.reserve(std::min(subset.size(), ids_.size()));
+      ret.reserve(std::min(subset.size(), ids_->size()));
 
       subset_map_.clear();
-      subset_map_.resize(ids_.size(), std::numeric_limits<std::uint64_t>::max());
+      subset_map_.resize(ids_->size(), std::numeric_limits<std::uint64_t>::max());
       std::uint64_t subset_index = 0;
-      for (auto it = ids_.begin(); it != ids_.end(); ++it)
+      for (auto it = ids_->begin(); it != ids_->end(); ++it)
       {
         if (subset.find(*it) != subset.end())
         {
-          subset_map_[std::distance(ids_.begin(), it)] = subset_index;
+          subset_map_[std::distance(ids_->begin(), it)] = subset_index;
           ret.push_back(*it);
           ++subset_index;
         }
@@ -306,20 +574,57 @@ namespace savvy
       return ret;
     }
 
+    inline
+    void reader::set_format_fields(const std::unordered_set<std::string>& fields, bool exclude)
+    {
+      const auto& fmt_entries = dict_->entries[dictionary::id];
+      skipped_format_ids_.clear();
+      skipped_format_ids_.resize(fmt_entries.size(), false);
+      for (std::size_t i = 0; i < fmt_entries.size(); ++i)
+        skipped_format_ids_[i] = (fields.find(fmt_entries[i].id) == fields.end()) != exclude;
+    }
+
+    inline
+    const std::vector<std::size_t>* reader::pbwt_sort_map(const std::string& key) const
+    {
+      for (auto it = sort_context_.record_sort_maps.begin(); it != sort_context_.record_sort_maps.end(); ++it)
+      {
+        if (it->first == key)
+          return it->second;
+      }
+      return nullptr;
+    }
+
+    inline
+    void reader::set_site_filter(std::function<bool(const site_info&)> fn)
+    {
+      site_filter_ = std::move(fn);
+    }
+
     inline
     reader& reader::reset_bounds(genomic_region reg, bounding_point bp)
+    {
+      return reset_bounds(std::vector<genomic_region>(1, std::move(reg)), bp);
+    }
+
+    inline
+    reader& reader::reset_bounds(const std::vector<genomic_region>& regs, bounding_point bp)
     {
       input_stream_->clear();
       s1r_query_.reset(nullptr);
       csi_query_.reset(nullptr);
 
+      std::vector<query_bounds> merged_bounds = query_bounds::merge(regs.begin(), regs.end());
+      std::vector<genomic_region> merged(std::make_move_iterator(merged_bounds.begin()), std::make_move_iterator(merged_bounds.end()));
+
       if (s1r_index_ && s1r_index_->good()) //file_format_ == format::sav1 || file_format_ == format::sav2)
       {
-        s1r_query_ = ::savvy::detail::make_unique<s1r_query_context>(*s1r_index_, reg, bp);
+        std::vector<std::uint64_t> blocks = s1r_index_->query_blocks(merged);
+        s1r_query_ = ::savvy::detail::make_unique<s1r_query_context>(std::move(merged), bp, std::move(blocks));
       }
       else if (csi_index_ && csi_index_->good())
       {
-        csi_query_ = ::savvy::detail::make_unique<csi_query_context>(*csi_index_, dict_.str_to_int[dictionary::contig], reg, bp);
+        csi_query_ = ::savvy::detail::make_unique<csi_query_context>(*csi_index_, dict_->str_to_int[dictionary::contig], std::move(merged), bp);
         if (!csi_query_->intervals.empty())
         {
           input_stream_->seekg(csi_query_->intervals.front().first);
@@ -336,55 +641,53 @@ namespace savvy
     inline
     reader& reader::reset_bounds(slice_bounds reg)
     {
-      if (file_format_ == format::sav1 || file_format_ == format::sav2)
+      input_stream_->clear();
+      s1r_query_.reset(nullptr);
+      csi_query_.reset(nullptr);
+
+      if ((file_format_ == format::sav1 || file_format_ == format::sav2) && s1r_index_ && s1r_index_->good())
       {
-        reset_bounds(genomic_region(reg.chromosome()));
+        if (reg.to() <= reg.from())
+        {
+          // Empty slice (e.g., an empty shard).
+          input_stream_->setstate(std::ios::eofbit);
+          return *this;
+        }
 
-        if (s1r_query_) //s1r_index_ && s1r_index_->good())
+        s1r_query_ = ::savvy::detail::make_unique<s1r_query_context>(std::vector<genomic_region>(1, genomic_region(reg.chromosome())), bounding_point::beg, std::vector<std::uint64_t>());
+
+        // Binary search for the block containing the first record of the slice.
+        const s1r::leaf_table& leaves = s1r_index_->leaf_entries(reg.chromosome());
+        if (!leaves.loaded)
         {
-          auto discard_skip = [this](std::uint32_t num)
-          {
-            savvy::variant tmp_var;
-            while (num > 0 && s1r_query_->current_offset_in_block < s1r_query_->total_in_block && good())
-            {
-              if (!read_record(tmp_var))
-                input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+          this->input_stream_->setstate(std::ios::badbit);
+          return *this;
+        }
 
-              ++(s1r_query_->current_offset_in_block);
-              --num;
-            }
-            return num;
-          };
-
-          std::size_t num_variants_to_skip = reg.from();
-          s1r_query_->max_records_to_read = reg.to() > reg.from() ? reg.to() - reg.from() : 0;
-    //        if (num_variants_to_skip < total_in_block_ - current_offset_in_block_)
-    //        {
-    //          discard_skip(num_variants_to_skip);
-    //        }
-    //        else
-          {
-    //          num_variants_to_skip -= (total_in_block_ - current_offset_in_block_);
-            while (s1r_query_->iter != s1r_query_->query.end())
-            {
-              s1r_query_->total_in_block = std::uint32_t(0x000000000000FFFF & s1r_query_->iter->value()) + 1;
+        const std::vector<std::uint64_t>& counts = leaves.cumulative_counts;
+        std::size_t block_idx = std::distance(counts.begin(), std::upper_bound(counts.begin(), counts.end(), std::uint64_t(reg.from()))) - 1;
+        if (block_idx >= leaves.values.size())
+        {
+          // Skipped past end of index.
+          this->input_stream_->setstate(std::ios::failbit);
+          return *this;
+        }
 
-              if (num_variants_to_skip < s1r_query_->total_in_block)
-              {
-                s1r_query_->current_offset_in_block = 0;
-                this->input_stream_->seekg(std::streampos((s1r_query_->iter->value() >> 16) & 0x0000FFFFFFFFFFFF));
-                ++(s1r_query_->iter);
-                discard_skip(num_variants_to_skip);
-                return *this;
-              }
+        s1r_query_->block_list = &leaves.values;
+        s1r_query_->next_block_idx = block_idx + 1;
+        s1r_query_->max_records_to_read = reg.to() > reg.from() ? reg.to() - reg.from() : 0;
 
-              num_variants_to_skip -= s1r_query_->total_in_block;
-              ++(s1r_query_->iter);
-            }
+        std::uint64_t block_value = leaves.values[block_idx];
+        s1r_query_->total_in_block = std::uint32_t(0x000000000000FFFF & block_value) + 1;
+        s1r_query_->current_offset_in_block = 0;
+        this->input_stream_->seekg(std::streampos((block_value >> 16) & 0x0000FFFFFFFFFFFF));
 
-            // Skipped past end of index.
-            this->input_stream_->setstate(std::ios::failbit);
-          }
+        savvy::variant tmp_var;
+        for (std::uint64_t num_variants_to_skip = reg.from() - counts[block_idx]; num_variants_to_skip > 0 && good(); --num_variants_to_skip)
+        {
+          if (!discard_record(tmp_var))
+            input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+          ++(s1r_query_->current_offset_in_block);
         }
       }
       else
@@ -395,6 +698,14 @@ namespace savvy
       return *this;
     }
 
+    inline
+    std::vector<slice_bounds> reader::plan_shards(std::size_t n_shards)
+    {
+      if ((file_format_ == format::sav1 || file_format_ == format::sav2) && s1r_index_ && s1r_index_->good())
+        return s1r_index_->plan_shards(n_shards);
+      return {};
+    }
+
     inline
     reader& reader::read_indexed_record(variant& r)
     {
@@ -408,21 +719,22 @@ namespace savvy
 
         if (s1r_query_->current_offset_in_block >= s1r_query_->total_in_block)
         {
-          if (s1r_query_->iter == s1r_query_->query.end())
+          std::uint64_t block_value;
+          if (!s1r_query_->next_block(block_value))
           {
             this->input_stream_->setstate(std::ios::eofbit);
             break;
           }
           else
           {
-            s1r_query_->total_in_block = std::uint32_t(0x000000000000FFFF & s1r_query_->iter->value()) + 1;
+            s1r_query_->total_in_block = std::uint32_t(0x000000000000FFFF & block_value) + 1;
             s1r_query_->current_offset_in_block = 0;
-            this->input_stream_->seekg(std::streampos((s1r_query_->iter->value() >> 16) & 0x0000FFFFFFFFFFFF));
-            ++(s1r_query_->iter);
+            this->input_stream_->seekg(std::streampos((block_value >> 16) & 0x0000FFFFFFFFFFFF));
           }
         }
 
-        if (!read_record(r))
+        bool filtered_out = false;
+        if (!read_record(r, filtered_out))
           input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
 
         if (!this->good())
@@ -437,7 +749,7 @@ namespace savvy
         {
           ++(s1r_query_->current_offset_in_block);
           ++(s1r_query_->total_records_read);
-          if (region_compare(s1r_query_->bounding_type, r, s1r_query_->reg))
+          if (!filtered_out)
           {
             //this->read_genotypes(annotations, destination);
             break;
@@ -451,6 +763,66 @@ namespace savvy
       return *this; //TODO: clear site info before returning if not good
     }
 
+    // Passes over the next record. SAV v2 records are skipped using their size prefixes, with only PBWT-sorted FORMAT
+    // fields being decoded so that sort mappings stay in sync with the records that follow.
+    inline
+    bool reader::discard_record(variant& tmp_var)
+    {
+      if (file_format_ != format::sav2)
+      {
+        bool filtered_out;
+        return (bool)read_record(tmp_var, filtered_out);
+      }
+
+      std::uint32_t sizes[2];
+      std::uint32_t shared_head[6]; // chrom through n.fmt.sample
+      if (!input_stream_->read((char*)sizes, sizeof(sizes)))
+        return false;
+
+      if (endianness::is_big())
+      {
+        sizes[0] = endianness::swap(sizes[0]);
+        sizes[1] = endianness::swap(sizes[1]);
+      }
+
+      if (sizes[0] < sizeof(shared_head)
+        || !input_stream_->read((char*)shared_head, sizeof(shared_head))
+        || input_stream_->ignore(sizes[0] - sizeof(shared_head)).gcount() != std::streamsize(sizes[0] - sizeof(shared_head)))
+      {
+        std::fprintf(stderr, "Error: Invalid shared data\n");
+        return false;
+      }
+
+      std::uint32_t n_fmt_sample = endianness::is_big() ? endianness::swap(shared_head[5]) : shared_head[5];
+      if (0x800000u & n_fmt_sample)
+        sort_context_.reset();
+
+      if (all_format_ids_.size() != dict_->entries[dictionary::id].size())
+        all_format_ids_.assign(dict_->entries[dictionary::id].size(), true);
+
+      tmp_var.n_fmt_ = n_fmt_sample >> 24u;
+      decltype(block_buf_) lender = nullptr;
+      if (variant::deserialize_indiv(tmp_var, *input_stream_, *dict_, ids_->size(), false, phasing_, all_format_ids_, sort_context_, extra_typed_value_, lender) != sizes[1])
+      {
+        std::fprintf(stderr, "Error: Invalid individual data\n");
+        return false;
+      }
+
+      return true;
+    }
+
+    // Checks whether a record should be skipped before its individual data is decoded, either because it falls
+    // outside of the current query region or because it is rejected by the site filter.
+    inline
+    bool reader::site_filtered_out(const site_info& s) const
+    {
+      if (s1r_query_ && !region_compare(s1r_query_->bounding_type, s, s1r_query_->regs))
+        return true;
+      if (csi_query_ && !region_compare(csi_query_->bounding_type, s, csi_query_->regs))
+        return true;
+      return site_filter_ && !site_filter_(s);
+    }
+
     inline
     reader& reader::read_csi_indexed_record(variant& r)
     {
@@ -480,7 +852,8 @@ namespace savvy
         }
 
         //auto pos_before = r.pos();
-        if (!read_record(r))
+        bool filtered_out = false;
+        if (!read_record(r, filtered_out))
         {
           assert(!"Read failed before end of csi block");
           input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
@@ -488,14 +861,20 @@ namespace savvy
 
         //assert(r.pos() >= pos_before);
 
-        if (region_compare(csi_query_->bounding_type, r, csi_query_->reg))
+        if (!filtered_out)
         {
           //this->read_genotypes(annotations, destination);
           break;
         }
-        else if (r.pos() > csi_query_->reg.to())
+        else if (csi_query_->past_regions(r.chrom(), r.pos()))
         {
-          input_stream_->setstate(std::ios::eofbit);
+          // Remaining records in this interval are beyond the queried regions of this chromosome (intervals do not span
+          // chromosomes).
+          csi_query_->intervals.pop_front();
+          if (csi_query_->intervals.empty())
+            input_stream_->setstate(std::ios::eofbit);
+          else
+            input_stream_->seekg(csi_query_->intervals.front().first);
         }
       }
       return *this; //TODO: clear site info before returning if not good
@@ -512,36 +891,152 @@ namespace savvy
         if (csi_query_)
           return read_csi_indexed_record(r);
 
-        if (!read_record(r) && input_stream_->good())
-          input_stream_->setstate(std::ios::badbit);
+        bool filtered_out = true;
+        while (filtered_out && good())
+        {
+          if (!read_record(r, filtered_out) && input_stream_->good())
+            input_stream_->setstate(std::ios::badbit);
+        }
       }
 
       return *this;
     }
 
+    template <typename T>
+    std::size_t reader::read_batch(variant_batch<T>& batch, std::size_t max_records)
+    {
+      batch.clear();
+      while (batch.size() < max_records)
+      {
+        if (!batch.has_pending_ && !read(batch.pending_))
+          break;
+
+        batch.has_pending_ = !batch.append(batch.pending_);
+        if (batch.has_pending_)
+          break;
+      }
+
+      return batch.size();
+    }
+
     inline
-    reader& reader::read_vcf_record(variant& r)
+    bool reader::deserialize_vcf_record(std::istream& is, variant& r, bool& filtered_out) const
+    {
+      if (!site_info::deserialize_vcf(r, is, *dict_))
+        return false;
+
+      // The filter and region bounds are evaluated even when individual data is not parsed.
+      filtered_out = site_filtered_out(r);
+      if (ids_->size() && (sites_only_ || filtered_out))
+      {
+        r.format_fields_.clear();
+        is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        return true;
+      }
+
+      if (ids_->size() && !variant::deserialize_vcf2(r, is, *dict_, ids_->size(), phasing_))
+        return false;
+
+      // TODO: Set not_minimized flag and move minimize routine to writer.
+      for (auto it = r.info_.begin(); it != r.info_.end(); ++it)
+        it->second.minimize();
+
+      for (auto it = r.format_fields_.begin(); it != r.format_fields_.end(); ++it)
+        it->second.minimize();
+
+      return true;
+    }
+
+    inline
+    reader& reader::read_vcf_record(variant& r, bool& filtered_out)
     {
       if (input_stream_->peek() < 0)
         input_stream_->setstate(input_stream_->rdstate() | std::ios::eofbit);
-      else if (!site_info::deserialize_vcf(r, *input_stream_, dict_))
+      else if (!deserialize_vcf_record(*input_stream_, r, filtered_out))
         input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
-      else if (ids_.size() && !variant::deserialize_vcf2(r, *input_stream_, dict_, ids_.size(), phasing_))
-        input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
-      else
+      else if (input_stream_->eof() && (bool)(*input_stream_))
+        input_stream_->clear();
+
+      return *this;
+    }
+
+    inline
+    bool reader::read_vcf_line(std::string& line)
+    {
+      if (!good())
+        return false;
+
+      if (file_format_ != format::vcf || s1r_query_ || csi_query_)
       {
-        // TODO: Set not_minimized flag and move minimize routine to writer.
-        for (auto it = r.info_.begin(); it != r.info_.end(); ++it)
-          it->second.minimize();
+        std::fprintf(stderr, "Error: read_vcf_line() is only supported for VCF files without a region query\n");
+        input_stream_->setstate(input_stream_->rdstate() | std::ios::failbit);
+        return false;
+      }
 
-        for (auto it = r.format_fields_.begin(); it != r.format_fields_.end(); ++it)
-          it->second.minimize();
+      if (input_stream_->peek() < 0)
+      {
+        input_stream_->setstate(input_stream_->rdstate() | std::ios::eofbit);
+        return false;
+      }
 
-        if (input_stream_->eof() && (bool)(*input_stream_))
-          input_stream_->clear();
+      if (!std::getline(*input_stream_, line))
+      {
+        input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+        return false;
       }
 
-      return *this;
+      if (input_stream_->eof())
+        input_stream_->clear();
+      return true;
+    }
+
+    inline
+    bool reader::parse_vcf_line(const std::string& line, variant& r, bool& filtered_out) const
+    {
+      filtered_out = false;
+      std::istringstream is(line);
+      if (!deserialize_vcf_record(is, r, filtered_out))
+        return false;
+
+      if (!filtered_out)
+      {
+        typed_value scratch;
+        project_format_fields(r, scratch);
+      }
+      return true;
+    }
+
+    inline
+    void reader::project_format_fields(variant& r, typed_value& scratch) const
+    {
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
+      // Remove unrequested FORMAT fields (SAV v2 and BCF records are filtered during deserialization)
+      if (sites_only_)
+      {
+        r.format_fields_.clear();
+      }
+      else if (!skipped_format_ids_.empty() && (file_format_ == format::vcf || file_format_ == format::sav1))
+      {
+        const auto& fmt_ids = dict_->str_to_int[dictionary::id];
+        r.format_fields_.erase(std::remove_if(r.format_fields_.begin(), r.format_fields_.end(), [this, &fmt_ids](const std::pair<std::string, typed_value>& f)
+        {
+          auto it = fmt_ids.find(f.first);
+          return it != fmt_ids.end() && it->second < skipped_format_ids_.size() && skipped_format_ids_[it->second];
+        }), r.format_fields_.end());
+      }
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
+
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
+      // Apply sample subset
+      if (subset_size_ != ids_->size()) // TODO: maybe do this after region_compare.
+      {
+        for (auto it = r.format_fields_.begin(); it != r.format_fields_.end(); ++it)
+        {
+          it->second.subset(subset_map_, subset_size_, scratch);
+          it->second.minimize(); // TODO: Set not_minimized flag and move minimize routine to writer.
+        }
+      }
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
     }
 
     inline
@@ -551,7 +1046,7 @@ namespace savvy
         input_stream_->setstate(input_stream_->rdstate() | std::ios::eofbit);
       else if (!site_info::deserialize_sav1(r, *input_stream_, info_headers_))
         input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
-      else if (!variant::deserialize_sav1(r, *input_stream_, format_headers_, ids_.size()))
+      else if (!variant::deserialize_sav1(r, *input_stream_, format_headers_, ids_->size()))
         input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
       else
       {
@@ -567,15 +1062,20 @@ namespace savvy
     }
 
     inline
-    reader& reader::read_record(variant& r)
+    reader& reader::read_record(variant& r, bool& filtered_out)
     {
+      filtered_out = false;
       if (good())
       {
 
         if (file_format_ == format::vcf)
-          read_vcf_record(r);
+        {
+          read_vcf_record(r, filtered_out);
+        }
         else if (file_format_ == format::sav1)
+        {
           read_sav1_record(r);
+        }
         else
         {
           std::uint32_t shared_sz, indiv_sz;
@@ -609,7 +1109,7 @@ namespace savvy
 //          }
 
           std::uint32_t shared_n_samples{};
-          if (site_info::deserialize_shared(r, *input_stream_, dict_, shared_n_samples) != shared_sz)
+          if (site_info::deserialize_shared(r, *input_stream_, *dict_, shared_n_samples) != shared_sz)
           {
             std::fprintf(stderr, "Error: Invalid shared data\n");
             input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
@@ -620,39 +1120,89 @@ namespace savvy
           if (pbwt_reset)
             sort_context_.reset();
 
-          if (variant::deserialize_indiv(r, *input_stream_, dict_, ids_.size(), file_format_ == format::bcf, phasing_) != indiv_sz)
+          filtered_out = site_filtered_out(r);
+          auto lender = zero_copy_ && file_format_ != format::bcf ? block_buf_ : nullptr;
+
+          if (sites_only_ || (filtered_out && file_format_ == format::bcf))
+          {
+            r.format_fields_.clear();
+            if (input_stream_->ignore(indiv_sz).gcount() != std::streamsize(indiv_sz))
+            {
+              std::fprintf(stderr, "Error: Invalid individual data\n");
+              input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+            }
+            return *this;
+          }
+
+          if (filtered_out)
+          {
+            // Every field is skipped, but PBWT-sorted fields are still decoded so that sort mappings stay in sync with later records.
+            if (all_format_ids_.size() != dict_->entries[dictionary::id].size())
+              all_format_ids_.assign(dict_->entries[dictionary::id].size(), true);
+            if (variant::deserialize_indiv(r, *input_stream_, *dict_, ids_->size(), false, phasing_, all_format_ids_, sort_context_, extra_typed_value_, lender) != indiv_sz)
+            {
+              std::fprintf(stderr, "Error: Invalid individual data\n");
+              input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+            }
+            return *this;
+          }
+
+          if (variant::deserialize_indiv(r, *input_stream_, *dict_, ids_->size(), file_format_ == format::bcf, phasing_, skipped_format_ids_, sort_context_, extra_typed_value_, lender) != indiv_sz)
           {
             std::fprintf(stderr, "Error: Invalid individual data\n");
             input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
             return *this;
           }
 
+          sort_context_.record_sort_maps.clear();
           if (file_format_ != format::bcf)
-            variant::pbwt_unsort_typed_values(r, extra_typed_value_, sort_context_);
-          //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
-        }
-
-        if (good())
-        {
-          //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
-          // Apply sample subset
-          if (subset_size_ != ids_.size()) // TODO: maybe do this after region_compare.
           {
-            for (auto it = r.format_fields_.begin(); it != r.format_fields_.end(); ++it)
+            bool pbwt_res = pbwt_unsort_ || subset_size_ != ids_->size() ? variant::pbwt_unsort_typed_values(r, extra_typed_value_, sort_context_) : variant::pbwt_update_sort_mappings(r, sort_context_);
+            if (!pbwt_res)
             {
-              it->second.subset(subset_map_, subset_size_, extra_typed_value_);
-              it->second.minimize(); // TODO: Set not_minimized flag and move minimize routine to writer.
+              std::fprintf(stderr, "Error: Invalid individual data\n");
+              input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+              return *this;
             }
           }
           //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
         }
+
+        if (good() && file_format_ == format::sav1)
+          filtered_out = site_filtered_out(r);
+
+        if (good() && !filtered_out)
+          project_format_fields(r, extra_typed_value_);
       }
 
       return *this;
     }
 
+    // Moves stream past the header without parsing it. Used by clone(), which copies the parsed header instead.
+    inline
+    bool reader::skip_header()
+    {
+      std::istream& ifs(*input_stream_);
+      if (file_format_ == format::vcf)
+      {
+        while (ifs.peek() == '#')
+          ifs.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        return ifs.good();
+      }
+
+      std::array<char, 5> magic;
+      std::uint32_t header_block_sz;
+      if (!ifs.read(magic.data(), magic.size()) || !ifs.read((char*)&header_block_sz, sizeof(header_block_sz)))
+        return false;
+
+      if (endianness::is_big())
+        header_block_sz = endianness::swap(header_block_sz);
+
+      return ifs.ignore(header_block_sz).gcount() == std::streamsize(header_block_sz);
+    }
+
     inline
-    bool reader::read_header_sav1()
+    bool reader::read_header_sav1(::savvy::dictionary& dict)
     {
 //      std::string version_string(7, '\0');
 //      input_stream_->read(&version_string[0], version_string.size());
@@ -667,8 +1217,8 @@ namespace savvy
       if (good() && varint_decode(in_it, end, headers_size) != end)
       {
         ++in_it;
-        headers_.reserve(1 + headers_size);
-        headers_.emplace_back("fileformat","VCFv4.2");
+        headers_->reserve(1 + headers_size);
+        headers_->emplace_back("fileformat","VCFv4.2");
 
         std::unordered_set<std::string> unique_info_fields;
 
@@ -694,8 +1244,8 @@ namespace savvy
                   val.resize(val_size);
                   input_stream_->read(&val[0], val_size);
 
-                  process_header_pair(key, val);
-                  headers_.emplace_back(std::move(key), std::move(val));
+                  process_header_pair(dict, key, val);
+                  headers_->emplace_back(std::move(key), std::move(val));
                 }
               }
 
@@ -715,18 +1265,18 @@ namespace savvy
           if (varint_decode(in_it, end, sample_size) != end)
           {
             ++in_it;
-            ids_.reserve(sample_size);
+            ids_->reserve(sample_size);
             subset_size_ = sample_size;
 
             std::uint64_t id_sz;
             while (sample_size && varint_decode(in_it, end, id_sz) != end)
             {
               ++in_it;
-              ids_.emplace_back();
+              ids_->emplace_back();
               if (id_sz)
               {
-                ids_.back().resize(id_sz);
-                input_stream_->read(&ids_.back()[0], id_sz);
+                ids_->back().resize(id_sz);
+                input_stream_->read(&ids_->back()[0], id_sz);
               }
               --sample_size;
             }
@@ -746,8 +1296,10 @@ namespace savvy
     {
       std::uint32_t header_block_sz = std::uint32_t(-1);
 
-      dict_.str_to_int[dictionary::id]["PASS"] = dict_.entries[dictionary::id].size();
-      dict_.entries[dictionary::id].emplace_back(dictionary::entry{"PASS", "", 0});
+      auto dict = std::make_shared<::savvy::dictionary>();
+      dict_ = dict;
+      dict->str_to_int[dictionary::id]["PASS"] = dict->entries[dictionary::id].size();
+      dict->entries[dictionary::id].emplace_back(dictionary::entry{"PASS", "", 0});
 
       std::istream& ifs(*input_stream_);
       int first_byte = ifs.peek();
@@ -775,7 +1327,7 @@ namespace savvy
           file_format_ = format::sav1;
           std::array<char, 2> discard;
           ifs.read(discard.data(), 2);
-          return read_header_sav1();
+          return read_header_sav1(*dict);
         }
         else
         {
@@ -799,7 +1351,7 @@ namespace savvy
 
           std::int64_t tab_cnt = std::count(hdr_line.begin(), hdr_line.end(), '\t');
           std::int64_t sample_size = std::max<std::int64_t>(tab_cnt - 8, 0);
-          ids_.reserve(sample_size);
+          ids_->reserve(sample_size);
 
           if (sample_size)
           {
@@ -807,7 +1359,7 @@ namespace savvy
             {
               if (tab_cnt < sample_size)
               {
-                ids_.emplace_back(hdr_line.substr(last_pos, tab_pos - last_pos));
+                ids_->emplace_back(hdr_line.substr(last_pos, tab_pos - last_pos));
               }
               last_pos = ++tab_pos;
               --tab_cnt;
@@ -815,10 +1367,10 @@ namespace savvy
 
             assert(tab_cnt == 0);
 
-            ids_.emplace_back(hdr_line.substr(last_pos, tab_pos - last_pos)); // TODO: allow for no samples.
+            ids_->emplace_back(hdr_line.substr(last_pos, tab_pos - last_pos)); // TODO: allow for no samples.
           }
 
-          assert(ids_.size() == std::size_t(sample_size));
+          assert(ids_->size() == std::size_t(sample_size));
           subset_size_ = sample_size;
 
           if (header_block_sz - bytes_read < 0)
@@ -851,8 +1403,8 @@ namespace savvy
           }
           std::string val(equal_it + 1, hdr_line.end());
 
-          process_header_pair(key, val);
-          headers_.emplace_back(std::move(key), std::move(val));
+          process_header_pair(*dict, key, val);
+          headers_->emplace_back(std::move(key), std::move(val));
         }
       }
 
@@ -14,6 +14,7 @@
 #include <limits>
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
 
 namespace savvy
 {
@@ -34,7 +35,7 @@ namespace savvy
      * @tparam Iter Iterator type
      * @param beg Begin iterator of container
      * @param end End iterator of container
-     * @return Vector of merged regions
+     * @return Vector of non-overlapping regions sorted by chromosome and start position
      */
     template <typename Iter>
     static std::vector<query_bounds> merge(Iter beg, Iter end);
@@ -94,22 +95,19 @@ namespace savvy
   template <typename Iter>
   std::vector<query_bounds> query_bounds::merge(Iter beg, Iter end)
   {
-    std::unordered_map<std::string, std::size_t> ret_index;
-    std::vector<query_bounds> ret;
+    std::vector<query_bounds> sorted(beg, end);
+    std::sort(sorted.begin(), sorted.end(), [](const query_bounds& a, const query_bounds& b)
+    {
+      return a.chromosome() < b.chromosome() || (a.chromosome() == b.chromosome() && a.from() < b.from());
+    });
 
-    for (auto it = beg; it != end; ++it)
+    std::vector<query_bounds> ret;
+    for (auto it = sorted.begin(); it != sorted.end(); ++it)
     {
-      auto insert_res = ret_index.insert(std::make_pair(it->chromosome(), ret.size()));
-      if (insert_res.second)
-      {
+      if (ret.empty() || ret.back().chromosome() != it->chromosome() || it->from() > ret.back().to())
         ret.emplace_back(*it);
-      }
-      else
-      {
-        std::uint64_t from = std::min(ret[insert_res.first->second].from(), it->from());
-        std::uint64_t to = std::max(ret[insert_res.first->second].to(), it->to());
-        ret[insert_res.first->second] = genomic_region(ret[insert_res.first->second].chromosome(), from, to);
-      }
+      else if (it->to() > ret.back().to())
+        ret.back() = query_bounds(it->chromosome(), ret.back().from(), it->to());
     }
 
     return ret;
@@ -192,6 +190,43 @@ namespace savvy
         return false;
       }
     }
+
+    /**
+     * Checks whether variant falls within any region of a list.
+     * @param bounding_type Specifies how indels are treated when they cross region bounds
+     * @param var Variant to test
+     * @param regs Non-overlapping regions sorted by chromosome and start position (see query_bounds::merge())
+     * @return True if variant is within at least one region
+     */
+    inline bool region_compare(bounding_point bounding_type, const site_info& var, const std::vector<genomic_region>& regs)
+    {
+      // Since regions are disjoint, the only candidate on a chromosome is the first region that does not end before
+      // the variant's position (or end position when bounding by end).
+      std::uint64_t pos = var.pos();
+      if (bounding_type == bounding_point::end)
+      {
+        std::uint32_t end_val;
+        if (!var.get_info("END", reinterpret_cast<std::int32_t&>(end_val)))
+        {
+          std::uint32_t max_allele_size(var.ref().size());
+          for (auto it = var.alts().begin(); it != var.alts().end(); ++it)
+            max_allele_size = std::max(max_allele_size, std::uint32_t(it->size()));
+          end_val = var.pos() + max_allele_size - 1;
+        }
+        pos = end_val;
+      }
+
+      auto test_chrom = [&](const std::string& chrom)
+      {
+        auto it = std::lower_bound(regs.begin(), regs.end(), pos, [&chrom](const genomic_region& reg, std::uint64_t p)
+        {
+          return reg.chromosome() < chrom || (reg.chromosome() == chrom && reg.to() < p);
+        });
+        return it != regs.end() && it->chromosome() == chrom && region_compare(bounding_type, var, *it);
+      };
+
+      return test_chrom(var.chrom()) || (!regs.empty() && regs.front().chromosome().empty() && test_chrom(""));
+    }
   //}
 
 #if 0
@@ -24,6 +24,7 @@
 #include <cstring>
 #include <tuple>
 #include <limits>
+#include <mutex>
 
 namespace savvy
 {
@@ -108,6 +109,43 @@ namespace savvy
       }
     }
 
+    /**
+     * Flat, in-memory copy of the leaf entries of one or more trees in file order. cumulative_counts has one more
+     * element than values, with cumulative_counts[i] being the number of records that precede the block referenced by
+     * values[i]. max_region_ends[i] is the largest region end of entries 0 through i, which allows overlapping entries
+     * to be found with binary searches.
+     */
+    struct leaf_table
+    {
+      std::vector<std::uint64_t> values;
+      std::vector<std::uint32_t> region_starts;
+      std::vector<std::uint32_t> region_ends;
+      std::vector<std::uint32_t> max_region_ends;
+      std::vector<std::uint64_t> cumulative_counts = {0};
+      bool starts_sorted = true; // Entries of unsorted files must be scanned to the end
+      bool loaded = true; // False if leaf nodes could not be read from the index
+
+      /**
+       * Marks entries that overlap region.
+       * @param beg Start of region
+       * @param end End of region
+       * @param hits Marks for each entry (must be the same size as values)
+       * @param search_from Index of first entry to consider (e.g., the return value of the previous call when regions are sorted)
+       * @return Index of first entry whose max region end reaches beg
+       */
+      std::size_t mark_overlaps(std::uint64_t beg, std::uint64_t end, std::vector<bool>& hits, std::size_t search_from = 0) const
+      {
+        std::size_t lo = std::distance(max_region_ends.begin(), std::lower_bound(max_region_ends.begin() + std::min(search_from, max_region_ends.size()), max_region_ends.end(), beg));
+        std::size_t hi = starts_sorted ? std::distance(region_starts.begin(), std::upper_bound(region_starts.begin(), region_starts.end(), end)) : region_starts.size();
+        for (std::size_t i = lo; i < hi; ++i)
+        {
+          if (region_ends[i] >= beg)
+            hits[i] = true;
+        }
+        return lo;
+      }
+    };
+
     class tree_base
     {
     public:
@@ -511,6 +549,38 @@ namespace savvy
       }
 
       const std::string& name() const { return name_; }
+
+      /**
+       * Appends all leaf entries to table. Leaf nodes are stored contiguously, so they are loaded with a single read.
+       * @param table Destination table
+       * @return False if index file could not be read
+       */
+      bool append_leaf_entries(leaf_table& table)
+      {
+        if (entry_count() == 0)
+          return true;
+
+        const std::uint64_t leaf_level = this->tree_height() - 1;
+        const std::uint64_t node_count = detail::ceil_divide(entry_count(), (std::uint64_t) this->entries_per_leaf_node());
+        std::vector<entry> leaf_nodes(node_count * this->entries_per_leaf_node());
+        ifs_.seekg(this->calculate_file_position(node_position(leaf_level, 0)));
+        if (!ifs_.read((char*) leaf_nodes.data(), node_count * this->bucket_size()))
+          return false;
+
+        std::uint32_t max_end = table.max_region_ends.empty() ? 0 : table.max_region_ends.back();
+        for (auto it = leaf_nodes.begin(); it != leaf_nodes.begin() + entry_count(); ++it)
+        {
+          max_end = std::max(max_end, it->region_end());
+          if (!table.region_starts.empty() && it->region_start() < table.region_starts.back())
+            table.starts_sorted = false;
+          table.values.push_back(it->value());
+          table.region_starts.push_back(it->region_start());
+          table.region_ends.push_back(it->region_end());
+          table.max_region_ends.push_back(max_end);
+          table.cumulative_counts.push_back(table.cumulative_counts.back() + (0x000000000000FFFF & it->value()) + 1);
+        }
+        return true;
+      }
     private:
       std::ifstream& ifs_;
       std::string name_;
@@ -537,6 +607,7 @@ namespace savvy
 
       bool good()
       {
+        std::lock_guard<std::mutex> lk(mtx_);
         if (input_file_.good())
           return true;
         init();
@@ -560,6 +631,7 @@ namespace savvy
         return ret;
       }
 
+      // Tree iterators are not locked, so they must not be used while readers sharing this index call good().
       std::vector<tree_reader>::iterator trees_begin()
       {
         return trees_.begin();
@@ -572,12 +644,115 @@ namespace savvy
         return trees_.begin();
       }
 
+      /**
+       * Gets in-memory leaf entries of a chromosome. Tables are loaded on first use and cached. This may be called
+       * concurrently by readers that share the index (see savvy::reader::clone()).
+       * @param chromosome Chromosome name (an empty string selects every tree in the index)
+       * @return Leaf table (empty if chromosome is not indexed, and empty with loaded set to false if the index could not be read)
+       */
+      const leaf_table& leaf_entries(const std::string& chromosome)
+      {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return load_leaf_entries(chromosome);
+      }
+
+      /**
+       * Finds the blocks that overlap any of the given regions in a single pass over the in-memory leaf entries of
+       * each chromosome. The index is locked for the whole query, since good() may reload the trees of a shared index.
+       * @param regions Genomic regions (an empty chromosome matches every chromosome)
+       * @return Deduplicated leaf entry values in file order
+       */
+      std::vector<std::uint64_t> query_blocks(std::vector<genomic_region> regions)
+      {
+        std::sort(regions.begin(), regions.end(), [](const genomic_region& a, const genomic_region& b) { return a.from() < b.from(); });
+
+        std::lock_guard<std::mutex> lk(mtx_);
+        std::vector<std::uint64_t> ret;
+        std::vector<bool> hits;
+        for (auto it = trees_begin(); it != trees_end(); ++it)
+        {
+          const leaf_table* table = nullptr;
+          std::size_t search_from = 0;
+          for (auto jt = regions.begin(); jt != regions.end(); ++jt)
+          {
+            if (!jt->chromosome().empty() && jt->chromosome() != it->name())
+              continue;
+
+            if (!table)
+            {
+              table = &load_leaf_entries(it->name());
+              hits.assign(table->values.size(), false);
+            }
+            search_from = table->mark_overlaps(jt->from(), jt->to(), hits, search_from);
+          }
+
+          for (std::size_t i = 0; table && i < hits.size(); ++i)
+          {
+            if (hits[i])
+              ret.push_back(table->values[i]);
+          }
+        }
+
+        return ret;
+      }
+
+      /**
+       * Splits the records of the file into contiguous shards with roughly equal record counts. Shard boundaries fall
+       * on block boundaries, so opening a shard with savvy::reader::reset_bounds() does not require skipping records.
+       * @param n_shards Number of shards
+       * @return n_shards slice bounds over all chromosomes (shards are empty when there are fewer blocks than shards), or an empty vector if the index could not be read
+       */
+      std::vector<slice_bounds> plan_shards(std::size_t n_shards)
+      {
+        std::vector<slice_bounds> ret;
+        const leaf_table& table = leaf_entries("");
+        if (!table.loaded)
+          return ret;
+
+        const std::vector<std::uint64_t>& counts = table.cumulative_counts;
+        const std::uint64_t total = counts.back();
+        std::uint64_t shard_beg = 0;
+        for (std::size_t i = 1; i <= n_shards; ++i)
+        {
+          // Pick the block boundary closest to the ideal end of this shard.
+          std::uint64_t target = i == n_shards ? total : std::uint64_t(double(total) * i / n_shards);
+          auto it = std::lower_bound(counts.begin(), counts.end(), target);
+          if (it != counts.begin() && (it == counts.end() || target - *(it - 1) < *it - target))
+            --it;
+          std::uint64_t shard_end = std::max(shard_beg, *it);
+          ret.emplace_back(shard_beg, shard_end);
+          shard_beg = shard_end;
+        }
+        return ret;
+      }
+
       class query;
       query create_query(genomic_region reg);
       query create_query(std::vector<genomic_region> regs);
       std::streampos file_offset() const { return index_file_offset_; }
       std::streampos size_on_disk() const { return size_on_disk_; }
     private:
+      // Loads leaf entries of a chromosome on first use. The caller must hold mtx_.
+      const leaf_table& load_leaf_entries(const std::string& chromosome)
+      {
+        auto insert_res = leaf_tables_.insert(std::make_pair(chromosome, leaf_table()));
+        leaf_table& ret = insert_res.first->second;
+        if (insert_res.second)
+        {
+          for (auto it = trees_begin(); it != trees_end(); ++it)
+          {
+            if ((chromosome.empty() || it->name() == chromosome) && !it->append_leaf_entries(ret))
+            {
+              leaf_tables_.erase(insert_res.first);
+              input_file_.clear();
+              static const leaf_table failed_table = []() { leaf_table t; t.loaded = false; return t; }();
+              return failed_table;
+            }
+          }
+        }
+        return ret;
+      }
+
       void init()
       {
         input_file_.clear();
@@ -687,6 +862,8 @@ namespace savvy
     private:
       std::ifstream input_file_;
       std::vector<tree_reader> trees_;
+      std::map<std::string, leaf_table> leaf_tables_;
+      std::mutex mtx_;
       std::array<char, 16> uuid_;
       std::streampos index_file_offset_ = 0;
       std::size_t size_on_disk_ = 0;
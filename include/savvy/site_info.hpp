@@ -16,6 +16,7 @@
 #include "varint.hpp"
 #include "sav1.hpp"
 #include "logging.hpp"
+#include "gt_tokenizer.hpp"
 
 #include <string>
 #include <vector>
@@ -25,6 +26,8 @@
 #include <cmath>
 #include <set>
 #include <list>
+#include <tuple>
+#include <atomic>
 
 namespace savvy
 {
@@ -234,7 +237,9 @@ namespace savvy
       const decltype(format_fields_)& format_fields() const { return format_fields_; }
 
       /**
-       * Gets value of FORMAT field.
+       * Gets value of FORMAT field. If the record was read with reader::pbwt_unsort() disabled, the field may still be
+       * in PBWT-sorted order (see typed_value::pbwt_flag()), in which case values are not in sample order and the
+       * record cannot be passed to writer::write() until the field is replaced with typed_value::copy_pbwt_unsorted().
        * @tparam T Data type of destination
        * @param key Key for INFO field
        * @param destination_vector Destinaton value object
@@ -261,8 +266,10 @@ namespace savvy
     private:
       template <typename OutT>
       static bool serialize(const variant& v, OutT out_it, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased, ::savvy::internal::pbwt_sort_context& pbwt_ctx, const std::vector<::savvy::internal::pbwt_sort_map*>& pbwt_format_pointers);
-      static std::int64_t deserialize_indiv(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased);
-      static void pbwt_unsort_typed_values(variant& v, typed_value& extra_val, internal::pbwt_sort_context& pbwt_context);
+      template <typename Lender>
+      static std::int64_t deserialize_indiv(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased, const std::vector<bool>& skipped_fmt_ids, internal::pbwt_sort_context& pbwt_context, typed_value& extra_val, Lender* lender);
+      static bool pbwt_unsort_typed_values(variant& v, typed_value& extra_val, internal::pbwt_sort_context& pbwt_context);
+      static bool pbwt_update_sort_mappings(const variant& v, internal::pbwt_sort_context& pbwt_context);
       static bool deserialize_vcf(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, phasing phasing_status);
       static bool deserialize_vcf2(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, phasing phasing_status);
       static bool deserialize_sav1(variant& v, std::istream& is, const std::list<header_value_details>& format_headers, std::size_t sample_size);
@@ -886,17 +893,91 @@ namespace savvy
     }
 
     inline
-    void variant::pbwt_unsort_typed_values(variant& v, typed_value& extra_val, internal::pbwt_sort_context& pbwt_context)
+    bool variant::pbwt_unsort_typed_values(variant& v, typed_value& extra_val, internal::pbwt_sort_context& pbwt_context)
     {
+      if (pbwt_context.pool)
+      {
+        // Sort maps are looked up on this thread since the lookup may insert into format_contexts.
+        auto& fields = pbwt_context.unsort_fields;
+        fields.clear();
+        std::size_t total_size = 0, max_size = 0;
+        for (auto it = v.format_fields_.begin(); it != v.format_fields_.end(); ++it)
+        {
+          if (it->second.pbwt_flag())
+          {
+            fields.emplace_back(&it->second, &pbwt_context.format_contexts[it->first][it->second.size()]);
+            total_size += it->second.size();
+            max_size = std::max(max_size, it->second.size());
+          }
+        }
+
+        if (pbwt_context.use_tasks(fields.size(), total_size, max_size))
+        {
+          std::atomic<bool> failed(false);
+          pbwt_context.run_tasks(fields.size(), [&fields, &failed](std::size_t i, internal::pbwt_sort_context::task_scratch& scratch)
+          {
+            if (!scratch.unsorted)
+              scratch.unsorted = ::savvy::detail::make_unique<typed_value>();
+            if (!typed_value::internal::pbwt_unsort(*fields[i].first, *scratch.unsorted, *fields[i].second, scratch.prev_sort_mapping, scratch.counts, scratch.unsort_scratch))
+              failed = true;
+            std::swap(*fields[i].first, *scratch.unsorted);
+          });
+          return !failed;
+        }
+      }
+
       for (auto it = v.format_fields_.begin(); it != v.format_fields_.end(); ++it)
       {
         if (it->second.pbwt_flag())
         {
           auto& format_pbwt_ctx = pbwt_context.format_contexts[it->first][it->second.size()];
-          typed_value::internal::pbwt_unsort(it->second, extra_val, format_pbwt_ctx, pbwt_context.prev_sort_mapping, pbwt_context.counts);
+          if (!typed_value::internal::pbwt_unsort(it->second, extra_val, format_pbwt_ctx, pbwt_context.prev_sort_mapping, pbwt_context.counts, pbwt_context.unsort_scratch))
+            return false;
           std::swap(it->second, extra_val);
         }
       }
+      return true;
+    }
+
+    // Advances the sort mappings of PBWT-sorted fields without unsorting them. The mapping that each field is currently
+    // sorted by is kept in pbwt_context.record_contexts.
+    inline
+    bool variant::pbwt_update_sort_mappings(const variant& v, internal::pbwt_sort_context& pbwt_context)
+    {
+      pbwt_context.record_sort_maps.clear();
+      auto& fields = pbwt_context.update_fields;
+      fields.clear();
+      std::size_t total_size = 0, max_size = 0;
+      for (auto it = v.format_fields_.begin(); it != v.format_fields_.end(); ++it)
+      {
+        if (it->second.pbwt_flag())
+        {
+          auto& format_pbwt_ctx = pbwt_context.format_contexts[it->first][it->second.size()];
+          auto& record_pbwt_ctx = pbwt_context.record_contexts[it->first][it->second.size()];
+          fields.emplace_back(&it->second, &format_pbwt_ctx, &record_pbwt_ctx);
+          total_size += it->second.size();
+          max_size = std::max(max_size, it->second.size());
+          pbwt_context.record_sort_maps.emplace_back(it->first, &record_pbwt_ctx);
+        }
+      }
+
+      if (!pbwt_context.use_tasks(fields.size(), total_size, max_size))
+      {
+        for (auto it = fields.begin(); it != fields.end(); ++it)
+        {
+          if (!typed_value::internal::pbwt_update_sort_mapping(*std::get<0>(*it), *std::get<1>(*it), *std::get<2>(*it), pbwt_context.counts))
+            return false;
+        }
+        return true;
+      }
+
+      std::atomic<bool> failed(false);
+      pbwt_context.run_tasks(fields.size(), [&fields, &failed](std::size_t i, internal::pbwt_sort_context::task_scratch& scratch)
+      {
+        if (!typed_value::internal::pbwt_update_sort_mapping(*std::get<0>(fields[i]), *std::get<1>(fields[i]), *std::get<2>(fields[i]), scratch.counts))
+          failed = true;
+      });
+      return !failed;
     }
 
     /* OLD METHOD USED FOR FLAT BUFFER DESIGN
@@ -1036,21 +1117,21 @@ namespace savvy
     }
     */
 
-    inline
-    std::int64_t variant::deserialize_indiv(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased)
+    template <typename Lender>
+    std::int64_t variant::deserialize_indiv(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased, const std::vector<bool>& skipped_fmt_ids, internal::pbwt_sort_context& pbwt_context, typed_value& extra_val, Lender* lender)
     {
       std::int64_t res = 0;
       std::int64_t bytes_read = 0;
 
-      //auto indiv_it = v.indiv_buf_.begin();
-      v.format_fields_.clear(); // Temp fix for crash until flat buffer design is removed.
+      // Existing fields are overwritten in place so that their buffers are reused across records.
       v.format_fields_.reserve(v.n_fmt_ + 1);
       v.format_fields_.resize(v.n_fmt_);
 
       typed_value ph_value;
 
       auto fmt_it = v.format_fields_.begin();
-      for (; fmt_it != v.format_fields_.end(); ++fmt_it)
+      std::size_t i = 0;
+      for (; i < v.n_fmt_; ++i)
       {
         try
         {
@@ -1065,8 +1146,27 @@ namespace savvy
             return -1;
           }
 
+          if ((std::uint32_t)fmt_key_id < skipped_fmt_ids.size() && skipped_fmt_ids[fmt_key_id])
+          {
+            if (!is_bcf && (is.peek() & 0x08))
+            {
+              // PBWT-sorted fields still have to be decoded so that the sort mapping stays in sync with later records.
+              if ((res = typed_value::internal::deserialize(extra_val, is, 1, lender)) < 0)
+                break;
+              auto& format_pbwt_ctx = pbwt_context.format_contexts[dict.entries[dictionary::id][fmt_key_id].id][extra_val.size()];
+              if (!typed_value::internal::pbwt_update_sort_mapping(extra_val, format_pbwt_ctx, pbwt_context.prev_sort_mapping, pbwt_context.counts))
+                return -1;
+            }
+            else if ((res = typed_value::internal::skip(is, is_bcf ? sample_size : 1)) < 0)
+            {
+              break;
+            }
+            bytes_read += res;
+            continue;
+          }
+
           fmt_it->first = dict.entries[dictionary::id][fmt_key_id].id;
-          if ((res = typed_value::internal::deserialize(fmt_it->second, is, is_bcf ? sample_size : 1)) < 0)
+          if ((res = typed_value::internal::deserialize(fmt_it->second, is, is_bcf ? sample_size : 1, lender)) < 0)
             break;
           bytes_read += res;
 
@@ -1084,6 +1184,7 @@ namespace savvy
               fmt_it->second.apply_dense(typed_value::bcf_gt_decoder());
             }
           }
+          ++fmt_it;
         }
         catch (const std::exception& e)
         {
@@ -1092,8 +1193,9 @@ namespace savvy
         }
       }
 
-      if (fmt_it == v.format_fields_.end() && is.good())
+      if (i == v.n_fmt_ && is.good())
       {
+        v.format_fields_.erase(fmt_it, v.format_fields_.end());
         if (v.format_fields_.size() && ph_value.size())
           v.format_fields_.insert(v.format_fields_.begin() + 1, std::make_pair("PH", std::move(ph_value)));
         return bytes_read;
@@ -1218,6 +1320,22 @@ namespace savvy
         return false;
       }
 
+      // Fast path for diploid GT-only records with single-character alleles. Irregular lines use the general parser below.
+      if (fmt_keys.size() == 1 && gt_present && typed_value::type_code((std::int64_t)v.alts().size()) == typed_value::int8)
+      {
+        bool has_ph = phasing_status == phasing::partial || phasing_status == phasing::unknown;
+        v.format_fields_.emplace_back("GT", typed_value(typed_value::int8, sample_size * 2));
+        if (has_ph)
+          v.format_fields_.emplace_back("PH", typed_value(typed_value::int8, sample_size));
+
+        if (detail::diploid_gt_tokenizer::tokenize(sample_line.data(), sample_line.size(), sample_size,
+          (std::int8_t*)v.format_fields_[0].second.val_ptr(), has_ph ? (std::int8_t*)v.format_fields_[1].second.val_ptr() : nullptr))
+        {
+          return true;
+        }
+        v.format_fields_.clear();
+      }
+
       struct vcf_fmt_stats
       {
         bool is_gt = false;
@@ -1584,6 +1702,45 @@ namespace savvy
     template <typename OutT>
     bool variant::serialize(const variant& v, OutT out_it, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased, ::savvy::internal::pbwt_sort_context& pbwt_ctx, const std::vector<::savvy::internal::pbwt_sort_map*>& pbwt_format_pointers)
     {
+      // Fields sorted by different mappings are serialized concurrently into task buffers, which are then copied to out_it
+      // in field order.
+      std::vector<std::size_t>& pbwt_task_indices = pbwt_ctx.serialize_task_indices;
+      pbwt_task_indices.clear();
+      if (pbwt_ctx.pool)
+      {
+        std::vector<std::size_t>& pbwt_field_indices = pbwt_ctx.serialize_fields;
+        pbwt_field_indices.clear();
+        std::size_t total_size = 0, max_size = 0;
+        for (std::size_t i = 0; i < pbwt_format_pointers.size(); ++i)
+        {
+          if (pbwt_format_pointers[i])
+          {
+            pbwt_field_indices.push_back(i);
+            total_size += v.format_fields_[i].second.size();
+            max_size = std::max(max_size, v.format_fields_[i].second.size());
+          }
+        }
+
+        if (pbwt_ctx.use_tasks(pbwt_field_indices.size(), total_size, max_size))
+        {
+          pbwt_task_indices.resize(pbwt_format_pointers.size(), std::size_t(-1));
+          for (std::size_t i = 0; i < pbwt_field_indices.size(); ++i)
+            pbwt_task_indices[pbwt_field_indices[i]] = i;
+
+          std::atomic<bool> failed(false);
+          pbwt_ctx.run_tasks(pbwt_field_indices.size(), [&](std::size_t i, ::savvy::internal::pbwt_sort_context::task_scratch& scratch)
+          {
+            std::size_t field_idx = pbwt_field_indices[i];
+            scratch.serialized.clear();
+            if (!typed_value::internal::serialize(v.format_fields_[field_idx].second, std::back_inserter(scratch.serialized), *pbwt_format_pointers[field_idx], scratch.prev_sort_mapping, scratch.counts, scratch.sort_scratch))
+              failed = true;
+          });
+
+          if (failed)
+            return false;
+        }
+      }
+
       // Encode FMT
       for (auto it = v.format_fields_.begin(); it != v.format_fields_.end(); ++it)
       {
@@ -1599,9 +1756,15 @@ namespace savvy
         typed_value::internal::serialize_typed_scalar(out_it, static_cast<std::int32_t>(res->second));
 
         auto* pbwt_ptr = pbwt_format_pointers[it - v.format_fields_.begin()];
-        if (pbwt_ptr)
+        if (pbwt_ptr && pbwt_task_indices.size())
+        {
+          const std::vector<char>& serialized = pbwt_ctx.task_scratches[pbwt_task_indices[it - v.format_fields_.begin()]].serialized;
+          out_it = std::copy(serialized.begin(), serialized.end(), out_it);
+        }
+        else if (pbwt_ptr)
         {
-          typed_value::internal::serialize(it->second, out_it, *pbwt_ptr, pbwt_ctx.prev_sort_mapping, pbwt_ctx.counts);
+          if (!typed_value::internal::serialize(it->second, out_it, *pbwt_ptr, pbwt_ctx.prev_sort_mapping, pbwt_ctx.counts, pbwt_ctx.sort_scratch))
+            return false;
         }
         else
         {
@@ -1616,7 +1779,7 @@ namespace savvy
               if (jt->first == "PH")
               {
                 assert(dense_gt.size() % sample_size == 0 && (dense_gt.size() / sample_size - 1) * sample_size == jt->second.size()); // TODO: graceful error
-                dense_gt.apply_dense(typed_value::bcf_gt_encoder(), (std::int8_t*) jt->second.val_data_.data(), dense_gt.size() / sample_size);
+                dense_gt.apply_dense(typed_value::bcf_gt_encoder(), (std::int8_t*) jt->second.val_ptr(), dense_gt.size() / sample_size);
                 break;
               }
             }
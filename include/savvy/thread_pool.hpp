@@ -0,0 +1,101 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_THREAD_POOL_HPP
+#define LIBSAVVY_THREAD_POOL_HPP
+
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <queue>
+#include <vector>
+#include <type_traits>
+
+namespace savvy
+{
+  namespace detail
+  {
+    /**
+     * Fixed size pool of worker threads. Tasks are run in FIFO order and results are delivered through std::future.
+     */
+    class thread_pool
+    {
+    private:
+      std::vector<std::thread> threads_;
+      std::queue<std::function<void()>> tasks_;
+      std::mutex mtx_;
+      std::condition_variable cv_;
+      bool stopping_ = false;
+    public:
+      thread_pool(std::size_t n_threads)
+      {
+        threads_.reserve(n_threads);
+        for (std::size_t i = 0; i < n_threads; ++i)
+          threads_.emplace_back(&thread_pool::run, this);
+      }
+
+      thread_pool(const thread_pool&) = delete;
+      thread_pool& operator=(const thread_pool&) = delete;
+
+      ~thread_pool()
+      {
+        {
+          std::unique_lock<std::mutex> lk(mtx_);
+          stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto it = threads_.begin(); it != threads_.end(); ++it)
+          it->join();
+      }
+
+      std::size_t size() const { return threads_.size(); }
+
+      template <typename Fn>
+      std::future<typename std::result_of<Fn()>::type> submit(Fn fn)
+      {
+        typedef typename std::result_of<Fn()>::type result_type;
+        auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(fn));
+        std::future<result_type> ret = task->get_future();
+
+        if (threads_.empty())
+        {
+          (*task)();
+          return ret;
+        }
+
+        {
+          std::unique_lock<std::mutex> lk(mtx_);
+          tasks_.emplace([task]() { (*task)(); });
+        }
+        cv_.notify_one();
+        return ret;
+      }
+    private:
+      void run()
+      {
+        while (true)
+        {
+          std::function<void()> task;
+          {
+            std::unique_lock<std::mutex> lk(mtx_);
+            cv_.wait(lk, [this]() { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty())
+              return;
+            task = std::move(tasks_.front());
+            tasks_.pop();
+          }
+          task();
+        }
+      }
+    };
+  }
+}
+
+#endif // LIBSAVVY_THREAD_POOL_HPP
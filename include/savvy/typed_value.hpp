@@ -12,6 +12,7 @@
 #include "sample_subset.hpp"
 #include "portable_endian.hpp"
 #include "endianness.hpp"
+#include "pbwt.hpp"
 
 #include <cstdint>
 #include <type_traits>
@@ -25,6 +26,7 @@
 #include <unordered_set>
 #include <cinttypes>
 #include <limits>
+#include <utility>
 
 namespace savvy
 {
@@ -440,6 +442,7 @@ namespace savvy
       }
       else if (val_type_)
       {
+        dest.discard_borrowed();
         // also sets dest.sparse_size_
         capply_dense(set_off_type(), std::ref(dest));
 
@@ -451,7 +454,7 @@ namespace savvy
         dest.val_data_.resize(dest.sparse_size_ * (1u << bcf_type_shift[dest.val_type_]));
 
 
-        dest.apply_sparse(fill_sparse_data(), val_data_.data(), size_);
+        dest.apply_sparse(fill_sparse_data(), val_ptr(), size_);
 
       }
 
@@ -460,6 +463,7 @@ namespace savvy
 
     bool copy_as_dense(typed_value& dest) const
     {
+      dest.discard_borrowed();
       dest.sparse_size_ = 0;
       dest.off_type_ = 0;
       dest.off_data_.clear();
@@ -476,27 +480,27 @@ namespace savvy
         {
         case 0x01u:
         {
-          auto p = (std::int8_t*)dest.val_data_.data();
+          auto p = (std::int8_t*)dest.val_ptr();
           return copy_sparse1<std::int8_t>(p);
         }
         case 0x02u:
         {
-          auto p = (std::int16_t*)dest.val_data_.data();
+          auto p = (std::int16_t*)dest.val_ptr();
           return copy_sparse1<std::int16_t>(p); // TODO: handle endianess
         }
         case 0x03u:
         {
-          auto p = (std::int32_t*)dest.val_data_.data();
+          auto p = (std::int32_t*)dest.val_ptr();
           return copy_sparse1<std::int32_t>(p);
         }
         case 0x04u:
         {
-          auto p = (std::int64_t*)dest.val_data_.data();
+          auto p = (std::int64_t*)dest.val_ptr();
           return copy_sparse1<std::int64_t>(p);
         }
         case 0x05u:
         {
-          auto p = (float*)dest.val_data_.data();
+          auto p = (float*)dest.val_ptr();
           return copy_sparse1<float>(p);
         }
         default:
@@ -508,19 +512,19 @@ namespace savvy
         switch (val_type_)
         {
         case 0x01u:
-          std::copy_n((std::int8_t*)val_data_.data(), size_, (std::int8_t*)dest.val_data_.data());
+          std::copy_n((std::int8_t*)val_ptr(), size_, (std::int8_t*)dest.val_ptr());
           break;
         case 0x02u:
-          std::copy_n((std::int16_t*)val_data_.data(), size_, (std::int16_t*)dest.val_data_.data()); // TODO: handle endianess
+          std::copy_n((std::int16_t*)val_ptr(), size_, (std::int16_t*)dest.val_ptr()); // TODO: handle endianess
           break;
         case 0x03u:
-          std::copy_n((std::int32_t*)val_data_.data(), size_, (std::int32_t*)dest.val_data_.data());
+          std::copy_n((std::int32_t*)val_ptr(), size_, (std::int32_t*)dest.val_ptr());
           break;
         case 0x04u:
-          std::copy_n((std::int64_t*)val_data_.data(), size_, (std::int64_t*)dest.val_data_.data());
+          std::copy_n((std::int64_t*)val_ptr(), size_, (std::int64_t*)dest.val_ptr());
           break;
         case 0x05u:
-          std::copy_n((float*)val_data_.data(), size_, (float*)dest.val_data_.data());
+          std::copy_n((float*)val_ptr(), size_, (float*)dest.val_ptr());
           break;
         default:
           return false;
@@ -532,6 +536,36 @@ namespace savvy
 
 
 
+    /**
+     * Copies a PBWT-sorted vector to dest in sample order. This is used for records that are read without being
+     * unsorted (see reader::pbwt_unsort()). Vectors that are not PBWT-sorted are copied as is.
+     *
+     * @param dest Destination value
+     * @param sort_map Mapping that the vector is sorted by (see reader::pbwt_sort_map())
+     * @return False if sort_map does not match the vector
+     */
+    bool copy_pbwt_unsorted(typed_value& dest, const std::vector<std::size_t>& sort_map) const
+    {
+      if (!pbwt_flag_)
+      {
+        dest = *this;
+        return true;
+      }
+
+      if (sort_map.size() != size_ || &dest == this)
+        return false;
+
+      switch (val_type_)
+      {
+      case 0x01u:
+        return internal::pbwt_unsort_with_map<std::int8_t>(*this, dest, sort_map);
+      case 0x02u:
+        return internal::pbwt_unsort_with_map<std::int16_t>(*this, dest, sort_map);
+      default:
+        return false;
+      }
+    }
+
     class dense_subset_functor
     {
     public:
@@ -602,21 +636,21 @@ namespace savvy
     template <typename ValT, typename Fn, typename... Args>
     bool apply_sparse_offsets(Fn fn, Args... args)
     {
-      if (!off_data_.data())
+      if (!off_ptr())
         return false;
       switch (off_type_)
       {
       case 0x01u:
-        fn((ValT*)val_data_.data(), ((ValT*)val_data_.data()) + sparse_size_, (std::uint8_t*)off_data_.data(), std::forward<Args>(args)...);
+        fn((ValT*)val_ptr(), ((ValT*)val_ptr()) + sparse_size_, (std::uint8_t*)off_ptr(), std::forward<Args>(args)...);
         break;
       case 0x02u:
-        fn((ValT*)val_data_.data(), ((ValT*)val_data_.data()) + sparse_size_, (std::uint16_t*)off_data_.data(), std::forward<Args>(args)...); // TODO: handle endianess
+        fn((ValT*)val_ptr(), ((ValT*)val_ptr()) + sparse_size_, (std::uint16_t*)off_ptr(), std::forward<Args>(args)...); // TODO: handle endianess
         break;
       case 0x03u:
-        fn((ValT*)val_data_.data(), ((ValT*)val_data_.data()) + sparse_size_, (std::uint32_t*)off_data_.data(), std::forward<Args>(args)...);
+        fn((ValT*)val_ptr(), ((ValT*)val_ptr()) + sparse_size_, (std::uint32_t*)off_ptr(), std::forward<Args>(args)...);
         break;
       case 0x04u:
-        fn((ValT*)val_data_.data(), ((ValT*)val_data_.data()) + sparse_size_, (std::uint64_t*)off_data_.data(), std::forward<Args>(args)...);
+        fn((ValT*)val_ptr(), ((ValT*)val_ptr()) + sparse_size_, (std::uint64_t*)off_ptr(), std::forward<Args>(args)...);
         break;
       default:
         return false;
@@ -649,21 +683,21 @@ namespace savvy
     template <typename ValT, typename Fn, typename... Args>
     bool capply_sparse_offsets(Fn fn, Args... args) const
     {
-      if (!off_data_.data())
+      if (!off_ptr())
         return false;
       switch (off_type_)
       {
       case 0x01u:
-        fn((const ValT*)val_data_.data(), ((const ValT*)val_data_.data()) + sparse_size_, (const std::uint8_t*)off_data_.data(), std::forward<Args>(args)...);
+        fn((const ValT*)val_ptr(), ((const ValT*)val_ptr()) + sparse_size_, (const std::uint8_t*)off_ptr(), std::forward<Args>(args)...);
         break;
       case 0x02u:
-        fn((const ValT*)val_data_.data(), ((const ValT*)val_data_.data()) + sparse_size_, (const std::uint16_t*)off_data_.data(), std::forward<Args>(args)...); // TODO: handle endianess
+        fn((const ValT*)val_ptr(), ((const ValT*)val_ptr()) + sparse_size_, (const std::uint16_t*)off_ptr(), std::forward<Args>(args)...); // TODO: handle endianess
         break;
       case 0x03u:
-        fn((const ValT*)val_data_.data(), ((const ValT*)val_data_.data()) + sparse_size_, (const std::uint32_t*)off_data_.data(), std::forward<Args>(args)...);
+        fn((const ValT*)val_ptr(), ((const ValT*)val_ptr()) + sparse_size_, (const std::uint32_t*)off_ptr(), std::forward<Args>(args)...);
         break;
       case 0x04u:
-        fn((const ValT*)val_data_.data(), ((const ValT*)val_data_.data()) + sparse_size_, (const std::uint64_t*)off_data_.data(), std::forward<Args>(args)...);
+        fn((const ValT*)val_ptr(), ((const ValT*)val_ptr()) + sparse_size_, (const std::uint64_t*)off_ptr(), std::forward<Args>(args)...);
         break;
       default:
         return false;
@@ -701,22 +735,22 @@ namespace savvy
       switch (val_type_)
       {
       case 0x01u:
-        fn((std::int8_t*)val_data_.data(), ((std::int8_t*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((std::int8_t*)val_ptr(), ((std::int8_t*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       case 0x02u:
-        fn((std::int16_t*)val_data_.data(), ((std::int16_t*)val_data_.data()) + sz, std::forward<Args>(args)...); // TODO: handle endianess
+        fn((std::int16_t*)val_ptr(), ((std::int16_t*)val_ptr()) + sz, std::forward<Args>(args)...); // TODO: handle endianess
         break;
       case 0x03u:
-        fn((std::int32_t*)val_data_.data(), ((std::int32_t*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((std::int32_t*)val_ptr(), ((std::int32_t*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       case 0x04u:
-        fn((std::int64_t*)val_data_.data(), ((std::int64_t*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((std::int64_t*)val_ptr(), ((std::int64_t*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       case 0x05u:
-        fn((float*)val_data_.data(), ((float*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((float*)val_ptr(), ((float*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       case 0x07u:
-        fn(val_data_.data(), val_data_.data() + sz, std::forward<Args>(args)...);
+        fn(val_ptr(), val_ptr() + sz, std::forward<Args>(args)...);
         break;
       default:
         return false;
@@ -732,22 +766,22 @@ namespace savvy
       switch (val_type_)
       {
       case 0x01u:
-        fn((const std::int8_t*)val_data_.data(), ((const std::int8_t*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((const std::int8_t*)val_ptr(), ((const std::int8_t*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       case 0x02u:
-        fn((const std::int16_t*)val_data_.data(), ((const std::int16_t*)val_data_.data()) + sz, std::forward<Args>(args)...); // TODO: handle endianess
+        fn((const std::int16_t*)val_ptr(), ((const std::int16_t*)val_ptr()) + sz, std::forward<Args>(args)...); // TODO: handle endianess
         break;
       case 0x03u:
-        fn((const std::int32_t*)val_data_.data(), ((const std::int32_t*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((const std::int32_t*)val_ptr(), ((const std::int32_t*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       case 0x04u:
-        fn((const std::int64_t*)val_data_.data(), ((const std::int64_t*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((const std::int64_t*)val_ptr(), ((const std::int64_t*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       case 0x05u:
-        fn((const float*)val_data_.data(), ((const float*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((const float*)val_ptr(), ((const float*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       case 0x07u:
-        fn((const char*)val_data_.data(), ((const char*)val_data_.data()) + sz, std::forward<Args>(args)...);
+        fn((const char*)val_ptr(), ((const char*)val_ptr()) + sz, std::forward<Args>(args)...);
         break;
       default:
         return false;
@@ -782,31 +816,31 @@ namespace savvy
       case 0x01u:
         {
           typedef std::int8_t T;
-          std::for_each((T*)val_data_.data(), ((T*)val_data_.data()) + sz, fn);
+          std::for_each((T*)val_ptr(), ((T*)val_ptr()) + sz, fn);
         }
         break;
       case 0x02u:
         {
           typedef std::int16_t T;
-          std::for_each((T*)val_data_.data(), ((T*)val_data_.data()) + sz, fn); // TODO: handle endianess
+          std::for_each((T*)val_ptr(), ((T*)val_ptr()) + sz, fn); // TODO: handle endianess
         }
         break;
       case 0x03u:
         {
           typedef std::int32_t T;
-          std::for_each((T*)val_data_.data(), ((T*)val_data_.data()) + sz, fn);
+          std::for_each((T*)val_ptr(), ((T*)val_ptr()) + sz, fn);
         }
         break;
       case 0x04u:
         {
           typedef std::int64_t T;
-          std::for_each((T*)val_data_.data(), ((T*)val_data_.data()) + sz, fn);
+          std::for_each((T*)val_ptr(), ((T*)val_ptr()) + sz, fn);
         }
         break;
       case 0x05u:
         {
           typedef float T;
-          std::for_each((T*)val_data_.data(), ((T*)val_data_.data()) + sz, fn);
+          std::for_each((T*)val_ptr(), ((T*)val_ptr()) + sz, fn);
         }
         break;
       default:
@@ -821,25 +855,25 @@ namespace savvy
     get(T& dest) const
     {
       static_assert(std::is_signed<T>::value, "Destination value_type must be signed.");
-      if (!val_data_.data() || size_ == 0)
+      if (!val_ptr() || size_ == 0)
         return false;
 
       switch (val_type_)
       {
       case 0x01u:
-        dest = reserved_transformation<T>(*((std::int8_t*) val_data_.data()));
+        dest = reserved_transformation<T>(*((std::int8_t*) val_ptr()));
         break;
       case 0x02u:
-        dest = reserved_transformation<T>(*((std::int16_t*) val_data_.data())); // TODO: handle endianess
+        dest = reserved_transformation<T>(*((std::int16_t*) val_ptr())); // TODO: handle endianess
         break;
       case 0x03u:
-        dest = reserved_transformation<T>(*((std::int32_t*) val_data_.data()));
+        dest = reserved_transformation<T>(*((std::int32_t*) val_ptr()));
         break;
       case 0x04u:
-        dest = reserved_transformation<T>(*((std::int64_t*) val_data_.data()));
+        dest = reserved_transformation<T>(*((std::int64_t*) val_ptr()));
         break;
       case 0x05u:
-        dest = *((float*)val_data_.data()); // TODO: this needs a reserved_transformation for float to int conversions.
+        dest = *((float*)val_ptr()); // TODO: this needs a reserved_transformation for float to int conversions.
         break;
       default:
         return false;
@@ -850,7 +884,7 @@ namespace savvy
 
     bool get(std::string& dest) const
     {
-      if (!val_data_.data() || size_ == 0)
+      if (!val_ptr() || size_ == 0)
         return false;
 
       switch (val_type_)
@@ -868,7 +902,7 @@ namespace savvy
 //        dest = missing_transformation<T>(*((std::int64_t*)val_ptr_));
 //        break;
       case 0x07u:
-        dest.assign(val_data_.data(), val_data_.data() + size_);
+        dest.assign(val_ptr(), val_ptr() + size_);
         break;
       default:
         return false;
@@ -913,31 +947,31 @@ namespace savvy
         {
         case 0x01u:
         {
-          auto p = (std::int8_t*)val_data_.data();
+          auto p = (std::int8_t*)val_ptr();
           std::transform(p, p + size_, dest.data(), reserved_transformation<T, std::int8_t>);
           break;
         }
         case 0x02u:
         {
-          auto p = (std::int16_t*)val_data_.data();
+          auto p = (std::int16_t*)val_ptr();
           std::transform(p, p + size_, dest.data(), reserved_transformation<T, std::int16_t>);
           break;
         }
         case 0x03u:
         {
-          auto p = (std::int32_t*)val_data_.data();
+          auto p = (std::int32_t*)val_ptr();
           std::transform(p, p + size_, dest.data(), reserved_transformation<T, std::int32_t>);
           break;
         }
         case 0x04u:
         {
-          auto p = (std::int64_t*)val_data_.data();
+          auto p = (std::int64_t*)val_ptr();
           std::transform(p, p + size_, dest.data(), reserved_transformation<T, std::int64_t>);
           break;
         }
         case 0x05u:
         {
-          auto p = (float*)val_data_.data();
+          auto p = (float*)val_ptr();
           std::transform(p, p + size_, dest.data(), reserved_transformation<T, float>);
           break;
         }
@@ -1048,20 +1082,20 @@ namespace savvy
         {
         case 0x01u:
         {
-          auto *vp = (std::int8_t *) val_data_.data();
+          auto *vp = (std::int8_t *) val_ptr();
           switch (off_type_)
           {
           case 0x01u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x02u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x03u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x04u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           default:
             return false;
@@ -1070,20 +1104,20 @@ namespace savvy
         }
         case 0x02u:
         {
-          auto *vp = (std::int16_t *) val_data_.data();
+          auto *vp = (std::int16_t *) val_ptr();
           switch (off_type_)
           {
           case 0x01u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x02u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x03u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x04u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           default:
             return false;
@@ -1092,20 +1126,20 @@ namespace savvy
         }
         case 0x03u:
         {
-          auto *vp = (std::int32_t *) val_data_.data();
+          auto *vp = (std::int32_t *) val_ptr();
           switch (off_type_)
           {
           case 0x01u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x02u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x03u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_data_.data()), size_), reserved_transformation_functor<T>();
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_ptr()), size_), reserved_transformation_functor<T>();
             break;
           case 0x04u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           default:
             return false;
@@ -1114,20 +1148,20 @@ namespace savvy
         }
         case 0x04u:
         {
-          auto *vp = (std::int64_t *) val_data_.data();
+          auto *vp = (std::int64_t *) val_ptr();
           switch (off_type_)
           {
           case 0x01u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x02u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x03u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x04u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           default:
             return false;
@@ -1136,20 +1170,20 @@ namespace savvy
         }
         case 0x05u:
         {
-          auto *vp = (float *) val_data_.data();
+          auto *vp = (float *) val_ptr();
           switch (off_type_)
           {
           case 0x01u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint8_t>((std::uint8_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x02u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint16_t>((std::uint16_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x03u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint32_t>((std::uint32_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           case 0x04u:
-            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_data_.data()), size_, reserved_transformation_functor<T>());
+            dest.assign(vp, vp + sparse_size_, compressed_offset_iterator<std::uint64_t>((std::uint64_t *) off_ptr()), size_, reserved_transformation_functor<T>());
             break;
           default:
             return false;
@@ -1169,31 +1203,31 @@ namespace savvy
         {
         case 0x01u:
         {
-          auto *p = (std::int8_t *) val_data_.data();
+          auto *p = (std::int8_t *) val_ptr();
           dest.assign(p, p + size_, reserved_transformation_functor<T>());
           break;
         }
         case 0x02u:
         {
-          auto *p = (std::int16_t *) val_data_.data();
+          auto *p = (std::int16_t *) val_ptr();
           dest.assign(p, p + size_, reserved_transformation_functor<T>());
           break;
         }// TODO: handle endianess
         case 0x03u:
         {
-          auto *p = (std::int32_t *) val_data_.data();
+          auto *p = (std::int32_t *) val_ptr();
           dest.assign(p, p + size_, reserved_transformation_functor<T>());
           break;
         }
         case 0x04u:
         {
-          auto *p = (std::int64_t *) val_data_.data();
+          auto *p = (std::int64_t *) val_ptr();
           dest.assign(p, p + size_, reserved_transformation_functor<T>());
           break;
         }
         case 0x05u:
         {
-          auto *p = (float *) val_data_.data();
+          auto *p = (float *) val_ptr();
           dest.assign(p, p + size_, reserved_transformation_functor<T>());
           break;
         }
@@ -1230,18 +1264,68 @@ namespace savvy
         }
       };
 
-      static void pbwt_unsort(const typed_value& src_v, typed_value& dest_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts);
+      static bool pbwt_unsort(const typed_value& src_v, typed_value& dest_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts, std::vector<std::size_t>& sparse_scratch);
 
       template<typename InIter, typename OutIter>
       static void pbwt_sort(InIter in_data, std::size_t in_data_size, OutIter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts);
 
+      static bool pbwt_update_sort_mapping(const typed_value& src_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts);
+
+      // Unsorts a PBWT-sorted sparse vector into dest_v (also sparse). If dest_v is null, only the sort mapping is advanced
+      // and scratch is not used. Returns false if the vector is malformed.
+      template<typename ValT>
+      static bool pbwt_unsort_sparse(const typed_value& src_v, typed_value* dest_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts, std::vector<std::size_t>* scratch);
+
+      template<typename ValT>
+      static void assign_sparse_pairs(const std::vector<std::pair<std::size_t, ValT>>& pairs, typed_value& dest_v);
+
+      // Assigns the values at marked indices (see pbwt_unsort_sparse_offsets()) to dest_v in index order.
+      template<typename ValT>
+      static void assign_marked_values(const std::size_t* marks, const std::size_t* vals, std::size_t sz, std::size_t n_marked, typed_value& dest_v);
+
+      template<typename ValT>
+      static bool pbwt_unsort_with_map(const typed_value& src_v, typed_value& dest_v, const std::vector<std::size_t>& sort_map);
+
+      // If unsorted_marks is not null, the unsorted index of each value is set in the unsorted_marks bitmap and the
+      // unsigned value is stored at that index of unsorted_vals.
+      template<typename ValT, typename OffT>
+      static bool pbwt_unsort_sparse_offsets(const ValT* val_ptr, const OffT* off_ptr, std::size_t sparse_sz, std::size_t sz, std::size_t* unsorted_marks, std::size_t* unsorted_vals, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts);
+
+      // Sorts a sparse vector and serializes the sorted values as either a sparse or a dense vector, whichever is smaller.
+      template<typename ValT, typename OutIter>
+      static bool pbwt_sort_sparse(const typed_value& v, OutIter& out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts, std::vector<std::size_t>& scratch);
+
+      // Writes an entry for each non-zero value of a sparse vector, with its sorted position above its unsigned value.
+      template<typename ValT, typename OffT>
+      static std::size_t pbwt_sort_sparse_offsets(const ValT* val_ptr, const OffT* off_ptr, std::size_t sparse_sz, const std::size_t* inverse_mapping, std::size_t* entries);
+
+      // Writes the low `width` bytes of val in little-endian order.
+      template<typename OutIter>
+      static void serialize_le(OutIter& out_it, std::uint64_t val, std::size_t width)
+      {
+        for (std::size_t i = 0; i < width; ++i)
+          *(out_it++) = char((val >> (8u * i)) & 0xFFu);
+      }
+
       static std::int64_t deserialize(typed_value& v, std::istream& is, std::size_t size_divisor);
 
+      // Lender provides a `const char* borrow(std::size_t n)` method that returns a pointer to the next n bytes of the
+      // stream's buffer (and advances past them) or nullptr when they aren't available contiguously.
+      template <typename Lender>
+      static std::int64_t deserialize(typed_value& v, std::istream& is, std::size_t size_divisor, Lender* lender);
+
+      struct null_lender
+      {
+        const char* borrow(std::size_t) { return nullptr; }
+      };
+
+      static std::int64_t skip(std::istream& is, std::size_t size_divisor);
+
       template<typename Iter>
       static void serialize(const typed_value& v, Iter out_it, std::size_t size_divisor);
 
       template<typename Iter>
-      static void serialize(const typed_value& v, Iter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts);
+      static bool serialize(const typed_value& v, Iter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts, std::vector<std::size_t>& scratch);
 
       //~~~~~~~~ OLD BCF ROUTINES ~~~~~~~~//
       template<typename T>
@@ -1301,6 +1385,11 @@ namespace savvy
       get_typed_value_size(T);
     };
 
+    /**
+     * Checks whether value references data owned by a reader (see reader::zero_copy()) rather than storing its own copy.
+     * @return True if data is borrowed
+     */
+    bool is_borrowed() const { return borrowed_val_ || borrowed_off_; }
   private:
     void clear()
     {
@@ -1310,6 +1399,7 @@ namespace savvy
       val_type_ = 0;
       off_data_.clear();
       val_data_.clear();
+      discard_borrowed();
       pbwt_flag_ = false;
     }
 
@@ -1500,19 +1590,22 @@ namespace savvy
 
       std::size_t stride = size_ / subset_mask.size();
 
+      own();
+      tmp_value.discard_borrowed();
+
       if (off_type_)
       {
         tmp_value.off_data_.resize(sizeof(std::uint64_t) * sparse_size_);
         switch (off_type_)
         {
         case 0x01u:
-          std::copy((std::uint8_t*)off_data_.data(), ((std::uint8_t*)off_data_.data()) + sparse_size_, (std::uint64_t*)tmp_value.off_data_.data());
+          std::copy((std::uint8_t*)off_ptr(), ((std::uint8_t*)off_ptr()) + sparse_size_, (std::uint64_t*)tmp_value.off_ptr());
           break;
         case 0x02u:
-          std::copy((std::uint16_t*)off_data_.data(), ((std::uint16_t*)off_data_.data()) + sparse_size_, (std::uint64_t*)tmp_value.off_data_.data());
+          std::copy((std::uint16_t*)off_ptr(), ((std::uint16_t*)off_ptr()) + sparse_size_, (std::uint64_t*)tmp_value.off_ptr());
           break;
         case 0x03u:
-          std::copy((std::uint32_t*)off_data_.data(), ((std::uint32_t*)off_data_.data()) + sparse_size_, (std::uint64_t*)tmp_value.off_data_.data());
+          std::copy((std::uint32_t*)off_ptr(), ((std::uint32_t*)off_ptr()) + sparse_size_, (std::uint64_t*)tmp_value.off_ptr());
           break;
 //        case 0x04u:
 //          DO NOTHING
@@ -1552,14 +1645,15 @@ namespace savvy
         std::size_t sp_sz = val_end - val_ptr;
         std::size_t stride = sz / subset_map_.size();
 
+        dest_.discard_borrowed();
         dest_.size_ = subset_size_ * stride;
         dest_.val_type_ = type_code<ValT>();
         dest_.off_type_ = type_code<std::int64_t>();
         //dest_.size_ = subset_size_ * stride;
         dest_.off_data_.resize(sp_sz * stride * sizeof(std::int64_t));
         dest_.val_data_.resize(sp_sz * stride  * sizeof(ValT));
-        ValT* dest_valp = (ValT*)dest_.val_data_.data();
-        std::uint64_t* dest_offp = (std::uint64_t*)dest_.off_data_.data();
+        ValT* dest_valp = (ValT*)dest_.val_ptr();
+        std::uint64_t* dest_offp = (std::uint64_t*)dest_.off_ptr();
 
         std::size_t last_offset_new = 0;
         std::size_t total_offset_old = 0;
@@ -1576,7 +1670,7 @@ namespace savvy
           }
         }
 
-        dest_.sparse_size_ = dest_valp - (ValT*)dest_.val_data_.data();
+        dest_.sparse_size_ = dest_valp - (ValT*)dest_.val_ptr();
       }
 
       template <typename T>
@@ -1585,16 +1679,18 @@ namespace savvy
         std::size_t sz = endp - valp;;
         std::size_t stride = sz / subset_map_.size();
 
+        dest_.discard_borrowed();
         dest_.val_type_ = type_code<T>();
         dest_.size_ = subset_size_ * stride;
         dest_.val_data_.resize(dest_.size_ * sizeof(T));
 
+        T* dest_valp = (T*)dest_.val_data_.data();
         for (std::size_t i = 0; i < subset_map_.size(); ++i)
         {
           if (subset_map_[i] < std::numeric_limits<std::size_t>::max())
           {
             for (std::size_t j = 0; j < stride; ++j)
-              ((T*)dest_.val_data_.data())[subset_map_[i] * stride + j] = valp[i * stride + j];
+              dest_valp[subset_map_[i] * stride + j] = valp[i * stride + j];
           }
         }
       }
@@ -1647,9 +1743,9 @@ namespace savvy
       std::size_t total_offset = 0;
       for (std::size_t i = 0; i < sparse_size_; ++i)
       {
-        OffT tmp_off = ((const OffT *) off_data_.data())[i];
+        OffT tmp_off = ((const OffT *) off_ptr())[i];
         total_offset += tmp_off;
-        dest[total_offset++] = reserved_transformation<DestT, ValT>(((const ValT *) val_data_.data())[i]);;
+        dest[total_offset++] = reserved_transformation<DestT, ValT>(((const ValT *) val_ptr())[i]);;
       }
     }
 
@@ -1719,7 +1815,35 @@ namespace savvy
 //    std::vector<char> local_data_;
     std::vector<char> off_data_;
     std::vector<char> val_data_;
+    const char* borrowed_off_ = nullptr;
+    const char* borrowed_val_ = nullptr;
     bool pbwt_flag_ = false;
+
+    std::size_t off_bytes() const { return off_type_ ? sparse_size_ * (1u << bcf_type_shift[off_type_]) : 0; }
+    std::size_t val_bytes() const { return (off_type_ ? sparse_size_ : size_) * (1u << bcf_type_shift[val_type_]); }
+
+    const char* off_ptr() const { return borrowed_off_ ? borrowed_off_ : off_data_.data(); }
+    const char* val_ptr() const { return borrowed_val_ ? borrowed_val_ : val_data_.data(); }
+    char* off_ptr() { own(); return off_data_.data(); }
+    char* val_ptr() { own(); return val_data_.data(); }
+
+    // Copies borrowed data into local storage so that it can be modified or outlive the buffer it references.
+    void own()
+    {
+      if (borrowed_off_)
+        off_data_.assign(borrowed_off_, borrowed_off_ + off_bytes());
+      if (borrowed_val_)
+        val_data_.assign(borrowed_val_, borrowed_val_ + val_bytes());
+      borrowed_off_ = nullptr;
+      borrowed_val_ = nullptr;
+    }
+
+    // Drops references to borrowed data without copying it. Used before local storage is overwritten.
+    void discard_borrowed()
+    {
+      borrowed_off_ = nullptr;
+      borrowed_val_ = nullptr;
+    }
   };
 
   template<>
@@ -2021,8 +2145,12 @@ namespace savvy
       // src may be reused, so keep src.{val|off}_data_ valid by swapping.
       val_data_.swap(src.val_data_);
       off_data_.swap(src.off_data_);
+      borrowed_val_ = src.borrowed_val_;
+      borrowed_off_ = src.borrowed_off_;
       pbwt_flag_ = src.pbwt_flag_;
 
+      src.discard_borrowed();
+
       src.val_type_ = 0;
       src.off_type_ = 0;
       src.size_ = 0;
@@ -2049,6 +2177,7 @@ namespace savvy
   {
     if (&src != this)
     {
+      discard_borrowed();
       val_type_ = src.val_type_;
       off_type_ = src.off_type_;
       size_ = src.size_;
@@ -2061,8 +2190,8 @@ namespace savvy
       off_data_.resize(off_width * sz);
       val_data_.resize(val_width * sz);
 
-      std::memcpy(off_data_.data(), src.off_data_.data(), off_width * sz);
-      std::memcpy(val_data_.data(), src.val_data_.data(), val_width * sz);
+      std::memcpy(off_ptr(), src.off_ptr(), off_width * sz);
+      std::memcpy(val_ptr(), src.val_ptr(), val_width * sz);
     }
     return *this;
   }
@@ -2137,8 +2266,20 @@ namespace savvy
     }
   }*/
 
+  // Only 8-bit vectors can take the biallelic fast path (see detail::biallelic_pbwt_unsorter).
+  template<typename T>
+  static bool pbwt_unsort_biallelic(const T* /*src_ptr*/, std::size_t /*sz*/, T* /*dest_ptr*/, std::vector<std::size_t>& /*sort_mapping*/, std::vector<std::size_t>& /*prev_sort_mapping*/, std::vector<std::size_t>& /*scratch*/)
+  {
+    return false;
+  }
+
+  inline bool pbwt_unsort_biallelic(const std::int8_t* src_ptr, std::size_t sz, std::int8_t* dest_ptr, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& scratch)
+  {
+    return ::savvy::detail::biallelic_pbwt_unsorter::unsort(src_ptr, sz, dest_ptr, sort_mapping, prev_sort_mapping, scratch);
+  }
+
   template<typename SrcT, typename DestT>
-  static void pbwt_unsort(SrcT src_ptr, std::size_t sz, DestT dest_ptr, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  static bool pbwt_unsort(SrcT src_ptr, std::size_t sz, DestT dest_ptr, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
   {
     std::swap(sort_mapping, prev_sort_mapping);
     if (prev_sort_mapping.empty())
@@ -2152,10 +2293,13 @@ namespace savvy
 
     if (prev_sort_mapping.size() != sz)
     {
-      fprintf(stderr, "Variable-sized data vectors not allowed with PBWT\n"); // TODO: handle better
-      exit(-1);
+      fprintf(stderr, "Error: variable-sized data vectors not allowed with PBWT\n");
+      return false;
     }
 
+    if (pbwt_unsort_biallelic(src_ptr, sz, dest_ptr, sort_mapping, prev_sort_mapping, counts))
+      return true;
+
     typedef typename std::make_unsigned<typename std::iterator_traits<SrcT>::value_type>::type utype;
     auto src_uptr = (utype*)src_ptr;
     counts.clear();
@@ -2185,11 +2329,11 @@ namespace savvy
       const utype d(src_ptr[i]);
       sort_mapping[counts[d]++] = unsorted_index;
     }
+    return true;
   }
 
-  inline void typed_value::internal::pbwt_unsort(const typed_value& src_v, typed_value& dest_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  inline bool typed_value::internal::pbwt_unsort(const typed_value& src_v, typed_value& dest_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts, std::vector<std::size_t>& sparse_scratch)
   {
-    assert(src_v.off_type_ == 0);
     //assert(v.local_data_.empty());
 
     dest_v.size_ = src_v.size_;
@@ -2197,27 +2341,398 @@ namespace savvy
     dest_v.val_type_ = src_v.val_type_;
     dest_v.off_type_ = src_v.off_type_;
     dest_v.pbwt_flag_ = false;
+    dest_v.discard_borrowed();
 
     if (src_v.off_type_)
     {
-      fprintf(stderr, "PBWT sort not supported with sparse vectors\n"); // TODO: implement
-      exit(-1);
+      if (src_v.val_type_ == 0x01u) return pbwt_unsort_sparse<std::int8_t>(src_v, &dest_v, sort_mapping, prev_sort_mapping, counts, &sparse_scratch);
+      if (src_v.val_type_ == 0x02u) return pbwt_unsort_sparse<std::int16_t>(src_v, &dest_v, sort_mapping, prev_sort_mapping, counts, &sparse_scratch);
+      fprintf(stderr, "Error: PBWT sorted vector values cannot be wider than 16 bits\n");
+      return false;
     }
     else if (src_v.val_type_)
     {
       dest_v.val_data_.resize(src_v.size_ * (1u << bcf_type_shift[src_v.val_type_]));
-      if (src_v.val_type_ == 0x01u) ::savvy::pbwt_unsort((std::int8_t *) src_v.val_data_.data(), src_v.size_, (std::int8_t *) dest_v.val_data_.data(), sort_mapping, prev_sort_mapping, counts);
-      else if (src_v.val_type_ == 0x02u) ::savvy::pbwt_unsort((std::int16_t *) src_v.val_data_.data(), src_v.size_, (std::int16_t *) dest_v.val_data_.data(), sort_mapping, prev_sort_mapping, counts); // TODO: make sure this works
-      else
+      if (src_v.val_type_ == 0x01u) return ::savvy::pbwt_unsort((std::int8_t *) src_v.val_ptr(), src_v.size_, (std::int8_t *) dest_v.val_ptr(), sort_mapping, prev_sort_mapping, counts);
+      if (src_v.val_type_ == 0x02u) return ::savvy::pbwt_unsort((std::int16_t *) src_v.val_ptr(), src_v.size_, (std::int16_t *) dest_v.val_ptr(), sort_mapping, prev_sort_mapping, counts); // TODO: make sure this works
+      fprintf(stderr, "Error: PBWT sorted vector values cannot be wider than 16 bits\n");
+      return false;
+    }
+    return true;
+  }
+
+  // Same as pbwt_unsort(), but only advances the sort mapping. Used when a PBWT-sorted field is not needed by the caller.
+  template<typename SrcT>
+  static bool pbwt_update_sort_mapping(SrcT src_ptr, std::size_t sz, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  {
+    std::swap(sort_mapping, prev_sort_mapping);
+    if (prev_sort_mapping.empty())
+    {
+      prev_sort_mapping.resize(sz);
+      for (std::size_t i = 0; i < sz; ++i)
+        prev_sort_mapping[i] = i;
+    }
+
+    sort_mapping.resize(sz);
+
+    if (prev_sort_mapping.size() != sz)
+    {
+      fprintf(stderr, "Error: variable-sized data vectors not allowed with PBWT\n");
+      return false;
+    }
+
+    typedef typename std::iterator_traits<SrcT>::value_type val_t;
+    if (pbwt_unsort_biallelic(src_ptr, sz, (val_t*)nullptr, sort_mapping, prev_sort_mapping, counts))
+      return true;
+
+    typedef typename std::make_unsigned<val_t>::type utype;
+    auto src_uptr = (utype*)src_ptr;
+    counts.clear();
+    counts.resize(std::numeric_limits<utype>::max() + 2);
+    auto counts_ptr = counts.data() + 1;
+    for (std::size_t i = 0; i < sz; ++i)
+      ++(counts_ptr[src_uptr[i]]);
+
+    for (std::size_t i = 1; i < counts.size(); ++i)
+      counts[i] = counts[i - 1] + counts[i];
+
+    for (std::size_t i = 0; i < sz; ++i)
+      sort_mapping[counts[src_uptr[i]]++] = prev_sort_mapping[i];
+    return true;
+  }
+
+  inline bool typed_value::internal::pbwt_update_sort_mapping(const typed_value& src_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  {
+    if (src_v.off_type_)
+    {
+      if (src_v.val_type_ == 0x01u) return pbwt_unsort_sparse<std::int8_t>(src_v, nullptr, sort_mapping, prev_sort_mapping, counts, nullptr);
+      if (src_v.val_type_ == 0x02u) return pbwt_unsort_sparse<std::int16_t>(src_v, nullptr, sort_mapping, prev_sort_mapping, counts, nullptr);
+    }
+    else if (src_v.val_type_ == 0x01u)
+      return ::savvy::pbwt_update_sort_mapping((std::int8_t *) src_v.val_ptr(), src_v.size_, sort_mapping, prev_sort_mapping, counts);
+    else if (src_v.val_type_ == 0x02u)
+      return ::savvy::pbwt_update_sort_mapping((std::int16_t *) src_v.val_ptr(), src_v.size_, sort_mapping, prev_sort_mapping, counts);
+    else if (!src_v.val_type_)
+    {
+      return true;
+    }
+
+    fprintf(stderr, "Error: PBWT sorted vector values cannot be wider than 16 bits\n");
+    return false;
+  }
+
+  static const std::size_t sparse_mark_bits = sizeof(std::size_t) * 8u;
+
+  inline std::size_t count_trailing_zeros(std::size_t x)
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    return std::size_t(__builtin_ctzll((unsigned long long)x));
+#else
+    std::size_t n = 0;
+    for (; !(x & 1u); x >>= 1u)
+      ++n;
+    return n;
+#endif
+  }
+
+  // Calls fn(i) for each index i set in the bitmap, in increasing order.
+  template<typename Fn>
+  static void for_each_marked(const std::size_t* marks, std::size_t n_words, Fn fn)
+  {
+    for (std::size_t w = 0; w < n_words; ++w)
+    {
+      for (std::size_t bits = marks[w]; bits; bits &= bits - 1u)
+        fn(w * sparse_mark_bits + count_trailing_zeros(bits));
+    }
+  }
+
+  template<typename ValT, typename OffT>
+  inline bool typed_value::internal::pbwt_unsort_sparse_offsets(const ValT* val_ptr, const OffT* off_ptr, std::size_t sparse_sz, std::size_t sz, std::size_t* unsorted_marks, std::size_t* unsorted_vals, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  {
+    std::swap(sort_mapping, prev_sort_mapping);
+    if (prev_sort_mapping.empty())
+    {
+      prev_sort_mapping.resize(sz);
+      for (std::size_t i = 0; i < sz; ++i)
+        prev_sort_mapping[i] = i;
+    }
+
+    sort_mapping.resize(sz);
+
+    if (prev_sort_mapping.size() != sz || sparse_sz > sz)
+    {
+      fprintf(stderr, "Error: variable-sized data vectors not allowed with PBWT\n");
+      return false;
+    }
+
+    typedef typename std::make_unsigned<ValT>::type utype;
+    counts.clear();
+    counts.resize(std::numeric_limits<utype>::max() + 2);
+    auto counts_ptr = counts.data() + 1;
+    counts_ptr[0] = sz - sparse_sz;
+    for (std::size_t j = 0; j < sparse_sz; ++j)
+      ++(counts_ptr[utype(val_ptr[j])]);
+
+    for (std::size_t i = 1; i < counts.size(); ++i)
+      counts[i] = counts[i - 1] + counts[i];
+
+    // Runs of zeros between non-zero values keep their relative order, so they are copied to the front of the next
+    // mapping in bulk and only the non-zero values are bucketed individually.
+    std::size_t i = 0;
+    for (std::size_t j = 0; j < sparse_sz; ++j)
+    {
+      std::size_t sorted_index = i + off_ptr[j];
+      if (sorted_index >= sz)
+      {
+        fprintf(stderr, "Error: sparse offset out of range in PBWT sorted vector\n");
+        return false;
+      }
+
+      std::copy(prev_sort_mapping.begin() + i, prev_sort_mapping.begin() + sorted_index, sort_mapping.begin() + counts[0]);
+      counts[0] += sorted_index - i;
+
+      const std::size_t unsorted_index = prev_sort_mapping[sorted_index];
+      sort_mapping[counts[utype(val_ptr[j])]++] = unsorted_index;
+      if (unsorted_marks)
       {
-        fprintf(stderr, "PBWT sorted vector values cannot be wider than 16 bits\n"); // TODO: handle better
-        exit(-1);
+        unsorted_marks[unsorted_index / sparse_mark_bits] |= std::size_t(1) << (unsorted_index % sparse_mark_bits);
+        unsorted_vals[unsorted_index] = utype(val_ptr[j]);
       }
+      i = sorted_index + 1;
+    }
+
+    std::copy(prev_sort_mapping.begin() + i, prev_sort_mapping.end(), sort_mapping.begin() + counts[0]);
+    return true;
+  }
+
+  template<typename ValT, typename OffT>
+  static void fill_sparse_pairs(const std::vector<std::pair<std::size_t, ValT>>& pairs, ValT* val_ptr, OffT* off_ptr)
+  {
+    std::size_t last_off = 0;
+    for (auto it = pairs.begin(); it != pairs.end(); ++it)
+    {
+      *(off_ptr++) = OffT(it->first - last_off);
+      *(val_ptr++) = it->second;
+      last_off = it->first + 1;
+    }
+  }
+
+  template<typename ValT, typename OffT>
+  static void fill_marked_values(const std::size_t* marks, const std::size_t* vals, std::size_t n_words, ValT* val_ptr, OffT* off_ptr)
+  {
+    std::size_t last_off = 0;
+    for_each_marked(marks, n_words, [&](std::size_t idx)
+    {
+      *(off_ptr++) = OffT(idx - last_off);
+      *(val_ptr++) = ValT(typename std::make_unsigned<ValT>::type(vals[idx]));
+      last_off = idx + 1;
+    });
+  }
+
+  template<typename ValT>
+  inline bool typed_value::internal::pbwt_unsort_sparse(const typed_value& src_v, typed_value* dest_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts, std::vector<std::size_t>* scratch)
+  {
+    // Rather than collecting (index, value) pairs and sorting them, unsorted indices are marked in a bitmap that is
+    // then read back in index order. scratch holds the bitmap followed by a value slot for each index.
+    const std::size_t n_mark_words = (src_v.size_ + sparse_mark_bits - 1) / sparse_mark_bits;
+    std::size_t* marks = nullptr;
+    std::size_t* unsorted_vals = nullptr;
+    if (dest_v)
+    {
+      if (scratch->size() < n_mark_words + src_v.size_)
+        scratch->resize(n_mark_words + src_v.size_);
+      std::fill_n(scratch->begin(), n_mark_words, std::size_t(0));
+      marks = scratch->data();
+      unsorted_vals = marks + n_mark_words;
     }
+
+    const ValT* val_ptr = (const ValT*)src_v.val_ptr();
+    bool res = false;
+    switch (src_v.off_type_)
+    {
+    case 0x01u:
+      res = pbwt_unsort_sparse_offsets(val_ptr, (const std::uint8_t*)src_v.off_ptr(), src_v.sparse_size_, src_v.size_, marks, unsorted_vals, sort_mapping, prev_sort_mapping, counts);
+      break;
+    case 0x02u:
+      res = pbwt_unsort_sparse_offsets(val_ptr, (const std::uint16_t*)src_v.off_ptr(), src_v.sparse_size_, src_v.size_, marks, unsorted_vals, sort_mapping, prev_sort_mapping, counts);
+      break;
+    case 0x03u:
+      res = pbwt_unsort_sparse_offsets(val_ptr, (const std::uint32_t*)src_v.off_ptr(), src_v.sparse_size_, src_v.size_, marks, unsorted_vals, sort_mapping, prev_sort_mapping, counts);
+      break;
+    case 0x04u:
+      res = pbwt_unsort_sparse_offsets(val_ptr, (const std::uint64_t*)src_v.off_ptr(), src_v.sparse_size_, src_v.size_, marks, unsorted_vals, sort_mapping, prev_sort_mapping, counts);
+      break;
+    default:
+      fprintf(stderr, "Error: invalid sparse offset type\n");
+    }
+
+    if (!res)
+      return false;
+
+    if (dest_v)
+      assign_marked_values<ValT>(marks, unsorted_vals, src_v.size_, src_v.sparse_size_, *dest_v);
+    return true;
+  }
+
+  template<typename ValT>
+  inline void typed_value::internal::assign_sparse_pairs(const std::vector<std::pair<std::size_t, ValT>>& pairs, typed_value& dest_v)
+  {
+    std::size_t offset_max = 0;
+    std::size_t last_off = 0;
+    for (auto it = pairs.begin(); it != pairs.end(); ++it)
+    {
+      offset_max = std::max(offset_max, it->first - last_off);
+      last_off = it->first + 1;
+    }
+
+    dest_v.off_type_ = type_code_ignore_missing(static_cast<std::int64_t>(offset_max));
+    dest_v.sparse_size_ = pairs.size();
+    dest_v.off_data_.resize(pairs.size() * (1u << bcf_type_shift[dest_v.off_type_]));
+    dest_v.val_data_.resize(pairs.size() * sizeof(ValT));
+
+    ValT* dest_val_ptr = (ValT*)dest_v.val_ptr();
+    switch (dest_v.off_type_)
+    {
+    case 0x01u: fill_sparse_pairs(pairs, dest_val_ptr, (std::uint8_t*)dest_v.off_ptr()); break;
+    case 0x02u: fill_sparse_pairs(pairs, dest_val_ptr, (std::uint16_t*)dest_v.off_ptr()); break;
+    case 0x03u: fill_sparse_pairs(pairs, dest_val_ptr, (std::uint32_t*)dest_v.off_ptr()); break;
+    default: fill_sparse_pairs(pairs, dest_val_ptr, (std::uint64_t*)dest_v.off_ptr()); break;
+    }
+  }
+
+  template<typename ValT>
+  inline void typed_value::internal::assign_marked_values(const std::size_t* marks, const std::size_t* vals, std::size_t sz, std::size_t n_marked, typed_value& dest_v)
+  {
+    const std::size_t n_words = (sz + sparse_mark_bits - 1) / sparse_mark_bits;
+    std::size_t offset_max = 0;
+    std::size_t last_off = 0;
+    for_each_marked(marks, n_words, [&](std::size_t idx)
+    {
+      offset_max = std::max(offset_max, idx - last_off);
+      last_off = idx + 1;
+    });
+
+    dest_v.off_type_ = type_code_ignore_missing(static_cast<std::int64_t>(offset_max));
+    dest_v.sparse_size_ = n_marked;
+    dest_v.off_data_.resize(n_marked * (1u << bcf_type_shift[dest_v.off_type_]));
+    dest_v.val_data_.resize(n_marked * sizeof(ValT));
+
+    ValT* dest_val_ptr = (ValT*)dest_v.val_ptr();
+    switch (dest_v.off_type_)
+    {
+    case 0x01u: fill_marked_values(marks, vals, n_words, dest_val_ptr, (std::uint8_t*)dest_v.off_ptr()); break;
+    case 0x02u: fill_marked_values(marks, vals, n_words, dest_val_ptr, (std::uint16_t*)dest_v.off_ptr()); break;
+    case 0x03u: fill_marked_values(marks, vals, n_words, dest_val_ptr, (std::uint32_t*)dest_v.off_ptr()); break;
+    default: fill_marked_values(marks, vals, n_words, dest_val_ptr, (std::uint64_t*)dest_v.off_ptr()); break;
+    }
+  }
+
+  template<typename ValT, typename OffT>
+  static bool pbwt_collect_unsorted_pairs(const ValT* val_ptr, const OffT* off_ptr, std::size_t sparse_sz, const std::vector<std::size_t>& sort_map, std::vector<std::pair<std::size_t, ValT>>& pairs)
+  {
+    std::size_t sorted_index = 0;
+    for (std::size_t j = 0; j < sparse_sz; ++j)
+    {
+      sorted_index += off_ptr[j];
+      if (sorted_index >= sort_map.size())
+        return false;
+      pairs.emplace_back(sort_map[sorted_index], val_ptr[j]);
+      ++sorted_index;
+    }
+    return true;
+  }
+
+  template<typename ValT>
+  inline bool typed_value::internal::pbwt_unsort_with_map(const typed_value& src_v, typed_value& dest_v, const std::vector<std::size_t>& sort_map)
+  {
+    dest_v.discard_borrowed();
+    dest_v.size_ = src_v.size_;
+    dest_v.val_type_ = src_v.val_type_;
+    dest_v.pbwt_flag_ = false;
+
+    if (src_v.off_type_)
+    {
+      std::vector<std::pair<std::size_t, ValT>> pairs;
+      pairs.reserve(src_v.sparse_size_);
+      const ValT* val_ptr = (const ValT*)src_v.val_ptr();
+      bool res = false;
+      switch (src_v.off_type_)
+      {
+      case 0x01u: res = pbwt_collect_unsorted_pairs(val_ptr, (const std::uint8_t*)src_v.off_ptr(), src_v.sparse_size_, sort_map, pairs); break;
+      case 0x02u: res = pbwt_collect_unsorted_pairs(val_ptr, (const std::uint16_t*)src_v.off_ptr(), src_v.sparse_size_, sort_map, pairs); break;
+      case 0x03u: res = pbwt_collect_unsorted_pairs(val_ptr, (const std::uint32_t*)src_v.off_ptr(), src_v.sparse_size_, sort_map, pairs); break;
+      case 0x04u: res = pbwt_collect_unsorted_pairs(val_ptr, (const std::uint64_t*)src_v.off_ptr(), src_v.sparse_size_, sort_map, pairs); break;
+      }
+
+      if (!res)
+        return false;
+
+      std::sort(pairs.begin(), pairs.end());
+      assign_sparse_pairs(pairs, dest_v);
+    }
+    else
+    {
+      dest_v.off_type_ = 0;
+      dest_v.sparse_size_ = 0;
+      dest_v.off_data_.clear();
+      dest_v.val_data_.resize(src_v.size_ * sizeof(ValT));
+
+      const ValT* src_ptr = (const ValT*)src_v.val_ptr();
+      ValT* dest_ptr = (ValT*)dest_v.val_ptr();
+      for (std::size_t i = 0; i < src_v.size_; ++i)
+        dest_ptr[sort_map[i]] = src_ptr[i];
+    }
+
+    return true;
+  }
+
+  inline
+  std::int64_t typed_value::internal::skip(std::istream& is, std::size_t size_divisor)
+  {
+    std::uint8_t type_byte = is.get();
+    std::uint8_t type = 0x07u & type_byte;
+
+    std::int64_t bytes_read = 1;
+    std::size_t sz = type_byte >> 4u;
+    if (sz == 15u)
+      bytes_read += internal::deserialize_int(is, sz);
+
+    sz *= size_divisor; // for BCF FORMAT fields.
+
+    if (!is.good())
+      return -1;
+
+    std::size_t bytes_to_skip = 0;
+    if (sz && type == typed_value::sparse)
+    {
+      std::uint8_t sp_type_byte = is.get();
+      ++bytes_read;
+      std::size_t sparse_sz = 0;
+      bytes_read += internal::deserialize_int(is, sparse_sz);
+      bytes_to_skip = sparse_sz * ((1u << bcf_type_shift[sp_type_byte >> 4u]) + (1u << bcf_type_shift[sp_type_byte & 0x0Fu]));
+    }
+    else
+    {
+      bytes_to_skip = sz * (1u << bcf_type_shift[type]);
+    }
+
+    if (!is.good())
+      return -1;
+
+    is.ignore(bytes_to_skip);
+    bytes_read += bytes_to_skip;
+
+    return is.good() ? bytes_read : -1;
   }
 
   inline
   std::int64_t typed_value::internal::deserialize(typed_value& v, std::istream& is, std::size_t size_divisor)
+  {
+    return deserialize(v, is, size_divisor, (null_lender*)nullptr);
+  }
+
+  template <typename Lender>
+  std::int64_t typed_value::internal::deserialize(typed_value& v, std::istream& is, std::size_t size_divisor, Lender* lender)
   {
     v.clear();
     std::uint8_t type_byte = is.get();
@@ -2236,56 +2751,63 @@ namespace savvy
 
     if (v.size_ && type == typed_value::sparse)
     {
-
       std::uint8_t sp_type_byte = is.get();
       ++bytes_read;
       v.off_type_ = sp_type_byte >> 4u;
       v.val_type_ = sp_type_byte & 0x0Fu;
       v.sparse_size_ = 0;
       bytes_read += internal::deserialize_int(is, v.sparse_size_);
-      //                if (indiv_it == v.indiv_buf_.end())
-      //                  break;
-      std::size_t off_width = 1u << bcf_type_shift[v.off_type_];
-      std::size_t val_width = 1u << bcf_type_shift[v.val_type_];
-      //std::size_t pair_width = off_width + val_width;
-
-      //fmt_it->first = fmt_key;
-      //fmt_it->second.init(val_type, sz, off_type, sp_sz, v.indiv_buf_.data() + (indiv_it - v.indiv_buf_.begin()));
-      v.off_data_.resize(v.sparse_size_ * off_width);
-      is.read(v.off_data_.data(), v.off_data_.size());
-      bytes_read += v.off_data_.size();
-
-      v.val_data_.resize(v.sparse_size_ * val_width);
-      is.read(v.val_data_.data(), v.val_data_.size());
-      bytes_read += v.val_data_.size();
-
-      if (!is.good())
-        return -1;
-
-      if (endianness::is_big() && v.sparse_size_)
-      {
-        v.apply(endian_swapper_fn());
-      }
     }
     else
     {
       v.off_type_ = 0;
       v.val_type_ = type;
       v.sparse_size_ = 0;
+    }
+
+    if (!is.good())
+      return -1;
 
-      std::size_t type_width = 1u << bcf_type_shift[v.val_type_];
+    std::size_t off_bytes = v.off_bytes();
+    std::size_t val_bytes = v.val_bytes();
 
-      v.val_data_.resize(v.size_ * type_width);
-      is.read(v.val_data_.data(), v.val_data_.size());
-      bytes_read += v.val_data_.size();
+    const char* borrowed = nullptr;
+    if (lender && val_bytes && !endianness::is_big() && (borrowed = lender->borrow(off_bytes + val_bytes)))
+    {
+      bytes_read += off_bytes + val_bytes;
 
-      if (endianness::is_big() && v.size_)
+      // Records are packed without padding, so data is only borrowed when it is aligned for its element types.
+      const char* borrowed_val = borrowed + off_bytes;
+      if ((!off_bytes || std::uintptr_t(borrowed) % v.off_width() == 0) && std::uintptr_t(borrowed_val) % v.val_width() == 0)
       {
-        v.apply(endian_swapper_fn());
+        v.borrowed_off_ = off_bytes ? borrowed : nullptr;
+        v.borrowed_val_ = borrowed_val;
       }
+      else
+      {
+        v.off_data_.assign(borrowed, borrowed_val);
+        v.val_data_.assign(borrowed_val, borrowed_val + val_bytes);
+      }
+      return bytes_read;
     }
 
-    return is.good() ? bytes_read : -1;
+    v.off_data_.resize(off_bytes);
+    is.read(v.off_data_.data(), off_bytes);
+    bytes_read += off_bytes;
+
+    v.val_data_.resize(val_bytes);
+    is.read(v.val_data_.data(), val_bytes);
+    bytes_read += val_bytes;
+
+    if (!is.good())
+      return -1;
+
+    if (endianness::is_big() && (v.off_type_ ? v.sparse_size_ : v.size_))
+    {
+      v.apply(endian_swapper_fn());
+    }
+
+    return bytes_read;
   }
 
   template <typename Iter>
@@ -2312,8 +2834,8 @@ namespace savvy
       if (endianness::is_big() && off_width > 1)
       {
         // TODO: this is a slow approach, but big-endian systems should be rare.
-        const char* ip_end = v.off_data_.data() + sz * off_width;
-        for (const char* ip = v.off_data_.data(); ip < ip_end; ip+=off_width)
+        const char* ip_end = v.off_ptr() + sz * off_width;
+        for (const char* ip = v.off_ptr(); ip < ip_end; ip+=off_width)
         {
           for (const char* jp = ip + off_width - 1; jp >= ip; --jp)
             *(out_it++) = *jp;
@@ -2321,7 +2843,7 @@ namespace savvy
       }
       else
       {
-        std::copy_n(v.off_data_.data(), sz * off_width, out_it);
+        std::copy_n(v.off_ptr(), sz * off_width, out_it);
       }
     }
 
@@ -2330,8 +2852,8 @@ namespace savvy
     if (endianness::is_big() && val_width > 1)
     {
       // TODO: this is a slow approach, but big-endian systems should be rare.
-      const char* ip_end = v.val_data_.data() + sz * val_width;
-      for (const char* ip = v.val_data_.data(); ip < ip_end; ip+=val_width)
+      const char* ip_end = v.val_ptr() + sz * val_width;
+      for (const char* ip = v.val_ptr(); ip < ip_end; ip+=val_width)
       {
         for (const char* jp = ip + val_width - 1; jp >= ip; --jp)
           *(out_it++) = *jp;
@@ -2339,7 +2861,7 @@ namespace savvy
     }
     else
     {
-      std::copy_n(v.val_data_.data(), sz * val_width, out_it);
+      std::copy_n(v.val_ptr(), sz * val_width, out_it);
     }
 
   }
@@ -2416,59 +2938,167 @@ namespace savvy
   }
 
   template <typename Iter>
-  void typed_value::internal::serialize(const typed_value& v, Iter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  bool typed_value::internal::serialize(const typed_value& v, Iter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts, std::vector<std::size_t>& scratch)
   {
-    std::uint8_t type_byte =  v.off_type_ ? typed_value::sparse : (0x08u | v.val_type_); // sparse with PBWT not currently supported.
+    if (v.off_type_)
+    {
+      if (v.val_type_ == 0x01u) return internal::pbwt_sort_sparse<std::int8_t>(v, out_it, sort_mapping, prev_sort_mapping, counts, scratch);
+      if (v.val_type_ == 0x02u) return internal::pbwt_sort_sparse<std::int16_t>(v, out_it, sort_mapping, prev_sort_mapping, counts, scratch);
+      fprintf(stderr, "Error: PBWT sorted vector values cannot be wider than 16 bits\n");
+      return false;
+    }
+
+    std::uint8_t type_byte = 0x08u | v.val_type_;
     type_byte = std::uint8_t(std::min(std::size_t(15), v.size_) << 4u) | type_byte;
     *(out_it++) = type_byte;
     if (v.size_ >= 15u)
       internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(v.size_));
 
-    if (v.off_type_ && v.size_)
+    // ---- PBWT ---- //
+    if (v.val_type_ == 0x01u) internal::pbwt_sort((std::int8_t *) v.val_ptr(), v.size_, out_it, sort_mapping, prev_sort_mapping, counts);
+    else if (v.val_type_ == 0x02u) internal::pbwt_sort((std::int16_t *) v.val_ptr(), v.size_, out_it, sort_mapping, prev_sort_mapping, counts); // TODO: make sure this works
+    else
     {
-      assert(!"This should never happen"); // TODO: Then why is this here?
-      type_byte = std::uint8_t(v.off_type_ << 4u) | v.val_type_;
-      *(out_it++) = type_byte;
-      internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(v.sparse_size_));
-      //std::size_t pair_width = (1u << bcf_type_shift[v.off_type_]) + (1u << bcf_type_shift[v.val_type_]);
-      std::size_t off_width = (1u << bcf_type_shift[v.off_type_]);
-      std::size_t val_width = (1u << bcf_type_shift[v.val_type_]);
+      fprintf(stderr, "Error: PBWT sorted vector values cannot be wider than 16 bits\n");
+      return false;
+    }
+    // ---- PBWT_END ---- //
+    return true;
+  }
 
-      if (endianness::is_big() && off_width > 1)
-      {
-        // TODO: this is a slow approach, but big-endian systems should be rare.
-        const char* ip_end = v.off_data_.data() + v.sparse_size_ * off_width;
-        for (const char* ip = v.off_data_.data(); ip < ip_end; ip+=off_width)
-        {
-          for (const char* jp = ip + off_width - 1; jp >= ip; --jp)
-            *(out_it++) = *jp;
-        }
+  template<typename ValT, typename OffT>
+  inline std::size_t typed_value::internal::pbwt_sort_sparse_offsets(const ValT* val_ptr, const OffT* off_ptr, std::size_t sparse_sz, const std::size_t* inverse_mapping, std::size_t* entries)
+  {
+    typedef typename std::make_unsigned<ValT>::type utype;
+    std::size_t n_entries = 0;
+    std::size_t total_offset = 0;
+    for (std::size_t i = 0; i < sparse_sz; ++i)
+    {
+      total_offset += off_ptr[i];
+      if (val_ptr[i])
+        entries[n_entries++] = (inverse_mapping[total_offset] << 16u) | utype(val_ptr[i]);
+      ++total_offset;
+    }
+    return n_entries;
+  }
 
-        ip_end = v.val_data_.data() + v.sparse_size_ * val_width;
-        for (const char* ip = v.val_data_.data(); ip < ip_end; ip+=val_width)
-        {
-          for (const char* jp = ip + val_width - 1; jp >= ip; --jp)
-            *(out_it++) = *jp;
-        }
-      }
-      else
+  template<typename ValT, typename OutIter>
+  inline bool typed_value::internal::pbwt_sort_sparse(const typed_value& v, OutIter& out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts, std::vector<std::size_t>& scratch)
+  {
+    const std::size_t sz = v.size_;
+
+    std::swap(sort_mapping, prev_sort_mapping);
+    if (prev_sort_mapping.empty())
+    {
+      prev_sort_mapping.resize(sz);
+      for (std::size_t i = 0; i < sz; ++i)
+        prev_sort_mapping[i] = i;
+    }
+
+    sort_mapping.resize(sz);
+
+    if (prev_sort_mapping.size() != sz)
+    {
+      fprintf(stderr, "Error: variable-sized data vectors not allowed with PBWT\n");
+      return false;
+    }
+
+    // Rather than densifying the vector, non-zero values are scattered to their sorted positions through the inverse of
+    // the previous sort mapping. scratch holds the inverse mapping followed by one entry per non-zero value.
+    scratch.resize(sz + v.sparse_size_);
+    std::size_t* inverse_mapping = scratch.data();
+    for (std::size_t i = 0; i < sz; ++i)
+      inverse_mapping[prev_sort_mapping[i]] = i;
+
+    std::size_t* entries = scratch.data() + sz;
+    std::size_t n_entries = 0;
+    const ValT* val_ptr = (const ValT*)v.val_ptr();
+    switch (v.off_type_)
+    {
+    case 0x01u:
+      n_entries = pbwt_sort_sparse_offsets(val_ptr, (const std::uint8_t*)v.off_ptr(), v.sparse_size_, inverse_mapping, entries);
+      break;
+    case 0x02u:
+      n_entries = pbwt_sort_sparse_offsets(val_ptr, (const std::uint16_t*)v.off_ptr(), v.sparse_size_, inverse_mapping, entries);
+      break;
+    case 0x03u:
+      n_entries = pbwt_sort_sparse_offsets(val_ptr, (const std::uint32_t*)v.off_ptr(), v.sparse_size_, inverse_mapping, entries);
+      break;
+    case 0x04u:
+      n_entries = pbwt_sort_sparse_offsets(val_ptr, (const std::uint64_t*)v.off_ptr(), v.sparse_size_, inverse_mapping, entries);
+      break;
+    default:
+      fprintf(stderr, "Error: invalid sparse offset type\n");
+      return false;
+    }
+    std::sort(entries, entries + n_entries);
+
+    typedef typename std::make_unsigned<ValT>::type utype;
+    const std::size_t val_mask = std::numeric_limits<utype>::max();
+    counts.clear();
+    counts.resize(std::numeric_limits<utype>::max() + 2);
+    counts[1] = sz - n_entries;
+    for (std::size_t j = 0; j < n_entries; ++j)
+      ++counts[(entries[j] & val_mask) + 1];
+
+    for (std::size_t i = 1; i < counts.size(); ++i)
+      counts[i] = counts[i - 1] + counts[i];
+
+    // Indices of zeros keep their previous order at the front of the next sort mapping, so runs between non-zero values
+    // are copied. Since similar haplotypes are adjacent after sorting, the offsets between non-zero values tend to be
+    // smaller than in the unsorted vector.
+    std::size_t* zeros_it = sort_mapping.data();
+    std::size_t offset_max = 0;
+    std::size_t last_pos = 0;
+    for (std::size_t j = 0; j < n_entries; ++j)
+    {
+      const std::size_t pos = entries[j] >> 16u;
+      zeros_it = std::copy(prev_sort_mapping.data() + last_pos, prev_sort_mapping.data() + pos, zeros_it);
+      sort_mapping[counts[entries[j] & val_mask]++] = prev_sort_mapping[pos];
+      offset_max = std::max(offset_max, pos - last_pos);
+      last_pos = pos + 1;
+    }
+    std::copy(prev_sort_mapping.data() + last_pos, prev_sort_mapping.data() + sz, zeros_it);
+
+    const std::uint8_t off_type = type_code_ignore_missing(static_cast<std::int64_t>(offset_max));
+    const std::size_t off_width = 1u << bcf_type_shift[off_type];
+    const std::size_t sparse_bytes = 2u + (1u << bcf_type_shift[type_code(static_cast<std::int64_t>(n_entries))]) + n_entries * (off_width + sizeof(ValT));
+    const bool write_sparse = sparse_bytes < sz * sizeof(ValT);
+
+    std::uint8_t type_byte = 0x08u | (write_sparse ? typed_value::sparse : v.val_type_);
+    type_byte = std::uint8_t(std::min(std::size_t(15), sz) << 4u) | type_byte;
+    *(out_it++) = type_byte;
+    if (sz >= 15u)
+      internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(sz));
+
+    if (write_sparse)
+    {
+      *(out_it++) = std::uint8_t(off_type << 4u) | v.val_type_;
+      internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(n_entries));
+      last_pos = 0;
+      for (std::size_t j = 0; j < n_entries; ++j)
       {
-        std::copy_n(v.off_data_.data(), v.sparse_size_ * off_width, out_it);
-        std::copy_n(v.val_data_.data(), v.sparse_size_ * val_width, out_it);
+        const std::size_t pos = entries[j] >> 16u;
+        serialize_le(out_it, pos - last_pos, off_width);
+        last_pos = pos + 1;
       }
+      for (std::size_t j = 0; j < n_entries; ++j)
+        serialize_le(out_it, entries[j] & val_mask, sizeof(ValT));
     }
     else
     {
-      // ---- PBWT ---- //
-      if (v.val_type_ == 0x01u) internal::pbwt_sort((std::int8_t *) v.val_data_.data(), v.size_, out_it, sort_mapping, prev_sort_mapping, counts);
-      else if (v.val_type_ == 0x02u) internal::pbwt_sort((std::int16_t *) v.val_data_.data(), v.size_, out_it, sort_mapping, prev_sort_mapping, counts); // TODO: make sure this works
-      else
+      std::size_t i = 0;
+      for (std::size_t j = 0; j < n_entries; ++j)
       {
-        fprintf(stderr, "PBWT sorted vector values cannot be wider than 16 bits\n"); // TODO: handle better
-        exit(-1);
+        for (const std::size_t pos = entries[j] >> 16u; i < pos; ++i)
+          serialize_le(out_it, 0, sizeof(ValT));
+        serialize_le(out_it, entries[j] & val_mask, sizeof(ValT));
+        ++i;
       }
-      // ---- PBWT_END ---- //
+      for (; i < sz; ++i)
+        serialize_le(out_it, 0, sizeof(ValT));
     }
+    return true;
   }
 
   template<typename T>
@@ -2480,7 +3110,7 @@ namespace savvy
     std::size_t width = 1u << bcf_type_shift[val_type_];
     // TODO: handle endianess
     val_data_.resize(width);
-    std::memcpy(val_data_.data(), &v, width);
+    std::memcpy(val_ptr(), &v, width);
   }
 
   template<typename T>
@@ -2517,19 +3147,19 @@ namespace savvy
     switch (val_type_)
     {
     case 0x01u:
-      std::transform(vec.begin(), vec.begin() + size_, (std::int8_t*) val_data_.data(), reserved_transformation<std::int8_t, typename T::value_type>);
+      std::transform(vec.begin(), vec.begin() + size_, (std::int8_t*) val_ptr(), reserved_transformation<std::int8_t, typename T::value_type>);
       break;
     case 0x02u:
-      std::transform(vec.begin(), vec.begin() + size_, (std::int16_t*) val_data_.data(), reserved_transformation<std::int16_t, typename T::value_type>); // TODO: handle endianess
+      std::transform(vec.begin(), vec.begin() + size_, (std::int16_t*) val_ptr(), reserved_transformation<std::int16_t, typename T::value_type>); // TODO: handle endianess
       break;
     case 0x03u:
-      std::transform(vec.begin(), vec.begin() + size_, (std::int32_t*) val_data_.data(), reserved_transformation<std::int32_t, typename T::value_type>);
+      std::transform(vec.begin(), vec.begin() + size_, (std::int32_t*) val_ptr(), reserved_transformation<std::int32_t, typename T::value_type>);
       break;
     case 0x04u:
-      std::transform(vec.begin(), vec.begin() + size_, (std::int64_t*) val_data_.data(), reserved_transformation<std::int64_t, typename T::value_type>);
+      std::transform(vec.begin(), vec.begin() + size_, (std::int64_t*) val_ptr(), reserved_transformation<std::int64_t, typename T::value_type>);
       break;
     case 0x05u:
-      std::transform(vec.begin(), vec.begin() + size_, (float*) val_data_.data(), reserved_transformation<float, typename T::value_type>);
+      std::transform(vec.begin(), vec.begin() + size_, (float*) val_ptr(), reserved_transformation<float, typename T::value_type>);
       break;
     }
   }
@@ -2601,35 +3231,35 @@ namespace savvy
     switch (off_type_)
     {
     case 0x01u:
-      copy_offsets(vec.index_data(), sparse_size_, (std::uint8_t*)off_data_.data());
+      copy_offsets(vec.index_data(), sparse_size_, (std::uint8_t*)off_ptr());
       break;
     case 0x02u:
-      copy_offsets(vec.index_data(), sparse_size_, (std::uint16_t*)off_data_.data()); // TODO: handle endianess
+      copy_offsets(vec.index_data(), sparse_size_, (std::uint16_t*)off_ptr()); // TODO: handle endianess
       break;
     case 0x03u:
-      copy_offsets(vec.index_data(), sparse_size_, (std::uint32_t*)off_data_.data());
+      copy_offsets(vec.index_data(), sparse_size_, (std::uint32_t*)off_ptr());
       break;
     case 0x04u:
-      copy_offsets(vec.index_data(), sparse_size_, (std::uint64_t*)off_data_.data());
+      copy_offsets(vec.index_data(), sparse_size_, (std::uint64_t*)off_ptr());
       break;
     }
 
     switch (val_type_)
     {
     case 0x01u:
-      std::transform(vec.begin(), vec.end(), (std::int8_t*) val_data_.data(), reserved_transformation<std::int8_t, typename T::value_type>);
+      std::transform(vec.begin(), vec.end(), (std::int8_t*) val_ptr(), reserved_transformation<std::int8_t, typename T::value_type>);
       break;
     case 0x02u:
-      std::transform(vec.begin(), vec.end(), (std::int16_t*) val_data_.data(), reserved_transformation<std::int16_t, typename T::value_type>); // TODO: handle endianess
+      std::transform(vec.begin(), vec.end(), (std::int16_t*) val_ptr(), reserved_transformation<std::int16_t, typename T::value_type>); // TODO: handle endianess
       break;
     case 0x03u:
-      std::transform(vec.begin(), vec.end(), (std::int32_t*) val_data_.data(), reserved_transformation<std::int32_t, typename T::value_type>);
+      std::transform(vec.begin(), vec.end(), (std::int32_t*) val_ptr(), reserved_transformation<std::int32_t, typename T::value_type>);
       break;
     case 0x04u:
-      std::transform(vec.begin(), vec.end(), (std::int64_t*) val_data_.data(), reserved_transformation<std::int64_t, typename T::value_type>);
+      std::transform(vec.begin(), vec.end(), (std::int64_t*) val_ptr(), reserved_transformation<std::int64_t, typename T::value_type>);
       break;
     case 0x05u:
-      std::transform(vec.begin(), vec.end(), (float*) val_data_.data(), reserved_transformation<float, typename T::value_type>);
+      std::transform(vec.begin(), vec.end(), (float*) val_ptr(), reserved_transformation<float, typename T::value_type>);
       break;
     }
   }
@@ -2668,7 +3298,7 @@ namespace savvy
     }
     else
     {
-      u.s = v.val_data_.data();
+      u.s = v.val_ptr();
 
       switch (v.val_type_)
       {
@@ -2743,7 +3373,7 @@ namespace savvy
         }
         break;
       case 0x07u:
-        os.write(v.val_data_.data(), v.size_);
+        os.write(v.val_ptr(), v.size_);
         break;
       default:
         os.setstate(os.rdstate() | std::ios::failbit);
@@ -2844,7 +3474,7 @@ namespace savvy
 //    {
 //    case 0x01u:
 //    {
-//      auto v = ((std::int8_t*)val_data_.data())[idx];
+//      auto v = ((std::int8_t*)val_ptr())[idx];
 //      if (is_end_of_vector(v))
 //        break;
 //      if (delim)
@@ -2855,7 +3485,7 @@ namespace savvy
 //    }
 //    case 0x02u:
 //    {
-//      auto v = ((std::int16_t*)val_data_.data())[idx];
+//      auto v = ((std::int16_t*)val_ptr())[idx];
 //      if (is_end_of_vector(v))
 //        break;
 //      if (delim)
@@ -2866,7 +3496,7 @@ namespace savvy
 //    }
 //    case 0x03u:
 //    {
-//      auto v = ((std::int32_t*)val_data_.data())[idx];
+//      auto v = ((std::int32_t*)val_ptr())[idx];
 //      if (is_end_of_vector(v))
 //        break;
 //      if (delim)
@@ -2877,7 +3507,7 @@ namespace savvy
 //    }
 //    case 0x04u:
 //    {
-//      auto v = ((std::int64_t*)val_data_.data())[idx];
+//      auto v = ((std::int64_t*)val_ptr())[idx];
 //      if (is_end_of_vector(v))
 //        break;
 //      if (delim)
@@ -2888,7 +3518,7 @@ namespace savvy
 //    }
 //    case 0x05u:
 //    {
-//      auto v = ((float*)val_data_.data())[idx];
+//      auto v = ((float*)val_ptr())[idx];
 //      if (is_end_of_vector(v))
 //        break;
 //      if (delim)
@@ -2899,8 +3529,8 @@ namespace savvy
 //    }
 //    case 0x07u:
 //    {
-//      if (val_data_.data()[idx] > '\r')
-//        os.put(val_data_.data()[idx]);
+//      if (val_ptr()[idx] > '\r')
+//        os.put(val_ptr()[idx]);
 //      break;
 //    }
 //    default:
@@ -2917,7 +3547,7 @@ namespace savvy
     {
     case 0x01u:
     {
-      auto v = ((std::int8_t*)val_data_.data())[idx];
+      auto v = ((std::int8_t*)val_ptr())[idx];
       if (is_end_of_vector(v))
         break;
       if (delim)
@@ -2929,7 +3559,7 @@ namespace savvy
     }
     case 0x02u:
     {
-      auto v = ((std::int16_t*)val_data_.data())[idx];
+      auto v = ((std::int16_t*)val_ptr())[idx];
       if (is_end_of_vector(v))
         break;
       if (delim)
@@ -2941,7 +3571,7 @@ namespace savvy
     }
     case 0x03u:
     {
-      auto v = ((std::int32_t*)val_data_.data())[idx];
+      auto v = ((std::int32_t*)val_ptr())[idx];
       if (is_end_of_vector(v))
         break;
       if (delim)
@@ -2953,7 +3583,7 @@ namespace savvy
     }
     case 0x04u:
     {
-      auto v = ((std::int64_t*)val_data_.data())[idx];
+      auto v = ((std::int64_t*)val_ptr())[idx];
       if (is_end_of_vector(v))
         break;
       if (delim)
@@ -2965,7 +3595,7 @@ namespace savvy
     }
     case 0x05u:
     {
-      auto v = ((float*)val_data_.data())[idx];
+      auto v = ((float*)val_ptr())[idx];
       if (is_end_of_vector(v))
         break;
       if (delim)
@@ -2977,8 +3607,8 @@ namespace savvy
     }
     case 0x07u:
     {
-      if (val_data_.data()[idx] > '\r')
-        *(out++) = (val_data_.data()[idx]);
+      if (val_ptr()[idx] > '\r')
+        *(out++) = (val_ptr()[idx]);
       break;
     }
     //default: TODO:
@@ -2992,72 +3622,78 @@ namespace savvy
     assert(!off_type_ && idx < size_);
 
     std::size_t end = idx + length;
+    own();
 
     switch (val_type_)
     {
     case 0x01u:
     {
+      auto p = (std::int8_t*)val_data_.data();
       for ( ; idx < end && *str != '\0'; ++idx,++str)
       {
-        if (*str == '.') ((std::int8_t*)val_data_.data())[idx] = std::int8_t(0x80), ++str;
-        else ((std::int8_t*)val_data_.data())[idx] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx] = std::int8_t(0x80), ++str;
+        else p[idx] = std::strtol(str, &str, 10);
         if (*str == '\0') --str;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int8_t*)val_data_.data())[idx] = std::int8_t(0x81);
+        p[idx] = std::int8_t(0x81);
       break;
     }
     case 0x02u:
     {
+      auto p = (std::int16_t*)val_data_.data();
       for ( ; idx < end && *str != '\0'; ++idx,++str)
       {
-        if (*str == '.') ((std::int16_t*)val_data_.data())[idx] = std::int16_t(0x8000), ++str;
-        else ((std::int16_t*)val_data_.data())[idx] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx] = std::int16_t(0x8000), ++str;
+        else p[idx] = std::strtol(str, &str, 10);
         if (*str == '\0') --str;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int16_t*)val_data_.data())[idx] = std::int16_t(0x8001);
+        p[idx] = std::int16_t(0x8001);
       break;
     }
     case 0x03u:
     {
+      auto p = (std::int32_t*)val_data_.data();
       for ( ; idx < end && *str != '\0'; ++idx,++str)
       {
-        if (*str == '.') ((std::int32_t*)val_data_.data())[idx] = std::int32_t(0x80000000), ++str;
-        else ((std::int32_t*)val_data_.data())[idx] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx] = std::int32_t(0x80000000), ++str;
+        else p[idx] = std::strtol(str, &str, 10);
         if (*str == '\0') --str;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int32_t*)val_data_.data())[idx] = std::int32_t(0x80000001);
+        p[idx] = std::int32_t(0x80000001);
       break;
     }
     case 0x04u:
     {
+      auto p = (std::int64_t*)val_data_.data();
       for ( ; idx < end && *str != '\0'; ++idx,++str)
       {
-        if (*str == '.') ((std::int64_t*)val_data_.data())[idx] = std::int64_t(0x8000000000000000), ++str;
-        else ((std::int64_t*)val_data_.data())[idx] = std::strtoll(str, &str, 10);
+        if (*str == '.') p[idx] = std::int64_t(0x8000000000000000), ++str;
+        else p[idx] = std::strtoll(str, &str, 10);
         if (*str == '\0') --str;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int64_t*)val_data_.data())[idx] = std::int64_t(0x8000000000000001);
+        p[idx] = std::int64_t(0x8000000000000001);
       break;
     }
     case 0x05u:
     {
+      auto p = (float*)val_data_.data();
       for ( ; idx < end && *str != '\0'; ++idx,++str)
       {
         if (*str == '.') ((std::int64_t*)val_data_.data())[idx] = missing_value<float>(), ++str;
-        else ((float*)val_data_.data())[idx] = std::strtof(str, &str);
+        else p[idx] = std::strtof(str, &str);
         if (*str == '\0') --str;
       }
 
       for ( ; idx < end; ++idx)
-        ((float*)val_data_.data())[idx] = end_of_vector_value<float>();
+        p[idx] = end_of_vector_value<float>();
       break;
     }
     default:
@@ -3072,83 +3708,90 @@ namespace savvy
     assert(!off_type_ && idx < size_);
 
     std::size_t end = idx + length;
+    own();
 
     switch (val_type_)
     {
     case 0x01u:
     {
+      auto p = (std::int8_t*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((std::int8_t*)val_data_.data())[idx++] = std::int8_t(0x80), ++str;
-        else ((std::int8_t*)val_data_.data())[idx++] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx++] = std::int8_t(0x80), ++str;
+        else p[idx++] = std::strtol(str, &str, 10);
         if (*str != ',') break;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int8_t*)val_data_.data())[idx] = std::int8_t(0x81);
+        p[idx] = std::int8_t(0x81);
       break;
     }
     case 0x02u:
     {
+      auto p = (std::int16_t*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((std::int16_t*)val_data_.data())[idx++] = std::int16_t(0x8000), ++str;
-        else ((std::int16_t*)val_data_.data())[idx++] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx++] = std::int16_t(0x8000), ++str;
+        else p[idx++] = std::strtol(str, &str, 10);
         if (*str != ',') break;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int16_t*)val_data_.data())[idx] = std::int16_t(0x8001);
+        p[idx] = std::int16_t(0x8001);
       break;
     }
     case 0x03u:
     {
+      auto p = (std::int32_t*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((std::int32_t*)val_data_.data())[idx++] = std::int32_t(0x80000000), ++str;
-        else ((std::int32_t*)val_data_.data())[idx++] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx++] = std::int32_t(0x80000000), ++str;
+        else p[idx++] = std::strtol(str, &str, 10);
         if (*str != ',') break;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int32_t*)val_data_.data())[idx] = std::int32_t(0x80000001);
+        p[idx] = std::int32_t(0x80000001);
       break;
     }
     case 0x04u:
     {
+      auto p = (std::int64_t*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((std::int64_t*)val_data_.data())[idx++] = std::int64_t(0x8000000000000000), ++str;
-        else ((std::int64_t*)val_data_.data())[idx++] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx++] = std::int64_t(0x8000000000000000), ++str;
+        else p[idx++] = std::strtol(str, &str, 10);
         if (*str != ',') break;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int64_t*)val_data_.data())[idx] = std::int64_t(0x8000000000000001);
+        p[idx] = std::int64_t(0x8000000000000001);
       break;
     }
     case 0x05u:
     {
+      auto p = (float*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((float*)val_data_.data())[idx++] = missing_value<float>(), ++str;
-        else ((float*)val_data_.data())[idx++] = std::strtof(str, &str);
+        if (*str == '.') p[idx++] = missing_value<float>(), ++str;
+        else p[idx++] = std::strtof(str, &str);
         if (*str != ',') break;
       }
 
       for ( ; idx < end; ++idx)
-        ((float*)val_data_.data())[idx] = end_of_vector_value<float>();
+        p[idx] = end_of_vector_value<float>();
       break;
     }
     case 0x07u:
     {
+      auto p = (char*)val_data_.data();
       for ( ; *str > '\r' && *str != ':'; ++str)
       {
-        ((char*)val_data_.data())[idx++] = *str;
+        p[idx++] = *str;
       }
 
       for ( ; idx < end; ++idx)
-        ((char*)val_data_.data())[idx] = '\0';
+        p[idx] = '\0';
       break;
     }
     default:
@@ -3163,118 +3806,130 @@ namespace savvy
     assert(!off_type_ && idx < size_);
 
     std::size_t end = idx + length;
+    own();
     assert(length);
     std::size_t ph_idx = idx / length * (length - 1);
+    char* ph_p = nullptr;
+    if (ph_value)
+    {
+      ph_value->own();
+      ph_p = ph_value->val_data_.data();
+    }
 
     switch (val_type_)
     {
     case 0x01u:
     {
+      auto p = (std::int8_t*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((std::int8_t*)val_data_.data())[idx++] = std::int8_t(0x80), ++str;
-        else ((std::int8_t*)val_data_.data())[idx++] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx++] = std::int8_t(0x80), ++str;
+        else p[idx++] = std::strtol(str, &str, 10);
         if (*str == '/')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 0;
+          if (ph_p) ph_p[ph_idx++] = 0;
         }
         else if(*str == '|')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 1;
+          if (ph_p) ph_p[ph_idx++] = 1;
         }
         else
           break;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int8_t*)val_data_.data())[idx] = std::int8_t(0x81);
+        p[idx] = std::int8_t(0x81);
       break;
     }
     case 0x02u:
     {
+      auto p = (std::int16_t*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((std::int16_t*)val_data_.data())[idx++] = std::int16_t(0x8000), ++str;
-        else ((std::int16_t*)val_data_.data())[idx++] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx++] = std::int16_t(0x8000), ++str;
+        else p[idx++] = std::strtol(str, &str, 10);
         if (*str == '/')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 0;
+          if (ph_p) ph_p[ph_idx++] = 0;
         }
         else if(*str == '|')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 1;
+          if (ph_p) ph_p[ph_idx++] = 1;
         }
         else
           break;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int16_t*)val_data_.data())[idx] = std::int16_t(0x8001);
+        p[idx] = std::int16_t(0x8001);
     }
     case 0x03u:
     {
+      auto p = (std::int32_t*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((std::int32_t*)val_data_.data())[idx++] = std::int32_t(0x80000000), ++str;
-        else ((std::int32_t*)val_data_.data())[idx++] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx++] = std::int32_t(0x80000000), ++str;
+        else p[idx++] = std::strtol(str, &str, 10);
         if (*str == '/')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 0;
+          if (ph_p) ph_p[ph_idx++] = 0;
         }
         else if(*str == '|')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 1;
+          if (ph_p) ph_p[ph_idx++] = 1;
         }
         else
           break;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int32_t*)val_data_.data())[idx] = std::int32_t(0x80000001);
+        p[idx] = std::int32_t(0x80000001);
       break;
     }
     case 0x04u:
     {
+      auto p = (std::int64_t*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((std::int64_t*)val_data_.data())[idx++] = std::int64_t(0x8000000000000000), ++str;
-        else ((std::int64_t*)val_data_.data())[idx++] = std::strtol(str, &str, 10);
+        if (*str == '.') p[idx++] = std::int64_t(0x8000000000000000), ++str;
+        else p[idx++] = std::strtol(str, &str, 10);
         if (*str == '/')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 0;
+          if (ph_p) ph_p[ph_idx++] = 0;
         }
         else if(*str == '|')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 1;
+          if (ph_p) ph_p[ph_idx++] = 1;
         }
         else
           break;
       }
 
       for ( ; idx < end; ++idx)
-        ((std::int64_t*)val_data_.data())[idx] = std::int64_t(0x8000000000000001);
+        p[idx] = std::int64_t(0x8000000000000001);
       break;
     }
     case 0x05u:
     {
+      auto p = (float*)val_data_.data();
       for ( ; idx < end; ++str)
       {
-        if (*str == '.') ((float*)val_data_.data())[idx++] = missing_value<float>(), ++str;
-        else ((float*)val_data_.data())[idx++] = std::strtof(str, &str);
+        if (*str == '.') p[idx++] = missing_value<float>(), ++str;
+        else p[idx++] = std::strtof(str, &str);
         if (*str == '/')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 0;
+          if (ph_p) ph_p[ph_idx++] = 0;
         }
         else if(*str == '|')
         {
-          if (ph_value) ph_value->val_data_.data()[ph_idx++] = 1;
+          if (ph_p) ph_p[ph_idx++] = 1;
         }
         else
           break;
       }
 
       for ( ; idx < end; ++idx)
-        ((float*)val_data_.data())[idx] = end_of_vector_value<float>();
+        p[idx] = end_of_vector_value<float>();
       break;
     }
     default:
@@ -0,0 +1,245 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_VARIANT_BATCH_HPP
+#define LIBSAVVY_VARIANT_BATCH_HPP
+
+#include "site_info.hpp"
+#include "compressed_vector.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace savvy
+{
+  /**
+   * Columnar (struct-of-arrays) storage for a batch of consecutive records. Site columns hold one entry per record.
+   * Values of a single FORMAT field are stored either as a dense column-major samples-by-variants block or in
+   * compressed sparse column (CSC) format. Batches are filled by reader::read_batch().
+   *
+   * @tparam T Value type of INFO columns and FORMAT data
+   */
+  template <typename T>
+  class variant_batch
+  {
+    friend class reader;
+  public:
+    typedef T value_type;
+  private:
+    std::string format_key_;
+    bool sparse_ = false;
+    std::vector<std::string> info_keys_;
+
+    std::vector<std::string> chroms_;
+    std::vector<std::uint32_t> positions_;
+    std::string ref_data_;
+    std::vector<std::size_t> ref_offsets_;
+    std::string alt_data_;
+    std::vector<std::size_t> alt_offsets_;
+    std::vector<std::vector<T>> info_columns_;
+
+    std::size_t stride_ = 0;
+    std::vector<T> values_;
+    std::vector<std::size_t> row_indices_;
+    std::vector<std::size_t> col_offsets_;
+
+    variant pending_;
+    bool has_pending_ = false;
+    std::vector<T> dense_buf_;
+    compressed_vector<T> sparse_buf_;
+  public:
+    /**
+     * Constructs batch object.
+     * @param format_key FORMAT field to collect (e.g., "GT" or "DS"). An empty key only collects site info.
+     * @param sparse If true, FORMAT data is stored in CSC format instead of a dense block
+     * @param info_keys INFO fields to collect as columns. The first value of each field is stored (missing if absent).
+     */
+    variant_batch(std::string format_key = "", bool sparse = false, std::vector<std::string> info_keys = {}) :
+      format_key_(std::move(format_key)),
+      sparse_(sparse),
+      info_keys_(std::move(info_keys)),
+      info_columns_(info_keys_.size())
+    {
+      clear();
+    }
+
+    /**
+     * Gets number of records in batch.
+     * @return Record count
+     */
+    std::size_t size() const { return positions_.size(); }
+    bool empty() const { return positions_.empty(); } ///< Checks whether batch has no records.
+
+    const std::string& format_key() const { return format_key_; } ///< Gets collected FORMAT key.
+    bool is_sparse() const { return sparse_; } ///< Checks whether FORMAT data is stored in CSC format.
+    const std::vector<std::string>& info_keys() const { return info_keys_; } ///< Gets collected INFO keys.
+
+    /**
+     * Gets chromosome column.
+     * @return Chromosome of each record
+     */
+    const std::vector<std::string>& chromosomes() const { return chroms_; }
+
+    /**
+     * Gets position column.
+     * @return 1-based position of each record
+     */
+    const std::vector<std::uint32_t>& positions() const { return positions_; }
+
+    /**
+     * Gets concatenated reference alleles. The allele of record i spans [ref_offsets()[i], ref_offsets()[i + 1]).
+     * @return Reference allele buffer
+     */
+    const std::string& ref_data() const { return ref_data_; }
+    const std::vector<std::size_t>& ref_offsets() const { return ref_offsets_; } ///< Gets offsets into ref_data() (size() + 1 entries).
+
+    /**
+     * Gets concatenated, comma-delimited alternate alleles. The alleles of record i span [alt_offsets()[i], alt_offsets()[i + 1]).
+     * @return Alternate allele buffer
+     */
+    const std::string& alt_data() const { return alt_data_; }
+    const std::vector<std::size_t>& alt_offsets() const { return alt_offsets_; } ///< Gets offsets into alt_data() (size() + 1 entries).
+
+    /**
+     * Gets reference allele of a record.
+     * @param i Record index within batch
+     * @return Reference allele string
+     */
+    std::string ref(std::size_t i) const { return ref_data_.substr(ref_offsets_[i], ref_offsets_[i + 1] - ref_offsets_[i]); }
+
+    /**
+     * Gets comma-delimited alternate alleles of a record.
+     * @param i Record index within batch
+     * @return Alternate allele string
+     */
+    std::string alts(std::size_t i) const { return alt_data_.substr(alt_offsets_[i], alt_offsets_[i + 1] - alt_offsets_[i]); }
+
+    /**
+     * Gets INFO column.
+     * @param key_idx Index into info_keys()
+     * @return One value per record
+     */
+    const std::vector<T>& info_column(std::size_t key_idx) const { return info_columns_[key_idx]; }
+
+    /**
+     * Gets number of values per record in FORMAT data (e.g., sample count times ploidy). All records in a batch have
+     * the same stride.
+     * @return FORMAT values per record
+     */
+    std::size_t stride() const { return stride_; }
+
+    /**
+     * Gets FORMAT values. In dense mode, values of record i span [i * stride(), (i + 1) * stride()). In sparse mode,
+     * non-zero values of record i span [col_offsets()[i], col_offsets()[i + 1]).
+     * @return Value buffer
+     */
+    const std::vector<T>& values() const { return values_; }
+
+    /**
+     * Gets row (i.e., offset within record) of each sparse value. Only populated in sparse mode.
+     * @return Row index buffer
+     */
+    const std::vector<std::size_t>& row_indices() const { return row_indices_; }
+
+    /**
+     * Gets column offsets into values() and row_indices(). Only populated in sparse mode (size() + 1 entries).
+     * @return Column offset buffer
+     */
+    const std::vector<std::size_t>& col_offsets() const { return col_offsets_; }
+
+    /**
+     * Removes all records while retaining allocated storage. A record deferred by reader::read_batch() is kept.
+     */
+    void clear()
+    {
+      chroms_.clear();
+      positions_.clear();
+      ref_data_.clear();
+      ref_offsets_.assign(1, 0);
+      alt_data_.clear();
+      alt_offsets_.assign(1, 0);
+      for (auto it = info_columns_.begin(); it != info_columns_.end(); ++it)
+        it->clear();
+      stride_ = 0;
+      values_.clear();
+      row_indices_.clear();
+      col_offsets_.assign(sparse_ ? 1 : 0, 0);
+    }
+
+    /**
+     * Removes all records, including a record deferred by reader::read_batch(). Should be called after reader::reset_bounds().
+     */
+    void reset()
+    {
+      has_pending_ = false;
+      clear();
+    }
+  private:
+    // Returns false without modifying batch if the record's FORMAT size does not match the stride of the batch.
+    bool append(const variant& var)
+    {
+      std::size_t sz = 0;
+      if (!format_key_.empty())
+      {
+        if (sparse_)
+        {
+          if (!var.get_format(format_key_, sparse_buf_))
+            sparse_buf_.clear();
+          sz = sparse_buf_.size();
+        }
+        else
+        {
+          if (!var.get_format(format_key_, dense_buf_))
+            dense_buf_.clear();
+          sz = dense_buf_.size();
+        }
+
+        if (positions_.empty())
+          stride_ = sz;
+        else if (sz != stride_)
+          return false;
+      }
+
+      if (sparse_)
+      {
+        const std::size_t* idx = sparse_buf_.index_data();
+        const T* val = sparse_buf_.value_data();
+        row_indices_.insert(row_indices_.end(), idx, idx + sparse_buf_.non_zero_size());
+        values_.insert(values_.end(), val, val + sparse_buf_.non_zero_size());
+        col_offsets_.push_back(values_.size());
+      }
+      else
+      {
+        values_.insert(values_.end(), dense_buf_.begin(), dense_buf_.end());
+      }
+
+      chroms_.emplace_back(var.chromosome());
+      positions_.push_back(var.position());
+      ref_data_ += var.ref();
+      ref_offsets_.push_back(ref_data_.size());
+      for (auto it = var.alts().begin(); it != var.alts().end(); ++it)
+      {
+        if (it != var.alts().begin())
+          alt_data_ += ',';
+        alt_data_ += *it;
+      }
+      alt_offsets_.push_back(alt_data_.size());
+
+      for (std::size_t i = 0; i < info_keys_.size(); ++i)
+      {
+        T v;
+        if (!var.get_info(info_keys_[i], v))
+          v = typed_value::missing_value<T>();
+        info_columns_[i].push_back(v);
+      }
+
+      return true;
+    }
+  };
+}
+
+#endif // LIBSAVVY_VARIANT_BATCH_HPP
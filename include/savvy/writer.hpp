@@ -16,6 +16,7 @@
 #include "region.hpp"
 #include "s1r.hpp"
 #include "pbwt.hpp"
+#include "block_obuf.hpp"
 
 
 #include <shrinkwrap/zstd.hpp>
@@ -63,12 +64,22 @@ namespace savvy
       static const int default_compression_level = 6;
       static const int default_block_size = 4096;
     private:
+      typedef ::savvy::detail::block_obuf<::savvy::detail::zstd_block_compressor> zstd_obuf;
+      typedef ::savvy::detail::block_obuf<::savvy::detail::bgzf_block_compressor> bgzf_obuf;
+      static const std::size_t max_chunk_size = 16 * ::savvy::detail::bgzf_block_compressor::max_block_size;
+
       std::mt19937_64 rng_;
+      std::string file_path_;
+      std::uint8_t compression_level_;
+      std::size_t compression_threads_ = 0;
+      zstd_obuf* zstd_buf_ = nullptr; // Set by create_out_streambuf(), so these must be declared before output_buf_.
+      bgzf_obuf* bgzf_buf_ = nullptr;
       std::unique_ptr<std::streambuf> output_buf_;
       std::ostream ofs_;
       std::size_t n_samples_ = 0;
       std::vector<char> serialized_buf_;
       std::unordered_set<std::string> pbwt_fields_;
+      bool sparse_pbwt_ = false;
 
       // Data members to support indexing
       std::fstream append_ofs_;
@@ -83,7 +94,7 @@ namespace savvy
     private:
       static std::filebuf *create_std_filebuf(const std::string& file_path, std::ios::openmode mode);
 
-      static std::unique_ptr<std::streambuf> create_out_streambuf(const std::string& file_path, format file_format, std::uint8_t compression_level);
+      std::unique_ptr<std::streambuf> create_out_streambuf(const std::string& file_path, format file_format, std::uint8_t compression_level);
 
     public:
       /**
@@ -108,8 +119,25 @@ namespace savvy
       /**
        * Specifies FORMAT fields for which PBWT will be applied.
        * @param pbwt_fields Set of fields
+       * @param sparse Also sort fields that are stored as sparse vectors. Readers older than the release that added sparse
+       * PBWT cannot decode these files, so sparse vectors are left unsorted by default.
+       */
+      void set_pbwt(const std::unordered_set<std::string>& pbwt_fields, bool sparse = false);
+
+      /**
+       * Compresses SAV blocks (or BGZF blocks of compressed VCF/BCF output) on a pool of worker threads. Blocks are
+       * still written in order. This must be called before the first record is written and has no effect on
+       * uncompressed output.
+       * @param n_threads Number of compression threads
        */
-      void set_pbwt(const std::unordered_set<std::string>& pbwt_fields);
+      void set_compression_threads(std::size_t n_threads);
+
+      /**
+       * Sorts the PBWT fields (see set_pbwt()) of each record concurrently. Each field is sorted by its own mapping, so
+       * this only helps when more than one field is PBWT-sorted. Output is identical to single-threaded sorting.
+       * @param n_threads Number of threads used per record, including the calling thread (values less than 2 disable)
+       */
+      void set_pbwt_threads(std::size_t n_threads);
 
       /**
        * Checks for EOF or write error.
@@ -121,25 +149,65 @@ namespace savvy
       //bool bad() const { return ofs_.bad(); }
 
       /**
-       * Writes record to file.
+       * Writes record to file. Records with FORMAT fields that are still in PBWT-sorted order (see
+       * reader::pbwt_unsort()) are rejected and put the writer into a failed state.
        * @param r Record object to write
        * @return *this
        */
       writer& write(const variant& r);
       writer& operator<<(const variant& v) { return write(v); } ///< Shorthand for write()
 
+      /**
+       * Formats record as a line of VCF text without writing it. Only the header state of the writer is used, so this
+       * may be called concurrently from multiple threads (e.g., to format records on worker threads and then write
+       * them in order with write_serialized()).
+       * @param r Record object to format
+       * @param os Stream to which the line is appended
+       * @return False if record could not be formatted (e.g., a FORMAT field is still in PBWT-sorted order)
+       */
+      bool serialize_vcf(const variant& r, std::ostream& os) const;
+
+      /**
+       * Writes lines of VCF text produced by serialize_vcf(). Only supported for VCF output.
+       * @param data Pointer to text
+       * @param sz Size of text
+       * @return *this
+       */
+      writer& write_serialized(const char* data, std::size_t sz);
+
       /**
        * For SAV files, gets file position for the beginning of current zstd block. For VCF/BCF files, gets "virtual offset".
+       * With compression threads, this waits for blocks that are still being compressed to be written.
        *
        * @return File position
        */
       std::streampos tellp() { return ofs_.tellp(); }
+
+      /**
+       * Same as tellp(), but does not wait for blocks that are still being compressed. For compressed output,
+       * on_position is called once the block containing the current position has been written (i.e., during a later
+       * write, flush or set_compression_threads(), or at the latest when the writer is destroyed).
+       *
+       * @param on_position Called with the file position
+       */
+      void tellp(std::function<void(std::int64_t)> on_position)
+      {
+        if (zstd_buf_)
+          zstd_buf_->mark_position(std::move(on_position));
+        else if (bgzf_buf_)
+          bgzf_buf_->mark_position(std::move(on_position));
+        else
+          on_position(std::int64_t(ofs_.tellp()));
+      }
     private:
       writer& write_vcf(const variant& r);
       void write_header(std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& ids);
 
-      bool serialize_vcf_shared(const site_info& s);
-      bool serialize_vcf_indiv(const variant& v, phasing phased);
+      void index_current_block();
+      void write_index_entry(const std::string& chrom, std::uint32_t min_pos, std::uint32_t max_pos, std::size_t record_count, std::uint64_t file_pos);
+      void end_full_chunk();
+      bool serialize_vcf_shared(const site_info& s, std::ostream& os) const;
+      bool serialize_vcf_indiv(const variant& v, phasing phased, std::ostream& os, std::vector<char>& buf) const;
       static std::size_t strfmt_buf_size(std::uint8_t type_code);
     };
 
@@ -159,10 +227,13 @@ namespace savvy
     {
       if (compression_level > 0)
       {
+        // Blocks are compressed on the calling thread until set_compression_threads() hands the file to a buffer with
+        // worker threads. The file is only ever written sequentially, so it can also be a pipe.
+        std::FILE* fp = std::fopen(file_path.c_str(), "wb");
         if (file_fmt == format::sav2 || file_fmt == format::sav1)
-          return std::unique_ptr<std::streambuf>(new shrinkwrap::zstd::obuf(file_path, compression_level));
+          return std::unique_ptr<std::streambuf>(zstd_buf_ = new zstd_obuf(fp, compression_level, 0, 0));
         else
-          return std::unique_ptr<std::streambuf>(new shrinkwrap::bgzf::obuf(file_path, compression_level));  //, compression_level)); TODO: Add compression level
+          return std::unique_ptr<std::streambuf>(bgzf_buf_ = new bgzf_obuf(fp, compression_level, 0, 0));
       }
       else
       {
@@ -173,6 +244,8 @@ namespace savvy
     inline
     writer::writer(const std::string& file_path, file::format file_format, std::vector<std::pair<std::string, std::string>> headers, const std::vector<std::string>& ids, std::uint8_t compression_level, std::string custom_index_path) :
       rng_(std::chrono::high_resolution_clock::now().time_since_epoch().count() ^ std::clock() ^ (std::uint64_t) this),
+      file_path_(file_path),
+      compression_level_(compression_level),
       output_buf_(create_out_streambuf(file_path, file_format, compression_level)),
       ofs_(output_buf_.get()),
       append_ofs_(file_path, std::ios::out | std::ios::binary | std::ios::app),
@@ -223,23 +296,11 @@ namespace savvy
       if (index_file_)
       {
         if (record_count_in_block_)
-        {
-          auto file_pos = std::uint64_t(ofs_.tellp());
-          if (record_count_in_block_ > 0x10000) // Max records per block: 64*1024
-          {
-            assert(!"Too many records in zstd frame to be indexed!");
-          }
-
-          if (file_pos > 0x0000FFFFFFFFFFFF) // Max file size: 256 TiB
-          {
-            assert(!"File size to large to be indexed!");
-          }
-
-          s1r::entry e(current_block_min_, current_block_max_, (file_pos << 16) | std::uint16_t(record_count_in_block_ - 1));
-          index_file_->write(current_chromosome_, e);
-        }
+          index_current_block();
 
         ofs_.flush();
+        if (zstd_buf_ && !zstd_buf_->drain())
+          ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
         auto idx_fs = index_file_->close();
 
         if (append_index_) // append if custom index path was not provided
@@ -266,25 +327,157 @@ namespace savvy
     }
 
     inline
-    void writer::set_pbwt(const std::unordered_set<std::string>& pbwt_fields)
+    void writer::set_pbwt(const std::unordered_set<std::string>& pbwt_fields, bool sparse)
     {
       if (file_format() == file::format::sav2)
+      {
         pbwt_fields_ = pbwt_fields;
+        sparse_pbwt_ = sparse;
+      }
       // TODO: potentially set failbit if not sav2.
     }
 
+    inline
+    void writer::set_pbwt_threads(std::size_t n_threads)
+    {
+      sort_context_.pool.reset(n_threads > 1 ? new ::savvy::detail::thread_pool(n_threads - 1) : nullptr);
+    }
+
+    inline
+    void writer::set_compression_threads(std::size_t n_threads)
+    {
+      if ((!zstd_buf_ && !bgzf_buf_) || n_threads == 0 || compression_threads_)
+        return;
+
+      if (record_count_)
+      {
+        ofs_.setstate(ofs_.rdstate() | std::ios::failbit);
+        std::cerr << "Warning: set_compression_threads() failed because records have already been written" << std::endl;
+        return;
+      }
+
+      // The header has already been flushed as its own block, so the file is handed to the new buffer as is. It is not
+      // reopened, which would fail for pipes, and no trailer (e.g., BGZF EOF block) is written in between.
+      ofs_.flush();
+      std::int64_t file_pos = 0;
+      std::FILE* fp = zstd_buf_ ? zstd_buf_->release(file_pos) : bgzf_buf_->release(file_pos);
+      if (!fp)
+      {
+        ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
+        std::cerr << "Error: failed to write to " << file_path_ << std::endl;
+        return;
+      }
+
+      if (zstd_buf_)
+        output_buf_.reset(zstd_buf_ = new zstd_obuf(fp, compression_level_, n_threads, file_pos));
+      else
+        output_buf_.reset(bgzf_buf_ = new bgzf_obuf(fp, compression_level_, n_threads, file_pos));
+      ofs_.rdbuf(output_buf_.get());
+      compression_threads_ = n_threads;
+    }
+
+    inline
+    void writer::index_current_block()
+    {
+      if (zstd_buf_)
+      {
+        // With compression threads, the offset of a block is not known until all preceding blocks have been written.
+        std::string chrom = current_chromosome_;
+        std::uint32_t min_pos = current_block_min_;
+        std::uint32_t max_pos = current_block_max_;
+        std::size_t record_count = record_count_in_block_;
+        if (!zstd_buf_->end_block([this, chrom, min_pos, max_pos, record_count](std::int64_t file_pos) { write_index_entry(chrom, min_pos, max_pos, record_count, std::uint64_t(file_pos)); }))
+          ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
+      }
+      else
+      {
+        write_index_entry(current_chromosome_, current_block_min_, current_block_max_, record_count_in_block_, std::uint64_t(ofs_.tellp()));
+      }
+    }
+
+    inline
+    void writer::write_index_entry(const std::string& chrom, std::uint32_t min_pos, std::uint32_t max_pos, std::size_t record_count, std::uint64_t file_pos)
+    {
+      if (record_count > 0x10000) // Max records per block: 64*1024
+      {
+        assert(!"Too many records in zstd frame to be indexed!");
+        ofs_.setstate(std::ios::badbit);
+      }
+
+      if (file_pos > 0x0000FFFFFFFFFFFF) // Max file size: 256 TiB
+      {
+        assert(!"File size too large to be indexed!");
+        ofs_.setstate(std::ios::badbit);
+      }
+
+      s1r::entry e(min_pos, max_pos, (file_pos << 16) | std::uint16_t(record_count - 1));
+      index_file_->write(chrom, e);
+    }
+
+    // Ends the current compression block once it is large enough. Only output that is not split into blocks by records
+    // (compressed VCF and BCF, or SAV with a block size of zero) needs this to bound the amount of buffered data.
+    inline
+    void writer::end_full_chunk()
+    {
+      if (bgzf_buf_ && bgzf_buf_->buffered_size() >= max_chunk_size && !bgzf_buf_->end_block())
+        ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
+      else if (zstd_buf_ && block_size_ == 0 && zstd_buf_->buffered_size() >= max_chunk_size && !zstd_buf_->end_block())
+        ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
+    }
+
     inline
     writer& writer::write_vcf(const variant& r)
     {
-      if (!serialize_vcf_shared(r) || !serialize_vcf_indiv(r, phasing_))
+      if (!serialize_vcf_shared(r, ofs_) || !serialize_vcf_indiv(r, phasing_, ofs_, serialized_buf_))
         ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
 
+      ++record_count_;
+      end_full_chunk();
+      return *this;
+    }
+
+    inline
+    bool writer::serialize_vcf(const variant& r, std::ostream& os) const
+    {
+      for (auto it = r.format_fields().begin(); it != r.format_fields().end(); ++it)
+      {
+        if (it->second.pbwt_flag())
+          return false;
+      }
+
+      static thread_local std::vector<char> buf;
+      return serialize_vcf_shared(r, os) && serialize_vcf_indiv(r, phasing_, os, buf);
+    }
+
+    inline
+    writer& writer::write_serialized(const char* data, std::size_t sz)
+    {
+      if (file_format_ != format::vcf)
+      {
+        std::cerr << "Error: write_serialized() is only supported for VCF output" << std::endl;
+        ofs_.setstate(ofs_.rdstate() | std::ios::failbit);
+        return *this;
+      }
+
+      ofs_.write(data, sz);
+      ++record_count_;
+      end_full_chunk();
       return *this;
     }
 
     inline
     writer& writer::write(const variant& r)
     {
+      for (auto it = r.format_fields().begin(); it != r.format_fields().end(); ++it)
+      {
+        if (it->second.pbwt_flag())
+        {
+          std::cerr << "Error: FMT/" << it->first << " is in PBWT-sorted order (see reader::pbwt_unsort())" << std::endl;
+          ofs_.setstate(ofs_.rdstate() | std::ios::failbit);
+          return *this;
+        }
+      }
+
       if (file_format_ == format::vcf)
         return write_vcf(r);
 
@@ -294,23 +487,7 @@ namespace savvy
       if (block_size_ != 0 && file_format_ == format::sav2 && (block_size_ <= record_count_in_block_ || r.chrom() != current_chromosome_)) // TODO: this needs to be fixed to support variable block size
       {
         if (index_file_ && record_count_in_block_)
-        {
-          auto file_pos = std::uint64_t(ofs_.tellp());
-          if (record_count_in_block_ > 0x10000) // Max records per block: 64*1024
-          {
-            assert(!"Too many records in zstd frame to be indexed!");
-            ofs_.setstate(std::ios::badbit);
-          }
-
-          if (file_pos > 0x0000FFFFFFFFFFFF) // Max file size: 256 TiB
-          {
-            assert(!"File size too large to be indexed!");
-            ofs_.setstate(std::ios::badbit);
-          }
-
-          s1r::entry e(current_block_min_, current_block_max_, (file_pos << 16) | std::uint16_t(record_count_in_block_ - 1));
-          index_file_->write(current_chromosome_, e);
-        }
+          index_current_block();
         ofs_.flush();
         current_chromosome_ = r.chrom();
         record_count_in_block_ = 0;
@@ -349,7 +526,7 @@ namespace savvy
       for (auto it = r.format_fields().begin(); it != r.format_fields().end(); ++it)
       {
         pbwt_format_pointers.emplace_back(nullptr);
-        if (!it->second.is_sparse() && it->second.val_width() <= 2 && pbwt_fields_.find(it->first) != pbwt_fields_.end())
+        if ((sparse_pbwt_ || !it->second.is_sparse()) && it->second.val_width() <= 2 && pbwt_fields_.find(it->first) != pbwt_fields_.end())
         {
           pbwt_format_pointers.back() = &sort_context_.format_contexts[it->first][it->second.size()];
         }
@@ -398,7 +575,7 @@ namespace savvy
 
       //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
       // Serialize shared data
-      if (!site_info::serialize(r, std::back_inserter(serialized_buf_), dict_, is_bcf ? n_samples_ : (flushed ? 0x800000u : 0u), n_fmt))
+      if (!site_info::serialize(r, std::back_inserter(serialized_buf_), *dict_, is_bcf ? n_samples_ : (flushed ? 0x800000u : 0u), n_fmt))
       {
         ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
         return *this;
@@ -417,7 +594,7 @@ namespace savvy
       //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
       // Serialize individual data
       if (!variant::serialize(r, std::back_inserter(serialized_buf_),
-        dict_, n_samples_, is_bcf, phasing_,
+        *dict_, n_samples_, is_bcf, phasing_,
         sort_context_, pbwt_format_pointers))
       {
         ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
@@ -462,6 +639,7 @@ namespace savvy
 
       ++record_count_in_block_;
       ++record_count_;
+      end_full_chunk();
 
 
       return *this;
@@ -472,8 +650,10 @@ namespace savvy
     {
       std::string magic = {'S', 'A', 'V', '\x02', '\x00'};
 
-      dict_.str_to_int[dictionary::id]["PASS"] = dict_.entries[dictionary::id].size();
-      dict_.entries[dictionary::id].emplace_back(dictionary::entry{"PASS", "", 0});
+      auto dict = std::make_shared<::savvy::dictionary>();
+      dict_ = dict;
+      dict->str_to_int[dictionary::id]["PASS"] = dict->entries[dictionary::id].size();
+      dict->entries[dictionary::id].emplace_back(dictionary::entry{"PASS", "", 0});
 
       bool gt_present{}, ph_present{};
 
@@ -511,7 +691,7 @@ namespace savvy
           }
         }
 
-        process_header_pair(it->first, it->second);
+        process_header_pair(*dict, it->first, it->second);
 
         header_block_sz += it->first.size();
         header_block_sz += it->second.size();
@@ -526,8 +706,8 @@ namespace savvy
         header_block_sz += headers.back().second.size();
         header_block_sz += 4;
 
-        dict_.str_to_int[dictionary::id]["PH"] = dict_.entries[dictionary::id].size();
-        dict_.entries[dictionary::id].emplace_back(dictionary::entry{"PH", ".", typed_value::int8});
+        dict->str_to_int[dictionary::id]["PH"] = dict->entries[dictionary::id].size();
+        dict->entries[dictionary::id].emplace_back(dictionary::entry{"PH", ".", typed_value::int8});
       }
 
       std::string column_names = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO";
@@ -574,62 +754,62 @@ namespace savvy
     }
 
     inline
-    bool writer::serialize_vcf_shared(const site_info& s)
+    bool writer::serialize_vcf_shared(const site_info& s, std::ostream& os) const
     {
-      (ofs_) << s.chrom_
+      os << s.chrom_
         << "\t" << s.pos_
         << "\t" << std::string(s.id_.size() ? s.id_ : ".")
         << "\t" << s.ref_;
 
       if (s.alts_.empty())
       {
-        ofs_ << "\t.";
+        os << "\t.";
       }
       else
       {
-        ofs_ << "\t" << s.alts_.front();
+        os << "\t" << s.alts_.front();
         for (auto it = s.alts_.begin() + 1; it != s.alts_.end(); ++it)
-          ofs_ << "," << *it;
+          os << "," << *it;
       }
 
       if (std::isnan(s.qual_))
-        ofs_ << "\t.";
+        os << "\t.";
       else
-        ofs_ << "\t" << s.qual_;
+        os << "\t" << s.qual_;
 
       if (s.filters_.empty())
       {
-        ofs_ << "\t.";
+        os << "\t.";
       }
       else
       {
-        ofs_ << "\t" << s.filters_.front();
+        os << "\t" << s.filters_.front();
         for (auto it = s.filters_.begin() + 1; it != s.filters_.end(); ++it)
-          ofs_ << ";" << *it;
+          os << ";" << *it;
       }
 
       if (s.info_.empty())
       {
-        ofs_ << "\t.";
+        os << "\t.";
       }
       else
       {
         auto hdr_detail_it = info_headers_map_.find(s.info_.front().first);
         if (hdr_detail_it != info_headers_map_.end() && hdr_detail_it->second.get().type == "Flag")
-          ofs_ << "\t" << s.info_.front().first;
+          os << "\t" << s.info_.front().first;
         else
-          ofs_ << "\t" << s.info_.front().first << "=" << s.info_.front().second;
+          os << "\t" << s.info_.front().first << "=" << s.info_.front().second;
         for (auto it = s.info_.begin() + 1; it != s.info_.end(); ++it)
         {
           auto hdr_detail_it = info_headers_map_.find(it->first);
           if (hdr_detail_it != info_headers_map_.end() && hdr_detail_it->second.get().type == "Flag")
-            ofs_ << ";" << it->first;
+            os << ";" << it->first;
           else
-            ofs_ << ";" << it->first << "=" << it->second;
+            os << ";" << it->first << "=" << it->second;
         }
       }
 
-      return ofs_.good();
+      return os.good();
     }
 
     inline
@@ -653,7 +833,7 @@ namespace savvy
     }
 
     inline
-    bool writer::serialize_vcf_indiv(const savvy::variant& v, phasing phased)
+    bool writer::serialize_vcf_indiv(const savvy::variant& v, phasing phased, std::ostream& os, std::vector<char>& buf) const
     {
       std::size_t out_buf_size = 1;
       std::vector<const typed_value*> typed_value_ptrs(v.format_fields_.size());
@@ -668,11 +848,11 @@ namespace savvy
         if (v.format_fields_[i].first == "PH")
         {
           assert(i == 1); // TODO: return error
-          ph_ptr = (std::int8_t*)v.format_fields_[i].second.val_data_.data();
+          ph_ptr = (std::int8_t*)v.format_fields_[i].second.val_ptr();
           continue;
         }
         out_buf_size += v.format_fields_[i].second.size() * (strfmt_buf_size(v.format_fields_[i].second.val_type_) + 1);
-        ofs_ << (i == 0 ? "\t" : ":") << v.format_fields_[i].first;
+        os << (i == 0 ? "\t" : ":") << v.format_fields_[i].first;
 
         strides[i] = (n_samples_ ? v.format_fields_[i].second.size() / n_samples_ : 0);
 
@@ -693,8 +873,8 @@ namespace savvy
         }
       }
 
-      serialized_buf_.resize(out_buf_size);
-      char* out_ptr = serialized_buf_.data();
+      buf.resize(out_buf_size);
+      char* out_ptr = buf.data();
       if (ph_ptr)
       {
         std::size_t ph_stride = strides[0] - 1;
@@ -732,14 +912,14 @@ namespace savvy
       }
 
       *(out_ptr++) = '\n';
-      if (std::size_t(out_ptr - serialized_buf_.data()) > serialized_buf_.size())
+      if (std::size_t(out_ptr - buf.data()) > buf.size())
       {
         assert(!"Output buffer too small");
-        throw std::runtime_error("VCF output buffer (" + std::to_string(out_ptr - serialized_buf_.data()) + "|" + std::to_string(serialized_buf_.size()) + ") is too small. Please notify maintainer.");
+        throw std::runtime_error("VCF output buffer (" + std::to_string(out_ptr - buf.data()) + "|" + std::to_string(buf.size()) + ") is too small. Please notify maintainer.");
       }
-      ofs_.write(serialized_buf_.data(), out_ptr - serialized_buf_.data());
+      os.write(buf.data(), out_ptr - buf.data());
 
-      return ofs_.good();
+      return os.good();
     }
     //================================================================//
 
@@ -13,10 +13,15 @@
 #include "savvy/savvy.hpp"
 #include "savvy/writer.hpp"
 #include "savvy/reader.hpp"
+#include "savvy/thread_pool.hpp"
 
 #include <regex>
 #include <cmath>
+#include <algorithm>
 #include <set>
+#include <deque>
+#include <future>
+#include <sstream>
 #include <fstream>
 #include <ctime>
 #include <getopt.h>
@@ -59,8 +64,12 @@ private:
   double sparse_threshold_ = 1.0;
   int update_info_ = -1;
   int compression_level_ = -1;
+  std::size_t threads_ = 1;
+  std::size_t shard_idx_ = 0;
+  std::size_t n_shards_ = 0;
   std::uint16_t block_size_ = default_block_size;
   bool sites_only_ = false;
+  bool sparse_pbwt_ = false;
   bool help_ = false;
   bool index_ = false;
 public:
@@ -85,12 +94,15 @@ public:
         {"regions-file", required_argument, 0, 'R'},
         {"sample-ids", required_argument, 0, 'i'},
         {"sample-ids-file", required_argument, 0, 'I'},
+        {"shard", required_argument, 0, '\x01'},
         {"slice", required_argument, 0, 'c'},
 //        {"sort", no_argument, 0, 's'},
 //        {"sort-point", required_argument, 0, 'S'},
         {"sparse-fields", required_argument, 0, '\x01'},
+        {"sparse-pbwt", no_argument, 0, '\x02'},
         {"sparse-threshold", required_argument, 0, '\x01'},
         {"sites-only", no_argument, 0, '\x02'},
+        {"threads", required_argument, 0, '\x01'},
         {"update-info", required_argument, 0, '\x01'},
         {0, 0, 0, 0}
       })
@@ -117,9 +129,13 @@ public:
   savvy::bounding_point bounding_point() const { return bounding_point_; }
   std::uint8_t compression_level() const { return std::uint8_t(compression_level_); }
   std::uint16_t block_size() const { return block_size_; }
+  std::size_t threads() const { return threads_; }
+  std::size_t shard_index() const { return shard_idx_; }
+  std::size_t shard_count() const { return n_shards_; }
   bool update_info() const { return update_info_ == 1 || (update_info_ == -1 && subset_ids_.size()); }
   bool index_is_set() const { return index_; }
   bool sites_only_is_set() const { return sites_only_; }
+  bool sparse_pbwt_is_set() const { return sparse_pbwt_; }
   bool help_is_set() const { return help_; }
 
   void print_usage(std::ostream& os)
@@ -153,9 +169,12 @@ public:
     os << "     --phasing             Sets file phasing status if phasing header is not present (none, full, or partial)\n";
     os << "     --pbwt-fields         Comma separated list of FORMAT fields for which to enable PBWT sorting\n";
     os << "     --sparse-fields       Comma separated list of FORMAT fields to make sparse (default: GT,HDS,DS,EC)\n";
+    os << "     --sparse-pbwt         Also applies PBWT to sparse vectors (not readable by savvy releases without sparse PBWT support)\n";
     os << "     --sparse-threshold    Non-zero frequency threshold for which sparse fields are encoded as sparse vectors (default: 1.0)\n";
+    os << "     --threads             Number of threads used to decompress, process and compress records (default: 1)\n";
     //os << "     --headers          Path to headers file that is either formatted as VCF headers or tab-delimited key value pairs\n";
-    //os << "     --sites-only       Exclude individual level data.\n";
+    os << "     --shard               Exports shard i of N shards with roughly equal record counts, formatted as i/N (requires index)\n";
+    os << "     --sites-only          Excludes individual level data (VCF output only)\n";
     os << "     --update-info         Specifies whether AC, MAC, AN, AF and MAF info fields should be updated (always, never or auto, default: auto)\n";
     os << std::flush;
   }
@@ -220,6 +239,15 @@ public:
           pbwt_fields_ = split_string_to_set(optarg, ',');
           break;
         }
+        else if (strcmp(long_options_[long_index].name, "shard") == 0)
+        {
+          if (!string_to_shard(optarg ? optarg : "", shard_idx_, n_shards_))
+          {
+            std::cerr << "Invalid --shard value (" << (optarg ? optarg : "") << ")\n";
+            return false;
+          }
+          break;
+        }
         else if (strcmp(long_options_[long_index].name, "sparse-fields") == 0)
         {
           sparse_fields_ = split_string_to_set(optarg, ',');
@@ -230,6 +258,17 @@ public:
           sparse_threshold_ = std::atof(optarg);
           break;
         }
+        else if (strcmp(long_options_[long_index].name, "threads") == 0)
+        {
+          int n = std::atoi(optarg ? optarg : "");
+          if (n < 1)
+          {
+            std::cerr << "Invalid --threads value (" << (optarg ? optarg : "") << ")\n";
+            return false;
+          }
+          threads_ = std::size_t(n);
+          break;
+        }
         std::cerr << "Invalid long only index (" << long_index << ")\n";
         return false;
       }
@@ -239,6 +278,10 @@ public:
         {
           sites_only_ = true;
         }
+        else if (std::string(long_options_[long_index].name) == "sparse-pbwt")
+        {
+          sparse_pbwt_ = true;
+        }
         break;
       }
       case '0':
@@ -504,6 +547,12 @@ public:
       return false;
     }
 
+    if (n_shards_ && (regions_.size() || slice_))
+    {
+      std::cerr << "--shard cannot be combined with --regions or --slice\n";
+      return false;
+    }
+
     if (update_info_ < 0)
     {
       update_info_ = subset_ids_.size() ? 1 : 0; // Automatically update info fields if samples are subset.
@@ -895,44 +944,215 @@ void update_standard_info_fields(savvy::variant& var)
   }
 }
 
+void prepare_record(savvy::variant& var, const export_prog_args& args, bool remove_ph, savvy::typed_value& tmp_val)
+{
+  if (remove_ph)
+    var.set_format("PH", {});
+
+  for (auto it = var.format_fields().begin(); it != var.format_fields().end(); ++it)
+  {
+    if (it->second.size() == 0) continue;
+
+    bool should_be_sparse = args.sparse_fields().find(it->first) != args.sparse_fields().end();
+    if (!it->second.is_sparse() && should_be_sparse)
+    {
+      it->second.copy_as_sparse(tmp_val);
+      if (tmp_val.size() && static_cast<double>(tmp_val.non_zero_size()) / tmp_val.size() <= args.sparse_threshold())
+        var.set_format(it->first, std::move(tmp_val)); // typed_value move operator implementation allows for reuse of tmp_val;
+    }
+    else if (it->second.is_sparse() && (!should_be_sparse || static_cast<double>(it->second.non_zero_size()) / it->second.size() > args.sparse_threshold()))
+    {
+      it->second.copy_as_dense(tmp_val);
+      var.set_format(it->first, std::move(tmp_val));
+    }
+  }
+
+  for (auto it = args.fields_to_generate().begin(); it != args.fields_to_generate().end(); ++it)
+    var.set_info(*it, 0);
+
+  if (args.update_info() || args.fields_to_generate().size())
+    update_standard_info_fields(var);
+
+  if (args.sites_only_is_set())
+  {
+    while (var.format_fields().size())
+      var.set_format(var.format_fields().front().first, {});
+  }
+}
+
 void export_records(savvy::reader& rdr, savvy::writer& wrt, const export_prog_args& args, bool remove_ph)
 {
   savvy::variant var;
   savvy::typed_value tmp_val;
   while (wrt && rdr.read(var))
   {
-    if (args.filter_functor()(var))
+    prepare_record(var, args, remove_ph, tmp_val);
+    wrt.write(var);
+  }
+}
+
+// Splits --threads between the pipeline stages instead of giving each stage that many threads. Decompression is the
+// cheapest stage, so it gets a quarter of the threads (none means the calling thread decompresses), and the rest are
+// shared by the workers that prepare records and the compression threads.
+struct export_thread_budget
+{
+  std::size_t decompression = 0;
+  std::size_t workers = 0;
+  std::size_t compression = 0;
+
+  explicit export_thread_budget(std::size_t n_threads)
+  {
+    if (n_threads > 1)
     {
-      if (remove_ph)
-        var.set_format("PH", {});
+      decompression = n_threads / 4;
+      compression = (n_threads - decompression) / 2;
+      workers = n_threads - decompression - compression;
+    }
+  }
+};
 
-      for (auto it = var.format_fields().begin(); it != var.format_fields().end(); ++it)
-      {
-        if (it->second.size() == 0) continue;
+// Gets the number of PBWT threads to use when reading, which is bounded by the number of PBWT-sorted FORMAT fields of
+// the first record. The first record is read through a clone that reopens the input, so inputs that are not regular
+// files (e.g., pipes) are not probed, since the clone would consume data meant for rdr.
+std::size_t input_pbwt_threads(const savvy::reader& rdr, const std::string& input_path, std::size_t n_threads)
+{
+  if (rdr.file_format() != savvy::file::format::sav2)
+    return 0;
 
-        bool should_be_sparse = args.sparse_fields().find(it->first) != args.sparse_fields().end();
-        if (!it->second.is_sparse() && should_be_sparse)
-        {
-          it->second.copy_as_sparse(tmp_val);
-          if (tmp_val.size() && static_cast<double>(tmp_val.non_zero_size()) / tmp_val.size() <= args.sparse_threshold())
-            var.set_format(it->first, std::move(tmp_val)); // typed_value move operator implementation allows for reuse of tmp_val;
-        }
-        else if (it->second.is_sparse() && (!should_be_sparse || static_cast<double>(it->second.non_zero_size()) / it->second.size() > args.sparse_threshold()))
+  struct stat st;
+  if (stat(input_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    return n_threads;
+
+  std::unique_ptr<savvy::reader> probe = rdr.clone();
+  savvy::variant var;
+  if (!probe)
+    return 0;
+  probe->pbwt_unsort(false);
+  if (!probe->read(var))
+    return 0;
+  std::size_t n_fields = std::count_if(var.format_fields().begin(), var.format_fields().end(), [](const std::pair<std::string, savvy::typed_value>& f) { return f.second.pbwt_flag(); });
+  return std::min(n_threads, n_fields);
+}
+
+// Reads batches of records on the calling thread and prepares them on a pool of worker threads. VCF input is only
+// split into lines by the calling thread and is parsed by the workers, and VCF output is also formatted by the workers.
+// Batches are written in the order they were read, so output matches export_records(). SAV and BCF records are
+// serialized by the writer, since PBWT sorting and indexing depend on preceding records.
+bool export_records_parallel(savvy::reader& rdr, savvy::writer& wrt, const export_prog_args& args, bool remove_ph, std::size_t n_workers)
+{
+  struct record_batch
+  {
+    std::vector<std::string> lines;
+    std::size_t n_lines = 0;
+    std::vector<savvy::variant> records;
+    std::size_t size = 0;
+    std::string text;
+  };
+
+  const std::size_t batch_size = 256;
+  const std::size_t max_batch_bytes = 16 * 1024 * 1024; // limits memory used by pending batches of very wide VCF lines
+  const bool parse_vcf = rdr.file_format() == savvy::file::format::vcf && args.regions().empty();
+  const std::size_t max_pending = 2 * n_workers;
+  const bool format_vcf = wrt.file_format() == savvy::file::format::vcf;
+
+  savvy::detail::thread_pool pool(n_workers);
+  std::deque<std::pair<std::shared_ptr<record_batch>, std::future<bool>>> pending;
+  std::vector<std::shared_ptr<record_batch>> free_batches;
+
+  auto write_front = [&]() -> bool
+  {
+    std::shared_ptr<record_batch> batch = pending.front().first;
+    bool ret = pending.front().second.get();
+    pending.pop_front();
+    if (!ret)
+    {
+      std::cerr << "Error: failed to process record" << std::endl;
+      return false;
+    }
+
+    if (format_vcf)
+    {
+      wrt.write_serialized(batch->text.data(), batch->text.size());
+    }
+    else
+    {
+      for (std::size_t i = 0; wrt && i < batch->size; ++i)
+        wrt.write(batch->records[i]);
+    }
+
+    free_batches.emplace_back(std::move(batch));
+    return wrt.good();
+  };
+
+  bool ok = true;
+  bool more = true;
+  while (ok && more)
+  {
+    std::shared_ptr<record_batch> batch;
+    if (free_batches.empty())
+      batch = std::make_shared<record_batch>();
+    else
+    {
+      batch = std::move(free_batches.back());
+      free_batches.pop_back();
+    }
+
+    batch->records.resize(batch_size);
+    batch->size = 0;
+    if (parse_vcf)
+    {
+      batch->lines.resize(batch_size);
+      batch->n_lines = 0;
+      std::size_t n_bytes = 0;
+      while (batch->n_lines < batch_size && n_bytes < max_batch_bytes && rdr.read_vcf_line(batch->lines[batch->n_lines]))
+        n_bytes += batch->lines[batch->n_lines++].size();
+      more = rdr.good();
+      if (batch->n_lines == 0)
+        break;
+    }
+    else
+    {
+      while (batch->size < batch_size && rdr.read(batch->records[batch->size]))
+        ++batch->size;
+      more = batch->size == batch_size;
+      if (batch->size == 0)
+        break;
+    }
+
+    pending.emplace_back(batch, pool.submit([batch, &rdr, &args, &wrt, remove_ph, parse_vcf, format_vcf]()
+    {
+      if (parse_vcf)
+      {
+        for (std::size_t i = 0; i < batch->n_lines; ++i)
         {
-          it->second.copy_as_dense(tmp_val);
-          var.set_format(it->first, std::move(tmp_val));
+          bool filtered_out = false;
+          if (!rdr.parse_vcf_line(batch->lines[i], batch->records[batch->size], filtered_out))
+            return false;
+          if (!filtered_out)
+            ++batch->size;
         }
       }
 
-      for (auto it = args.fields_to_generate().begin(); it != args.fields_to_generate().end(); ++it)
-        var.set_info(*it, 0);
-
-      if (args.update_info() || args.fields_to_generate().size())
-        update_standard_info_fields(var);
+      savvy::typed_value tmp_val;
+      std::ostringstream text;
+      for (std::size_t i = 0; i < batch->size; ++i)
+      {
+        prepare_record(batch->records[i], args, remove_ph, tmp_val);
+        if (format_vcf && !wrt.serialize_vcf(batch->records[i], text))
+          return false;
+      }
+      batch->text = text.str();
+      return true;
+    }));
 
-      wrt.write(var);
-    }
+    if (pending.size() > max_pending)
+      ok = write_front();
   }
+
+  while (ok && !pending.empty())
+    ok = write_front();
+
+  return ok;
 }
 
 int export_main(int argc, char** argv)
@@ -950,7 +1170,8 @@ int export_main(int argc, char** argv)
     return EXIT_SUCCESS;
   }
 
-  savvy::reader rdr(args.input_path());
+  const export_thread_budget budget(args.threads());
+  savvy::reader rdr(args.input_path(), budget.decompression);
   if (!rdr)
   {
     std::cerr << "Error: failed to open input file" << std::endl;
@@ -959,7 +1180,7 @@ int export_main(int argc, char** argv)
 
   if (args.regions().size())
   {
-    if (!rdr.reset_bounds(args.regions().front(), args.bounding_point()))
+    if (!rdr.reset_bounds(args.regions(), args.bounding_point()))
     {
       std::cerr << "Error: failed to load index for genomic region query" << std::endl;
       return EXIT_FAILURE;
@@ -973,6 +1194,16 @@ int export_main(int argc, char** argv)
       return EXIT_FAILURE;
     }
   }
+  else if (args.shard_count())
+  {
+    std::vector<savvy::slice_bounds> shards = rdr.plan_shards(args.shard_count());
+    if (shards.empty())
+    {
+      std::cerr << "Error: failed to load index for shard query" << std::endl;
+      return EXIT_FAILURE;
+    }
+    rdr.reset_bounds(shards[args.shard_index()]);
+  }
 
   auto fmt = savvy::file::format::vcf;
   if (args.file_format() == "sav" || args.file_format() == "sav")
@@ -1079,24 +1310,39 @@ int export_main(int argc, char** argv)
   if (args.subset_ids().size())
     sample_ids = rdr.subset_samples({args.subset_ids().begin(), args.subset_ids().end()});
 
-  savvy::writer wrt(args.output_path(), fmt, hdrs, sample_ids, args.compression_level(), args.index_path());
-  wrt.set_block_size(args.block_size());
-  wrt.set_pbwt(args.pbwt_fields());
+  if (args.sites_only_is_set())
+  {
+    // Genotypes are only needed when generating INFO fields from them.
+    if (args.update_info() || args.fields_to_generate().size())
+      rdr.set_format_fields({"GT"});
+    else
+      rdr.sites_only(true);
+    sample_ids.clear();
+    hdrs.erase(std::remove_if(hdrs.begin(), hdrs.end(), [](const std::pair<std::string, std::string>& h) { return h.first == "FORMAT"; }), hdrs.end());
+  }
 
-  export_records(rdr, wrt, args, remove_ph);
+  rdr.set_site_filter([&args](const savvy::site_info& site) { return args.filter_functor()(site); });
 
-  if (args.regions().size())
+  savvy::writer wrt(args.output_path(), fmt, hdrs, sample_ids, args.compression_level(), args.index_path());
+  wrt.set_block_size(args.block_size());
+  wrt.set_pbwt(args.pbwt_fields(), args.sparse_pbwt_is_set());
+  if (args.threads() > 1)
   {
-    for (auto it = args.regions().begin() + 1; it != args.regions().end(); ++it)
-    {
-      if (!rdr.reset_bounds(*it, args.bounding_point()))
-      {
-        std::cerr << "Error: failed to load index for genomic region query" << std::endl;
-        return EXIT_FAILURE;
-      }
+    wrt.set_compression_threads(budget.compression);
+    // Each PBWT field is sorted by its own mapping, so more threads than fields would sit idle. PBWT threads only run
+    // while the calling thread waits for them in read() or write().
+    wrt.set_pbwt_threads(std::min(args.threads(), args.pbwt_fields().size()));
+    rdr.set_pbwt_threads(input_pbwt_threads(rdr, args.input_path(), args.threads()));
+  }
 
-      export_records(rdr, wrt, args, remove_ph);
-    }
+  if (args.threads() > 1)
+  {
+    if (!export_records_parallel(rdr, wrt, args, remove_ph, budget.workers))
+      return EXIT_FAILURE;
+  }
+  else
+  {
+    export_records(rdr, wrt, args, remove_ph);
   }
 
   return wrt.good() && !rdr.bad() ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -139,6 +139,8 @@ bool create_index(const std::string& input_file_path, std::string output_file_pa
     return EXIT_FAILURE;
   }
 
+  r.sites_only(true);
+
   std::int64_t start_pos = r.tellg();
 
   bool append_index = output_file_path.empty();
@@ -9,6 +9,7 @@
 #include "sav/head.hpp"
 #include "sav/import.hpp"
 #include "sav/index.hpp"
+#include "sav/match.hpp"
 #include "sav/merge.hpp"
 #include "sav/rehead.hpp"
 #include "sav/sort.hpp"
@@ -48,6 +49,7 @@ public:
     os << " head:        Prints SAV headers or samples IDs\n";
     os << " import:      Imports VCF or BCF into SAV\n";
     os << " index:       Indexes SAV file\n";
+    os << " match:       Finds shared haplotype segments with PBWT\n";
     //os << " merge:       Merges multiple files into one\n";
     os << " rehead:      Replaces headers without recompressing variant blocks\n";
     os << " sort:        Sorts variant records\n";
@@ -117,6 +119,10 @@ int main(int argc, char** argv)
   {
     return index_main(argc, argv);
   }
+  else if (args.sub_command() == "match")
+  {
+    return match_main(argc, argv);
+  }
 //  else if (args.sub_command() == "merge") // TODO
 //  {
 //    return merge_main(argc, argv);
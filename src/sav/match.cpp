@@ -0,0 +1,261 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "sav/match.hpp"
+#include "sav/utility.hpp"
+#include "savvy/reader.hpp"
+#include "savvy/pbwt_matcher.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <getopt.h>
+#include <memory>
+#include <unordered_set>
+
+class match_prog_args
+{
+private:
+  std::vector<option> long_options_;
+  std::string input_path_;
+  std::unordered_set<std::string> query_samples_;
+  std::unique_ptr<savvy::genomic_region> reg_;
+  std::size_t min_length_ = 100;
+  bool set_maximal_ = false;
+  bool include_self_matches_ = false;
+  bool help_ = false;
+public:
+  match_prog_args() :
+    long_options_(
+      {
+        {"help", no_argument, 0, 'h'},
+        {"include-self-matches", no_argument, 0, '\x02'},
+        {"min-length", required_argument, 0, 'L'},
+        {"query-samples", required_argument, 0, 'q'},
+        {"region", required_argument, 0, 'r'},
+        {"set-maximal", no_argument, 0, 'm'},
+        {0, 0, 0, 0}
+      })
+  {
+  }
+
+  const std::string& input_path() const { return input_path_; }
+  const std::unordered_set<std::string>& query_samples() const { return query_samples_; }
+  const std::unique_ptr<savvy::genomic_region>& reg() const { return reg_; }
+  std::size_t min_length() const { return min_length_; }
+  bool set_maximal() const { return set_maximal_; }
+  bool include_self_matches() const { return include_self_matches_; }
+  bool help_is_set() const { return help_; }
+
+  void print_usage(std::ostream& os)
+  {
+    os << "Usage: sav match [opts ...] <in.sav> \n";
+    os << "\n";
+    os << " -h, --help                 Print usage\n";
+    os << "     --include-self-matches Reports matches between haplotypes of the same sample\n";
+    os << " -L, --min-length           Minimum number of matching sites (default: 100)\n";
+    os << " -m, --set-maximal          Reports set-maximal matches instead of all long matches\n";
+    os << " -q, --query-samples        Comma separated list of samples; only matches involving their haplotypes are searched for\n";
+    os << "                            (the PBWT is still built over all haplotypes, so each site costs at least as much as without -q)\n";
+    os << " -r, --region               Genomic region to search (chr or chr:beg-end)\n";
+    os << std::flush;
+  }
+
+  bool parse(int argc, char** argv)
+  {
+    int long_index = 0;
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "hL:mq:r:", long_options_.data(), &long_index )) != -1)
+    {
+      char copt = char(opt & 0xFF);
+      switch (copt)
+      {
+      case 'h':
+        help_ = true;
+        return true;
+      case '\x02':
+        include_self_matches_ = true;
+        break;
+      case 'L':
+      {
+        // The whole argument must be a number (e.g., not "100abc").
+        const char* arg = optarg ? optarg : "";
+        char* end = nullptr;
+        errno = 0;
+        long long n = std::strtoll(arg, &end, 10);
+        if (!std::isdigit((unsigned char)arg[0]) || errno != 0 || *end != '\0' || n < 1)
+        {
+          std::cerr << "Invalid --min-length value (" << (optarg ? optarg : "") << ")\n";
+          return false;
+        }
+        min_length_ = std::size_t(n);
+        break;
+      }
+      case 'm':
+        set_maximal_ = true;
+        break;
+      case 'q':
+        query_samples_ = split_string_to_set(optarg ? optarg : "", ',');
+        break;
+      case 'r':
+        reg_ = savvy::detail::make_unique<savvy::genomic_region>(string_to_region(optarg ? optarg : ""));
+        break;
+      default:
+        return false;
+      }
+    }
+
+    int remaining_arg_count = argc - optind;
+
+    if (remaining_arg_count == 1)
+    {
+      input_path_ = argv[optind];
+    }
+    else if (remaining_arg_count < 1)
+    {
+      std::cerr << "Too few arguments\n";
+      return false;
+    }
+    else
+    {
+      std::cerr << "Too many arguments\n";
+      return false;
+    }
+
+    return true;
+  }
+};
+
+int match_main(int argc, char** argv)
+{
+  match_prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  savvy::reader input_file(args.input_path());
+  if (!input_file)
+  {
+    std::cerr << "Error: could not open " << args.input_path() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (args.reg())
+  {
+    input_file.reset_bounds(*args.reg());
+    if (!input_file)
+    {
+      std::cerr << "Error: could not load region " << args.reg()->chromosome() << ":" << args.reg()->from() << "-" << args.reg()->to() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (input_file.phasing_status() == savvy::phasing::none)
+  {
+    std::cerr << "Error: GT must be phased" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  input_file.set_format_fields({"GT", "PH"});
+
+  const std::vector<std::string>& sample_ids = input_file.samples();
+  std::vector<bool> is_query_sample(sample_ids.size(), args.query_samples().empty());
+  std::size_t query_cnt = 0;
+  for (std::size_t i = 0; i < sample_ids.size(); ++i)
+  {
+    if (args.query_samples().find(sample_ids[i]) != args.query_samples().end())
+    {
+      is_query_sample[i] = true;
+      ++query_cnt;
+    }
+  }
+
+  if (query_cnt < args.query_samples().size())
+    std::cerr << "Warning: " << (args.query_samples().size() - query_cnt) << " query samples not found in input file" << std::endl;
+
+  const auto mode = args.set_maximal() ? savvy::pbwt_matcher::mode::set_maximal : savvy::pbwt_matcher::mode::long_matches;
+  std::unique_ptr<savvy::pbwt_matcher> matcher;
+  std::size_t ploidy = 0;
+  std::string chrom;
+  std::vector<std::uint32_t> positions;
+
+  std::cout << "#CHROM\tBEGIN\tEND\tN_SITES\tSAMPLE\tHAPLOTYPE\tMATCHING_SAMPLE\tMATCHING_HAPLOTYPE\n";
+  auto print_match = [&](const savvy::pbwt_matcher::match& m)
+  {
+    std::size_t s1 = m.haplotype / ploidy, s2 = m.matching_haplotype / ploidy;
+    if (s1 == s2 && !args.include_self_matches())
+      return;
+
+    std::cout << chrom << "\t"
+      << positions[m.begin] << "\t"
+      << positions[m.end - 1] << "\t"
+      << m.length() << "\t"
+      << sample_ids[s1] << "\t"
+      << (m.haplotype % ploidy) << "\t"
+      << sample_ids[s2] << "\t"
+      << (m.matching_haplotype % ploidy) << "\n";
+  };
+
+  savvy::variant rec;
+  std::vector<std::int8_t> gt, ph;
+  std::size_t unphased_cnt = 0;
+  while (input_file.read(rec))
+  {
+    if (!rec.get_format("GT", gt) || sample_ids.empty() || gt.size() % sample_ids.size())
+    {
+      std::cerr << "Error: GT missing or malformed at " << rec.chromosome() << ":" << rec.position() << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (rec.get_format("PH", ph) && std::find(ph.begin(), ph.end(), 0) != ph.end())
+      ++unphased_cnt;
+
+    if (!matcher)
+    {
+      ploidy = gt.size() / sample_ids.size();
+      matcher = savvy::detail::make_unique<savvy::pbwt_matcher>(gt.size(), args.min_length(), mode);
+      if (!args.query_samples().empty())
+      {
+        std::vector<bool> is_query_hap(gt.size());
+        for (std::size_t i = 0; i < is_query_hap.size(); ++i)
+          is_query_hap[i] = is_query_sample[i / ploidy];
+        matcher->set_query_haplotypes(std::move(is_query_hap));
+      }
+    }
+
+    if (rec.chromosome() != chrom)
+    {
+      matcher->finish(print_match);
+      chrom = rec.chromosome();
+      positions.clear();
+    }
+
+    if (!matcher->add_site(gt, print_match))
+    {
+      std::cerr << "Error: ploidy must be constant (" << rec.chromosome() << ":" << rec.position() << ")" << std::endl;
+      return EXIT_FAILURE;
+    }
+    positions.push_back(rec.position());
+  }
+
+  if (matcher)
+    matcher->finish(print_match);
+
+  if (unphased_cnt)
+    std::cerr << "Warning: " << unphased_cnt << " records have unphased genotypes, which are matched as if they were phased" << std::endl;
+
+  return input_file.bad() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
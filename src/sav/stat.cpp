@@ -15,6 +15,8 @@
 #include <functional>
 #include <getopt.h>
 #include <memory>
+#include <thread>
+#include <atomic>
 
 class stat_prog_args
 {
@@ -26,6 +28,9 @@ private:
   std::string per_ac_path_;
   std::string per_sample_path_;
   std::unique_ptr<savvy::genomic_region> reg_;
+  std::size_t shard_idx_ = 0;
+  std::size_t n_shards_ = 0;
+  std::size_t threads_ = 1;
   bool help_ = false;
 public:
   stat_prog_args() :
@@ -36,7 +41,9 @@ public:
         {"per-ac-out", required_argument, 0, '\x01'},
         {"per-sample-out", required_argument, 0, '\x01'},
         {"region", required_argument, 0, 'r'},
+        {"shard", required_argument, 0, '\x01'},
         {"summary-out", required_argument, 0, '\x01'},
+        {"threads", required_argument, 0, '\x01'},
         {0, 0, 0, 0}
       })
   {
@@ -48,13 +55,18 @@ public:
   const std::string& per_ac_path() const { return per_ac_path_; }
   const std::string& per_sample_path() const { return per_sample_path_; }
   const std::unique_ptr<savvy::genomic_region>& reg() const { return reg_; }
+  std::size_t shard_index() const { return shard_idx_; }
+  std::size_t shard_count() const { return n_shards_; }
+  std::size_t threads() const { return threads_; }
   bool help_is_set() const { return help_; }
 
   void print_usage(std::ostream& os)
   {
     os << "Usage: sav stat [opts ...] <in.sav> \n";
     os << "\n";
-    os << " -h, --help  Print usage\n";
+    os << " -h, --help     Print usage\n";
+    os << "     --shard    Computes stats for shard i of N shards with roughly equal record counts, formatted as i/N (requires index)\n";
+    os << "     --threads  Number of threads used to compute stats of indexed SAV files (default: 1). Other input and --region queries use 1 thread\n";
     os << std::flush;
   }
 
@@ -80,6 +92,26 @@ public:
           per_sample_path_ = optarg ? optarg : "";
           break;
         }
+        else if (long_opt_name == "threads")
+        {
+          int n = std::atoi(optarg ? optarg : "");
+          if (n < 1)
+          {
+            std::cerr << "Invalid --threads value (" << (optarg ? optarg : "") << ")\n";
+            return false;
+          }
+          threads_ = std::size_t(n);
+          break;
+        }
+        else if (long_opt_name == "shard")
+        {
+          if (!string_to_shard(optarg ? optarg : "", shard_idx_, n_shards_))
+          {
+            std::cerr << "Invalid --shard value (" << (optarg ? optarg : "") << ")\n";
+            return false;
+          }
+          break;
+        }
 
         std::cerr << "Invalid long only index (" << long_index << ")\n";
         return false;
@@ -123,6 +155,12 @@ public:
       return false;
     }
 
+    if (reg_ && n_shards_)
+    {
+      std::cerr << "--shard cannot be combined with --region\n";
+      return false;
+    }
+
     return true;
   }
 };
@@ -181,57 +219,63 @@ struct per_sample_t
   }
 };
 
-int stat_main(int argc, char** argv)
+// Counts accumulated over a set of records. Each thread of stat_main() fills its own accumulator.
+struct stat_accumulator
 {
-  stat_prog_args args;
-  if (!args.parse(argc, argv))
-  {
-    args.print_usage(std::cerr);
-    return EXIT_FAILURE;
-  }
+  std::size_t multi_allelic = 0;
+  std::size_t record_cnt = 0;
+  std::size_t variant_cnt = 0;
+  std::vector<per_ac_t> per_ac_stats;
+  std::vector<per_sample_t> per_sample_stats;
+  std::vector<std::int8_t> geno;
 
-  if (args.help_is_set())
+  void merge(const stat_accumulator& other)
   {
-    args.print_usage(std::cout);
-    return EXIT_SUCCESS;
-  }
-
-  std::size_t multi_allelic{}, record_cnt{}, variant_cnt{};
+    multi_allelic += other.multi_allelic;
+    record_cnt += other.record_cnt;
+    variant_cnt += other.variant_cnt;
 
+    if (other.per_ac_stats.size() > per_ac_stats.size())
+      per_ac_stats.resize(other.per_ac_stats.size());
+    for (std::size_t i = 0; i < other.per_ac_stats.size(); ++i)
+    {
+      per_ac_stats[i].n_snp += other.per_ac_stats[i].n_snp;
+      per_ac_stats[i].n_indel += other.per_ac_stats[i].n_indel;
+      per_ac_stats[i].n_syn += other.per_ac_stats[i].n_syn;
+      per_ac_stats[i].n_nonsyn += other.per_ac_stats[i].n_nonsyn;
+    }
 
-  savvy::reader input_file(args.input_path());
-  if (!input_file)
-  {
-    std::cerr << "Error: could not open " << args.input_path() << std::endl;
-    return EXIT_FAILURE;
-  }
-
-  if (args.reg())
-  {
-    input_file.reset_bounds(*args.reg());
-    if (!input_file)
+    for (std::size_t i = 0; i < other.per_sample_stats.size(); ++i)
     {
-      std::cerr << "Error: could not load region " << args.reg()->chromosome() << ":" << args.reg()->from() << "-" << args.reg()->to() << std::endl;
-      return EXIT_FAILURE;
+      per_sample_stats[i].n_het += other.per_sample_stats[i].n_het;
+      per_sample_stats[i].n_hom += other.per_sample_stats[i].n_hom;
+      per_sample_stats[i].n_snp += other.per_sample_stats[i].n_snp;
+      per_sample_stats[i].n_indel += other.per_sample_stats[i].n_indel;
+      per_sample_stats[i].n_syn += other.per_sample_stats[i].n_syn;
+      per_sample_stats[i].n_nonsyn += other.per_sample_stats[i].n_nonsyn;
     }
   }
+};
 
-  savvy::variant rec;
-  std::vector<std::int8_t> geno;
-
-  std::vector<per_sample_t> per_sample_stats;
+void configure_stat_reader(savvy::reader& rdr, const stat_prog_args& args)
+{
+  // Only GT is used for per-sample stats, so other FORMAT fields don't need to be decoded.
   if (args.per_sample_path().size())
-    per_sample_stats.assign(input_file.samples().begin(), input_file.samples().end());
+    rdr.set_format_fields({"GT"});
+  else
+    rdr.sites_only(true);
 
-  std::size_t bin_width = 1;
-  std::vector<per_ac_t> per_ac_stats;
+  rdr.set_site_filter([&args](const savvy::site_info& site) { return args.filter_functor()(site); });
+}
 
-  std::unordered_set<std::string> synonymous_labels = {
+bool accumulate_stats(savvy::reader& input_file, const stat_prog_args& args, stat_accumulator& acc)
+{
+  static const std::unordered_set<std::string> synonymous_labels = {
     "start_retained",
     "stop_retained",
     "synonymous"};
 
-  std::unordered_set<std::string> nonsynonymous_labels = {
+  static const std::unordered_set<std::string> nonsynonymous_labels = {
     "stop_gained",
     "frameshift",
     "stop_lost",
@@ -240,16 +284,20 @@ int stat_main(int argc, char** argv)
     "inframe_deletion",
     "missense"};
 
+  const std::size_t bin_width = 1;
+  std::vector<per_ac_t>& per_ac_stats = acc.per_ac_stats;
+  std::vector<per_sample_t>& per_sample_stats = acc.per_sample_stats;
+  std::vector<std::int8_t>& geno = acc.geno;
+
+  savvy::variant rec;
   while (input_file.read(rec))
   {
-    if (!args.filter_functor()(rec)) continue;
-
     if (rec.alts().size() > 1)
-      ++multi_allelic;
-    variant_cnt += std::max<std::size_t>(1, rec.alts().size());
-    ++record_cnt;
+      ++acc.multi_allelic;
+    acc.variant_cnt += std::max<std::size_t>(1, rec.alts().size());
+    ++acc.record_cnt;
 
-    bool is_snp = rec.ref().size() == 1 && rec.alts()[0].size() == 1;
+    bool is_snp = rec.ref().size() == 1 && rec.alts().size() && rec.alts()[0].size() == 1;
     bool is_syn = false;
     bool is_nonsyn = false;
     std::string ann;
@@ -285,13 +333,13 @@ int stat_main(int argc, char** argv)
       if (!rec.get_info("AC", ac) || !rec.get_info("AN", an))
       {
         std::cerr << "Error: AC and AN INFO fields are required" << std::endl;
-        return EXIT_FAILURE;
+        return false;
       }
 
       if (ac > an || ac < 0)
       {
         std::cerr << "Error: AC INFO field must be in range of [0, AN]" << std::endl;
-        return EXIT_FAILURE;
+        return false;
       }
 
       if (an / bin_width + 1 > per_ac_stats.size())
@@ -341,15 +389,131 @@ int stat_main(int argc, char** argv)
     }
   }
 
+  return true;
+}
+
+int stat_main(int argc, char** argv)
+{
+  stat_prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  savvy::reader input_file(args.input_path());
+  if (!input_file)
+  {
+    std::cerr << "Error: could not open " << args.input_path() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<savvy::slice_bounds> shards;
+  if (args.reg())
+  {
+    input_file.reset_bounds(*args.reg());
+    if (!input_file)
+    {
+      std::cerr << "Error: could not load region " << args.reg()->chromosome() << ":" << args.reg()->from() << "-" << args.reg()->to() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  else if (args.shard_count())
+  {
+    shards = input_file.plan_shards(args.shard_count());
+    if (shards.empty())
+    {
+      std::cerr << "Error: could not load index for shard query" << std::endl;
+      return EXIT_FAILURE;
+    }
+    input_file.reset_bounds(shards[args.shard_index()]);
+  }
+  else if (args.threads() > 1)
+  {
+    shards = input_file.plan_shards(1);
+  }
+
+  if (args.threads() > 1 && shards.empty())
+    std::cerr << "Notice: --threads requires an indexed SAV file and cannot be combined with --region (using 1 thread)" << std::endl;
+
+  stat_accumulator totals;
+  if (args.per_sample_path().size())
+    totals.per_sample_stats.assign(input_file.samples().begin(), input_file.samples().end());
+
+  // Records are split into more pieces than threads so that threads finishing early can pick up remaining work.
+  // Pieces come from a finer shard plan clipped to the selected shard, so every piece starts on a block boundary
+  // and no block is decompressed by more than one thread.
+  std::vector<savvy::slice_bounds> pieces;
+  if (args.threads() > 1 && shards.size())
+  {
+    const savvy::slice_bounds& range = shards[args.shard_index()];
+    std::vector<savvy::slice_bounds> fine_shards = input_file.plan_shards(shards.size() * args.threads() * 4);
+    for (auto it = fine_shards.begin(); it != fine_shards.end(); ++it)
+    {
+      std::uint64_t from = std::max(it->from(), range.from());
+      std::uint64_t to = std::min(it->to(), range.to());
+      if (to > from)
+        pieces.emplace_back(from, to);
+    }
+  }
+
+  if (pieces.empty())
+  {
+    configure_stat_reader(input_file, args);
+    if (!accumulate_stats(input_file, args, totals))
+      return EXIT_FAILURE;
+  }
+  else
+  {
+    std::vector<std::unique_ptr<savvy::reader>> readers(std::min(args.threads(), pieces.size()));
+    std::vector<stat_accumulator> accumulators(readers.size(), totals);
+    for (auto it = readers.begin(); it != readers.end(); ++it)
+    {
+      *it = input_file.clone();
+      configure_stat_reader(**it, args);
+    }
+
+    std::atomic<std::size_t> next_piece(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < readers.size(); ++t)
+    {
+      threads.emplace_back([&, t]()
+      {
+        std::size_t i;
+        while (!failed && (i = next_piece++) < pieces.size())
+        {
+          readers[t]->reset_bounds(pieces[i]);
+          if (!accumulate_stats(*readers[t], args, accumulators[t]))
+            failed = true;
+        }
+      });
+    }
+
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+
+    if (failed)
+      return EXIT_FAILURE;
+
+    for (auto it = accumulators.begin(); it != accumulators.end(); ++it)
+      totals.merge(*it);
+  }
 
   std::ofstream summary_out(args.summary_path(), std::ios::binary);
-  std::cout << record_cnt << "\t" << variant_cnt << "\t" << multi_allelic << "\n";
+  std::cout << totals.record_cnt << "\t" << totals.variant_cnt << "\t" << totals.multi_allelic << "\n";
 
   if (args.per_sample_path().size())
   {
     std::ofstream per_sample_out(args.per_sample_path(), std::ios::binary);
     per_sample_t::print_header(per_sample_out);
-    for (const per_sample_t& s : per_sample_stats)
+    for (const per_sample_t& s : totals.per_sample_stats)
     {
       s.print(per_sample_out);
     }
@@ -357,11 +521,12 @@ int stat_main(int argc, char** argv)
 
   if (args.per_ac_path().size())
   {
+    const std::size_t bin_width = 1;
     std::ofstream per_ac_out(args.per_ac_path(), std::ios::binary);
     per_ac_t::print_header(per_ac_out);
-    for (std::size_t i = 0; i < per_ac_stats.size(); ++i)
+    for (std::size_t i = 0; i < totals.per_ac_stats.size(); ++i)
     {
-      per_ac_stats[i].print(per_ac_out, i / bin_width);
+      totals.per_ac_stats[i].print(per_ac_out, i / bin_width);
     }
   }
 
@@ -11,6 +11,9 @@
 #include <iostream>
 #include <cstring>
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 
 savvy::genomic_region string_to_region(const std::string& s)
 {
@@ -46,6 +49,35 @@ savvy::genomic_region string_to_region(const std::string& s)
 
 }
 
+// Parses shard formatted as i/N (1-based). Sets shard_idx to the 0-based index.
+bool string_to_shard(const std::string& s, std::size_t& shard_idx, std::size_t& n_shards)
+{
+  const std::size_t slash_pos = s.find('/');
+  if (slash_pos == std::string::npos)
+    return false;
+
+  // Both numbers must be plain digits that make up the whole of their side of the slash (e.g., not "2x/4" or "1/4abc").
+  auto parse_count = [](const std::string& str, long long& dest)
+  {
+    if (str.empty() || !std::isdigit((unsigned char)str[0]))
+      return false;
+    char* end = nullptr;
+    errno = 0;
+    dest = std::strtoll(str.c_str(), &end, 10);
+    return errno == 0 && *end == '\0';
+  };
+
+  long long i, n;
+  if (!parse_count(s.substr(0, slash_pos), i) || !parse_count(s.substr(slash_pos + 1), n))
+    return false;
+  if (i < 1 || n < 1 || i > n)
+    return false;
+
+  shard_idx = std::size_t(i - 1);
+  n_shards = std::size_t(n);
+  return true;
+}
+
 std::string join_vector_to_string(const std::vector<std::string>& vec, std::string delim)
 {
   std::string ret;
@@ -15,17 +15,30 @@
 #include "savvy/writer.hpp"
 #include "savvy/site_info.hpp"
 #include "savvy/data_format.hpp"
+#include "savvy/pbwt_matcher.hpp"
+#include "sav/export.hpp"
+#include "sav/match.hpp"
+#include "sav/stat.hpp"
+#include "sav/utility.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <numeric>
+#include <cmath>
 #include <chrono>
 #include <sstream>
 #include <tuple>
 #include <type_traits>
 #include <utility>
+#include <thread>
+#include <random>
+#include <set>
+#include <map>
 #include <sys/stat.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <csignal>
 
 
 //bool has_extension(const std::string& fullString, const std::string& ext)
@@ -827,6 +840,2122 @@ void missing_headers_test()
   assert(!input.bad());
 }
 
+void threaded_read_test(const std::string& path, const std::string& fmt_field)
+{
+  {
+    savvy::reader single_threaded(path);
+    savvy::reader multi_threaded(path, 4);
+    assert(single_threaded.good() && multi_threaded.good());
+    bool same = make_file_checksum_test(single_threaded, multi_threaded, fmt_field)();
+    assert(same && !multi_threaded.bad());
+    (void)same;
+  }
+
+  savvy::reader rdr(path, 4);
+  savvy::variant var;
+  std::size_t cnt{};
+  rdr.reset_bounds({"18", 2234600, 2234700});
+  while (rdr >> var)
+    ++cnt;
+  assert(cnt == 4);
+  assert(!rdr.bad());
+
+  cnt = 0;
+  rdr.reset_bounds({"20", 1234600, 2234567});
+  while (rdr >> var)
+    ++cnt;
+  assert(cnt == 4);
+  assert(!rdr.bad());
+}
+
+// Streams a file through a pipe on a separate thread and returns the /dev/fd path of the read end, so that it can be
+// opened like a non-seekable input such as stdin. The read end is closed and the thread joined by the returned guard.
+struct piped_file
+{
+  int fd = -1;
+  std::thread feeder;
+
+  piped_file(const std::string& file_path)
+  {
+    int fds[2];
+    int rc = ::pipe(fds);
+    assert(rc == 0);
+    (void)rc;
+    fd = fds[0];
+    int write_fd = fds[1];
+    std::signal(SIGPIPE, SIG_IGN); // Readers may stop early, which must not kill the test.
+    feeder = std::thread([file_path, write_fd]()
+    {
+      std::ifstream ifs(file_path, std::ios::binary);
+      std::vector<char> buf(64 * 1024);
+      while (ifs.read(buf.data(), buf.size()) || ifs.gcount())
+      {
+        if (::write(write_fd, buf.data(), ifs.gcount()) != ifs.gcount())
+          break;
+      }
+      ::close(write_fd);
+    });
+  }
+
+  ~piped_file()
+  {
+    ::close(fd);
+    feeder.join();
+  }
+
+  std::string path() const { return "/dev/fd/" + std::to_string(fd); }
+};
+
+std::string read_file_contents(const std::string& path)
+{
+  std::ifstream ifs(path, std::ios::binary);
+  std::ostringstream ss;
+  ss << ifs.rdbuf();
+  return ss.str();
+}
+
+// Decompresses BGZF data with zlib, one gzip member at a time, which also checks each member's CRC32 and ISIZE. Returns
+// false if a member does not have a BC extra field whose BSIZE matches its length or if the data does not end with an
+// empty (EOF) member.
+bool inflate_bgzf(const std::string& data, std::string& out)
+{
+  out.clear();
+  std::size_t pos = 0;
+  std::size_t last_isize = 1;
+  while (pos < data.size())
+  {
+    if (data.size() - pos < 28 || std::uint8_t(data[pos]) != 31 || std::uint8_t(data[pos + 1]) != 139 || data[pos + 3] != 4
+      || data[pos + 10] != 6 || data[pos + 11] != 0 || data[pos + 12] != 'B' || data[pos + 13] != 'C')
+      return false;
+
+    std::size_t member_size = (std::size_t(std::uint8_t(data[pos + 16])) | (std::size_t(std::uint8_t(data[pos + 17])) << 8)) + 1;
+    if (member_size > data.size() - pos)
+      return false;
+
+    z_stream zs{};
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+      return false;
+    std::string member_out(0x10000, '\0');
+    zs.next_in = (Bytef*)&data[pos];
+    zs.avail_in = uInt(member_size);
+    zs.next_out = (Bytef*)&member_out[0];
+    zs.avail_out = uInt(member_out.size());
+    int res = inflate(&zs, Z_FINISH);
+    bool complete = res == Z_STREAM_END && zs.avail_in == 0;
+    last_isize = zs.total_out;
+    inflateEnd(&zs);
+    if (!complete)
+      return false;
+
+    out.append(member_out.data(), last_isize);
+    pos += member_size;
+  }
+  return last_isize == 0;
+}
+
+// Collects everything written to a pipe on a separate thread. The write end can be opened through path() like a
+// non-seekable output such as stdout. contents() closes it and waits for the remaining data.
+struct piped_sink
+{
+  int fd = -1;
+  std::string data;
+  std::thread collector;
+
+  piped_sink()
+  {
+    int fds[2];
+    int rc = ::pipe(fds);
+    assert(rc == 0);
+    (void)rc;
+    fd = fds[1];
+    int read_fd = fds[0];
+    collector = std::thread([this, read_fd]()
+    {
+      std::vector<char> buf(64 * 1024);
+      ssize_t n;
+      while ((n = ::read(read_fd, buf.data(), buf.size())) > 0)
+        data.append(buf.data(), n);
+      ::close(read_fd);
+    });
+  }
+
+  ~piped_sink()
+  {
+    contents();
+  }
+
+  const std::string& contents()
+  {
+    if (fd >= 0)
+    {
+      ::close(fd);
+      fd = -1;
+      collector.join();
+    }
+    return data;
+  }
+
+  std::string path() const { return "/dev/fd/" + std::to_string(fd); }
+};
+
+void threaded_write_test()
+{
+  const std::string out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".threaded.sav";
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+
+    savvy::writer output(out_path, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_block_size(3);
+    output.set_compression_threads(4);
+
+    std::size_t cnt = 0;
+    while (input.read(var))
+    {
+      output.write(var);
+      ++cnt;
+    }
+
+    assert(output.good() && !input.bad());
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+  }
+
+  run_file_checksum_test(SAVVYT_VCF_FILE, out_path, "GT");
+
+  savvy::reader rdr(out_path);
+  savvy::variant var;
+  std::size_t cnt{};
+  rdr.reset_bounds({"18", 2234600, 2234700});
+  while (rdr >> var)
+  {
+    assert(var.chromosome() == "18" && var.position() >= 2234600 && var.position() <= 2234700);
+    ++cnt;
+  }
+  assert(cnt == 4);
+  assert(!rdr.bad());
+
+  std::remove(out_path.c_str());
+
+  // VCF text formatted ahead of time and written with parallel BGZF compression
+  const std::string vcf_out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".threaded.vcf.gz";
+  std::vector<std::pair<std::int64_t, std::string>> line_offsets;
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+
+    savvy::writer output(vcf_out_path, savvy::file::format::vcf, input.headers(), input.samples());
+    output.set_compression_threads(4);
+
+    std::ostringstream text;
+    while (input.read(var))
+    {
+      bool formatted = output.serialize_vcf(var, text);
+      assert(formatted);
+      (void)formatted;
+      // Alternate between the waiting and the callback form of tellp().
+      std::size_t idx = line_offsets.size();
+      line_offsets.emplace_back(-1, text.str());
+      if (idx % 2)
+        output.tellp([&line_offsets, idx](std::int64_t pos) { line_offsets[idx].first = pos; });
+      else
+        line_offsets[idx].first = std::int64_t(output.tellp());
+      output.write_serialized(text.str().data(), text.str().size());
+      text.str("");
+    }
+
+    assert(output.good() && !input.bad());
+  }
+
+  run_file_checksum_test(SAVVYT_VCF_FILE, vcf_out_path, "GT");
+
+  // tellp() reports BGZF virtual offsets that can be used to seek back to each record
+  for (auto it = line_offsets.begin(); it != line_offsets.end(); ++it)
+  {
+    assert(it == line_offsets.begin() || it->first > (it - 1)->first);
+    shrinkwrap::bgzf::istream is(vcf_out_path);
+    is.seekg(std::streampos(it->first));
+    std::string line;
+    assert(std::getline(is, line));
+    assert(line + "\n" == it->second);
+  }
+
+  // Positions marked in chunks that span several BGZF blocks are resolved once the chunk is written.
+  line_offsets.clear();
+  {
+    savvy::detail::block_obuf<savvy::detail::bgzf_block_compressor> buf(std::fopen(vcf_out_path.c_str(), "wb"), 6, 4, 0);
+    for (std::size_t i = 0; i < 20000; ++i)
+    {
+      std::string line = "line " + std::to_string(i) + std::string(i % 13, 'x') + "\n";
+      std::size_t idx = line_offsets.size();
+      line_offsets.emplace_back(-1, line);
+      buf.mark_position([&line_offsets, idx](std::int64_t pos) { line_offsets[idx].first = pos; });
+      buf.sputn(line.data(), line.size());
+      if (i % 5000 == 4999)
+      {
+        bool ended = buf.end_block();
+        assert(ended);
+        (void)ended;
+      }
+    }
+  }
+
+  {
+    shrinkwrap::bgzf::istream is(vcf_out_path);
+    for (auto it = line_offsets.begin(); it != line_offsets.end(); ++it)
+    {
+      assert(it == line_offsets.begin() || it->first > (it - 1)->first);
+      is.seekg(std::streampos(it->first));
+      std::string line;
+      assert(std::getline(is, line));
+      assert(line + "\n" == it->second);
+    }
+  }
+  std::remove(vcf_out_path.c_str());
+
+  // Without compression threads, BGZF output decompresses with plain zlib to the same text as uncompressed output.
+  const std::string plain_out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".serial.vcf";
+  for (auto fmt : {savvy::file::format::vcf, savvy::file::format::bcf})
+  {
+    for (std::uint8_t level : {std::uint8_t(0), std::uint8_t(savvy::writer::default_compression_level)})
+    {
+      savvy::reader input(SAVVYT_VCF_FILE);
+      savvy::variant var;
+
+      savvy::writer output(level ? vcf_out_path : plain_out_path, fmt, input.headers(), input.samples(), level);
+      while (input.read(var))
+        output.write(var);
+
+      assert(output.good() && !input.bad());
+    }
+
+    std::string inflated;
+    bool valid = inflate_bgzf(read_file_contents(vcf_out_path), inflated);
+    assert(valid);
+    (void)valid;
+    assert(inflated == read_file_contents(plain_out_path));
+    std::remove(vcf_out_path.c_str());
+    std::remove(plain_out_path.c_str());
+  }
+
+  // Output that cannot be reopened or seeked (e.g., a pipe to stdout) is handed to the compression threads as is. BGZF
+  // output only ends with an EOF block.
+  const std::string piped_out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".piped";
+  const std::string bgzf_eof = savvy::detail::bgzf_block_compressor::trailer();
+  for (auto fmt : {savvy::file::format::sav2, savvy::file::format::bcf, savvy::file::format::vcf})
+  {
+    piped_sink sink;
+    {
+      savvy::reader input(SAVVYT_VCF_FILE);
+      savvy::variant var;
+
+      savvy::writer output(sink.path(), fmt, input.headers(), input.samples(), savvy::writer::default_compression_level, "/dev/null");
+      output.set_compression_threads(4);
+      while (input.read(var))
+        output.write(var);
+
+      assert(output.good() && !input.bad());
+    }
+
+    const std::string& data = sink.contents();
+    if (fmt != savvy::file::format::sav2)
+      assert(data.size() > bgzf_eof.size() && data.find(bgzf_eof) == data.size() - bgzf_eof.size());
+
+    {
+      std::ofstream ofs(piped_out_path, std::ios::binary);
+      ofs.write(data.data(), data.size());
+    }
+    run_file_checksum_test(SAVVYT_VCF_FILE, piped_out_path, "GT");
+    std::remove(piped_out_path.c_str());
+  }
+}
+
+void format_projection_test()
+{
+  const std::string out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".pbwt.sav";
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+
+    savvy::writer output(out_path, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_pbwt({"GT", "GQ", "DP"});
+    while (input.read(var))
+      output.write(var);
+    assert(output.good() && !input.bad());
+  }
+
+  for (const std::string& path : {std::string(SAVVYT_VCF_FILE), out_path})
+  {
+    savvy::reader full(path);
+    savvy::reader projected(path);
+    projected.set_format_fields({"GT", "DP"}, true);
+
+    savvy::variant full_var, projected_var;
+    std::vector<std::int32_t> full_vals, projected_vals;
+    std::size_t cnt = 0;
+    while (full >> full_var)
+    {
+      assert(projected >> projected_var);
+      assert(full_var.position() == projected_var.position());
+      assert(!projected_var.get_format("GT", projected_vals) && !projected_var.get_format("DP", projected_vals));
+      for (const std::string fmt : {"GQ", "HQ"})
+      {
+        bool has_field = full_var.get_format(fmt, full_vals);
+        assert(has_field == projected_var.get_format(fmt, projected_vals));
+        assert(full_vals == projected_vals || !has_field);
+        (void)has_field;
+      }
+      ++cnt;
+    }
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+    assert(!(projected >> projected_var));
+    assert(!full.bad() && !projected.bad());
+  }
+
+  std::remove(out_path.c_str());
+}
+
+// Sorts large sparse vectors, which are then written as sparse vectors, and checks that they produce the same sort
+// mapping as the dense vectors and that they are restored by pbwt_unsort().
+template <typename T>
+void sparse_pbwt_sort_test(T nonzero_val)
+{
+  std::mt19937 rng(7);
+  std::vector<std::size_t> sparse_map, sparse_prev, dense_map, dense_prev, unsort_map, unsort_prev, counts, scratch;
+  std::size_t n_sparse_out = 0;
+  for (std::size_t rec = 0; rec < 50; ++rec)
+  {
+    std::vector<T> vals(1000);
+    for (auto it = vals.begin(); it != vals.end(); ++it)
+    {
+      std::size_t r = rng() % 100;
+      *it = r < 3 ? T(1) : (r < 4 ? nonzero_val : (r < 5 ? std::numeric_limits<T>::min() : T(0)));
+    }
+
+    savvy::typed_value dense_val(vals), sparse_val;
+    dense_val.copy_as_sparse(sparse_val);
+
+    std::string dense_buf, sparse_buf;
+    savvy::typed_value::internal::serialize(dense_val, std::back_inserter(dense_buf), dense_map, dense_prev, counts, scratch);
+    savvy::typed_value::internal::serialize(sparse_val, std::back_inserter(sparse_buf), sparse_map, sparse_prev, counts, scratch);
+    assert(sparse_map == dense_map);
+    if ((sparse_buf[0] & 0x07) == savvy::typed_value::sparse) // Low 3 bits of type byte, below the PBWT flag
+      ++n_sparse_out;
+
+    std::istringstream is(sparse_buf);
+    savvy::typed_value sorted_val, unsorted_val;
+    assert(savvy::typed_value::internal::deserialize(sorted_val, is, 1) >= 0);
+    savvy::typed_value::internal::pbwt_unsort(sorted_val, unsorted_val, unsort_map, unsort_prev, counts, scratch);
+    std::vector<T> unsorted;
+    assert(unsorted_val.get(unsorted) && unsorted == vals);
+    assert(unsort_map == sparse_map);
+  }
+  assert(n_sparse_out == 50);
+
+  // An offset past the end of a sorted sparse vector is reported as an error.
+  {
+    std::vector<T> vals(1000);
+    vals.back() = nonzero_val;
+    savvy::typed_value dense_val(vals), sparse_val, sorted_val, unsorted_val;
+    dense_val.copy_as_sparse(sparse_val);
+    std::vector<std::size_t> map, prev;
+    std::string buf;
+    savvy::typed_value::internal::serialize(sparse_val, std::back_inserter(buf), map, prev, counts, scratch);
+    assert((buf[0] & 0x07) == savvy::typed_value::sparse);
+    std::size_t off_pos = buf.size() - sizeof(T) - 2; // Single 16-bit offset followed by a single value
+    buf[off_pos] = char(0xFF);
+    buf[off_pos + 1] = char(0x7F);
+
+    std::istringstream is(buf);
+    assert(savvy::typed_value::internal::deserialize(sorted_val, is, 1) >= 0);
+    map.clear();
+    prev.clear();
+    assert(!savvy::typed_value::internal::pbwt_unsort(sorted_val, unsorted_val, map, prev, counts, scratch));
+  }
+}
+
+void sparse_pbwt_test()
+{
+  const std::string out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".sparse_pbwt.sav";
+  std::vector<std::vector<std::int32_t>> expected_gt, expected_dp;
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+    savvy::typed_value tmp_val;
+
+    savvy::writer output(out_path, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_block_size(4);
+    output.set_pbwt({"GT", "DP"}, true);
+
+    std::vector<std::int32_t> vals;
+    std::size_t cnt = 0;
+    while (input.read(var))
+    {
+      // Alternate sparse and dense encodings so that both share the same sort mapping.
+      for (auto it = var.format_fields().begin(); it != var.format_fields().end(); ++it)
+      {
+        if (cnt % 2 == 0 && (it->first == "GT" || it->first == "DP"))
+        {
+          it->second.copy_as_sparse(tmp_val);
+          var.set_format(it->first, std::move(tmp_val));
+        }
+      }
+
+      var.get_format("GT", vals);
+      expected_gt.push_back(vals);
+      if (!var.get_format("DP", vals)) vals.clear();
+      expected_dp.push_back(vals);
+
+      output.write(var);
+      ++cnt;
+    }
+
+    assert(output.good() && !input.bad());
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+  }
+
+  run_file_checksum_test(SAVVYT_VCF_FILE, out_path, "GT");
+
+  {
+    savvy::reader rdr(out_path);
+    savvy::variant var;
+    std::vector<std::int32_t> vals;
+    std::size_t cnt = 0;
+    while (rdr >> var)
+    {
+      assert(var.get_format("GT", vals) && vals == expected_gt[cnt]);
+      if (!var.get_format("DP", vals)) vals.clear();
+      assert(vals == expected_dp[cnt]);
+      ++cnt;
+    }
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD && !rdr.bad());
+  }
+
+  {
+    // Skipped PBWT fields only advance the sort mapping.
+    savvy::reader rdr(out_path);
+    rdr.set_format_fields({"GT"}, true);
+    savvy::variant var;
+    std::vector<std::int32_t> vals;
+    std::size_t cnt = 0;
+    while (rdr >> var)
+    {
+      assert(!var.get_format("GT", vals));
+      if (!var.get_format("DP", vals)) vals.clear();
+      assert(vals == expected_dp[cnt]);
+      ++cnt;
+    }
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD && !rdr.bad());
+  }
+
+  // Without opting in, sparse vectors are written unsorted so that older readers can decode the file.
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+    savvy::typed_value tmp_val;
+
+    savvy::writer output(out_path, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_pbwt({"GT"});
+    while (input.read(var))
+    {
+      for (auto it = var.format_fields().begin(); it != var.format_fields().end(); ++it)
+      {
+        if (it->first == "GT")
+        {
+          it->second.copy_as_sparse(tmp_val);
+          var.set_format(it->first, std::move(tmp_val));
+        }
+      }
+      output.write(var);
+    }
+    assert(output.good() && !input.bad());
+  }
+
+  {
+    savvy::reader rdr(out_path);
+    rdr.pbwt_unsort(false);
+    savvy::variant var;
+    std::vector<std::int32_t> vals;
+    std::size_t cnt = 0;
+    while (rdr >> var)
+    {
+      assert(rdr.pbwt_sort_map("GT") == nullptr);
+      assert(var.get_format("GT", vals) && vals == expected_gt[cnt]);
+      ++cnt;
+    }
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD && !rdr.bad());
+  }
+
+  std::remove(out_path.c_str());
+}
+
+void lazy_pbwt_unsort_test()
+{
+  const std::string out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".lazy_pbwt.sav";
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+    savvy::typed_value tmp_val;
+
+    savvy::writer output(out_path, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_block_size(4);
+    output.set_pbwt({"GT", "DP"}, true);
+
+    std::size_t cnt = 0;
+    while (input.read(var))
+    {
+      if (cnt++ % 2 == 0)
+      {
+        for (auto it = var.format_fields().begin(); it != var.format_fields().end(); ++it)
+        {
+          if (it->first == "GT")
+          {
+            it->second.copy_as_sparse(tmp_val);
+            var.set_format(it->first, std::move(tmp_val));
+          }
+        }
+      }
+      output.write(var);
+    }
+    assert(output.good() && !input.bad());
+  }
+
+  const std::string rewrite_path = out_path + ".rewrite.sav";
+  {
+    savvy::reader unsorted_rdr(out_path);
+    savvy::reader sorted_rdr(out_path);
+    sorted_rdr.pbwt_unsort(false);
+
+    savvy::writer rewrite_output(rewrite_path, savvy::file::format::sav2, sorted_rdr.headers(), sorted_rdr.samples());
+    rewrite_output.set_block_size(4);
+    rewrite_output.set_pbwt({"GT", "DP"}, true);
+
+    savvy::variant unsorted_var, sorted_var;
+    savvy::typed_value tmp_val;
+    std::vector<std::int32_t> unsorted_vals, sorted_vals;
+    std::vector<std::pair<std::string, savvy::typed_value>> unsorted_fmts;
+    std::size_t cnt = 0, cnt_sorted = 0;
+    while (unsorted_rdr >> unsorted_var)
+    {
+      assert(sorted_rdr >> sorted_var);
+      assert(unsorted_rdr.pbwt_sort_map("GT") == nullptr);
+      unsorted_fmts.clear();
+      for (const std::string fmt : {"GT", "DP"})
+      {
+        const savvy::typed_value* sorted_fmt = nullptr;
+        for (auto it = sorted_var.format_fields().begin(); it != sorted_var.format_fields().end(); ++it)
+        {
+          if (it->first == fmt)
+            sorted_fmt = &it->second;
+        }
+
+        if (!sorted_fmt)
+          continue;
+
+        const std::vector<std::size_t>* sort_map = sorted_rdr.pbwt_sort_map(fmt);
+        assert(sorted_fmt->pbwt_flag() == (sort_map != nullptr));
+        if (sort_map)
+          ++cnt_sorted;
+
+        // Permutation-invariant summaries can be computed from sorted values.
+        unsorted_var.get_format(fmt, unsorted_vals);
+        sorted_var.get_format(fmt, sorted_vals);
+        assert(std::accumulate(unsorted_vals.begin(), unsorted_vals.end(), std::int64_t(0)) == std::accumulate(sorted_vals.begin(), sorted_vals.end(), std::int64_t(0)));
+
+        bool res = sort_map ? sorted_fmt->copy_pbwt_unsorted(tmp_val, *sort_map) : sorted_fmt->copy_pbwt_unsorted(tmp_val, {});
+        assert(res && !tmp_val.pbwt_flag());
+        (void)res;
+        tmp_val.get(sorted_vals);
+        assert(unsorted_vals == sorted_vals);
+        if (sorted_fmt->pbwt_flag())
+          unsorted_fmts.emplace_back(fmt, std::move(tmp_val));
+      }
+
+      // Writers reject fields that are still in PBWT-sorted order.
+      if (!unsorted_fmts.empty())
+      {
+        for (auto f : {savvy::file::format::sav2, savvy::file::format::bcf, savvy::file::format::vcf})
+        {
+          savvy::writer rejecting_output(out_path + ".rejected", f, sorted_rdr.headers(), sorted_rdr.samples());
+          assert(rejecting_output.good());
+          assert(!rejecting_output.serialize_vcf(sorted_var, std::cout));
+          assert(!rejecting_output.write(sorted_var).good());
+        }
+      }
+
+      for (auto it = unsorted_fmts.begin(); it != unsorted_fmts.end(); ++it)
+        sorted_var.set_format(it->first, std::move(it->second));
+      assert(rewrite_output.write(sorted_var).good());
+      ++cnt;
+    }
+
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD && cnt_sorted > 0);
+    assert(!(sorted_rdr >> sorted_var));
+    assert(!unsorted_rdr.bad() && !sorted_rdr.bad());
+  }
+
+  savvy::reader expected_rdr(out_path);
+  savvy::reader rewritten_rdr(rewrite_path);
+  savvy::variant expected_var, rewritten_var;
+  std::vector<std::int32_t> expected_vals, rewritten_vals;
+  std::size_t cnt = 0;
+  while (expected_rdr >> expected_var)
+  {
+    assert(rewritten_rdr >> rewritten_var);
+    for (const std::string fmt : {"GT", "DP"})
+    {
+      assert(expected_var.get_format(fmt, expected_vals) == rewritten_var.get_format(fmt, rewritten_vals));
+      assert(expected_vals == rewritten_vals);
+    }
+    ++cnt;
+  }
+  assert(cnt == SAVVYT_MARKER_COUNT_HARD && !(rewritten_rdr >> rewritten_var));
+
+  std::remove(out_path.c_str());
+  std::remove(rewrite_path.c_str());
+  std::remove((out_path + ".rejected").c_str());
+}
+
+void sites_only_test(const std::string& path)
+{
+  savvy::reader full(path);
+  savvy::reader sites(path);
+  sites.sites_only(true);
+  assert(sites.sites_only());
+
+  savvy::variant full_var, sites_var;
+  std::size_t cnt = 0;
+  while (full >> full_var)
+  {
+    assert(sites >> sites_var);
+    assert(sites_var.format_fields().empty());
+    assert(full_var.chromosome() == sites_var.chromosome() && full_var.position() == sites_var.position());
+    assert(full_var.ref() == sites_var.ref() && full_var.alts() == sites_var.alts());
+    ++cnt;
+  }
+  assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+  assert(!(sites >> sites_var));
+  assert(!sites.bad());
+
+  cnt = 0;
+  sites.reset_bounds({"18", 2234600, 2234700});
+  while (sites >> sites_var)
+    ++cnt;
+  assert(cnt == 4);
+  assert(!sites.bad());
+}
+
+void site_filter_test(const std::string& path)
+{
+  auto pred = [](const savvy::site_info& s) { return s.chromosome() == "20" || s.position() % 2 == 0; };
+
+  savvy::reader full(path);
+  savvy::reader filtered(path);
+  filtered.set_site_filter(pred);
+
+  savvy::variant full_var, filtered_var;
+  std::vector<std::int8_t> full_gt, filtered_gt;
+  std::size_t cnt = 0;
+  while (full >> full_var)
+  {
+    if (!pred(full_var))
+      continue;
+    assert(filtered >> filtered_var);
+    assert(full_var.chromosome() == filtered_var.chromosome() && full_var.position() == filtered_var.position());
+    assert(full_var.get_format("GT", full_gt) && filtered_var.get_format("GT", filtered_gt));
+    assert(full_gt == filtered_gt);
+    ++cnt;
+  }
+  assert(cnt > 0 && cnt < SAVVYT_MARKER_COUNT_HARD);
+  assert(!(filtered >> filtered_var));
+  assert(!filtered.bad());
+
+  // The filter also applies when individual data is not parsed.
+  savvy::reader sites_only(path);
+  sites_only.sites_only(true);
+  sites_only.set_site_filter(pred);
+  std::size_t sites_only_cnt = 0;
+  while (sites_only >> filtered_var)
+  {
+    assert(pred(filtered_var) && filtered_var.format_fields().empty());
+    ++sites_only_cnt;
+  }
+  assert(sites_only_cnt == cnt && !sites_only.bad());
+}
+
+void zero_copy_test(const std::string& path, const std::string& fmt_field)
+{
+  auto same = [](const std::vector<float>& a, const std::vector<float>& b)
+  {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](float x, float y) { return x == y || (std::isnan(x) && std::isnan(y)); });
+  };
+
+  savvy::reader copied(path, 2);
+  savvy::reader borrowed(path, 2);
+  borrowed.zero_copy(true);
+  assert(borrowed.zero_copy());
+
+  savvy::variant copied_var, borrowed_var, prev_var;
+  std::vector<float> copied_vals, borrowed_vals, prev_vals;
+  bool prev_has_field = false;
+  std::size_t cnt = 0, borrowed_cnt = 0;
+  while (copied >> copied_var)
+  {
+    assert(borrowed >> borrowed_var);
+    assert(copied_var.position() == borrowed_var.position());
+    assert(copied_var.format_fields().size() == borrowed_var.format_fields().size());
+    for (auto it = borrowed_var.format_fields().begin(); it != borrowed_var.format_fields().end(); ++it)
+    {
+      if (it->second.is_borrowed())
+        ++borrowed_cnt;
+    }
+    bool has_field = copied_var.get_format(fmt_field, copied_vals);
+    assert(has_field == borrowed_var.get_format(fmt_field, borrowed_vals));
+    assert(!has_field || same(copied_vals, borrowed_vals));
+
+    // Copies own their data and must remain intact after the next read.
+    if (cnt)
+    {
+      assert(prev_has_field == prev_var.get_format(fmt_field, borrowed_vals));
+      assert(!prev_has_field || same(borrowed_vals, prev_vals));
+    }
+    prev_var = borrowed_var;
+    for (auto it = prev_var.format_fields().begin(); it != prev_var.format_fields().end(); ++it)
+      assert(!it->second.is_borrowed());
+    prev_has_field = has_field;
+    prev_vals = copied_vals;
+    ++cnt;
+  }
+  (void)same;
+  (void)prev_has_field;
+  assert(cnt > 0 && borrowed_cnt > 0);
+  assert(!(borrowed >> borrowed_var));
+  assert(!borrowed.bad());
+}
+
+void read_batch_test(const std::string& path, bool sparse)
+{
+  savvy::reader rdr(path);
+  savvy::reader batch_rdr(path);
+  savvy::variant var;
+  savvy::variant_batch<float> batch("GT", sparse, {"AF", "NS"});
+  std::vector<float> gt, info_af;
+  float ns;
+  std::size_t cnt = 0, n_batches = 0;
+  while (batch_rdr.read_batch(batch, 5))
+  {
+    assert(batch.size() <= 5);
+    assert(batch.positions().size() == batch.size() && batch.info_column(0).size() == batch.size());
+    for (std::size_t i = 0; i < batch.size(); ++i, ++cnt)
+    {
+      assert(rdr >> var);
+      assert(batch.chromosomes()[i] == var.chromosome() && batch.positions()[i] == var.position());
+      std::string alts;
+      for (auto it = var.alts().begin(); it != var.alts().end(); ++it)
+        alts += (it == var.alts().begin() ? "" : ",") + *it;
+      assert(batch.ref(i) == var.ref() && batch.alts(i) == alts);
+      assert(var.get_info("AF", info_af) ? info_af[0] == batch.info_column(0)[i] : std::isnan(batch.info_column(0)[i]));
+      assert(var.get_info("NS", ns) ? ns == batch.info_column(1)[i] : std::isnan(batch.info_column(1)[i]));
+
+      assert(var.get_format("GT", gt) && gt.size() == batch.stride());
+      if (sparse)
+      {
+        std::vector<float> dense(batch.stride());
+        for (std::size_t j = batch.col_offsets()[i]; j < batch.col_offsets()[i + 1]; ++j)
+          dense[batch.row_indices()[j]] = batch.values()[j];
+        assert(std::equal(gt.begin(), gt.end(), dense.begin(), [](float x, float y) { return x == y || (std::isnan(x) && std::isnan(y)); }));
+      }
+      else
+      {
+        assert(std::equal(gt.begin(), gt.end(), batch.values().begin() + i * batch.stride(), [](float x, float y) { return x == y || (std::isnan(x) && std::isnan(y)); }));
+      }
+    }
+    ++n_batches;
+  }
+  (void)ns;
+  assert(cnt == SAVVYT_MARKER_COUNT_HARD && n_batches == (cnt + 4) / 5);
+  assert(!(rdr >> var));
+  assert(!batch_rdr.bad());
+}
+
+void slice_query_test(const std::string& path)
+{
+  std::vector<savvy::site_info> all_sites;
+  {
+    savvy::reader rdr(path);
+    savvy::variant var;
+    while (rdr >> var)
+      all_sites.emplace_back(var);
+    assert(all_sites.size() == SAVVYT_MARKER_COUNT_HARD);
+  }
+
+  savvy::reader rdr(path);
+  savvy::variant var;
+  std::vector<std::int8_t> gt;
+  for (auto bounds : {std::make_pair(0, 3), std::make_pair(5, 6), std::make_pair(7, 24), std::make_pair(23, 100)})
+  {
+    std::size_t i = bounds.first;
+    rdr.reset_bounds(savvy::slice_bounds(bounds.first, bounds.second));
+    while (rdr >> var)
+    {
+      assert(i < all_sites.size() && var.chromosome() == all_sites[i].chromosome() && var.position() == all_sites[i].position());
+      assert(var.get_format("GT", gt));
+      ++i;
+    }
+    assert(i == std::min<std::size_t>(bounds.second, all_sites.size()));
+    assert(!rdr.bad());
+  }
+
+  std::size_t cnt = 0;
+  rdr.reset_bounds(savvy::slice_bounds(1, 3, "20"));
+  while (rdr >> var)
+  {
+    assert(var.chromosome() == "20" && var.position() == all_sites[5 + 1 + cnt].position());
+    ++cnt;
+  }
+  assert(cnt == 2 && !rdr.bad());
+
+  assert(!rdr.reset_bounds(savvy::slice_bounds(100, 200)).good());
+}
+
+void block_cache_test(const std::string& path)
+{
+  auto cache = std::make_shared<savvy::block_cache>(std::size_t(1) << 20);
+  savvy::reader uncached(path);
+  savvy::reader cached_a(path, 0, cache);
+  savvy::reader cached_b(path, 2, cache);
+
+  std::vector<savvy::genomic_region> regions = {{"18", 2234600, 2234700}, {"20", 1, 1234600}, {"18", 2234600, 2234700}, {"20", 1000000, 4000000}};
+  savvy::variant expected, var_a, var_b;
+  std::vector<std::int8_t> expected_gt, gt;
+  for (std::size_t i = 0; i < 2; ++i)
+  {
+    for (auto it = regions.begin(); it != regions.end(); ++it)
+    {
+      uncached.reset_bounds(*it);
+      cached_a.reset_bounds(*it);
+      cached_b.reset_bounds(*it);
+      std::size_t cnt = 0;
+      while (uncached >> expected)
+      {
+        assert(cached_a >> var_a);
+        assert(cached_b >> var_b);
+        assert(expected.position() == var_a.position() && expected.position() == var_b.position());
+        assert(expected.get_format("GT", expected_gt));
+        assert(var_a.get_format("GT", gt) && gt == expected_gt);
+        assert(var_b.get_format("GT", gt) && gt == expected_gt);
+        ++cnt;
+      }
+      assert(cnt > 0);
+      assert(!(cached_a >> var_a) && !(cached_b >> var_b));
+      assert(!cached_a.bad() && !cached_b.bad());
+    }
+  }
+
+  assert(cache->hits() > 0 && cache->size_in_bytes() > 0 && cache->size_in_bytes() <= cache->max_bytes());
+}
+
+std::uint32_t tbi_reg2bin(std::uint32_t beg, std::uint32_t end)
+{
+  --end;
+  if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+  if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+  if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+  if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+  if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+  return 0;
+}
+
+// Writes a TBI index for a BGZF-compressed VCF, using virtual offsets from reader::tellg(). Chunks and the linear index
+// are built as by tabix. If single_bin is set, all chunks are put in bin 0 so that queries can only be narrowed by the
+// linear index.
+void write_tbi_index(const std::string& vcf_path, bool single_bin = false)
+{
+  std::vector<std::string> names;
+  std::vector<std::map<std::uint32_t, std::vector<std::pair<std::uint64_t, std::uint64_t>>>> bins;
+  std::vector<std::vector<std::uint64_t>> linear_indices;
+  {
+    savvy::reader rdr(vcf_path);
+    rdr.sites_only(true);
+    savvy::variant var;
+    std::uint64_t beg_off = std::uint64_t(rdr.tellg());
+    while (rdr.read(var))
+    {
+      std::uint64_t end_off = std::uint64_t(rdr.tellg());
+      if (names.empty() || names.back() != var.chromosome())
+      {
+        names.push_back(var.chromosome());
+        bins.emplace_back();
+        linear_indices.emplace_back();
+      }
+
+      std::uint32_t beg = var.position() - 1, end = beg + std::max<std::uint32_t>(1, var.ref().size());
+      auto& chunks = bins.back()[single_bin ? 0 : tbi_reg2bin(beg, end)];
+      if (chunks.size() && chunks.back().second == beg_off)
+        chunks.back().second = end_off;
+      else
+        chunks.emplace_back(beg_off, end_off);
+
+      auto& linear_index = linear_indices.back();
+      if (linear_index.size() <= (end - 1) >> 14)
+        linear_index.resize(((end - 1) >> 14) + 1, 0);
+      for (std::uint32_t w = beg >> 14; w <= (end - 1) >> 14; ++w)
+      {
+        if (!linear_index[w])
+          linear_index[w] = beg_off;
+      }
+      beg_off = end_off;
+    }
+    assert(!rdr.bad());
+  }
+
+  shrinkwrap::bgzf::ostream os(vcf_path + ".tbi");
+  auto write_int = [&os](std::int32_t v) { os.write((const char*)&v, sizeof(v)); };
+  auto write_uint64 = [&os](std::uint64_t v) { os.write((const char*)&v, sizeof(v)); };
+  os.write("TBI\x01", 4);
+  write_int(names.size());
+  for (std::int32_t v : {2, 1, 2, 0, int('#'), 0}) // VCF format, columns, meta char, skip
+    write_int(v);
+  std::string concat_names;
+  for (auto it = names.begin(); it != names.end(); ++it)
+    concat_names += *it + '\0';
+  write_int(concat_names.size());
+  os.write(concat_names.data(), concat_names.size());
+
+  for (std::size_t i = 0; i < names.size(); ++i)
+  {
+    write_int(bins[i].size());
+    for (auto it = bins[i].begin(); it != bins[i].end(); ++it)
+    {
+      write_int(it->first);
+      write_int(it->second.size());
+      for (auto jt = it->second.begin(); jt != it->second.end(); ++jt)
+      {
+        write_uint64(jt->first);
+        write_uint64(jt->second);
+      }
+    }
+
+    // Empty windows point to the previous window, as in htslib.
+    auto& linear_index = linear_indices[i];
+    for (std::size_t w = 1; w < linear_index.size(); ++w)
+    {
+      if (!linear_index[w])
+        linear_index[w] = linear_index[w - 1];
+    }
+    write_int(linear_index.size());
+    for (auto it = linear_index.begin(); it != linear_index.end(); ++it)
+      write_uint64(*it);
+  }
+  assert(os.good());
+}
+
+void create_indexed_vcf_file()
+{
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::writer output(SAVVYT_VCF_GZ_FILE, savvy::file::format::vcf, input.headers(), input.samples());
+    savvy::variant var;
+    while (input.read(var))
+      output.write(var);
+    assert(output.good() && !input.bad());
+  }
+  write_tbi_index(SAVVYT_VCF_GZ_FILE);
+}
+
+void csi_query_test(const std::string& path)
+{
+  std::vector<savvy::genomic_region> regions = {{"18", 2234670, 2234700}, {"20", 14000, 20000}, {"20", 1234567, 3234697}, {"20", 4234767}};
+  for (auto reg = regions.begin(); reg != regions.end(); ++reg)
+  {
+    savvy::reader full_scan(path);
+    std::vector<std::pair<std::string, std::uint32_t>> expected;
+    std::vector<std::vector<std::int8_t>> expected_gt;
+    savvy::variant var;
+    std::vector<std::int8_t> gt;
+    while (full_scan >> var)
+    {
+      if (savvy::region_compare(savvy::bounding_point::beg, var, *reg))
+      {
+        expected.emplace_back(var.chromosome(), var.position());
+        var.get_format("GT", gt);
+        expected_gt.push_back(gt);
+      }
+    }
+    assert(expected.size() > 0);
+
+    // Region bounds apply whether or not individual data is parsed.
+    for (bool sites_only : {false, true})
+    {
+      savvy::reader rdr(path);
+      rdr.sites_only(sites_only);
+      assert(rdr.reset_bounds(*reg).good());
+      std::size_t cnt = 0;
+      while (rdr >> var)
+      {
+        assert(cnt < expected.size());
+        assert(var.chromosome() == expected[cnt].first && var.position() == expected[cnt].second);
+        assert(sites_only ? var.format_fields().empty() : var.get_format("GT", gt) && gt == expected_gt[cnt]);
+        ++cnt;
+      }
+      assert(cnt == expected.size());
+      assert(!rdr.bad());
+    }
+  }
+}
+
+void multi_region_test(const std::string& path)
+{
+  std::vector<savvy::genomic_region> regions = {{"20", 1234600, 1300000}, {"18", 2234600, 2234700}, {"20", 1000000, 2234567}, {"18", 2234650, 2234680}, {"20", 2234567}};
+
+  // Expected records come from a full scan, in file order and without duplicates.
+  savvy::reader full_scan(path);
+  std::vector<std::pair<std::string, std::uint32_t>> expected;
+  std::vector<std::vector<std::int8_t>> expected_gt;
+  savvy::variant var;
+  std::vector<std::int8_t> gt;
+  while (full_scan >> var)
+  {
+    for (auto it = regions.begin(); it != regions.end(); ++it)
+    {
+      if (savvy::region_compare(savvy::bounding_point::beg, var, *it))
+      {
+        expected.emplace_back(var.chromosome(), var.position());
+        var.get_format("GT", gt);
+        expected_gt.push_back(gt);
+        break;
+      }
+    }
+  }
+  assert(expected.size() > 0);
+
+  savvy::reader rdr(path);
+  assert(rdr.reset_bounds(regions).good());
+  std::size_t cnt = 0;
+  while (rdr >> var)
+  {
+    assert(cnt < expected.size());
+    assert(var.chromosome() == expected[cnt].first && var.position() == expected[cnt].second);
+    var.get_format("GT", gt);
+    assert(gt == expected_gt[cnt]);
+    ++cnt;
+  }
+  assert(cnt == expected.size());
+  assert(!rdr.bad());
+}
+
+// Writes a BGZF-compressed VCF that spans several compressed blocks. Records are placed at both ends of linear index
+// windows, every fifth window is empty and a few long deletions span several windows. One deletion near the end of
+// chromosome 1 is stored in a bin that also covers positions past the last record.
+void create_large_indexed_vcf_file(const std::string& path)
+{
+  const std::size_t n_samples = 50;
+  shrinkwrap::bgzf::ostream os(path);
+  os << "##fileformat=VCFv4.2\n##contig=<ID=1>\n##contig=<ID=2>\n";
+  os << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+  os << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+  for (std::size_t j = 0; j < n_samples; ++j)
+    os << "\tS" << j;
+  os << "\n";
+
+  for (std::string chrom : {"1", "2"})
+  {
+    for (std::uint32_t k = 1; k <= 800; ++k)
+    {
+      if (k % 5 == 0)
+        continue;
+
+      std::vector<std::uint32_t> positions = {(k << 14) - 2000, k << 14};
+      if (chrom == "1" && k == 704)
+        positions.insert(positions.begin(), (703 << 14) + 100);
+
+      for (std::uint32_t pos : positions)
+      {
+        std::string ref = pos % 97 == 0 ? std::string(40000, 'A') : (pos == (703 << 14) + 100 ? std::string(20000, 'A') : "A");
+        os << chrom << "\t" << pos << "\t.\t" << ref << "\tG\t.\tPASS\t.\tGT";
+        for (std::size_t j = 0; j < n_samples; ++j)
+          os << ((k + j) % 3 == 0 ? "\t0|1" : ((pos + j) % 7 == 0 ? "\t1|1" : "\t0|0"));
+        os << "\n";
+      }
+    }
+  }
+  assert(os.good());
+}
+
+void tbi_linear_index_test(const std::string& path)
+{
+  struct site
+  {
+    std::string chrom;
+    std::uint32_t pos;
+    std::uint32_t end; // zero-based, exclusive
+    std::uint64_t offset;
+    std::vector<std::int8_t> gt;
+  };
+
+  std::vector<site> sites;
+  {
+    savvy::reader full_scan(path);
+    savvy::variant var;
+    std::uint64_t offset = std::uint64_t(full_scan.tellg());
+    while (full_scan >> var)
+    {
+      sites.push_back({var.chromosome(), std::uint32_t(var.position()), std::uint32_t(var.position() - 1 + var.ref().size()), offset, {}});
+      var.get_format("GT", sites.back().gt);
+      offset = std::uint64_t(full_scan.tellg());
+    }
+    assert(!full_scan.bad() && sites.size() > 2000);
+    assert((sites.back().offset >> 16) > 4); // Records span several BGZF blocks.
+  }
+
+  std::vector<savvy::genomic_region> regions = {
+    {"1", 40 << 14},                     // Starts at the last base of a window, which holds a record.
+    {"1", 40 << 14, 41 << 14},
+    {"1", (5 << 14) + 1, 12 << 14},      // Starts in an empty window.
+    {"1", (97 << 14) + 10, 98 << 14},    // Overlaps a long deletion, which starts before the region.
+    {"2", (101 << 14) - 2000, (101 << 14) - 2000},
+    {"2", (301 << 14) - 2000, 305 << 14},
+    {"2"}};
+
+  // Offset of first record that overlaps the linear index window of a zero-based position. Empty windows take the
+  // offset of the previous window.
+  auto linear_index_offset = [&sites](const std::string& chrom, std::uint32_t beg)
+  {
+    for (std::int64_t w = beg >> 14; w >= 0; --w)
+    {
+      for (auto it = sites.begin(); it != sites.end(); ++it)
+      {
+        if (it->chrom == chrom && it->end > std::uint32_t(w << 14) && it->pos - 1 < std::uint32_t((w + 1) << 14))
+          return it->offset;
+      }
+    }
+    return std::uint64_t(0);
+  };
+
+  for (bool single_bin : {false, true})
+  {
+    write_tbi_index(path, single_bin);
+
+    // Query intervals start no earlier than the linear index offset of the region start. With only bin 0, this
+    // offset comes from the linear index alone.
+    savvy::csi_index idx(path + ".tbi");
+    assert(idx.good());
+    for (auto reg = regions.begin(); reg != regions.end(); ++reg)
+    {
+      std::uint32_t beg = std::uint32_t(reg->from() ? reg->from() - 1 : 0);
+      auto intervals = idx.query_intervals(reg->chromosome(), {}, beg, std::min<std::uint64_t>(reg->to(), std::numeric_limits<std::int64_t>::max()));
+      assert(intervals.size());
+      std::uint64_t min_off = linear_index_offset(reg->chromosome(), beg);
+      assert(single_bin ? intervals.front().first == min_off : intervals.front().first >= min_off);
+      (void)min_off;
+    }
+
+    // Past the end of the linear index, the minimum offset is the loff of the nearest bin to the left. TBI bins do not
+    // store loff, so it is derived from the linear index, and it excludes the chunk of the deletion in a larger bin.
+    if (!single_bin)
+    {
+      auto deletion = std::find_if(sites.begin(), sites.end(), [](const site& st) { return st.chrom == "1" && st.pos == (703 << 14) + 100; });
+      assert(deletion != sites.end());
+      auto intervals = idx.query_intervals("1", {}, 810 << 14, 820 << 14);
+      assert(intervals.empty() || intervals.front().first > deletion->offset);
+      (void)deletion;
+    }
+
+    // Region queries, one at a time and all at once, match a full scan.
+    for (std::size_t i = 0; i <= regions.size(); ++i)
+    {
+      std::vector<savvy::genomic_region> query_regions(regions.begin() + (i < regions.size() ? i : 0), i < regions.size() ? regions.begin() + i + 1 : regions.end());
+      std::vector<const site*> expected;
+      for (auto it = sites.begin(); it != sites.end(); ++it)
+      {
+        for (auto reg = query_regions.begin(); reg != query_regions.end(); ++reg)
+        {
+          if (it->chrom == reg->chromosome() && it->pos >= reg->from() && it->pos <= reg->to())
+          {
+            expected.push_back(&*it);
+            break;
+          }
+        }
+      }
+      assert(expected.size() > 0);
+
+      savvy::reader rdr(path);
+      assert(rdr.reset_bounds(query_regions).good());
+      savvy::variant var;
+      std::vector<std::int8_t> gt;
+      std::size_t cnt = 0;
+      while (rdr >> var)
+      {
+        assert(cnt < expected.size());
+        assert(var.chromosome() == expected[cnt]->chrom && var.position() == expected[cnt]->pos);
+        assert(var.get_format("GT", gt) && gt == expected[cnt]->gt);
+        ++cnt;
+      }
+      assert(cnt == expected.size() && !rdr.bad());
+    }
+  }
+}
+
+void clone_test(const std::string& path)
+{
+  savvy::reader rdr(path);
+  assert(rdr.good());
+
+  // Clones start at the first record and read the same records as the original.
+  auto cln = rdr.clone();
+  assert(cln->good() && cln->samples() == rdr.samples() && cln->headers() == rdr.headers() && cln->file_format() == rdr.file_format());
+  assert(&cln->dictionary() == &rdr.dictionary()); // Header dictionary is shared rather than copied.
+  savvy::reader fresh(path);
+  savvy::variant expected, var;
+  std::vector<std::int8_t> expected_gt, gt;
+  std::size_t cnt = 0;
+  while (fresh >> expected)
+  {
+    assert(*cln >> var);
+    assert(var.chromosome() == expected.chromosome() && var.position() == expected.position() && var.ref() == expected.ref() && var.alts() == expected.alts());
+    bool has_gt = expected.get_format("GT", expected_gt);
+    assert(var.get_format("GT", gt) == has_gt && (!has_gt || gt == expected_gt));
+    (void)has_gt;
+    ++cnt;
+  }
+  assert(cnt > 0 && !(*cln >> var) && !cln->bad());
+
+  if (rdr.file_format() != savvy::file::format::sav2)
+    return;
+
+  // Clones share the index and can query regions concurrently.
+  std::vector<savvy::genomic_region> regions = {{"18", 2234600, 2234700}, {"20", 1, 1234600}, {"20", 1000000, 4000000}, {"20"}};
+  std::vector<std::size_t> expected_counts;
+  for (auto it = regions.begin(); it != regions.end(); ++it)
+  {
+    rdr.reset_bounds(*it);
+    std::size_t n = 0;
+    while (rdr >> var)
+      ++n;
+    expected_counts.push_back(n);
+  }
+
+  std::vector<std::size_t> counts(regions.size(), 0);
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < regions.size(); ++i)
+  {
+    std::shared_ptr<savvy::reader> thread_rdr = rdr.clone();
+    threads.emplace_back([thread_rdr, i, &regions, &counts]()
+    {
+      savvy::variant v;
+      for (std::size_t j = 0; j < 10; ++j)
+      {
+        thread_rdr->reset_bounds(regions[i]);
+        std::size_t n = 0;
+        while (*thread_rdr >> v)
+          ++n;
+        counts[i] = n;
+      }
+    });
+  }
+
+  for (auto it = threads.begin(); it != threads.end(); ++it)
+    it->join();
+
+  assert(counts == expected_counts);
+}
+
+void threaded_bgzf_read_test()
+{
+  const std::string out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".bgzf.vcf.gz";
+  std::size_t n_written = 0;
+  {
+    savvy::writer output(out_path, savvy::file::format::vcf, savvy::reader(SAVVYT_VCF_FILE).headers(), savvy::reader(SAVVYT_VCF_FILE).samples());
+    for (int i = 0; i < 500; ++i) // spans multiple BGZF blocks
+    {
+      savvy::reader input(SAVVYT_VCF_FILE);
+      savvy::variant var;
+      while (input.read(var))
+      {
+        output.write(var);
+        ++n_written;
+      }
+    }
+    assert(output.good());
+  }
+
+  savvy::reader single(out_path);
+  savvy::reader threaded(out_path, 3);
+  assert(single.good() && threaded.good() && single.samples() == threaded.samples());
+
+  savvy::variant expected, var;
+  std::vector<std::int8_t> expected_gt, gt;
+  std::size_t cnt = 0;
+  std::uint64_t last_offset = 0;
+  while (single.read(expected))
+  {
+    bool read_ok = (bool)threaded.read(var);
+    assert(read_ok);
+    last_offset = std::uint64_t(threaded.tellg());
+    assert(std::uint64_t(single.tellg()) == last_offset); // virtual offsets must match for CSI queries
+    assert(var.chromosome() == expected.chromosome() && var.position() == expected.position() && var.alts() == expected.alts());
+    bool has_gt = expected.get_format("GT", expected_gt);
+    assert(var.get_format("GT", gt) == has_gt && (!has_gt || gt == expected_gt));
+    (void)read_ok;
+    (void)has_gt;
+    ++cnt;
+  }
+  assert(cnt == n_written && (last_offset >> 16) > 0);
+  (void)last_offset;
+  assert(!threaded.read(var) && !threaded.bad() && !single.bad());
+
+  std::remove(out_path.c_str());
+}
+
+void gt_tokenizer_test()
+{
+  std::mt19937 rng(42);
+  const char alleles[] = "0123456789.";
+  for (std::size_t n_samples = 0; n_samples < 70; ++n_samples)
+  {
+    std::string line;
+    for (std::size_t i = 0; i < n_samples; ++i)
+    {
+      line += '\t';
+      line += alleles[rng() % 11];
+      line += (rng() % 2 ? '|' : '/');
+      line += alleles[rng() % 11];
+    }
+
+    std::vector<std::int8_t> gt(2 * n_samples, 0x7F), expected_gt(2 * n_samples, 0x7E);
+    std::vector<std::int8_t> ph(n_samples, 0x7F), expected_ph(n_samples, 0x7E);
+    bool ok = savvy::detail::diploid_gt_tokenizer::tokenize(line.data(), line.size(), n_samples, gt.data(), ph.data());
+    bool expected_ok = savvy::detail::diploid_gt_tokenizer::tokenize_scalar(line.data(), 0, n_samples, expected_gt.data(), expected_ph.data());
+    assert(ok && expected_ok && gt == expected_gt && ph == expected_ph);
+    (void)expected_ok;
+
+    for (std::size_t i = 0; i < n_samples; ++i)
+    {
+      assert(gt[2 * i] == (line[4 * i + 1] == '.' ? std::int8_t(0x80) : std::int8_t(line[4 * i + 1] - '0')));
+      assert(ph[i] == (line[4 * i + 2] == '|'));
+    }
+
+    // Any irregular character must be rejected regardless of which chunk it falls in.
+    for (std::size_t pos = 0; pos < line.size(); ++pos)
+    {
+      std::string bad_line = line;
+      bad_line[pos] = (pos % 4 == 0 ? ':' : 'x');
+      ok = savvy::detail::diploid_gt_tokenizer::tokenize(bad_line.data(), bad_line.size(), n_samples, gt.data(), nullptr);
+      assert(!ok);
+    }
+
+    ok = savvy::detail::diploid_gt_tokenizer::tokenize(line.data(), line.size(), n_samples + 1, gt.data(), nullptr);
+    assert(!ok);
+    (void)ok;
+  }
+}
+
+void biallelic_pbwt_test()
+{
+  std::mt19937 rng(42);
+  for (std::size_t sz : {1, 31, 32, 33, 100, 1000})
+  {
+    std::vector<std::size_t> sort_mapping, prev_sort_mapping, counts, scratch;
+    std::vector<std::size_t> expected_mapping(sz);
+    std::iota(expected_mapping.begin(), expected_mapping.end(), 0);
+
+    for (std::size_t rec = 0; rec < 20; ++rec)
+    {
+      std::vector<std::int8_t> sorted(sz);
+      for (auto it = sorted.begin(); it != sorted.end(); ++it)
+        *it = std::int8_t(rng() % 4 == 0);
+      if (rec % 5 == 4)
+        sorted[rng() % sz] = (rec % 2 ? std::int8_t(0x80) : std::int8_t(2)); // Falls back to counting sort.
+
+      // Next mapping is a stable sort of the current one by unsigned value.
+      std::vector<std::int8_t> expected_vals(sz);
+      std::vector<std::size_t> order(sz);
+      for (std::size_t i = 0; i < sz; ++i)
+        expected_vals[expected_mapping[i]] = sorted[i];
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&sorted](std::size_t a, std::size_t b) { return std::uint8_t(sorted[a]) < std::uint8_t(sorted[b]); });
+      std::vector<std::size_t> next_mapping(sz);
+      for (std::size_t i = 0; i < sz; ++i)
+        next_mapping[i] = expected_mapping[order[i]];
+
+      savvy::typed_value src(sorted), dest;
+      std::vector<std::int8_t> vals;
+      savvy::typed_value::internal::pbwt_unsort(src, dest, sort_mapping, prev_sort_mapping, counts, scratch);
+      dest.get(vals);
+      assert(vals == expected_vals);
+      assert(sort_mapping == next_mapping);
+
+      expected_mapping = next_mapping;
+    }
+  }
+}
+
+void pbwt_match_test()
+{
+  typedef std::tuple<std::size_t, std::size_t, std::size_t, std::size_t> match_t;
+  std::mt19937 rng(42);
+  for (std::size_t trial = 0; trial < 50; ++trial)
+  {
+    std::size_t n_haps = 2 + rng() % 30, n_sites = 1 + rng() % 60, min_len = 1 + rng() % 6;
+    std::vector<std::vector<std::int8_t>> sites(n_sites, std::vector<std::int8_t>(n_haps));
+    for (std::size_t k = 0; k < n_sites; ++k)
+    {
+      for (std::size_t i = 0; i < n_haps; ++i)
+        sites[k][i] = k && rng() % 4 ? sites[k - 1][i] : std::int8_t(rng() % 3);
+    }
+
+    // Brute force maximal pairwise matches.
+    std::vector<match_t> maximal;
+    for (std::size_t a = 0; a < n_haps; ++a)
+    {
+      for (std::size_t b = 0; b < n_haps; ++b)
+      {
+        std::size_t beg = 0;
+        for (std::size_t k = 0; a != b && k <= n_sites; ++k)
+        {
+          if (k == n_sites || sites[k][a] != sites[k][b])
+          {
+            if (k > beg)
+              maximal.emplace_back(a, b, beg, k);
+            beg = k + 1;
+          }
+        }
+      }
+    }
+
+    std::set<match_t> expected_long, expected_set_max;
+    for (auto it = maximal.begin(); it != maximal.end(); ++it)
+    {
+      std::size_t len = std::get<3>(*it) - std::get<2>(*it);
+      if (len < min_len)
+        continue;
+      if (std::get<0>(*it) < std::get<1>(*it))
+        expected_long.insert(*it);
+
+      bool contained = std::any_of(maximal.begin(), maximal.end(), [&](const match_t& o)
+      {
+        return std::get<0>(o) == std::get<0>(*it) && std::get<2>(o) <= std::get<2>(*it) && std::get<3>(o) >= std::get<3>(*it) && std::get<3>(o) - std::get<2>(o) > len;
+      });
+      if (!contained)
+        expected_set_max.insert(*it);
+    }
+
+    for (auto mode : {savvy::pbwt_matcher::mode::long_matches, savvy::pbwt_matcher::mode::set_maximal})
+    {
+      std::set<match_t> found;
+      auto fn = [&found](const savvy::pbwt_matcher::match& m)
+      {
+        bool inserted = found.emplace(m.haplotype, m.matching_haplotype, m.begin, m.end).second;
+        assert(inserted);
+        (void)inserted;
+      };
+
+      savvy::pbwt_matcher matcher(n_haps, min_len, mode);
+      for (std::size_t k = 0; k < n_sites; ++k)
+        assert(matcher.add_site(sites[k], fn));
+      matcher.finish(fn);
+      assert(matcher.site_count() == 0);
+      assert(found == (mode == savvy::pbwt_matcher::mode::set_maximal ? expected_set_max : expected_long));
+    }
+
+    // Query haplotypes only find the matches that involve them.
+    std::vector<bool> is_query(n_haps);
+    for (std::size_t i = 0; i < n_haps; ++i)
+      is_query[i] = rng() % 3 == 0;
+    for (auto mode : {savvy::pbwt_matcher::mode::long_matches, savvy::pbwt_matcher::mode::set_maximal})
+    {
+      const bool set_max = mode == savvy::pbwt_matcher::mode::set_maximal;
+      std::set<match_t> expected;
+      for (const match_t& m : (set_max ? expected_set_max : expected_long))
+      {
+        if (is_query[std::get<0>(m)] || (!set_max && is_query[std::get<1>(m)]))
+          expected.insert(m);
+      }
+
+      std::set<match_t> found;
+      auto fn = [&found](const savvy::pbwt_matcher::match& m)
+      {
+        bool inserted = found.emplace(m.haplotype, m.matching_haplotype, m.begin, m.end).second;
+        assert(inserted);
+        (void)inserted;
+      };
+
+      savvy::pbwt_matcher matcher(n_haps, min_len, mode);
+      matcher.set_query_haplotypes(is_query);
+      for (std::size_t k = 0; k < n_sites; ++k)
+      {
+        bool added = matcher.add_site(sites[k], fn);
+        assert(added);
+        (void)added;
+      }
+      matcher.finish(fn);
+      assert(found == expected);
+    }
+  }
+}
+
+// Writes records with and without PBWT threads and checks that both files read the same with and without PBWT threads.
+void check_threaded_pbwt(const std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& samples, const std::vector<savvy::variant>& records)
+{
+  const std::string serial_path = std::string(SAVVYT_SAV_FILE_HARD) + ".serial_pbwt.sav";
+  const std::string threaded_path = std::string(SAVVYT_SAV_FILE_HARD) + ".threaded_pbwt.sav";
+  {
+    savvy::writer serial_output(serial_path, savvy::file::format::sav2, headers, samples);
+    savvy::writer threaded_output(threaded_path, savvy::file::format::sav2, headers, samples);
+    serial_output.set_block_size(4);
+    threaded_output.set_block_size(4);
+    serial_output.set_pbwt({"GT", "DP"}, true);
+    threaded_output.set_pbwt({"GT", "DP"}, true);
+    threaded_output.set_pbwt_threads(3);
+
+    for (auto it = records.begin(); it != records.end(); ++it)
+    {
+      serial_output.write(*it);
+      threaded_output.write(*it);
+    }
+
+    assert(serial_output.good() && threaded_output.good());
+  }
+
+  for (bool unsort : {true, false})
+  {
+    savvy::reader serial_rdr(serial_path);
+    savvy::reader threaded_rdr(threaded_path);
+    serial_rdr.pbwt_unsort(unsort);
+    threaded_rdr.pbwt_unsort(unsort);
+    threaded_rdr.set_pbwt_threads(3);
+
+    // When fields are left sorted, matching values and sort maps mean that sorting concurrently did not change the
+    // encoding.
+    savvy::variant serial_var, threaded_var;
+    std::vector<std::int32_t> serial_vals, threaded_vals;
+    std::size_t cnt = 0;
+    while (serial_rdr.read(serial_var))
+    {
+      assert(threaded_rdr.read(threaded_var));
+      for (std::string key : {"GT", "DP"})
+      {
+        bool has_field = serial_var.get_format(key, serial_vals);
+        assert(threaded_var.get_format(key, threaded_vals) == has_field);
+        assert(!has_field || serial_vals == threaded_vals);
+        if (!unsort && has_field)
+          assert(serial_rdr.pbwt_sort_map(key) && *serial_rdr.pbwt_sort_map(key) == *threaded_rdr.pbwt_sort_map(key));
+      }
+      ++cnt;
+    }
+    assert(!threaded_rdr.read(threaded_var));
+    assert(cnt == records.size() && !serial_rdr.bad() && !threaded_rdr.bad());
+  }
+
+  std::remove(serial_path.c_str());
+  std::remove(threaded_path.c_str());
+}
+
+void threaded_pbwt_test()
+{
+  {
+    // Fields of the test file are too small to be processed concurrently.
+    savvy::reader input(SAVVYT_VCF_FILE);
+    std::vector<savvy::variant> records(1);
+    while (input.read(records.back()))
+      records.emplace_back();
+    records.pop_back();
+    assert(records.size() == SAVVYT_MARKER_COUNT_HARD && !input.bad());
+    check_threaded_pbwt(input.headers(), input.samples(), records);
+  }
+
+  // Wide records whose fields are large enough to be processed by tasks.
+  const std::size_t n_samples = savvy::internal::pbwt_sort_context::min_concurrent_size + 100;
+  std::vector<std::string> samples(n_samples);
+  for (std::size_t i = 0; i < n_samples; ++i)
+    samples[i] = "S" + std::to_string(i);
+  std::vector<std::pair<std::string, std::string>> headers = {
+    {"fileformat", "VCFv4.2"},
+    {"contig", "<ID=1>"},
+    {"FORMAT", "<ID=GT,Number=1,Type=String,Description=\"Genotype\">"},
+    {"FORMAT", "<ID=DP,Number=1,Type=Integer,Description=\"Read depth\">"}};
+
+  std::mt19937 rng(11);
+  std::vector<savvy::variant> records;
+  std::vector<std::int8_t> gt(n_samples * 2);
+  std::vector<std::int16_t> dp(n_samples);
+  for (std::size_t k = 0; k < 10; ++k)
+  {
+    for (auto it = gt.begin(); it != gt.end(); ++it)
+      *it = std::int8_t(rng() % 10 == 0 ? (k % 3 == 0 ? 2 : 1) : 0);
+    for (auto it = dp.begin(); it != dp.end(); ++it)
+      *it = std::int16_t(rng() % 40);
+    records.emplace_back("1", std::uint32_t(100 + k), "A", std::vector<std::string>{"C", "G"});
+    records.back().set_format("GT", gt);
+    records.back().set_format("DP", dp);
+  }
+  check_threaded_pbwt(headers, samples, records);
+}
+
+void vcf_line_test()
+{
+  savvy::reader expected_rdr(SAVVYT_VCF_FILE);
+  savvy::reader line_rdr(SAVVYT_VCF_FILE);
+  expected_rdr.set_site_filter([](const savvy::site_info& s) { return s.position() % 2 == 0; });
+  line_rdr.set_site_filter([](const savvy::site_info& s) { return s.position() % 2 == 0; });
+
+  // Lines are parsed on worker threads and must match records parsed by read().
+  std::vector<std::string> lines;
+  std::string line;
+  while (line_rdr.read_vcf_line(line))
+    lines.push_back(line);
+  assert(lines.size() == SAVVYT_MARKER_COUNT_HARD && !line_rdr.bad());
+
+  std::vector<savvy::variant> parsed(lines.size());
+  std::vector<char> filtered(lines.size(), 0);
+  std::vector<char> ok(lines.size(), 0);
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < 4; ++t)
+  {
+    threads.emplace_back([&, t]()
+    {
+      for (std::size_t i = t; i < lines.size(); i += 4)
+      {
+        bool filtered_out = false;
+        ok[i] = line_rdr.parse_vcf_line(lines[i], parsed[i], filtered_out);
+        filtered[i] = filtered_out;
+      }
+    });
+  }
+  for (auto it = threads.begin(); it != threads.end(); ++it)
+    it->join();
+
+  savvy::variant expected;
+  std::vector<std::int8_t> expected_gt, gt;
+  std::size_t cnt = 0;
+  for (std::size_t i = 0; i < lines.size(); ++i)
+  {
+    assert(ok[i]);
+    if (filtered[i])
+      continue;
+    bool read_ok = (bool)expected_rdr.read(expected);
+    assert(read_ok);
+    assert(parsed[i].chromosome() == expected.chromosome() && parsed[i].position() == expected.position() && parsed[i].alts() == expected.alts());
+    bool has_gt = expected.get_format("GT", expected_gt);
+    assert(parsed[i].get_format("GT", gt) == has_gt && (!has_gt || gt == expected_gt));
+    (void)read_ok;
+    (void)has_gt;
+    ++cnt;
+  }
+  assert(cnt > 0 && cnt < lines.size() && !expected_rdr.read(expected) && !expected_rdr.bad());
+
+  savvy::reader sav_rdr(SAVVYT_SAV_FILE_HARD);
+  assert(!sav_rdr.read_vcf_line(line));
+}
+
+void shard_test()
+{
+  const std::string out_path = std::string(SAVVYT_SAV_FILE_HARD) + ".shard.sav";
+  std::vector<savvy::site_info> all_sites;
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+
+    savvy::writer output(out_path, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_block_size(3);
+
+    while (input.read(var))
+    {
+      output.write(var);
+      all_sites.emplace_back(var);
+    }
+    assert(output.good() && !input.bad());
+  }
+
+  savvy::s1r::reader idx(out_path);
+  const std::vector<std::uint64_t>& block_bounds = idx.leaf_entries("").cumulative_counts;
+  assert(block_bounds.back() == all_sites.size());
+  (void)block_bounds;
+
+  savvy::reader rdr(out_path);
+  savvy::variant var;
+  for (std::size_t n_shards : {1, 2, 3, 5, 40})
+  {
+    std::vector<savvy::slice_bounds> shards = rdr.plan_shards(n_shards);
+    assert(shards.size() == n_shards);
+
+    std::size_t i = 0;
+    for (auto it = shards.begin(); it != shards.end(); ++it)
+    {
+      assert(it->from() == i && it->to() >= it->from());
+      assert(std::binary_search(block_bounds.begin(), block_bounds.end(), it->to())); // Shards end on block boundaries.
+      assert(it->to() - it->from() <= all_sites.size() / n_shards + 3);
+      rdr.reset_bounds(*it);
+      while (rdr >> var)
+      {
+        assert(i < it->to() && var.chromosome() == all_sites[i].chromosome() && var.position() == all_sites[i].position());
+        ++i;
+      }
+      assert(i == it->to() && !rdr.bad());
+    }
+    assert(i == all_sites.size());
+  }
+
+  // --shard arguments must be exactly i/N with 1 <= i <= N.
+  std::size_t shard_idx = 0, n_shards = 0;
+  bool parsed = string_to_shard("2/4", shard_idx, n_shards);
+  assert(parsed && shard_idx == 1 && n_shards == 4);
+  for (const char* bad_shard : {"", "2", "0/4", "5/4", "2x/4", "1/4abc", "/4", "2/", " 2/4", "2/+4", "-1/4", "1/99999999999999999999"})
+  {
+    parsed = string_to_shard(bad_shard, shard_idx, n_shards);
+    assert(!parsed);
+  }
+  (void)parsed;
+
+  std::remove(out_path.c_str());
+}
+
+// Runs a sav subcommand in process. The first argument is the subcommand name.
+int run_sav_command(int (*cmd_main)(int, char**), std::vector<std::string> args)
+{
+  std::vector<char*> argv;
+  for (auto it = args.begin(); it != args.end(); ++it)
+    argv.push_back(&(*it)[0]);
+  argv.push_back(nullptr);
+  optind = 0; // Reinitializes getopt for each command.
+  return cmd_main(int(args.size()), argv.data());
+}
+
+void stat_threads_test()
+{
+  const std::string in_path = std::string(SAVVYT_SAV_FILE_HARD) + ".stat.sav";
+  const std::string per_ac_path = in_path + ".per_ac.tsv";
+  const std::string per_sample_path = in_path + ".per_sample.tsv";
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+    std::vector<std::int8_t> gt;
+
+    auto headers = input.headers();
+    headers.emplace_back("INFO", "<ID=AC,Number=1,Type=Integer,Description=\"Alternate allele count\">");
+    headers.emplace_back("INFO", "<ID=AN,Number=1,Type=Integer,Description=\"Total allele count\">");
+    headers.emplace_back("INFO", "<ID=ANN,Number=.,Type=String,Description=\"Annotation\">");
+    savvy::writer output(in_path, savvy::file::format::sav2, headers, input.samples());
+    output.set_block_size(3);
+
+    std::size_t i = 0;
+    while (input.read(var))
+    {
+      var.get_format("GT", gt);
+      var.set_info("AC", std::int32_t(std::count_if(gt.begin(), gt.end(), [](std::int8_t g) { return g > 0; })));
+      var.set_info("AN", std::int32_t(std::count_if(gt.begin(), gt.end(), [](std::int8_t g) { return g >= 0; })));
+      var.set_info("ANN", std::string(i++ % 2 ? "A|missense_variant&missense" : "A|synonymous,A|stop_retained"));
+      output.write(var);
+    }
+    assert(output.good() && !input.bad());
+  }
+
+  // Summary, per-AC and per-sample results do not depend on the number of threads.
+  std::string expected_summary, expected_per_ac, expected_per_sample;
+  for (std::string n_threads : {"1", "2", "3", "16"})
+  {
+    std::ostringstream summary;
+    std::streambuf* cout_buf = std::cout.rdbuf(summary.rdbuf());
+    int rc = run_sav_command(stat_main, {"stat", "--threads", n_threads, "--per-ac-out", per_ac_path, "--per-sample-out", per_sample_path, in_path});
+    std::cout.rdbuf(cout_buf);
+    assert(rc == EXIT_SUCCESS);
+    (void)rc;
+
+    if (n_threads == "1")
+    {
+      expected_summary = summary.str();
+      expected_per_ac = read_file_contents(per_ac_path);
+      expected_per_sample = read_file_contents(per_sample_path);
+      assert(expected_summary.compare(0, 3, std::to_string(SAVVYT_MARKER_COUNT_HARD) + "\t") == 0);
+      assert(std::count(expected_per_sample.begin(), expected_per_sample.end(), '\n') > 1);
+      assert(std::count(expected_per_ac.begin(), expected_per_ac.end(), '\n') > 1);
+    }
+    else
+    {
+      assert(summary.str() == expected_summary);
+      assert(read_file_contents(per_ac_path) == expected_per_ac);
+      assert(read_file_contents(per_sample_path) == expected_per_sample);
+    }
+  }
+
+  std::remove(per_ac_path.c_str());
+  std::remove(per_sample_path.c_str());
+  std::remove(in_path.c_str());
+}
+
+bool same_exported_records(const std::string& path_a, const std::string& path_b)
+{
+  savvy::reader rdr_a(path_a), rdr_b(path_b);
+  savvy::variant var_a, var_b;
+  std::vector<std::int8_t> gt_a, gt_b;
+  std::vector<float> hds_a, hds_b;
+  std::size_t cnt = 0;
+  while (rdr_a.read(var_a))
+  {
+    if (!rdr_b.read(var_b))
+      return false;
+    if (var_a.chromosome() != var_b.chromosome() || var_a.position() != var_b.position() || var_a.ref() != var_b.ref() || var_a.alts() != var_b.alts())
+      return false;
+    if (var_a.get_format("GT", gt_a) != var_b.get_format("GT", gt_b) || gt_a != gt_b)
+      return false;
+    if (var_a.get_format("HDS", hds_a) != var_b.get_format("HDS", hds_b) || hds_a.size() != hds_b.size())
+      return false;
+    if (!std::equal(hds_a.begin(), hds_a.end(), hds_b.begin(), [](float a, float b) { return a == b || (std::isnan(a) && std::isnan(b)); }))
+      return false;
+    ++cnt;
+  }
+  return cnt > 0 && !rdr_b.read(var_b) && !rdr_a.bad() && !rdr_b.bad();
+}
+
+void export_threads_test()
+{
+  // The input is large enough to be split into several batches by the threaded export.
+  const std::size_t n_reps = 40;
+  const std::string vcf_path = std::string(SAVVYT_SAV_FILE_HARD) + ".export_in.vcf";
+  const std::string sav_path = std::string(SAVVYT_SAV_FILE_HARD) + ".export_in.sav";
+  const std::string bad_path = std::string(SAVVYT_SAV_FILE_HARD) + ".export_bad.vcf";
+  {
+    std::ifstream ifs(SAVVYT_VCF_FILE);
+    std::ofstream ofs(vcf_path), bad_ofs(bad_path);
+    std::vector<std::string> records;
+    std::string line;
+    while (std::getline(ifs, line))
+    {
+      if (line.size() && line[0] == '#')
+      {
+        ofs << line << "\n";
+        bad_ofs << line << "\n";
+      }
+      else if (line.size())
+        records.push_back(line);
+    }
+
+    std::size_t cnt = 0;
+    for (std::string chrom : {"18", "20"})
+    {
+      for (std::size_t rep = 0; rep < n_reps; ++rep)
+      {
+        for (auto it = records.begin(); it != records.end(); ++it)
+        {
+          if (it->compare(0, chrom.size() + 1, chrom + "\t") != 0)
+            continue;
+          std::size_t pos_end = it->find('\t', chrom.size() + 1);
+          std::uint64_t pos = std::stoull(it->substr(chrom.size() + 1, pos_end - chrom.size() - 1)) + rep * 10000000;
+          line = chrom + "\t" + std::to_string(pos) + it->substr(pos_end);
+          ofs << line << "\n";
+          // Record with a missing sample column is written part way through the third batch.
+          bad_ofs << (++cnt == 600 ? line.substr(0, line.rfind('\t')) : line) << "\n";
+        }
+      }
+    }
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD * n_reps);
+  }
+
+  // Output of threaded export matches serial export for VCF and SAV input and all output formats. Compressed VCF and
+  // BCF output are written through parallel BGZF compression.
+  assert(run_sav_command(export_main, {"export", "-O", "sav", "-o", sav_path, vcf_path}) == EXIT_SUCCESS);
+  for (std::string in_path : {vcf_path, sav_path})
+  {
+    for (std::string fmt : {"vcf", "vcf.gz", "bcf", "sav"})
+    {
+      const std::string serial_path = in_path + ".serial." + fmt;
+      const std::string threaded_path = in_path + ".threaded." + fmt;
+      assert(run_sav_command(export_main, {"export", "-O", fmt, "-o", serial_path, in_path}) == EXIT_SUCCESS);
+      assert(run_sav_command(export_main, {"export", "--threads", "4", "-O", fmt, "-o", threaded_path, in_path}) == EXIT_SUCCESS);
+      assert(same_exported_records(serial_path, threaded_path));
+      if (fmt == "vcf")
+        assert(read_file_contents(serial_path) == read_file_contents(threaded_path));
+      std::remove(serial_path.c_str());
+      std::remove(threaded_path.c_str());
+    }
+  }
+
+  // Threaded compression also works when the output is a pipe (e.g., stdout).
+  for (std::string fmt : {"vcf.gz", "bcf"})
+  {
+    const std::string serial_path = vcf_path + ".serial_piped." + fmt;
+    const std::string threaded_path = vcf_path + ".threaded_piped." + fmt;
+    assert(run_sav_command(export_main, {"export", "-O", fmt, "-o", serial_path, vcf_path}) == EXIT_SUCCESS);
+    {
+      piped_sink output;
+      assert(run_sav_command(export_main, {"export", "--threads", "4", "-O", fmt, "-o", output.path(), vcf_path}) == EXIT_SUCCESS);
+      std::ofstream ofs(threaded_path, std::ios::binary);
+      ofs.write(output.contents().data(), output.contents().size());
+    }
+    assert(same_exported_records(serial_path, threaded_path));
+    std::remove(serial_path.c_str());
+    std::remove(threaded_path.c_str());
+  }
+
+  // Input that cannot be reopened (e.g., stdin) is only read once, including the first record, which threaded export
+  // otherwise reads separately to count PBWT fields. Small blocks make the file larger than what is buffered up front.
+  {
+    const std::string serial_path = sav_path + ".serial_pipe.vcf";
+    const std::string threaded_path = sav_path + ".threaded_pipe.vcf";
+    const std::string pbwt_path = sav_path + ".pbwt.sav";
+    assert(run_sav_command(export_main, {"export", "-O", "sav", "-b", "16", "--pbwt-fields", "GT", "--sparse-pbwt", "-o", pbwt_path, vcf_path}) == EXIT_SUCCESS);
+    assert(run_sav_command(export_main, {"export", "-o", serial_path, pbwt_path}) == EXIT_SUCCESS);
+    {
+      piped_file input(pbwt_path);
+      assert(run_sav_command(export_main, {"export", "--threads", "4", "-o", threaded_path, input.path()}) == EXIT_SUCCESS);
+    }
+    assert(read_file_contents(serial_path) == read_file_contents(threaded_path));
+    std::remove(serial_path.c_str());
+    std::remove(threaded_path.c_str());
+    std::remove(pbwt_path.c_str());
+  }
+
+  // Sample subsets, and the FORMAT projection used by --sites-only with generated INFO fields, are applied to VCF
+  // lines parsed on worker threads.
+  std::vector<std::vector<std::string>> subset_args = {{"-i", "NA00001,NA00003"}, {"--sample-ids", "NA00002"}, {"--sites-only", "--generate-info", "AC,AN,AF"}};
+  for (auto it = subset_args.begin(); it != subset_args.end(); ++it)
+  {
+    for (std::string fmt : {"vcf", "bcf"})
+    {
+      if (it->front() == "--sites-only" && fmt != "vcf")
+        continue;
+      const std::string serial_path = vcf_path + ".serial_subset." + fmt;
+      const std::string threaded_path = vcf_path + ".threaded_subset." + fmt;
+      std::vector<std::string> serial_cmd = {"export", "-O", fmt, "-o", serial_path};
+      std::vector<std::string> threaded_cmd = {"export", "--threads", "4", "-O", fmt, "-o", threaded_path};
+      serial_cmd.insert(serial_cmd.end(), it->begin(), it->end());
+      threaded_cmd.insert(threaded_cmd.end(), it->begin(), it->end());
+      serial_cmd.push_back(vcf_path);
+      threaded_cmd.push_back(vcf_path);
+      assert(run_sav_command(export_main, serial_cmd) == EXIT_SUCCESS);
+      assert(run_sav_command(export_main, threaded_cmd) == EXIT_SUCCESS);
+
+      savvy::reader serial_rdr(serial_path), threaded_rdr(threaded_path);
+      assert(serial_rdr.samples() == threaded_rdr.samples());
+      assert(serial_rdr.samples().size() == (it->front() == "--sites-only" ? 0 : std::size_t(std::count(it->back().begin(), it->back().end(), ',')) + 1));
+      if (fmt == "vcf")
+        assert(read_file_contents(serial_path) == read_file_contents(threaded_path));
+      else
+        assert(same_exported_records(serial_path, threaded_path));
+      std::remove(serial_path.c_str());
+      std::remove(threaded_path.c_str());
+    }
+  }
+
+  // A record that fails to parse on a worker thread fails the export.
+  for (std::string fmt : {"vcf", "bcf"})
+  {
+    const std::string out_path = bad_path + ".out." + fmt;
+    assert(run_sav_command(export_main, {"export", "--threads", "4", "-O", fmt, "-o", out_path, bad_path}) == EXIT_FAILURE);
+    std::remove(out_path.c_str());
+  }
+
+  std::remove(vcf_path.c_str());
+  std::remove(sav_path.c_str());
+  std::remove(bad_path.c_str());
+}
+
+void sav_match_test()
+{
+  const std::string phased_path = std::string(SAVVYT_SAV_FILE_HARD) + ".match_phased.vcf";
+  const std::string unphased_path = std::string(SAVVYT_SAV_FILE_HARD) + ".match_unphased.vcf";
+  const std::string no_phasing_path = std::string(SAVVYT_SAV_FILE_HARD) + ".match_no_phasing.vcf";
+  auto write_vcf = [](const std::string& path, const std::string& extra_header, char delim)
+  {
+    // Both haplotypes of sample A match each other across every site.
+    std::ofstream ofs(path);
+    ofs << "##fileformat=VCFv4.2\n" << extra_header;
+    ofs << "##contig=<ID=1>\n";
+    ofs << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    ofs << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\tC\n";
+    for (std::size_t k = 0; k < 6; ++k)
+      ofs << "1\t" << (100 + k) << "\t.\tA\tC\t.\tPASS\t.\tGT\t0" << delim << "0\t1" << delim << "0\t" << (k % 2) << delim << "0\n";
+  };
+  write_vcf(phased_path, "##phasing=full\n", '|');
+  write_vcf(unphased_path, "", '/');
+  write_vcf(no_phasing_path, "##phasing=none\n", '/');
+
+  auto run_match = [](std::vector<std::string> args, std::string& out, std::string& err)
+  {
+    std::ostringstream out_ss, err_ss;
+    std::streambuf* cout_buf = std::cout.rdbuf(out_ss.rdbuf());
+    std::streambuf* cerr_buf = std::cerr.rdbuf(err_ss.rdbuf());
+    int rc = run_sav_command(match_main, args);
+    std::cout.rdbuf(cout_buf);
+    std::cerr.rdbuf(cerr_buf);
+    out = out_ss.str();
+    err = err_ss.str();
+    return rc;
+  };
+
+  auto count_self_matches = [](const std::string& out)
+  {
+    std::size_t cnt = 0;
+    std::istringstream ss(out);
+    std::string line;
+    std::getline(ss, line); // header
+    while (std::getline(ss, line))
+    {
+      std::vector<std::string> cols;
+      std::istringstream line_ss(line);
+      for (std::string col; std::getline(line_ss, col, '\t'); )
+        cols.push_back(col);
+      assert(cols.size() == 8);
+      if (cols[4] == cols[6])
+        ++cnt;
+    }
+    return cnt;
+  };
+
+  std::string out, err;
+  for (std::string mode : {"", "--set-maximal"})
+  {
+    std::vector<std::string> args = {"match", "-L", "3", phased_path};
+    if (mode.size())
+      args.insert(args.begin() + 1, mode);
+    int rc = run_match(args, out, err);
+    assert(rc == EXIT_SUCCESS && err.empty());
+    assert(std::count(out.begin(), out.end(), '\n') > 1 && count_self_matches(out) == 0);
+
+    args.insert(args.begin() + 1, "--include-self-matches");
+    rc = run_match(args, out, err);
+    assert(rc == EXIT_SUCCESS && err.empty());
+    assert(count_self_matches(out) > 0);
+    (void)rc;
+  }
+  (void)count_self_matches;
+
+  int rc = run_match({"match", "-L", "3", unphased_path}, out, err);
+  assert(rc == EXIT_SUCCESS);
+  assert(err.find("Warning: 6 records have unphased genotypes") != std::string::npos);
+
+  rc = run_match({"match", "-L", "3", no_phasing_path}, out, err);
+  assert(rc == EXIT_FAILURE);
+  assert(err.find("GT must be phased") != std::string::npos);
+
+  // Query samples only report matches that involve them.
+  rc = run_match({"match", "-L", "3", "-q", "C", phased_path}, out, err);
+  assert(rc == EXIT_SUCCESS && err.empty());
+  {
+    std::istringstream ss(out);
+    std::string line;
+    std::getline(ss, line); // header
+    std::size_t cnt = 0;
+    while (std::getline(ss, line))
+    {
+      assert(line.find("\tC\t") != std::string::npos);
+      ++cnt;
+    }
+    assert(cnt > 0);
+  }
+
+  for (std::string bad_len : {"3abc", "0", "-3", "", "99999999999999999999999"})
+  {
+    rc = run_match({"match", "-L", bad_len, phased_path}, out, err);
+    assert(rc == EXIT_FAILURE);
+    assert(err.find("Invalid --min-length value") != std::string::npos);
+  }
+  (void)rc;
+
+  std::remove(phased_path.c_str());
+  std::remove(unphased_path.c_str());
+  std::remove(no_phasing_path.c_str());
+}
+
 int main(int argc, char** argv)
 {
   std::string cmd = (argc < 2) ? "" : argv[1];
@@ -841,6 +2970,31 @@ int main(int argc, char** argv)
     std::cout << "- varint" << std::endl;
     std::cout << "- stride-reduce" << std::endl;
     std::cout << "- missing-headers" << std::endl;
+    std::cout << "- threaded-read" << std::endl;
+    std::cout << "- threaded-write" << std::endl;
+    std::cout << "- format-projection" << std::endl;
+    std::cout << "- sites-only" << std::endl;
+    std::cout << "- site-filter" << std::endl;
+    std::cout << "- zero-copy" << std::endl;
+    std::cout << "- read-batch" << std::endl;
+    std::cout << "- slice-query" << std::endl;
+    std::cout << "- block-cache" << std::endl;
+    std::cout << "- multi-region" << std::endl;
+    std::cout << "- clone" << std::endl;
+    std::cout << "- shard" << std::endl;
+    std::cout << "- vcf-line" << std::endl;
+    std::cout << "- gt-tokenizer" << std::endl;
+    std::cout << "- threaded-bgzf-read" << std::endl;
+    std::cout << "- sparse-pbwt" << std::endl;
+    std::cout << "- lazy-pbwt-unsort" << std::endl;
+    std::cout << "- biallelic-pbwt" << std::endl;
+    std::cout << "- pbwt-match" << std::endl;
+    std::cout << "- threaded-pbwt" << std::endl;
+    std::cout << "- csi-query" << std::endl;
+    std::cout << "- stat-threads" << std::endl;
+    std::cout << "- export-threads" << std::endl;
+    std::cout << "- sav-match" << std::endl;
+    std::cout << "- tbi-linear-index" << std::endl;
     std::cin >> cmd;
   }
 
@@ -891,6 +3045,142 @@ int main(int argc, char** argv)
   {
     missing_headers_test();
   }
+  else if (cmd == "threaded-read")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+    if (!file_exists(SAVVYT_SAV_FILE_DOSE)) convert_file_test("HDS");
+
+    threaded_read_test(SAVVYT_SAV_FILE_HARD, "GT");
+    threaded_read_test(SAVVYT_SAV_FILE_DOSE, "HDS");
+  }
+  else if (cmd == "threaded-write")
+  {
+    threaded_write_test();
+  }
+  else if (cmd == "format-projection")
+  {
+    format_projection_test();
+  }
+  else if (cmd == "sites-only")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+
+    sites_only_test(SAVVYT_SAV_FILE_HARD);
+  }
+  else if (cmd == "site-filter")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+
+    site_filter_test(SAVVYT_VCF_FILE);
+    site_filter_test(SAVVYT_SAV_FILE_HARD);
+  }
+  else if (cmd == "zero-copy")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+    if (!file_exists(SAVVYT_SAV_FILE_DOSE)) convert_file_test("HDS");
+
+    zero_copy_test(SAVVYT_SAV_FILE_HARD, "GT");
+    zero_copy_test(SAVVYT_SAV_FILE_DOSE, "HDS");
+  }
+  else if (cmd == "read-batch")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+
+    read_batch_test(SAVVYT_VCF_FILE, false);
+    read_batch_test(SAVVYT_SAV_FILE_HARD, false);
+    read_batch_test(SAVVYT_SAV_FILE_HARD, true);
+  }
+  else if (cmd == "slice-query")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+
+    slice_query_test(SAVVYT_SAV_FILE_HARD);
+  }
+  else if (cmd == "block-cache")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+
+    block_cache_test(SAVVYT_SAV_FILE_HARD);
+  }
+  else if (cmd == "multi-region")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+
+    multi_region_test(SAVVYT_SAV_FILE_HARD);
+  }
+  else if (cmd == "clone")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+
+    clone_test(SAVVYT_SAV_FILE_HARD);
+    clone_test(SAVVYT_VCF_FILE);
+  }
+  else if (cmd == "shard")
+  {
+    shard_test();
+  }
+  else if (cmd == "threaded-bgzf-read")
+  {
+    threaded_bgzf_read_test();
+  }
+  else if (cmd == "gt-tokenizer")
+  {
+    gt_tokenizer_test();
+  }
+  else if (cmd == "sparse-pbwt")
+  {
+    sparse_pbwt_sort_test<std::int8_t>(2);
+    sparse_pbwt_sort_test<std::int16_t>(300);
+    sparse_pbwt_test();
+  }
+  else if (cmd == "lazy-pbwt-unsort")
+  {
+    lazy_pbwt_unsort_test();
+  }
+  else if (cmd == "biallelic-pbwt")
+  {
+    biallelic_pbwt_test();
+  }
+  else if (cmd == "pbwt-match")
+  {
+    pbwt_match_test();
+  }
+  else if (cmd == "threaded-pbwt")
+  {
+    threaded_pbwt_test();
+  }
+  else if (cmd == "csi-query")
+  {
+    create_indexed_vcf_file();
+    csi_query_test(SAVVYT_VCF_GZ_FILE);
+    multi_region_test(SAVVYT_VCF_GZ_FILE);
+  }
+  else if (cmd == "stat-threads")
+  {
+    stat_threads_test();
+  }
+  else if (cmd == "export-threads")
+  {
+    export_threads_test();
+  }
+  else if (cmd == "sav-match")
+  {
+    sav_match_test();
+  }
+  else if (cmd == "tbi-linear-index")
+  {
+    const std::string path = std::string(SAVVYT_VCF_GZ_FILE) + ".large.vcf.gz";
+    create_large_indexed_vcf_file(path);
+    tbi_linear_index_test(path);
+    std::remove(path.c_str());
+    std::remove((path + ".tbi").c_str());
+  }
+  else if (cmd == "vcf-line")
+  {
+    if (!file_exists(SAVVYT_SAV_FILE_HARD)) convert_file_test("GT");
+
+    vcf_line_test();
+  }
   else
   {
     std::cerr << "Invalid Command" << std::endl;